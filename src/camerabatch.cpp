@@ -0,0 +1,216 @@
+#include "camerabatch.h"
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include "defaults.h"
+#include "settingsmanager.h"
+
+using namespace std;
+using namespace al::raycasting;
+
+CameraBatch::CameraBatch()
+: world(NULL), done(NULL), cameras(NULL), outputs(NULL), auxOutputs(NULL),
+  quit(false)
+{
+}
+
+CameraBatch::~CameraBatch()
+{
+  destroy();
+}
+
+// Starts threadCount threads that draw the world of a Game. The Game has to
+// outlive the CameraBatch and can't stream its level.
+bool CameraBatch::create(Game& world, int threadCount, int stripWidth,
+                         int fov)
+{
+  destroy();
+  this->world = &world;
+  quit = false;
+  threadCount = std::max(1, threadCount);
+  workers.resize(threadCount);
+  for (int t=0; t<threadCount; ++t) {
+    Worker& worker = workers[t];
+    worker.batch = this;
+    worker.game = new Game(NULL, false);
+    worker.first = worker.last = 0;
+    worker.ok = true;
+    worker.thread = NULL;
+    worker.start = NULL;
+    if (!worker.game->startHeadless(DEFAULT_DISPLAY_WIDTH,
+                                    DEFAULT_DISPLAY_HEIGHT, stripWidth, fov)) {
+      destroy();
+      return false;
+    }
+    worker.game->shareLevel(world);
+  }
+
+  done = SDL_CreateSemaphore(0);
+  for (int t=0; t<threadCount; ++t) {
+    workers[t].start = SDL_CreateSemaphore(0);
+    workers[t].thread = SDL_CreateThread(workerMain, "CameraBatch",
+                                         &workers[t]);
+    if (!workers[t].thread) {
+      printf("SDL_CreateThread failed: %s\n", SDL_GetError());
+      destroy();
+      return false;
+    }
+  }
+  return true;
+}
+
+void CameraBatch::destroy()
+{
+  quit = true;
+  for (size_t t=0; t<workers.size(); ++t) {
+    if (workers[t].thread) {
+      SDL_SemPost(workers[t].start);
+      SDL_WaitThread(workers[t].thread, NULL);
+    }
+    if (workers[t].start) {
+      SDL_DestroySemaphore(workers[t].start);
+    }
+    delete workers[t].game;
+  }
+  workers.clear();
+  if (done) {
+    SDL_DestroySemaphore(done);
+    done = NULL;
+  }
+  world = NULL;
+}
+
+bool CameraBatch::render(const Camera* cameras, SDL_Surface** outputs,
+                         int count, AuxBuffers* auxOutputs)
+{
+  if (workers.empty() || !world->captureWorld(snapshot)) {
+    return false;
+  }
+  spriteIndex.build(world->getSprites(), TILE_SIZE);
+  this->cameras = cameras;
+  this->outputs = outputs;
+  this->auxOutputs = auxOutputs;
+  const int threadCount = workers.size();
+  for (int t=0; t<threadCount; ++t) {
+    workers[t].first = count * t / threadCount;
+    workers[t].last = count * (t+1) / threadCount;
+    SDL_SemPost(workers[t].start);
+  }
+  for (int t=0; t<threadCount; ++t) {
+    SDL_SemWait(done);
+  }
+  bool ok = true;
+  for (int t=0; t<threadCount; ++t) {
+    ok = ok && workers[t].ok;
+  }
+  return ok;
+}
+
+// A surface to draw a camera into, in the format of every Game's screen
+SDL_Surface* CameraBatch::createOutput(int width, int height)
+{
+  return SDL_CreateRGBSurface(0, width, height, 32, 0x00FF0000, 0x0000FF00,
+                              0x000000FF, 0xFF000000);
+}
+
+int CameraBatch::workerMain(void* data)
+{
+  Worker* worker = (Worker*) data;
+  CameraBatch* batch = worker->batch;
+  for (;;) {
+    SDL_SemWait(worker->start);
+    if (batch->quit) {
+      break;
+    }
+    batch->renderCameras(*worker);
+    SDL_SemPost(batch->done);
+  }
+  return 0;
+}
+
+void CameraBatch::renderCameras(Worker& worker)
+{
+  worker.ok = worker.first == worker.last ||
+              worker.game->restoreWorld(snapshot);
+  for (int i=worker.first; worker.ok && i<worker.last; ++i) {
+    worker.ok = worker.game->renderCamera(cameras[i], outputs[i],
+                                          &spriteIndex,
+                                          auxOutputs ? &auxOutputs[i] : NULL);
+  }
+}
+
+void al::raycasting::benchCameras(int count, int threadCount, int frames)
+{
+  const int width = 320, height = 200;
+  count = std::max(1, count);
+  frames = std::max(1, frames);
+  SettingsManager settingsManager;
+  settingsManager.loadConfig("config.ini");
+  const int stripWidth = settingsManager.getInt("stripWidth",
+                                                DEFAULT_STRIP_WIDTH);
+  const int fov = settingsManager.getInt("fov", DEFAULT_FOV_DEGREES);
+  const string levelFile = settingsManager.getString("levelFile", "");
+
+  Game world;
+  if (levelFile.size() && !world.loadLevel(levelFile)) {
+    printf("Using the default level instead of %s\n", levelFile.c_str());
+  }
+  CameraBatch batch;
+  if (!batch.create(world, threadCount, stripWidth, fov)) {
+    return;
+  }
+  Game single(NULL, false);
+  if (!single.startHeadless(width, height, stripWidth, fov)) {
+    return;
+  }
+  single.shareLevel(world);
+
+  const Sprite& player = world.getPlayer();
+  vector<Camera> cameras(count);
+  vector<SDL_Surface*> outputs(count);
+  for (int i=0; i<count; ++i) {
+    const float angle = TWO_PI * i / count;
+    cameras[i].x = player.x + cos(angle) * TILE_SIZE;
+    cameras[i].y = player.y - sin(angle) * TILE_SIZE;
+    cameras[i].rot = angle;
+    outputs[i] = CameraBatch::createOutput(width, height);
+  }
+
+  const Uint64 frequency = SDL_GetPerformanceFrequency();
+  Uint64 start = SDL_GetPerformanceCounter();
+  for (int frame=0; frame<frames; ++frame) {
+    batch.render(&cameras[0], &outputs[0], count);
+  }
+  const double batchMs = (SDL_GetPerformanceCounter() - start) * 1000.0 /
+                         frequency / frames / count;
+
+  vector<AuxBuffers> auxOutputs(count);
+  start = SDL_GetPerformanceCounter();
+  for (int frame=0; frame<frames; ++frame) {
+    batch.render(&cameras[0], &outputs[0], count, &auxOutputs[0]);
+  }
+  const double auxMs = (SDL_GetPerformanceCounter() - start) * 1000.0 /
+                       frequency / frames / count;
+
+  WorldSnapshot snapshot;
+  start = SDL_GetPerformanceCounter();
+  for (int frame=0; frame<frames; ++frame) {
+    // Caught up once per frame, like each thread of the batch
+    world.captureWorld(snapshot);
+    single.restoreWorld(snapshot);
+    for (int i=0; i<count; ++i) {
+      single.renderCamera(cameras[i], outputs[i], NULL);
+    }
+  }
+  const double singleMs = (SDL_GetPerformanceCounter() - start) * 1000.0 /
+                          frequency / frames / count;
+
+  printf("cameras: %d cameras of %d x %d, %d frames\n", count, width, height,
+         frames);
+  printf("cameras: batch on %d threads %.3f ms/camera, one at a time "
+         "%.3f ms/camera\n", std::max(1, threadCount), batchMs, singleMs);
+  printf("cameras: batch with aux buffers %.3f ms/camera\n", auxMs);
+  for (int i=0; i<count; ++i) {
+    SDL_FreeSurface(outputs[i]);
+  }
+}
@@ -0,0 +1,72 @@
+/*
+Many views of one world drawn at once on a pool of threads.
+
+Author: Andrew Lim
+https://github.com/andrew-lim/sdl2-raycast
+*/
+#ifndef AL_RAYCASTING_CAMERABATCH_H
+#define AL_RAYCASTING_CAMERABATCH_H
+#include <SDL.h>
+#include <vector>
+#include "game.h"
+
+namespace al {
+namespace raycasting {
+
+/**
+ * Draws the world of one Game from many Cameras at once. Each thread draws
+ * its share of the Cameras with a headless Game of its own, which keeps its
+ * textures and ThinWalls between render() calls and catches up with the
+ * world through one WorldSnapshot. The SpriteIndex is built once per
+ * render() for all of them.
+ */
+class CameraBatch {
+public:
+  CameraBatch();
+  ~CameraBatch();
+  bool create(Game& world, int threadCount, int stripWidth, int fov);
+  void destroy();
+  // Draws what cameras[i] sees into outputs[i], for count cameras, and its
+  // aux buffers into auxOutputs[i] if auxOutputs isn't NULL. Outputs have
+  // to be like the ones createOutput() makes.
+  bool render(const Camera* cameras, SDL_Surface** outputs, int count,
+              AuxBuffers* auxOutputs=NULL);
+  static SDL_Surface* createOutput(int width, int height);
+
+private:
+  CameraBatch(const CameraBatch&);
+  CameraBatch& operator=(const CameraBatch&);
+
+  struct Worker {
+    CameraBatch* batch;
+    Game* game;
+    int first, last; // Cameras [first,last) of the render in progress
+    bool ok;
+    SDL_Thread* thread;
+    SDL_sem* start;
+  };
+  static int workerMain(void* data);
+  void renderCameras(Worker& worker);
+
+  Game* world;
+  std::vector<Worker> workers;
+  WorldSnapshot snapshot;
+  SpriteIndex spriteIndex;
+  SDL_sem* done;
+  // Of the render in progress
+  const Camera* cameras;
+  SDL_Surface** outputs;
+  AuxBuffers* auxOutputs;
+  bool quit;
+};
+
+// -cameras [count [threads [frames]]]: draws count cameras in a ring around
+// the start of the level with a CameraBatch, with and without aux buffers,
+// then one at a time with a single Game that catches up with the world for
+// each camera, and prints how long a camera took each way
+void benchCameras(int count, int threadCount, int frames);
+
+} // raycasting
+} // al
+
+#endif
@@ -0,0 +1,39 @@
+/*
+Grid cells and the material table they index.
+
+Author: Andrew Lim
+https://github.com/andrew-lim/sdl2-raycast
+*/
+#ifndef AL_RAYCASTING_CELL_H
+#define AL_RAYCASTING_CELL_H
+#include <stdint.h>
+
+namespace al {
+namespace raycasting {
+
+// A grid cell. The low 8 bits are an index into the material table and the
+// high bits hold state that can change while playing. 0 is empty space.
+typedef uint16_t Cell;
+
+const int MAX_MATERIALS = 256;
+const int CELL_MATERIAL_MASK = 0x00FF;
+const int CELL_DOOR_OPEN = 0x8000;
+
+enum MaterialFlags {
+  MATERIAL_SOLID           = 1 << 0, // blocks movement, doors only if closed
+  MATERIAL_DOOR            = 1 << 1,
+  MATERIAL_DOOR_HORIZONTAL = 1 << 2, // door is hit on horizontal grid lines
+  MATERIAL_TRANSPARENT     = 1 << 3  // walls behind it can be seen
+};
+
+// Describes every cell using the same material index.
+// Level files store these as is.
+struct CellMaterial {
+  int32_t textureID; // row in the wall texture image
+  uint32_t flags;    // MaterialFlags
+};
+
+} // raycasting
+} // al
+
+#endif
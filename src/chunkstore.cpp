@@ -0,0 +1,405 @@
+#include "chunkstore.h"
+#include <SDL.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+using namespace std;
+using namespace al::raycasting;
+
+ChunkStore::ChunkStore()
+: width(0), height(0), gridCount(0), chunksX(0), chunksY(0), updateCount(0),
+  thread(0), mutex(0), cond(0), running(false)
+{
+}
+
+ChunkStore::~ChunkStore()
+{
+  close();
+}
+
+bool ChunkStore::open(const string& filename, int maxChunks)
+{
+  close();
+  if (!level.load(filename)) {
+    return false;
+  }
+  width = level.getWidth();
+  height = level.getHeight();
+  gridCount = level.getGridCount();
+  chunksX = level.getChunksX();
+  chunksY = level.getChunksY();
+  assignedSlots.assign(chunksX * chunksY, -1);
+  residentSlots.assign(chunksX * chunksY, -1);
+
+  // All memory for chunks is allocated here and reused
+  slots.resize(std::max(maxChunks, 1));
+  for (size_t i=0; i<slots.size(); ++i) {
+    Chunk& chunk = slots[i];
+    chunk.chunkX = chunk.chunkY = -1;
+    chunk.state = CHUNK_FREE;
+    chunk.loadFinished = false;
+    chunk.lastUsed = 0;
+    chunk.cells.assign(gridCount * CHUNK_CELLS, 0);
+    chunk.distances.assign(gridCount * CHUNK_CELLS, 0);
+    chunk.floor.assign(CHUNK_CELLS, 0);
+    chunk.ceiling.assign(CHUNK_CELLS, 0);
+  }
+
+  mutex = SDL_CreateMutex();
+  cond = SDL_CreateCond();
+  running = true;
+  thread = SDL_CreateThread(loaderThread, "ChunkLoader", this);
+  if (!thread) {
+    printf("SDL_CreateThread failed: %s\n", SDL_GetError());
+    close();
+    return false;
+  }
+  return true;
+}
+
+void ChunkStore::close()
+{
+  if (thread) {
+    SDL_LockMutex(mutex);
+    running = false;
+    SDL_CondBroadcast(cond);
+    SDL_UnlockMutex(mutex);
+    SDL_WaitThread(thread, NULL);
+    thread = 0;
+  }
+  running = false;
+  if (cond) {
+    SDL_DestroyCond(cond);
+    cond = 0;
+  }
+  if (mutex) {
+    SDL_DestroyMutex(mutex);
+    mutex = 0;
+  }
+  queue.clear();
+  slots.clear();
+  assignedSlots.clear();
+  residentSlots.clear();
+  loaded.clear();
+  evicted.clear();
+  changedCells.clear();
+  level.close();
+}
+
+int ChunkStore::loaderThread(void* data)
+{
+  ChunkStore* store = (ChunkStore*) data;
+  SDL_LockMutex(store->mutex);
+  while (store->running) {
+    if (store->queue.empty()) {
+      SDL_CondWait(store->cond, store->mutex);
+      continue;
+    }
+    const int slot = store->queue.front();
+    store->queue.pop_front();
+    SDL_UnlockMutex(store->mutex);
+
+    store->loadChunk(store->slots[slot]);
+
+    SDL_LockMutex(store->mutex);
+    store->slots[slot].loadFinished = true;
+  }
+  SDL_UnlockMutex(store->mutex);
+  return 0;
+}
+
+// Copies a chunk out of the mapped level. Runs on the loader thread.
+void ChunkStore::loadChunk(Chunk& chunk)
+{
+  const int x0 = chunk.chunkX << LEVEL_CHUNK_SHIFT;
+  const int y0 = chunk.chunkY << LEVEL_CHUNK_SHIFT;
+  const int w = std::min(LEVEL_CHUNK_SIZE, width - x0);
+  const int h = std::min(LEVEL_CHUNK_SIZE, height - y0);
+
+  // Cells past the edge of the level are never looked up, but clear them
+  // anyway so the distance fields don't see stale walls
+  if (w < LEVEL_CHUNK_SIZE || h < LEVEL_CHUNK_SIZE) {
+    std::fill(chunk.cells.begin(), chunk.cells.end(), 0);
+  }
+
+  for (int y=0; y<h; ++y) {
+    const int src = x0 + (y0+y) * width;
+    const int dst = y << LEVEL_CHUNK_SHIFT;
+    for (int z=0; z<gridCount; ++z) {
+      memcpy(&chunk.cells[z*CHUNK_CELLS + dst], level.grid(z) + src,
+             w * sizeof(Cell));
+    }
+    memcpy(&chunk.floor[dst], level.getFloorData() + src, w * sizeof(int));
+    memcpy(&chunk.ceiling[dst], level.getCeilingData() + src, w*sizeof(int));
+  }
+
+  for (int z=0; z<gridCount; ++z) {
+    if (level.hasDistanceFields()) {
+      unsigned char* distances = &chunk.distances[z*CHUNK_CELLS];
+      for (int y=0; y<h; ++y) {
+        memcpy(distances + (y << LEVEL_CHUNK_SHIFT),
+               level.distanceField(z) + x0 + (y0+y) * width, w);
+      }
+    }
+    else {
+      computeDistances(chunk, z);
+    }
+
+    clampDistances(chunk, z);
+  }
+}
+
+// Keeps every distance inside the chunk. A ray can then never skip over a
+// chunk that isn't loaded, and a chunk's distances stay correct no matter
+// what its neighbours contain.
+void ChunkStore::clampDistances(Chunk& chunk, int z)
+{
+  unsigned char* field = &chunk.distances[z*CHUNK_CELLS];
+  for (int y=0; y<LEVEL_CHUNK_SIZE; ++y) {
+    for (int x=0; x<LEVEL_CHUNK_SIZE; ++x) {
+      const int edge = std::min(std::min(x, LEVEL_CHUNK_SIZE-1-x),
+                                std::min(y, LEVEL_CHUNK_SIZE-1-y));
+      unsigned char& d = field[x + (y << LEVEL_CHUNK_SHIFT)];
+      if (d > edge+1) {
+        d = edge+1;
+      }
+    }
+  }
+}
+
+// Two pass Chebyshev chamfer transform of one chunk level, same as
+// Raycaster::updateDistanceField() but ignoring cells outside the chunk.
+void ChunkStore::computeDistances(Chunk& chunk, int z)
+{
+  const Cell* cells = &chunk.cells[z*CHUNK_CELLS];
+  unsigned char* field = &chunk.distances[z*CHUNK_CELLS];
+  const int n = LEVEL_CHUNK_SIZE;
+  for (int i=0; i<CHUNK_CELLS; ++i) {
+    field[i] = cells[i] ? 0 : 255;
+  }
+  for (int y=0; y<n; ++y) {
+    for (int x=0; x<n; ++x) {
+      const int i = x + y*n;
+      int d = field[i];
+      if (x>0) d = std::min(d, field[i-1]+1);
+      if (y>0) {
+        d = std::min(d, field[i-n]+1);
+        if (x>0) d = std::min(d, field[i-n-1]+1);
+        if (x<n-1) d = std::min(d, field[i-n+1]+1);
+      }
+      field[i] = d;
+    }
+  }
+  for (int y=n-1; y>=0; --y) {
+    for (int x=n-1; x>=0; --x) {
+      const int i = x + y*n;
+      int d = field[i];
+      if (x<n-1) d = std::min(d, field[i+1]+1);
+      if (y<n-1) {
+        d = std::min(d, field[i+n]+1);
+        if (x>0) d = std::min(d, field[i+n-1]+1);
+        if (x<n-1) d = std::min(d, field[i+n+1]+1);
+      }
+      field[i] = d;
+    }
+  }
+}
+
+// Finds a free slot, or the least recently used resident slot that is out of
+// range of the player. Returns -1 if every slot is still needed.
+int ChunkStore::findSlotToReuse(int playerChunkX, int playerChunkY, int range)
+{
+  int best = -1;
+  for (int i=0; i<(int)slots.size(); ++i) {
+    const Chunk& chunk = slots[i];
+    if (chunk.state == CHUNK_FREE) {
+      return i;
+    }
+    if (chunk.state != CHUNK_RESIDENT) {
+      continue;
+    }
+    const int dx = abs(chunk.chunkX - playerChunkX);
+    const int dy = abs(chunk.chunkY - playerChunkY);
+    if (std::max(dx, dy) <= range) {
+      continue;
+    }
+    if (best < 0 || chunk.lastUsed < slots[best].lastUsed) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+void ChunkStore::update(int cellX, int cellY, int viewDistance)
+{
+  loaded.clear();
+  evicted.clear();
+  if (!running) {
+    return;
+  }
+  ++updateCount;
+
+  // Make chunks finished by the loader thread visible
+  SDL_LockMutex(mutex);
+  for (int i=0; i<(int)slots.size(); ++i) {
+    Chunk& chunk = slots[i];
+    if (chunk.state == CHUNK_LOADING && chunk.loadFinished) {
+      const int index = chunk.chunkX + chunk.chunkY * chunksX;
+      chunk.loadFinished = false;
+      chunk.state = CHUNK_RESIDENT;
+      residentSlots[index] = i;
+      loaded.push_back(index);
+    }
+  }
+  SDL_UnlockMutex(mutex);
+  for (size_t i=0; i<loaded.size(); ++i) {
+    applyChangedCells(slots[residentSlots[loaded[i]]], loaded[i]);
+  }
+
+  const int playerChunkX = std::max(0, std::min(cellX, width-1))
+                           >> LEVEL_CHUNK_SHIFT;
+  const int playerChunkY = std::max(0, std::min(cellY, height-1))
+                           >> LEVEL_CHUNK_SHIFT;
+  const int range = (viewDistance + LEVEL_CHUNK_SIZE - 1) >> LEVEL_CHUNK_SHIFT;
+
+  // Visit chunks in rings around the player so the nearest load first
+  bool slotsLeft = true;
+  for (int ring=0; ring<=range && slotsLeft; ++ring) {
+    for (int cy=playerChunkY-ring; cy<=playerChunkY+ring && slotsLeft; ++cy) {
+      if (cy<0 || cy>=chunksY) {
+        continue;
+      }
+      const bool edgeRow = cy==playerChunkY-ring || cy==playerChunkY+ring;
+      const int stepX = edgeRow ? 1 : std::max(1, ring*2);
+      for (int cx=playerChunkX-ring; cx<=playerChunkX+ring; cx+=stepX) {
+        if (cx<0 || cx>=chunksX) {
+          continue;
+        }
+        const int index = cx + cy * chunksX;
+        if (assignedSlots[index] >= 0) {
+          slots[assignedSlots[index]].lastUsed = updateCount;
+          continue;
+        }
+        const int slot = findSlotToReuse(playerChunkX, playerChunkY, range);
+        if (slot < 0) {
+          slotsLeft = false;
+          break;
+        }
+        Chunk& chunk = slots[slot];
+        if (chunk.state == CHUNK_RESIDENT) {
+          const int old = chunk.chunkX + chunk.chunkY * chunksX;
+          residentSlots[old] = -1;
+          assignedSlots[old] = -1;
+          evicted.push_back(old);
+        }
+        chunk.chunkX = cx;
+        chunk.chunkY = cy;
+        chunk.lastUsed = updateCount;
+        assignedSlots[index] = slot;
+
+        chunk.state = CHUNK_LOADING;
+        SDL_LockMutex(mutex);
+        queue.push_back(slot);
+        SDL_CondSignal(cond);
+        SDL_UnlockMutex(mutex);
+      }
+    }
+  }
+}
+
+int ChunkStore::getResidentCount() const
+{
+  int count = 0;
+  for (size_t i=0; i<slots.size(); ++i) {
+    if (slots[i].state == CHUNK_RESIDENT) {
+      count++;
+    }
+  }
+  return count;
+}
+
+void ChunkStore::getResidentChunks(vector<int>& chunks) const
+{
+  chunks.clear();
+  for (size_t i=0; i<slots.size(); ++i) {
+    if (slots[i].state == CHUNK_RESIDENT) {
+      chunks.push_back(slots[i].chunkX + slots[i].chunkY * chunksX);
+    }
+  }
+}
+
+// Sets a cell of a resident chunk, cell being its index in Chunk::cells.
+// Returns true if the cell went from empty to solid or back, which leaves
+// the distances of its level to be recomputed.
+bool ChunkStore::writeCell(Chunk& chunk, int cell, Cell value)
+{
+  const bool wasEmpty = !chunk.cells[cell];
+  chunk.cells[cell] = value;
+  return wasEmpty != !value;
+}
+
+// Applies the changes made to a chunk before it was last evicted
+void ChunkStore::applyChangedCells(Chunk& chunk, int index)
+{
+  map<int, CellChanges>::const_iterator changes = changedCells.find(index);
+  if (changes == changedCells.end()) {
+    return;
+  }
+  vector<bool> dirty(gridCount, false);
+  for (CellChanges::const_iterator it=changes->second.begin();
+       it!=changes->second.end(); ++it) {
+    if (writeCell(chunk, it->first, it->second)) {
+      dirty[it->first / CHUNK_CELLS] = true;
+    }
+  }
+  for (int z=0; z<gridCount; ++z) {
+    if (dirty[z]) {
+      computeDistances(chunk, z);
+      clampDistances(chunk, z);
+    }
+  }
+}
+
+void ChunkStore::setCell(int x, int y, int z, Cell value)
+{
+  const int index = (x >> LEVEL_CHUNK_SHIFT) + (y >> LEVEL_CHUNK_SHIFT)*chunksX;
+  const int slot = residentSlots[index];
+  if (slot < 0) {
+    return;
+  }
+  Chunk& chunk = slots[slot];
+  const int cell = z*CHUNK_CELLS + offsetInChunk(x, y);
+  changedCells[index][cell] = value;
+  if (!writeCell(chunk, cell, value)) {
+    return; // only state bits changed
+  }
+  computeDistances(chunk, z);
+  clampDistances(chunk, z);
+}
+
+void ChunkStore::revertCells()
+{
+  for (map<int, CellChanges>::iterator changes=changedCells.begin();
+       changes!=changedCells.end(); ++changes) {
+    const int index = changes->first;
+    const int slot = residentSlots[index];
+    if (slot < 0) {
+      continue; // reloaded from the level file when it is needed again
+    }
+    Chunk& chunk = slots[slot];
+    const int x0 = chunk.chunkX << LEVEL_CHUNK_SHIFT;
+    const int y0 = chunk.chunkY << LEVEL_CHUNK_SHIFT;
+    for (CellChanges::iterator it=changes->second.begin();
+         it!=changes->second.end(); ++it) {
+      const int z = it->first / CHUNK_CELLS;
+      const int offset = it->first % CHUNK_CELLS;
+      const int x = x0 + (offset & CHUNK_MASK);
+      const int y = y0 + (offset >> LEVEL_CHUNK_SHIFT);
+      it->second = level.grid(z)[x + y*width];
+    }
+    applyChangedCells(chunk, index);
+  }
+  changedCells.clear();
+}
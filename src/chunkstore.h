@@ -0,0 +1,154 @@
+/*
+Streams chunks of a level file in and out of memory around the player.
+
+Author: Andrew Lim
+https://github.com/andrew-lim/sdl2-raycast
+*/
+#ifndef AL_RAYCASTING_CHUNKSTORE_H
+#define AL_RAYCASTING_CHUNKSTORE_H
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include "level.h"
+
+struct SDL_Thread;
+struct SDL_mutex;
+struct SDL_cond;
+
+namespace al {
+namespace raycasting {
+
+// Returned by ChunkStore::cellAt() for cells in chunks that aren't loaded
+const int CELL_NOT_RESIDENT = -1;
+
+const int CHUNK_MASK = LEVEL_CHUNK_SIZE - 1;
+const int CHUNK_CELLS = LEVEL_CHUNK_SIZE * LEVEL_CHUNK_SIZE;
+
+/**
+ * A fixed size pool of chunk slots filled by a background thread from a
+ * memory mapped level file.
+ *
+ * Only the main thread calls update() and the lookup functions, and only it
+ * changes a slot's state. The loader thread only writes to slots in the
+ * CHUNK_LOADING state and sets their loadFinished under mutex. Lookups don't
+ * see those slots until update() finds they are finished.
+ */
+class ChunkStore {
+public:
+  enum ChunkState {
+    CHUNK_FREE,
+    CHUNK_LOADING,
+    CHUNK_RESIDENT
+  };
+
+  struct Chunk {
+    int chunkX, chunkY;
+    ChunkState state;
+    bool loadFinished; // by the loader thread, only read under mutex
+    unsigned int lastUsed; // update() count, for least recently used eviction
+    std::vector<Cell> cells; // [gridCount][CHUNK_SIZE][CHUNK_SIZE]
+    std::vector<unsigned char> distances; // same layout as cells
+    std::vector<int> floor, ceiling;
+  };
+
+  ChunkStore();
+  ~ChunkStore();
+
+  // Maps the level file and starts the loader thread.
+  // At most maxChunks chunks are kept in memory at once.
+  bool open(const std::string& filename, int maxChunks);
+  void close();
+  bool isOpen() const { return running; }
+
+  // Requests the chunks within viewDistance cells of a cell, nearest first,
+  // and evicts the least recently used chunks that are out of range.
+  // Chunks that were finished or evicted since the last call are listed in
+  // loadedChunks() and evictedChunks() as chunkX + chunkY * chunksX.
+  void update(int cellX, int cellY, int viewDistance);
+  const std::vector<int>& loadedChunks() const { return loaded; }
+  const std::vector<int>& evictedChunks() const { return evicted; }
+
+  const Level& getLevel() const { return level; }
+  int getWidth() const { return width; }
+  int getHeight() const { return height; }
+  int getGridCount() const { return gridCount; }
+  int getChunksX() const { return chunksX; }
+  int getResidentCount() const;
+  // Chunks currently visible to lookups, as chunkX + chunkY * chunksX
+  void getResidentChunks(std::vector<int>& chunks) const;
+
+  // Lookups expect x and y to be inside the level
+  bool isResident(int x, int y) const { return chunkFor(x, y) != 0; }
+  int cellAt(int x, int y, int z) const {
+    const Chunk* chunk = chunkFor(x, y);
+    return chunk ? chunk->cells[z*CHUNK_CELLS + offsetInChunk(x, y)]
+                 : CELL_NOT_RESIDENT;
+  }
+  int distanceAt(int x, int y, int z) const {
+    const Chunk* chunk = chunkFor(x, y);
+    return chunk ? chunk->distances[z*CHUNK_CELLS + offsetInChunk(x, y)] : 0;
+  }
+  int floorAt(int x, int y) const {
+    const Chunk* chunk = chunkFor(x, y);
+    return chunk ? chunk->floor[offsetInChunk(x, y)] : 0;
+  }
+  int ceilingAt(int x, int y) const {
+    const Chunk* chunk = chunkFor(x, y);
+    return chunk ? chunk->ceiling[offsetInChunk(x, y)] : 0;
+  }
+  // Changes a resident cell. The change is kept when the chunk is evicted
+  // and applied again when it is loaded back.
+  void setCell(int x, int y, int z, Cell value);
+  // Puts every changed cell back the way the level file has it
+  void revertCells();
+
+private:
+  ChunkStore(const ChunkStore&);
+  ChunkStore& operator=(const ChunkStore&);
+
+  const Chunk* chunkFor(int x, int y) const {
+    const int slot = residentSlots[(x >> LEVEL_CHUNK_SHIFT) +
+                                   (y >> LEVEL_CHUNK_SHIFT) * chunksX];
+    return slot < 0 ? 0 : &slots[slot];
+  }
+  static int offsetInChunk(int x, int y) {
+    return (x & CHUNK_MASK) + ((y & CHUNK_MASK) << LEVEL_CHUNK_SHIFT);
+  }
+
+  static int loaderThread(void* data);
+  void loadChunk(Chunk& chunk);
+  void computeDistances(Chunk& chunk, int z);
+  void clampDistances(Chunk& chunk, int z);
+  int findSlotToReuse(int playerChunkX, int playerChunkY, int range);
+  bool writeCell(Chunk& chunk, int cell, Cell value);
+  void applyChangedCells(Chunk& chunk, int index);
+
+  // Cells setCell() changed, by chunk index and then by the cell's index in
+  // Chunk::cells. Only chunks with changes have an entry.
+  typedef std::map<int, Cell> CellChanges;
+  std::map<int, CellChanges> changedCells;
+
+  Level level;
+  int width, height, gridCount, chunksX, chunksY;
+  std::vector<Chunk> slots;
+
+  // For each chunk in the level, the slot holding it or -1.
+  // residentSlots only has CHUNK_RESIDENT slots and is used for lookups.
+  std::vector<int> assignedSlots;
+  std::vector<int> residentSlots;
+
+  std::vector<int> loaded, evicted;
+  unsigned int updateCount;
+
+  SDL_Thread* thread;
+  SDL_mutex* mutex;
+  SDL_cond* cond;
+  std::deque<int> queue; // slots waiting for the loader thread
+  bool running;
+};
+
+} // raycasting
+} // al
+
+#endif
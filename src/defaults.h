@@ -5,6 +5,7 @@
 // Increase this to boost FPS but reduce rendering quality.
 // Currently supports values from 1 to 4.
 const int DEFAULT_STRIP_WIDTH = 2;
+const int MAX_STRIP_WIDTH = 4;
 
 const int DEFAULT_DISPLAY_WIDTH = 800;
 const int DEFAULT_DISPLAY_HEIGHT = 600;
@@ -0,0 +1,270 @@
+#include "framering.h"
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+using namespace al::raycasting;
+
+// Keeps every buffer and slot on its own cache lines
+static size_t align64(size_t n)
+{
+  return (n + 63) & ~(size_t) 63;
+}
+
+static size_t ringHeaderSize()
+{
+  return align64(sizeof(FrameRingHeader));
+}
+
+FrameRing::FrameRing()
+: header(0)
+{
+}
+
+bool FrameRing::create(const string& name, int slotCount, int maxWidth,
+                       int maxHeight, bool withAux)
+{
+  close();
+  if (slotCount < 1 || maxWidth < 1 || maxHeight < 1) {
+    printf("A frame ring needs at least one slot and pixel\n");
+    return false;
+  }
+  const size_t pixels = (size_t) maxWidth * maxHeight;
+  const size_t pixelsOffset = align64(sizeof(FrameSlotHeader));
+  const size_t depthOffset = align64(pixelsOffset + pixels*4);
+  const size_t surfaceOffset = align64(depthOffset + pixels*sizeof(float));
+  const size_t materialOffset = align64(surfaceOffset + pixels);
+  const size_t slotSize = withAux ? align64(materialOffset + pixels*2)
+                                  : depthOffset;
+  if (!memory.create(name, ringHeaderSize() + slotCount * slotSize)) {
+    return false;
+  }
+  header = (FrameRingHeader*) memory.getData();
+  header->version = FRAME_RING_VERSION;
+  header->headerSize = sizeof(FrameRingHeader);
+  header->slotCount = slotCount;
+  header->slotSize = slotSize;
+  header->maxWidth = maxWidth;
+  header->maxHeight = maxHeight;
+  header->flags = withAux ? FRAME_HAS_AUX : 0;
+  SDL_AtomicSet(&header->latestSlot, -1);
+  for (int i=0; i<slotCount; ++i) {
+    FrameSlotHeader* s = slot(i);
+    s->pixelsOffset = pixelsOffset;
+    if (withAux) {
+      s->depthOffset = depthOffset;
+      s->surfaceOffset = surfaceOffset;
+      s->materialOffset = materialOffset;
+    }
+  }
+  // Readers check the magic first, so it goes in last
+  SDL_MemoryBarrierRelease();
+  memcpy(header->magic, FRAME_RING_MAGIC, 4);
+  return true;
+}
+
+void FrameRing::close()
+{
+  memory.close();
+  header = 0;
+}
+
+FrameSlotHeader* FrameRing::slot(int index)
+{
+  return (FrameSlotHeader*) ((char*) header + ringHeaderSize() +
+                             index * (size_t) header->slotSize);
+}
+
+/*
+A slot is only written once the writer has set its writing flag and then
+seen no readers, and a reader only reads after adding itself to readers and
+then seeing no writing flag. Both sides change their own counter with a full
+barrier before looking at the other's, so at most one of them goes ahead.
+*/
+bool FrameRing::write(const FrameSlotHeader& info, const void* pixels,
+                      int bytesPerRow, const float* depth,
+                      const uint8_t* surface, const uint16_t* material)
+{
+  if (!header) {
+    return false;
+  }
+  if (info.width > header->maxWidth || info.height > header->maxHeight) {
+    SDL_AtomicIncRef(&header->framesDropped);
+    return false;
+  }
+  const int slotCount = header->slotCount;
+  const int latest = SDL_AtomicGet(&header->latestSlot);
+  for (int i=1; i<=slotCount; ++i) {
+    // Oldest first, and the newest frame only if nothing else is free
+    const int index = (latest + i) % slotCount;
+    FrameSlotHeader* s = slot(index);
+    if (SDL_AtomicGet(&s->readers) ||
+        !SDL_AtomicCAS(&s->writing, 0, 1)) {
+      continue;
+    }
+    if (SDL_AtomicGet(&s->readers)) {
+      SDL_AtomicSet(&s->writing, 0);
+      continue;
+    }
+
+    s->frame = SDL_AtomicGet(&header->framesWritten);
+    s->tick = info.tick;
+    s->playerX = info.playerX;
+    s->playerY = info.playerY;
+    s->playerZ = info.playerZ;
+    s->playerRot = info.playerRot;
+    s->pitch = info.pitch;
+    s->width = info.width;
+    s->height = info.height;
+    s->flags = 0;
+
+    char* base = (char*) s;
+    const size_t count = (size_t) info.width * info.height;
+    const size_t rowSize = info.width * 4;
+    if ((size_t) bytesPerRow == rowSize) {
+      memcpy(base + s->pixelsOffset, pixels, count*4);
+    }
+    else {
+      for (uint32_t y=0; y<info.height; ++y) {
+        memcpy(base + s->pixelsOffset + y*rowSize,
+               (const char*) pixels + y*bytesPerRow, rowSize);
+      }
+    }
+    if ((header->flags & FRAME_HAS_AUX) && depth && surface && material) {
+      memcpy(base + s->depthOffset, depth, count*sizeof(float));
+      memcpy(base + s->surfaceOffset, surface, count);
+      memcpy(base + s->materialOffset, material, count*2);
+      s->flags = FRAME_HAS_AUX;
+    }
+
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&s->writing, 0);
+    SDL_AtomicSet(&header->latestSlot, index);
+    SDL_AtomicIncRef(&header->framesWritten);
+    return true;
+  }
+  SDL_AtomicIncRef(&header->framesDropped);
+  return false;
+}
+
+int FrameRing::getFramesWritten() const
+{
+  return header ? SDL_AtomicGet(&header->framesWritten) : 0;
+}
+
+int FrameRing::getFramesDropped() const
+{
+  return header ? SDL_AtomicGet(&header->framesDropped) : 0;
+}
+
+FrameRingReader::FrameRingReader()
+: header(0), haveFrame(false), lastFrame(0), framesRead(0), framesMissed(0)
+{
+}
+
+bool FrameRingReader::open(const string& name)
+{
+  close();
+  if (!memory.open(name)) {
+    return false;
+  }
+  const FrameRingHeader* h = (const FrameRingHeader*) memory.getData();
+  const size_t size = memory.getSize();
+  if (size < ringHeaderSize() || memcmp(h->magic, FRAME_RING_MAGIC, 4) ||
+      h->version != FRAME_RING_VERSION ||
+      h->headerSize != sizeof(FrameRingHeader) || !h->slotCount ||
+      h->slotSize < sizeof(FrameSlotHeader) ||
+      h->slotCount > (size - ringHeaderSize()) / h->slotSize) {
+    printf("%s is not a frame ring\n", name.c_str());
+    memory.close();
+    return false;
+  }
+  SDL_MemoryBarrierAcquire();
+  header = (FrameRingHeader*) memory.getData();
+  return true;
+}
+
+void FrameRingReader::close()
+{
+  memory.close();
+  header = 0;
+  haveFrame = false;
+  lastFrame = framesRead = framesMissed = 0;
+}
+
+int FrameRingReader::getFramesDropped() const
+{
+  return header ? SDL_AtomicGet(&header->framesDropped) : 0;
+}
+
+// Whether a buffer of count elements of elementSize bytes at offset lies
+// inside a slot after its header
+static bool bufferInSlot(uint32_t offset, uint64_t count, size_t elementSize,
+                         uint32_t slotSize)
+{
+  return offset >= sizeof(FrameSlotHeader) && offset <= slotSize &&
+         count * elementSize <= slotSize - offset;
+}
+
+// Readers index the buffers with the width and height of the slot, so they
+// can't be trusted until they are checked against the ring
+static bool slotValid(const FrameRingHeader* header, const FrameSlotHeader* s)
+{
+  if (!s->width || !s->height || s->width > header->maxWidth ||
+      s->height > header->maxHeight) {
+    return false;
+  }
+  const uint64_t count = (uint64_t) s->width * s->height;
+  const uint32_t slotSize = header->slotSize;
+  if (!bufferInSlot(s->pixelsOffset, count, sizeof(uint32_t), slotSize)) {
+    return false;
+  }
+  return !(s->flags & FRAME_HAS_AUX) ||
+         (bufferInSlot(s->depthOffset, count, sizeof(float), slotSize) &&
+          bufferInSlot(s->surfaceOffset, count, sizeof(uint8_t), slotSize) &&
+          bufferInSlot(s->materialOffset, count, sizeof(uint16_t), slotSize));
+}
+
+const FrameSlotHeader* FrameRingReader::acquire()
+{
+  if (!header) {
+    return NULL;
+  }
+  const int index = SDL_AtomicGet(&header->latestSlot);
+  if (index < 0 || index >= (int) header->slotCount) {
+    return NULL;
+  }
+  FrameSlotHeader* s = (FrameSlotHeader*) ((char*) header + ringHeaderSize() +
+                                           index * (size_t) header->slotSize);
+  SDL_AtomicIncRef(&s->readers);
+  if (SDL_AtomicGet(&s->writing)) {
+    SDL_AtomicAdd(&s->readers, -1);
+    return NULL;
+  }
+  SDL_MemoryBarrierAcquire();
+  // The slot may have been written again since latestSlot was read, but
+  // only ever with a newer frame
+  if (haveFrame && (int32_t) (s->frame - lastFrame) <= 0) {
+    SDL_AtomicAdd(&s->readers, -1);
+    return NULL;
+  }
+  if (haveFrame) {
+    framesMissed += s->frame - lastFrame - 1;
+  }
+  haveFrame = true;
+  lastFrame = s->frame;
+  if (!slotValid(header, s)) {
+    framesMissed++;
+    SDL_AtomicAdd(&s->readers, -1);
+    return NULL;
+  }
+  framesRead++;
+  return s;
+}
+
+void FrameRingReader::release(const FrameSlotHeader* slot)
+{
+  if (slot) {
+    SDL_AtomicAdd(&const_cast<FrameSlotHeader*>(slot)->readers, -1);
+  }
+}
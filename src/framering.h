@@ -0,0 +1,145 @@
+/*
+Rendered frames in shared memory, for other processes on the same machine to
+read while the game runs.
+
+Author: Andrew Lim
+https://github.com/andrew-lim/sdl2-raycast
+*/
+#ifndef AL_RAYCASTING_FRAMERING_H
+#define AL_RAYCASTING_FRAMERING_H
+#include <SDL.h>
+#include <stdint.h>
+#include <string>
+#include "sharedmemory.h"
+
+namespace al {
+namespace raycasting {
+
+const char FRAME_RING_MAGIC[4] = { 'R', 'C', 'F', 'R' };
+const uint32_t FRAME_RING_VERSION = 1;
+
+// FrameRingHeader::flags and FrameSlotHeader::flags
+enum {
+  FRAME_HAS_AUX = 1 // depth, surface and material buffers
+};
+
+/*
+The shared memory is a FrameRingHeader followed by slotCount slots of
+slotSize bytes. Each slot is a FrameSlotHeader, then the pixels and, if the
+slot has FRAME_HAS_AUX, the aux buffers, at the offsets the slot header gives
+from its own start. All of them are width*height long with no padding.
+
+The writer never waits for readers. Each frame goes into the next slot no
+reader is holding, and if they all are the frame is dropped. Readers hold a
+slot while they read it in place, so a slow reader only makes the writer go
+around the slot it holds.
+*/
+struct FrameRingHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t headerSize;  // sizeof(FrameRingHeader)
+  uint32_t slotCount;
+  uint32_t slotSize;    // bytes from one FrameSlotHeader to the next
+  uint32_t maxWidth, maxHeight;
+  uint32_t flags;       // FRAME_HAS_AUX if slots have room for aux buffers
+  SDL_atomic_t latestSlot;    // of the newest frame, -1 before the first
+  SDL_atomic_t framesWritten;
+  SDL_atomic_t framesDropped; // because readers were holding every slot
+};
+
+struct FrameSlotHeader {
+  SDL_atomic_t writing; // 1 while the writer fills the slot
+  SDL_atomic_t readers; // FrameRingReaders holding the slot
+  uint32_t frame;       // framesWritten when it was written
+  uint32_t tick;        // simulation ticks since the level was reset
+  float playerX, playerY, playerZ, playerRot;
+  float pitch;          // in pixels, like Game::pitch
+  uint32_t width, height;
+  uint32_t flags;
+  uint32_t pixelsOffset;   // ARGB8888
+  uint32_t depthOffset;    // floats, straight distance from the eye
+  uint32_t surfaceOffset;  // bytes, AuxSurface values
+  uint32_t materialOffset; // uint16s
+};
+
+inline const uint32_t* framePixels(const FrameSlotHeader* slot) {
+  return (const uint32_t*) ((const char*) slot + slot->pixelsOffset);
+}
+inline const float* frameDepth(const FrameSlotHeader* slot) {
+  return (const float*) ((const char*) slot + slot->depthOffset);
+}
+inline const uint8_t* frameSurface(const FrameSlotHeader* slot) {
+  return (const uint8_t*) ((const char*) slot + slot->surfaceOffset);
+}
+inline const uint16_t* frameMaterial(const FrameSlotHeader* slot) {
+  return (const uint16_t*) ((const char*) slot + slot->materialOffset);
+}
+
+/**
+ * Creates the shared memory and writes frames into it. write() copies the
+ * frame once and never blocks, so it can run on the render thread.
+ */
+class FrameRing {
+public:
+  FrameRing();
+  bool create(const std::string& name, int slotCount, int maxWidth,
+              int maxHeight, bool withAux);
+  void close();
+  bool isOpen() const { return header != 0; }
+
+  // Copies a frame in, with the tick, pose and size from info. pixels are
+  // 32-bit, bytesPerRow apart. The aux buffers are only copied when all of
+  // them are given and the ring was created withAux. False if the frame was
+  // dropped, which also happens when it is larger than maxWidth*maxHeight.
+  bool write(const FrameSlotHeader& info, const void* pixels, int bytesPerRow,
+             const float* depth, const uint8_t* surface,
+             const uint16_t* material);
+
+  int getFramesWritten() const;
+  int getFramesDropped() const;
+
+private:
+  FrameSlotHeader* slot(int index);
+
+  SharedMemory memory;
+  FrameRingHeader* header;
+};
+
+/**
+ * Maps a FrameRing another process created and hands out the frames it
+ * writes. Only frames newer than the last one acquired are returned, and
+ * the ones skipped over are counted as missed.
+ */
+class FrameRingReader {
+public:
+  FrameRingReader();
+  bool open(const std::string& name);
+  void close();
+  bool isOpen() const { return header != 0; }
+  const FrameRingHeader* getHeader() const { return header; }
+
+  // The newest frame, held so the writer leaves it alone until release().
+  // NULL if there isn't a new one yet or the writer is busy with it. A frame
+  // whose size or buffers don't fit its slot is counted as missed.
+  const FrameSlotHeader* acquire();
+  void release(const FrameSlotHeader* slot);
+
+  uint32_t getFramesRead() const { return framesRead; }
+  // Written by the FrameRing but never acquired, since open()
+  uint32_t getFramesMissed() const { return framesMissed; }
+  // By the FrameRing because every slot was held
+  int getFramesDropped() const;
+
+private:
+  SharedMemory memory;
+  FrameRingHeader* header;
+  bool haveFrame;
+  uint32_t lastFrame;
+  uint32_t framesRead;
+  uint32_t framesMissed;
+};
+
+} // raycasting
+} // al
+
+#endif
@@ -0,0 +1,377 @@
+/*
+The Game: one world, the simulation that runs it and the renderer that draws
+it. main.cpp defines it, and VectorEnv and CameraBatch run many of them.
+
+Author: Andrew Lim
+https://github.com/andrew-lim/sdl2-raycast
+*/
+#ifndef AL_RAYCASTING_GAME_H
+#define AL_RAYCASTING_GAME_H
+#include <SDL.h>
+#include <SDL_mixer.h>
+#include <cmath>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+#include "sdl2utils.h"
+#include "raycasting.h"
+#include "level.h"
+#include "chunkstore.h"
+#include "terrain.h"
+#include "inputrecording.h"
+#include "framering.h"
+
+namespace al {
+namespace raycasting {
+
+// Length of a wall or cell in game units.
+const int TILE_SIZE = 128;
+const int DESIRED_FPS = 120;
+const int UPDATE_INTERVAL = 1000/DESIRED_FPS; // one simulation tick, in ms
+const float TWO_PI = M_PI*2;
+
+// Everything the simulation changes, see Game::captureWorld()
+struct WorldSnapshot {
+  std::vector<unsigned char> data; // reused by every captureWorld()
+};
+
+// What a pixel of AuxBuffers::surface shows. AuxBuffers::material holds the
+// CellMaterial index of grid walls, the wallType of ThinWalls, the textureID
+// of sprites and the floor or ceiling texture of everything else.
+enum AuxSurface {
+  AUX_SKY = 0,       // nothing was hit
+  AUX_WALL,
+  AUX_FLOOR,         // floors, terrain and the tops of walls and ThickWalls
+  AUX_CEILING,       // ceilings and the bottoms of walls and ThickWalls
+  AUX_SLOPE,         // top of a slope
+  AUX_SLOPE_CEILING, // underside of an inverted slope
+  AUX_SPRITE,
+  AUX_FOG            // chunk that isn't loaded yet
+};
+
+// Per pixel extras of a frame, filled in by the code that writes the colors
+// when Game::setAuxBuffersOn() is set. They are laid out like the pixels.
+struct AuxBuffers {
+  int width, height;
+  std::vector<float> depth; // straight distance from the eye, 0 for AUX_SKY
+  std::vector<Uint8> surface; // AuxSurface
+  std::vector<Uint16> material;
+  AuxBuffers() : width(0), height(0) {}
+  void clear(int newWidth, int newHeight) {
+    width = newWidth;
+    height = newHeight;
+    depth.assign(width * height, 0.0f);
+    surface.assign(width * height, AUX_SKY);
+    material.assign(width * height, 0);
+  }
+};
+
+// A viewpoint Game::renderCamera() draws from instead of the player's. pitch
+// is in pixels of the surface drawn to, like Game::pitch.
+struct Camera {
+  float x, y, z, rot, pitch;
+  Camera() : x(0), y(0), z(0), rot(0), pitch(0) {}
+};
+
+// Textures and sounds, which nothing changes after Game::loadAssets(). The
+// Games of a VectorEnv all draw with the first one's.
+struct GameAssets {
+  sdl2utils::SurfaceTexture wallsImage, wallsImageDark;
+  sdl2utils::SurfaceTexture gatesImage, gatesOpenImage, gunImage;
+  std::map<int,sdl2utils::SurfaceTexture> spriteTextures;
+  std::vector<sdl2utils::Bitmap> floorCeilingBitmaps;
+  sdl2utils::Bitmap ceilingBitmap;
+  SDL_Surface* skyboxSurface;
+  Uint32 ceilingColor;
+  Mix_Chunk* projectileFireSound;
+  Mix_Chunk* projectileExplodeSound;
+  Mix_Chunk* doorOpenSound;
+  Mix_Chunk* doorCloseSound;
+  GameAssets()
+  : skyboxSurface(NULL), ceilingColor(0), projectileFireSound(NULL),
+    projectileExplodeSound(NULL), doorOpenSound(NULL), doorCloseSound(NULL) {}
+};
+
+class Game {
+public:
+    // Games that will shareLevel() or loadLevel() pass false for
+    // defaultLevel, so a level they throw away isn't built first
+    explicit Game(GameAssets* sharedAssets=NULL, bool defaultLevel=true);
+    ~Game();
+    void start(int benchmarkFrames=0);
+    void benchmark(int frames);
+    bool loadAssets(Uint32 pf, bool swizzleTextures);
+    bool startHeadless(int width, int height, int newStripWidth, int fov);
+    void shareLevel(const Game& other);
+    GameAssets* getAssets() { return &assets; }
+    const Sprite& getPlayer() const { return world.player; }
+    const std::vector<Sprite>& getSprites() const { return world.sprites; }
+    SDL_Surface* getFrame() { return screenSurface; }
+    void recordTo(const std::string& filename) { recordFile = filename; }
+    void replayFrom(const std::string& filename) { replayFile = filename; }
+    void replay();
+    void stop() ;
+    void draw();
+    void renderFrame();
+    void writeFrameRing();
+    bool renderCamera(const Camera& camera, SDL_Surface* output,
+                      const SpriteIndex* sharedSpriteIndex,
+                      AuxBuffers* auxOutput=NULL);
+    void setAuxBuffersOn(bool on) { aux = on ? &ownAux : NULL; }
+    // Quiet Games don't print what the player does, like opening doors
+    void setQuiet(bool on) { quiet = on; }
+    const AuxBuffers* getAuxBuffers() const { return aux; }
+    void presentFrame();
+    void beginRender();
+    void finishRender();
+    static int renderThreadMain(void* data);
+    void savePreviousState();
+    void publishWorld(float alpha);
+    void fillRect(SDL_Rect* rc, int r, int g, int b );
+    void drawLine(int startX, int startY, int endX, int endY, int r, int g,
+                  int b, int alpha=SDL_ALPHA_OPAQUE );
+    void fpsChanged( int fps );
+    void onQuit();
+    void onKeyDown( SDL_Event* event );
+    void onKeyUp( SDL_Event* event );
+    void handleEvent( SDL_Event& event );
+    InputSnapshot takeInput();
+    void setMouseLook(bool on);
+    void reset();
+    bool captureWorld(WorldSnapshot& snapshot);
+    bool restoreWorld(const WorldSnapshot& snapshot);
+    void copyGridRow(int y, const void* cells, const unsigned char* distances,
+                     int levelStride);
+    void run();
+    void printHelp();
+    void update(float timeElapsed, const InputSnapshot& input);
+    void drawWallTop(RayHit& rayHit, int wallScreenHeight, float playerScreenZ);
+    void drawWallBottom(RayHit&rayHit,int wallScreenHeight,float playerScreenZ);
+    void drawThinWallTop(RayHit& rayHit, int wallScreenHeight);
+    void drawThinWallBottom(RayHit& rayHit, int wallScreenHeight);
+    void drawThickWallFace(RayHit& rayHit, float planeZ, int textureID,
+                           bool top);
+    bool drawSlope(RayHit& rayHit);
+    bool drawSlopeInverted(RayHit& rayHit);
+    bool drawSlopeSurface(RayHit& rayHit, float nearY, float farY,
+                          int textureID, bool topSurface);
+    void drawFloor(std::vector<RayHit>& rayHits);
+    void drawSkyboxAndHighestCeiling(std::vector<RayHit>& rayHits);
+    void drawSkybox();
+    void drawWeapon();
+    void drawMiniMap();
+    void drawMiniMapSprites();
+    void updatePlayer(float elapsedTime, const InputSnapshot& input);
+    void updateProjectiles(float elaspedTime);
+    void drawPlayer();
+    void drawRay(float rayX, float rayY);
+    void drawRays(std::vector<RayHit>& rayHits);
+    float wallScreenY(RayHit& rayHit, float wallHeight);
+    SDL_Rect stripScreenRect(RayHit& rayHit, float wallHeight);
+    void drawSlopeStrip(RayHit& rayHit, sdl2utils::SurfaceTexture& img,
+                        float textureX, float textureY);
+    void drawThinWallStrip(RayHit& rayHit, sdl2utils::SurfaceTexture& img,
+                           float textureX, float textureY,
+                           bool aboveWall=false, bool beloWall=false);
+    void drawWallStrip(RayHit& rayHit, sdl2utils::SurfaceTexture& img,
+                       float textureX, float textureY,
+                       int wallScreenHeight,
+                       bool aboveWall=false, bool beloWall=false);
+    bool ignoreWallStrip(RayHit& rayHit);
+    void drawWorld(std::vector<RayHit>& rayHits);
+    void createStripAngles();
+    void createScreenBuffers();
+    void setRenderResolution(int width, int height, int newStripWidth);
+    void setResolutionLevel(int level);
+    void updateDynamicResolution(float frameMs);
+    void raycastWorld(std::vector<RayHit>& rayHits,
+                      const SpriteIndex* sharedSpriteIndex=NULL);
+    void castGridRay(int strip);
+    void refineGridRays(int stripA, int stripB);
+    bool canInterpolateGridRays(int stripA, int stripB);
+    float gridRayReach(int strip);
+    bool sameWallRun(const RayHit& a, const RayHit& b);
+    void interpolateGridRays(int stripA, int stripB);
+    bool isWallCell(int wallX, int wallY, int level=0);
+    bool playerInWall(float playerX, float playerY, float playerZ);
+    SDL_Rect findSpriteScreenPosition( Sprite& sprite );
+    void addSpriteAt( int spriteid, int cellX, int cellY );
+    void addProjectile(int textureid, int x, int y, int z, int size,
+                       float rotation);
+    float sine(float f);
+    float cosine(float f);
+    void toggleDoorPressed();
+    void usePendingDoor();
+    void playSound(Mix_Chunk* sound);
+    void toggleDoor(int cellX, int cellY);
+    bool isDoorOpen(int cellX, int cellY);
+    bool isDoorHit(const RayHit& rayHit);
+    Uint32 fogPixel( Uint32 pixel, float distance );
+    void writeAux(int dstPixel, float depth, int surface, int material);
+    void writeAuxRect(const SDL_Rect& rect, float depth, int surface,
+                      int material);
+    void writeAuxBlit(SDL_Surface* src, const SDL_Rect* srcRect,
+                      const SDL_Rect& dstRect, float depth, int surface,
+                      int material);
+    void fogWallStrip( SDL_Rect* dstrect, float distance  );
+    void drawFogStrip(RayHit& rayHit);
+    float slopeHeightAt(float worldX, float worldY);
+    int floorMipLevel(float distance);
+    int wallMipLevel(float wallScreenHeight);
+    void createThinWalls();
+    ThickWall* createThickWall(const LevelThickWall& desc);
+    void addChunkObjects(int chunk);
+    void removeChunkObjects(int chunk);
+    void clearThickWalls();
+    void streamChunks();
+    const Level& activeLevel() const;
+    int floorTypeAt(int cellX, int cellY);
+    int ceilingTypeAt(int cellX, int cellY);
+    void createDefaultLevel();
+    bool loadLevel(const std::string& filename);
+    bool saveLevel(const std::string& filename);
+    bool loadHeightmap(const std::string& filename, float maxHeight);
+    void raycastTerrain(std::vector<RayHit>& rayHits, int strip,
+                        float stripAngle);
+    void drawTerrainStrip(RayHit& rayHit);
+private:
+    // displayWidth and displayHeight are the size frames are rendered at,
+    // which dynamic resolution can make smaller than the window
+    int displayWidth, displayHeight, stripWidth, rayCount;
+    int windowWidth, windowHeight, windowStripWidth;
+    sdl2utils::FramePacer framePacer;
+
+    // Events since the last tick, see takeInput()
+    InputSnapshot pendingInput;
+    bool pendingUseDone; // pendingInput.use has toggled its door already
+    bool mouseLook;
+    float mouseSensitivity; // radians per pixel
+    // Input to photon latency: the oldest input ticked since the last
+    // publishWorld(), the oldest input in the frame being drawn, and the
+    // latencies of presented frames since fpsChanged()
+    Uint32 tickedInputTime, frameInputTime;
+    double latencySum;
+    int latencyCount;
+
+    // reset() seeds random with seed, so a recording replays the same
+    Uint32 seed;
+    Random random;
+    InputRecording recording; // every tick's input when recordFile is set
+    std::string recordFile, replayFile;
+
+    // The world right after the first reset() of a level, which later
+    // resets restore. Rows of cells missing from snapshots are copied from
+    // baseCells and baseDistances, laid out like the grids.
+    WorldSnapshot resetSnapshot;
+    const Cell* baseCells;
+    const unsigned char* baseDistances;
+    std::vector<unsigned char> computedDistanceFields; // if the level has none
+
+    bool dynamicResolution;
+    float frameBudgetMs;
+    float averageFrameMs;
+    int resolutionLevel, resolutionSettleFrames;
+    int fovDegrees;
+    float fovRadians, viewDist;
+    bool fullscreen;
+    float pitch; // drawn copy of world.pitch, in pixels of this frame
+    Uint32 tick; // drawn copy of world.tick
+    FrameRing frameRing; // every rendered frame when frameRing is set
+    float* stripAngles;
+    // Strip angles of the last renderCamera() output width and stripWidth
+    float* cameraStripAngles;
+    int cameraWidth, cameraStripWidth;
+    Raycaster raycaster3D;
+    Level level;
+    std::string levelFile;
+    ChunkStore chunkStore;
+    bool streaming; // levelFile is streamed through chunkStore
+    int streamViewDistance;
+    Terrain terrain;
+    int terrainViewDistance;
+    std::vector<Uint32> terrainPixels; // [row][strip], see raycastTerrain()
+    std::vector<float> terrainDepths;  // same, only filled for aux
+    std::vector<Uint16> terrainMaterials;
+    int mapWidth, mapHeight;
+    std::vector<int> groundWalls;
+    int frameSkip ;
+    int running ;
+    bool sdlStarted; // by start(), so stop() has to quit SDL
+    bool quiet; // see setQuiet()
+    SDL_Window* window;
+    SDL_Renderer* renderer;
+    Sprite player; // drawn copy of world.player
+
+    // Everything update() changes. Frames are drawn from the copy that
+    // publishWorld() makes in player, sprites and pitch, so the next ticks
+    // can run while a frame is drawn on the render thread.
+    struct WorldState {
+      Sprite player;
+      std::vector<Sprite> sprites;
+      float pitch;
+      Uint32 tick; // update()s since the level was reset
+      WorldState() : pitch(0), tick(0) {}
+    };
+    WorldState world;
+
+    // Where the player and sprites were before the last tick. Only what is
+    // interpolated is kept, and the buffer is reused every tick.
+    struct TickPosition {
+      float x, y, z, rot;
+    };
+    TickPosition previousPlayer;
+    std::vector<TickPosition> previousSprites;
+
+    // raycastWorld() and drawWorld() run on renderThread when there is one.
+    // The main thread only touches what they use between finishRender()
+    // and beginRender().
+    SDL_Thread* renderThread;
+    SDL_sem* renderStart;
+    SDL_sem* renderDone;
+    bool renderPending;
+    bool renderThreadQuit;
+    float renderMs; // how long the last renderFrame() took
+    std::vector<RayHit> frameRayHits;
+    GameAssets ownAssets;
+    GameAssets& assets; // ownAssets unless shared by a VectorEnv
+    std::vector<Sprite> sprites; // drawn copy of world.sprites
+    SpriteIndex spriteIndex; // of sprites, see raycastWorld()
+    std::queue<Sprite> projectilesQueue;
+    bool drawMiniMapOn, drawTexturedFloorOn, drawCeilingOn, drawWallsOn;
+    bool skipDrawnFloorStrips;
+    bool skipDrawnHighestCeilingStrips;
+    bool drawWeaponOn;
+    bool fogOn;
+    bool mipmapsOn;
+    bool adaptiveRaysOn;
+    int adaptiveRayStep;
+    int gridRaysCast; // by the last raycastWorld()
+    std::vector< std::vector<RayHit> > gridStripHits; // see raycastWorld()
+    std::vector<int> skyboxRowOffsets; // per screen row, see drawSkybox()
+    std::vector<int> skyboxColumnOffsets;
+    std::vector<int> skyboxColumnTops;
+
+    SDL_Texture* screenTexture;
+    SDL_Surface* screenSurface;
+    // Filled in along with screenSurface when not NULL, which costs one
+    // test per strip row or blit when it is
+    AuxBuffers* aux;
+    AuxBuffers ownAux;
+    int highestCeilingLevel;
+    int rayHitsCount;
+    std::vector<ThinWall*> thinWalls;
+    // ThickWalls of the chunks added, by index in the level. chunks counts
+    // the added chunks each one overlaps.
+    struct ChunkThickWall {
+      ThickWall* thickWall;
+      int chunks;
+    };
+    std::map<uint32_t, ChunkThickWall> thickWalls;
+    ThickWallIndex thickWallIndex;
+};
+
+} // raycasting
+} // al
+
+#endif
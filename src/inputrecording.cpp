@@ -0,0 +1,204 @@
+#include "inputrecording.h"
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+using namespace al::raycasting;
+
+// Bits of the flags byte of a record
+enum {
+  INPUT_MOUSE_LOOK = 1,
+  INPUT_JUMP       = 2,
+  INPUT_FIRE       = 4,
+  INPUT_USE        = 8,
+  INPUT_RESET      = 16,
+  INPUT_FACE_EAST_BIT = 32,
+  INPUT_FACE_WEST_BIT = 64,
+  INPUT_HAS_MOUSE  = 128
+};
+
+// Flags that only apply to the tick they happened in
+const int INPUT_ONE_OFF = ~INPUT_MOUSE_LOOK & 0xff;
+
+const int MAX_RECORD_TICKS = 255;
+
+static int clampInt16(int value)
+{
+  return value < -32768 ? -32768 : (value > 32767 ? 32767 : value);
+}
+
+static void putInt16(vector<unsigned char>& out, int value)
+{
+  const uint16_t bits = (uint16_t) clampInt16(value);
+  out.push_back(bits & 0xff);
+  out.push_back(bits >> 8);
+}
+
+static int getInt16(const unsigned char* in)
+{
+  return (int16_t) (uint16_t) (in[0] | (in[1] << 8));
+}
+
+// Each axis is -1, 0 or 1 and takes 2 bits
+static unsigned char encodeAxes(const InputSnapshot& input)
+{
+  return (input.move + 1) | ((input.turn + 1) << 2) |
+         ((input.strafe + 1) << 4) | ((input.look + 1) << 6);
+}
+
+static unsigned char encodeFlags(const InputSnapshot& input)
+{
+  unsigned char flags = 0;
+  if (input.mouseLook) flags |= INPUT_MOUSE_LOOK;
+  if (input.jump) flags |= INPUT_JUMP;
+  if (input.fire) flags |= INPUT_FIRE;
+  if (input.use) flags |= INPUT_USE;
+  if (input.reset) flags |= INPUT_RESET;
+  if (input.face == INPUT_FACE_EAST) flags |= INPUT_FACE_EAST_BIT;
+  if (input.face == INPUT_FACE_WEST) flags |= INPUT_FACE_WEST_BIT;
+  if (input.mouseX || input.mouseY) flags |= INPUT_HAS_MOUSE;
+  return flags;
+}
+
+InputRecording::InputRecording()
+{
+  clear(1, 0, 0);
+}
+
+void InputRecording::clear(uint32_t seed, int tickMs, float mouseSensitivity)
+{
+  data.clear();
+  this->seed = seed;
+  this->tickMs = tickMs;
+  this->mouseSensitivity = mouseSensitivity;
+  tickCount = 0;
+  lastRecord = 0;
+  rewind();
+}
+
+void InputRecording::add(const InputSnapshot& input)
+{
+  const unsigned char axes = encodeAxes(input);
+  const unsigned char flags = encodeFlags(input);
+  tickCount++;
+
+  // Same as the last tick and nothing happened, so it only counts up
+  if (!(flags & INPUT_ONE_OFF) && data.size() &&
+      data[lastRecord] == axes && data[lastRecord+1] == flags &&
+      data.back() < MAX_RECORD_TICKS) {
+    data.back()++;
+    return;
+  }
+  lastRecord = data.size();
+  data.push_back(axes);
+  data.push_back(flags);
+  if (flags & INPUT_HAS_MOUSE) {
+    putInt16(data, input.mouseX);
+    putInt16(data, input.mouseY);
+  }
+  data.push_back(1);
+}
+
+bool InputRecording::save(const string& filename) const
+{
+  RecordingHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, INPUT_RECORDING_MAGIC, 4);
+  h.version = INPUT_RECORDING_VERSION;
+  h.seed = seed;
+  h.tickMs = tickMs;
+  h.mouseSensitivity = mouseSensitivity;
+  h.tickCount = tickCount;
+  h.dataSize = data.size();
+
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    printf("Could not write %s\n", filename.c_str());
+    return false;
+  }
+  bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+  if (ok && data.size()) {
+    ok = fwrite(&data[0], 1, data.size(), fp) == data.size();
+  }
+  fclose(fp);
+  if (!ok) {
+    printf("Could not write %s\n", filename.c_str());
+  }
+  return ok;
+}
+
+bool InputRecording::load(const string& filename)
+{
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (!fp) {
+    printf("Could not open %s\n", filename.c_str());
+    return false;
+  }
+  RecordingHeader h;
+  bool ok = fread(&h, sizeof(h), 1, fp) == 1 &&
+            !memcmp(h.magic, INPUT_RECORDING_MAGIC, 4) &&
+            h.version == INPUT_RECORDING_VERSION;
+  if (ok) {
+    clear(h.seed, h.tickMs, h.mouseSensitivity);
+    data.resize(h.dataSize);
+    ok = !h.dataSize || fread(&data[0], 1, h.dataSize, fp) == h.dataSize;
+    tickCount = h.tickCount;
+  }
+  fclose(fp);
+  if (!ok) {
+    printf("%s is not a valid input recording\n", filename.c_str());
+    clear(1, 0, 0);
+  }
+  return ok;
+}
+
+void InputRecording::rewind()
+{
+  readPos = 0;
+  repeatsLeft = 0;
+  repeated.clear();
+}
+
+bool InputRecording::next(InputSnapshot& input)
+{
+  if (repeatsLeft > 0) {
+    repeatsLeft--;
+    input = repeated;
+    return true;
+  }
+  if (readPos + 3 > data.size()) {
+    return false;
+  }
+  const unsigned char* in = &data[readPos];
+  const int axes = in[0];
+  const int flags = in[1];
+  const size_t size = flags & INPUT_HAS_MOUSE ? 7 : 3;
+  if (readPos + size > data.size() || !in[size-1]) {
+    return false;
+  }
+
+  input.clear();
+  input.move = (axes & 3) - 1;
+  input.turn = ((axes >> 2) & 3) - 1;
+  input.strafe = ((axes >> 4) & 3) - 1;
+  input.look = ((axes >> 6) & 3) - 1;
+  input.mouseLook = flags & INPUT_MOUSE_LOOK;
+  input.jump = flags & INPUT_JUMP;
+  input.fire = flags & INPUT_FIRE;
+  input.use = flags & INPUT_USE;
+  input.reset = flags & INPUT_RESET;
+  if (flags & INPUT_FACE_EAST_BIT) {
+    input.face = INPUT_FACE_EAST;
+  }
+  else if (flags & INPUT_FACE_WEST_BIT) {
+    input.face = INPUT_FACE_WEST;
+  }
+  if (flags & INPUT_HAS_MOUSE) {
+    input.mouseX = getInt16(in + 2);
+    input.mouseY = getInt16(in + 4);
+  }
+  repeated = input;
+  repeatsLeft = in[size-1] - 1;
+  readPos += size;
+  return true;
+}
@@ -0,0 +1,129 @@
+/*
+Per tick input and recordings of it for deterministic replays.
+
+Author: Andrew Lim
+https://github.com/andrew-lim/sdl2-raycast
+*/
+#ifndef AL_RAYCASTING_INPUTRECORDING_H
+#define AL_RAYCASTING_INPUTRECORDING_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace al {
+namespace raycasting {
+
+const char INPUT_RECORDING_MAGIC[4] = { 'R', 'C', 'I', 'N' };
+const uint32_t INPUT_RECORDING_VERSION = 1;
+
+// InputSnapshot::face values, from the O and P debug keys
+enum InputFace {
+  INPUT_FACE_NONE = 0,
+  INPUT_FACE_EAST,  // rotation 0
+  INPUT_FACE_WEST   // rotation pi
+};
+
+// What the player asked for during one simulation tick. The simulation reads
+// input only from here, so replaying the same snapshots from the same start
+// gives the same ticks.
+struct InputSnapshot {
+  int move;   // 1 forward, -1 backward
+  int turn;   // 1 right, -1 left
+  int strafe; // 1 right, -1 left
+  int look;   // 1 up, -1 down
+  int mouseX, mouseY; // relative mouse motion in pixels
+  bool mouseLook;
+  bool jump, fire, use, reset;
+  int face;
+  uint32_t timestamp; // SDL_GetTicks() of the oldest event in it, or 0
+  InputSnapshot() { clear(); }
+  void clear() {
+    move = turn = strafe = look = 0;
+    mouseX = mouseY = 0;
+    mouseLook = false;
+    jump = fire = use = reset = false;
+    face = INPUT_FACE_NONE;
+    timestamp = 0;
+  }
+};
+
+/**
+ * Small xorshift generator. Unlike rand() the same seed gives the same
+ * numbers on every platform, and nothing else draws from it.
+ */
+class Random {
+public:
+  explicit Random(uint32_t seed=1) { setSeed(seed); }
+  void setSeed(uint32_t seed) { state = seed ? seed : 1; }
+  // Passing this to setSeed() continues from where it is now
+  uint32_t getState() const { return state; }
+  uint32_t next() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+  // 0 to n-1
+  int nextInt(int n) { return next() % n; }
+private:
+  uint32_t state;
+};
+
+/*
+A recording file is a RecordingHeader followed by the encoded ticks. Each
+record is two bytes, movement axes and flags, then the mouse motion as two
+little-endian int16s if INPUT_HAS_MOUSE is set, then how many ticks in a row
+the record covers. Only ticks without one-off actions are merged, so an idle
+minute takes a few dozen bytes.
+*/
+struct RecordingHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t seed;            // Random seed the simulation started with
+  uint32_t tickMs;          // length of one tick
+  float mouseSensitivity;   // radians per pixel
+  uint32_t tickCount;
+  uint32_t dataSize;        // bytes of encoded ticks after the header
+};
+
+/**
+ * The InputSnapshots of a play session, kept encoded in memory. add() them
+ * while playing and save(), or load() and read them back with next().
+ */
+class InputRecording {
+public:
+  InputRecording();
+
+  void clear(uint32_t seed, int tickMs, float mouseSensitivity);
+  void add(const InputSnapshot& input);
+  bool save(const std::string& filename) const;
+  bool load(const std::string& filename);
+
+  // Starts next() over from the first tick
+  void rewind();
+  // Copies the next tick into input. False when there are none left.
+  bool next(InputSnapshot& input);
+
+  uint32_t getSeed() const { return seed; }
+  int getTickMs() const { return tickMs; }
+  float getMouseSensitivity() const { return mouseSensitivity; }
+  int getTickCount() const { return tickCount; }
+  size_t getDataSize() const { return data.size(); }
+
+private:
+  std::vector<unsigned char> data;
+  uint32_t seed;
+  int tickMs;
+  float mouseSensitivity;
+  int tickCount;
+  size_t lastRecord; // offset of the last record in data, for merging
+
+  size_t readPos;
+  int repeatsLeft;
+  InputSnapshot repeated;
+};
+
+} // raycasting
+} // al
+
+#endif
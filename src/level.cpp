@@ -0,0 +1,489 @@
+#include "level.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+using namespace al::raycasting;
+
+// Offsets are 32-bit, so a level can't be any bigger
+const uint64_t LEVEL_MAX_BYTES = 0xffffffffu;
+
+static uint64_t align4(uint64_t n)
+{
+  return (n + 3) & ~(uint64_t) 3;
+}
+
+// Checks that a section of count*elementSize bytes at offset fits in the file
+static bool sectionFits(uint32_t offset, uint64_t count, size_t elementSize,
+                        size_t fileSize)
+{
+  if (offset % 4 || offset > fileSize) {
+    return false;
+  }
+  return count <= (fileSize - offset) / (elementSize ? elementSize : 1);
+}
+
+static bool spriteInMap(const LevelSprite& sprite, int width, int height)
+{
+  return sprite.cellX >= 0 && sprite.cellX < width &&
+         sprite.cellY >= 0 && sprite.cellY < height;
+}
+
+// Every point of a ThickWall has to be inside the map or on its edge
+static bool thickWallInMap(const LevelThickWall& desc, int width, int height,
+                           int tileSize)
+{
+  float minX, minY, maxX, maxY;
+  if (!Level::thickWallBounds(desc, minX, minY, maxX, maxY)) {
+    return false;
+  }
+  return minX >= 0 && minY >= 0 &&
+         maxX <= (float) width * tileSize && maxY <= (float) height * tileSize;
+}
+
+static bool textureIDValid(int32_t id)
+{
+  return id >= 0 && id < LEVEL_MAX_TEXTURES;
+}
+
+// Every floor and ceiling texture ID of the map
+static bool texturesValid(const int32_t* floor, const int32_t* ceiling,
+                          size_t cells)
+{
+  for (size_t i=0; i<cells; ++i) {
+    if (!textureIDValid(floor[i]) || !textureIDValid(ceiling[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool thickWallTexturesValid(const LevelThickWall& desc)
+{
+  return textureIDValid(desc.floorTextureID) &&
+         textureIDValid(desc.ceilingTextureID);
+}
+
+static int chunksAcross(int cells)
+{
+  return (cells + LEVEL_CHUNK_SIZE - 1) >> LEVEL_CHUNK_SHIFT;
+}
+
+static int chunkOf(float position, int tileSize, int cells)
+{
+  const int cell = std::max(0, std::min((int) (position / tileSize), cells-1));
+  return cell >> LEVEL_CHUNK_SHIFT;
+}
+
+bool Level::thickWallBounds(const LevelThickWall& desc, float& minX,
+                            float& minY, float& maxX, float& maxY)
+{
+  int points;
+  float coords[8];
+  memcpy(coords, desc.coords, sizeof(coords));
+  switch (desc.shape) {
+    case LEVEL_WALL_RECT:
+    case LEVEL_WALL_SLOPE:
+    case LEVEL_WALL_INVERTED_SLOPE:
+      // x, y, w, h to opposite corners
+      coords[2] += coords[0];
+      coords[3] += coords[1];
+      points = 2;
+      break;
+    case LEVEL_WALL_TRIANGLE: points = 3; break;
+    case LEVEL_WALL_QUAD: points = 4; break;
+    default: return false;
+  }
+  minX = maxX = coords[0];
+  minY = maxY = coords[1];
+  for (int i=1; i<points; ++i) {
+    minX = std::min(minX, coords[i*2]);
+    maxX = std::max(maxX, coords[i*2]);
+    minY = std::min(minY, coords[i*2+1]);
+    maxY = std::max(maxY, coords[i*2+1]);
+  }
+  return true;
+}
+
+int Level::thickWallChunk(const LevelThickWall& desc, int tileSize,
+                          int chunksX, int chunksY)
+{
+  int chunkX = (int)(desc.coords[0] / tileSize) >> LEVEL_CHUNK_SHIFT;
+  int chunkY = (int)(desc.coords[1] / tileSize) >> LEVEL_CHUNK_SHIFT;
+  chunkX = std::max(0, std::min(chunkX, chunksX-1));
+  chunkY = std::max(0, std::min(chunkY, chunksY-1));
+  return chunkX + chunkY * chunksX;
+}
+
+// Orders ThickWalls and sprites by the chunk they belong to
+struct ChunkOrder {
+  int tileSize, chunksX, chunksY;
+  ChunkOrder(int tileSize, int chunksX, int chunksY)
+  : tileSize(tileSize), chunksX(chunksX), chunksY(chunksY) {}
+  int chunk(const LevelThickWall& a) const {
+    return Level::thickWallChunk(a, tileSize, chunksX, chunksY);
+  }
+  int chunk(const LevelSprite& a) const {
+    return (a.cellX >> LEVEL_CHUNK_SHIFT) +
+           (a.cellY >> LEVEL_CHUNK_SHIFT) * chunksX;
+  }
+  bool operator()(const LevelThickWall& a, const LevelThickWall& b) const {
+    return chunk(a) < chunk(b);
+  }
+  bool operator()(const LevelSprite& a, const LevelSprite& b) const {
+    return chunk(a) < chunk(b);
+  }
+};
+
+Level::Level()
+: data(0), size(0), header(0), gridsData(0), floorData(0), ceilingData(0),
+  distanceFieldsData(0), thickWallsData(0), thickWallRefsData(0),
+  spritesData(0), chunkIndexData(0),
+  materialsData(0), terrainData(0), chunksX(0), chunksY(0)
+{
+}
+
+void Level::close()
+{
+  file.close();
+  vector<uint32_t>().swap(memory);
+  data = 0;
+  size = 0;
+  header = 0;
+  gridsData = 0;
+  floorData = ceilingData = 0;
+  distanceFieldsData = 0;
+  thickWallsData = 0;
+  thickWallRefsData = 0;
+  spritesData = 0;
+  chunkIndexData = 0;
+  materialsData = 0;
+  terrainData = 0;
+  chunksX = chunksY = 0;
+}
+
+void Level::swap(Level& other)
+{
+  file.swap(other.file);
+  memory.swap(other.memory);
+  std::swap(data, other.data);
+  std::swap(size, other.size);
+  std::swap(header, other.header);
+  std::swap(gridsData, other.gridsData);
+  std::swap(floorData, other.floorData);
+  std::swap(ceilingData, other.ceilingData);
+  std::swap(distanceFieldsData, other.distanceFieldsData);
+  std::swap(thickWallsData, other.thickWallsData);
+  std::swap(thickWallRefsData, other.thickWallRefsData);
+  std::swap(spritesData, other.spritesData);
+  std::swap(chunkIndexData, other.chunkIndexData);
+  std::swap(materialsData, other.materialsData);
+  std::swap(terrainData, other.terrainData);
+  std::swap(chunksX, other.chunksX);
+  std::swap(chunksY, other.chunksY);
+}
+
+bool Level::load(const string& filename)
+{
+  close();
+  if (!file.open(filename)) {
+    return false;
+  }
+  if (!attach(file.getData(), file.getSize())) {
+    printf("%s is not a valid level file\n", filename.c_str());
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool Level::attach(const char* data, size_t size)
+{
+  if (size < sizeof(LevelHeader)) {
+    return false;
+  }
+  const LevelHeader* h = (const LevelHeader*) data;
+  if (memcmp(h->magic, LEVEL_MAGIC, 4)) {
+    return false;
+  }
+  if (h->version != LEVEL_FORMAT_VERSION) {
+    printf("Unsupported level format version %u\n", (unsigned) h->version);
+    return false;
+  }
+  if (h->headerSize != sizeof(LevelHeader) ||
+      h->width <= 0 || h->width > LEVEL_MAX_DIMENSION ||
+      h->height <= 0 || h->height > LEVEL_MAX_DIMENSION ||
+      h->gridCount <= 0 || h->tileSize <= 0) {
+    return false;
+  }
+  const uint64_t cells = (uint64_t) h->width * h->height;
+  if (!sectionFits(h->gridsOffset, cells * h->gridCount, sizeof(Cell), size) ||
+      !sectionFits(h->floorOffset, cells, 4, size) ||
+      !sectionFits(h->ceilingOffset, cells, 4, size) ||
+      !sectionFits(h->thickWallsOffset, h->thickWallCount,
+                   sizeof(LevelThickWall), size) ||
+      !sectionFits(h->spritesOffset, h->spriteCount,
+                   sizeof(LevelSprite), size) ||
+      h->materialCount > (uint32_t) MAX_MATERIALS ||
+      !sectionFits(h->materialsOffset, h->materialCount,
+                   sizeof(CellMaterial), size) ||
+      !sectionFits(h->thickWallRefsOffset, h->thickWallRefCount,
+                   sizeof(uint32_t), size)) {
+    return false;
+  }
+  const int chunksX = chunksAcross(h->width);
+  const int chunksY = chunksAcross(h->height);
+  if (!sectionFits(h->chunkIndexOffset, (uint64_t) chunksX * chunksY,
+                   sizeof(LevelChunkIndex), size)) {
+    return false;
+  }
+  if (h->distanceFieldsOffset &&
+      !sectionFits(h->distanceFieldsOffset, cells * h->gridCount, 1, size)) {
+    return false;
+  }
+  const uint64_t vertices = (uint64_t) (h->width+1) * (h->height+1);
+  if (h->terrainOffset &&
+      !sectionFits(h->terrainOffset, vertices, sizeof(float), size)) {
+    return false;
+  }
+
+  this->data = data;
+  this->size = size;
+  header = h;
+  gridsData = (const Cell*) (data + h->gridsOffset);
+  floorData = (const int32_t*) (data + h->floorOffset);
+  ceilingData = (const int32_t*) (data + h->ceilingOffset);
+  distanceFieldsData = h->distanceFieldsOffset ?
+                       (const uint8_t*) (data + h->distanceFieldsOffset) : 0;
+  thickWallsData = (const LevelThickWall*) (data + h->thickWallsOffset);
+  thickWallRefsData = (const uint32_t*) (data + h->thickWallRefsOffset);
+  spritesData = (const LevelSprite*) (data + h->spritesOffset);
+  chunkIndexData = (const LevelChunkIndex*) (data + h->chunkIndexOffset);
+  materialsData = (const CellMaterial*) (data + h->materialsOffset);
+  terrainData = h->terrainOffset ?
+                (const float*) (data + h->terrainOffset) : 0;
+  this->chunksX = chunksX;
+  this->chunksY = chunksY;
+
+  // Sprites and ThickWalls outside the map would be put in chunks that
+  // don't exist
+  for (uint32_t i=0; i<h->spriteCount; ++i) {
+    if (!spriteInMap(spritesData[i], h->width, h->height)) {
+      return false;
+    }
+  }
+  for (uint32_t i=0; i<h->thickWallCount; ++i) {
+    if (!thickWallInMap(thickWallsData[i], h->width, h->height,
+                        h->tileSize) ||
+        !thickWallTexturesValid(thickWallsData[i])) {
+      return false;
+    }
+  }
+  if (!texturesValid(floorData, ceilingData, cells)) {
+    return false;
+  }
+
+  // Make sure every chunk only refers to records that exist
+  for (uint32_t i=0; i<h->thickWallRefCount; ++i) {
+    if (thickWallRefsData[i] >= h->thickWallCount) {
+      return false;
+    }
+  }
+  for (int i=0; i<chunksX*chunksY; ++i) {
+    const LevelChunkIndex& c = chunkIndexData[i];
+    if (c.firstThickWallRef > h->thickWallRefCount ||
+        c.thickWallRefCount > h->thickWallRefCount - c.firstThickWallRef ||
+        c.firstSprite > h->spriteCount ||
+        c.spriteCount > h->spriteCount - c.firstSprite) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Level::build(int width, int height, int gridCount, int tileSize,
+                  int playerCellX, int playerCellY, float playerRot,
+                  const Cell* cellData,
+                  const int* floor, const int* ceiling,
+                  const vector<unsigned char>& distanceFields,
+                  const vector<CellMaterial>& materials,
+                  const vector<LevelThickWall>& unsortedThickWalls,
+                  const vector<LevelSprite>& unsortedSprites,
+                  const float* terrain)
+{
+  close();
+  if (width <= 0 || width > LEVEL_MAX_DIMENSION ||
+      height <= 0 || height > LEVEL_MAX_DIMENSION ||
+      gridCount <= 0 || tileSize <= 0) {
+    printf("Invalid level size %dx%dx%d\n", width, height, gridCount);
+    return false;
+  }
+  for (size_t i=0; i<unsortedSprites.size(); ++i) {
+    if (!spriteInMap(unsortedSprites[i], width, height)) {
+      printf("Sprite at cell (%d,%d) is outside the level\n",
+             unsortedSprites[i].cellX, unsortedSprites[i].cellY);
+      return false;
+    }
+  }
+  for (size_t i=0; i<unsortedThickWalls.size(); ++i) {
+    if (!thickWallInMap(unsortedThickWalls[i], width, height, tileSize)) {
+      printf("ThickWall %d is outside the level\n", (int) i);
+      return false;
+    }
+    if (!thickWallTexturesValid(unsortedThickWalls[i])) {
+      printf("ThickWall %d has an invalid texture ID\n", (int) i);
+      return false;
+    }
+  }
+  if (!texturesValid(floor, ceiling, (size_t) width * height)) {
+    printf("Floor or ceiling texture IDs must be from 0 to %d\n",
+           LEVEL_MAX_TEXTURES - 1);
+    return false;
+  }
+  const uint64_t cells = (uint64_t) width * height;
+  const int chunksX = chunksAcross(width);
+  const int chunksY = chunksAcross(height);
+  const uint32_t chunkCount = chunksX * chunksY;
+
+  ChunkOrder order(tileSize, chunksX, chunksY);
+  vector<LevelThickWall> thickWalls(unsortedThickWalls);
+  vector<LevelSprite> sprites(unsortedSprites);
+  std::stable_sort(thickWalls.begin(), thickWalls.end(), order);
+  std::stable_sort(sprites.begin(), sprites.end(), order);
+
+  // Every chunk a ThickWall's bounds overlap refers to it, so it stays
+  // loaded as long as any of them is. Pairs of chunk and ThickWall index.
+  vector< pair<uint32_t,uint32_t> > refs;
+  for (uint32_t i=0; i<thickWalls.size(); ++i) {
+    float minX, minY, maxX, maxY;
+    thickWallBounds(thickWalls[i], minX, minY, maxX, maxY);
+    const int chunkX1 = chunkOf(maxX, tileSize, width);
+    const int chunkY1 = chunkOf(maxY, tileSize, height);
+    for (int cy=chunkOf(minY, tileSize, height); cy<=chunkY1; ++cy) {
+      for (int cx=chunkOf(minX, tileSize, width); cx<=chunkX1; ++cx) {
+        refs.push_back(make_pair(cx + cy*chunksX, i));
+      }
+    }
+  }
+  std::sort(refs.begin(), refs.end());
+
+  vector<LevelChunkIndex> chunkIndex(chunkCount);
+  memset(&chunkIndex[0], 0, chunkCount * sizeof(LevelChunkIndex));
+  for (uint32_t i=refs.size(); i-->0; ) {
+    LevelChunkIndex& c = chunkIndex[refs[i].first];
+    c.firstThickWallRef = i;
+    c.thickWallRefCount++;
+  }
+  for (uint32_t i=sprites.size(); i-->0; ) {
+    LevelChunkIndex& c = chunkIndex[order.chunk(sprites[i])];
+    c.firstSprite = i;
+    c.spriteCount++;
+  }
+  const bool withDistanceFields = distanceFields.size() == cells * gridCount;
+
+  LevelHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, LEVEL_MAGIC, 4);
+  h.version = LEVEL_FORMAT_VERSION;
+  h.headerSize = sizeof(LevelHeader);
+  h.width = width;
+  h.height = height;
+  h.gridCount = gridCount;
+  h.tileSize = tileSize;
+  h.playerCellX = playerCellX;
+  h.playerCellY = playerCellY;
+  h.playerRot = playerRot;
+
+  uint64_t offset = align4(sizeof(LevelHeader));
+  h.gridsOffset = offset;
+  offset = align4(offset + cells * gridCount * sizeof(Cell));
+  h.floorOffset = offset;
+  offset += cells * 4;
+  h.ceilingOffset = offset;
+  offset += cells * 4;
+  if (withDistanceFields) {
+    h.distanceFieldsOffset = offset;
+    offset = align4(offset + cells * gridCount);
+  }
+  h.thickWallCount = thickWalls.size();
+  h.thickWallsOffset = offset;
+  offset += thickWalls.size() * sizeof(LevelThickWall);
+  h.spriteCount = sprites.size();
+  h.spritesOffset = offset;
+  offset += sprites.size() * sizeof(LevelSprite);
+  h.chunkIndexOffset = offset;
+  offset += chunkCount * sizeof(LevelChunkIndex);
+  h.materialCount = std::min((int) materials.size(), MAX_MATERIALS);
+  h.materialsOffset = offset;
+  offset += h.materialCount * sizeof(CellMaterial);
+  const uint64_t vertices = (uint64_t) (width+1) * (height+1);
+  if (terrain) {
+    h.terrainOffset = offset;
+    offset += vertices * sizeof(float);
+  }
+  h.thickWallRefCount = refs.size();
+  h.thickWallRefsOffset = offset;
+  offset += refs.size() * sizeof(uint32_t);
+  // The offsets above wrap when it is any bigger
+  if (offset > LEVEL_MAX_BYTES) {
+    printf("Level is too large, %.0f MB\n", offset / (1024.0 * 1024.0));
+    return false;
+  }
+
+  memory.assign(offset/4, 0);
+  char* out = (char*) &memory[0];
+  memcpy(out, &h, sizeof(h));
+  memcpy(out + h.gridsOffset, cellData, cells * gridCount * sizeof(Cell));
+  memcpy(out + h.floorOffset, floor, cells*4);
+  memcpy(out + h.ceilingOffset, ceiling, cells*4);
+  if (withDistanceFields) {
+    memcpy(out + h.distanceFieldsOffset, &distanceFields[0], cells*gridCount);
+  }
+  if (!thickWalls.empty()) {
+    memcpy(out + h.thickWallsOffset, &thickWalls[0],
+           thickWalls.size() * sizeof(LevelThickWall));
+  }
+  if (!sprites.empty()) {
+    memcpy(out + h.spritesOffset, &sprites[0],
+           sprites.size() * sizeof(LevelSprite));
+  }
+  memcpy(out + h.chunkIndexOffset, &chunkIndex[0],
+         chunkCount * sizeof(LevelChunkIndex));
+  if (h.materialCount) {
+    memcpy(out + h.materialsOffset, &materials[0],
+           h.materialCount * sizeof(CellMaterial));
+  }
+  if (terrain) {
+    memcpy(out + h.terrainOffset, terrain, vertices * sizeof(float));
+  }
+  uint32_t* refsOut = (uint32_t*) (out + h.thickWallRefsOffset);
+  for (size_t i=0; i<refs.size(); ++i) {
+    refsOut[i] = refs[i].second;
+  }
+  return attach(out, offset);
+}
+
+bool Level::share(const Level& other)
+{
+  close();
+  return other.data && attach(other.data, other.size);
+}
+
+bool Level::save(const string& filename) const
+{
+  if (!data) {
+    return false;
+  }
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    printf("Could not write %s\n", filename.c_str());
+    return false;
+  }
+  const bool ok = fwrite(data, 1, size, fp) == size;
+  fclose(fp);
+  if (!ok) {
+    printf("Could not write %s\n", filename.c_str());
+  }
+  return ok;
+}
@@ -0,0 +1,225 @@
+/*
+Binary level files.
+
+Author: Andrew Lim
+https://github.com/andrew-lim/sdl2-raycast
+*/
+#ifndef AL_RAYCASTING_LEVEL_H
+#define AL_RAYCASTING_LEVEL_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "mappedfile.h"
+#include "cell.h"
+
+namespace al {
+namespace raycasting {
+
+const char LEVEL_MAGIC[4] = { 'R', 'C', 'L', 'V' };
+const uint32_t LEVEL_FORMAT_VERSION = 5;
+
+// Largest width or height supported by the fixed-point raycast
+const int LEVEL_MAX_DIMENSION = 16383;
+
+// Floor, ceiling and ThickWall texture IDs are from 0 up to but not
+// including this. IDs a Game has no texture for aren't drawn.
+const int LEVEL_MAX_TEXTURES = 256;
+
+// Levels are split into square chunks of cells for streaming
+const int LEVEL_CHUNK_SHIFT = 6;
+const int LEVEL_CHUNK_SIZE = 1 << LEVEL_CHUNK_SHIFT;
+
+enum LevelThickWallShape {
+  LEVEL_WALL_RECT = 0,
+  LEVEL_WALL_TRIANGLE,
+  LEVEL_WALL_QUAD,
+  LEVEL_WALL_SLOPE,
+  LEVEL_WALL_INVERTED_SLOPE
+};
+
+/*
+A level file is laid out exactly like it is in memory so it can be mapped and
+used without parsing. All values are little-endian and every section starts
+on a 4 byte boundary.
+
+  LevelHeader
+  Cell     grids[gridCount][height][width]  (padded)
+  int32_t  floor[height][width]
+  int32_t  ceiling[height][width]
+  uint8_t  distanceFields[gridCount][height][width]  (optional, padded)
+  LevelThickWall thickWalls[thickWallCount]
+  LevelSprite    sprites[spriteCount]
+  LevelChunkIndex chunks[chunksY][chunksX]
+  CellMaterial   materials[materialCount]
+  float    terrain[height+1][width+1]  (optional)
+  uint32_t thickWallRefs[thickWallRefCount]
+
+Offsets in the header are in bytes from the start of the file.
+distanceFieldsOffset is 0 if the file has no distance fields and
+terrainOffset is 0 if the level has no terrain.
+
+Sprites are sorted by the chunk they are in so the ones in a chunk can be
+found through its LevelChunkIndex. ThickWalls can cover more than one chunk,
+so each chunk has a range of thickWallRefs instead, the indices of every
+ThickWall whose bounds overlap it. ThickWalls are still sorted by the chunk
+of their first point. Sprite cells and ThickWall points have to be inside the
+map.
+*/
+struct LevelHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t headerSize;
+  int32_t width, height, gridCount, tileSize;
+  int32_t playerCellX, playerCellY; // player start
+  float playerRot;
+  uint32_t gridsOffset;
+  uint32_t floorOffset;
+  uint32_t ceilingOffset;
+  uint32_t distanceFieldsOffset;
+  uint32_t thickWallCount, thickWallsOffset;
+  uint32_t spriteCount, spritesOffset;
+  uint32_t chunkIndexOffset;
+  uint32_t materialCount, materialsOffset;
+  uint32_t terrainOffset;
+  uint32_t thickWallRefCount, thickWallRefsOffset;
+};
+
+// Describes one ThickWall. Its ThinWalls are created when the level is loaded.
+struct LevelThickWall {
+  int32_t shape;          // LevelThickWallShape
+  int32_t slopeType;      // SLOPE_TYPE_WEST_EAST or SLOPE_TYPE_NORTH_SOUTH
+  int32_t thinWallType;
+  int32_t ceilingTextureID;
+  int32_t floorTextureID;
+  float z, height;        // unused by slopes
+  float startHeight, endHeight; // slopes only
+  // LEVEL_WALL_RECT and slopes: x, y, w, h
+  // LEVEL_WALL_TRIANGLE: x1, y1, x2, y2, x3, y3
+  // LEVEL_WALL_QUAD: x1, y1, x2, y2, x3, y3, x4, y4
+  float coords[8];
+};
+
+struct LevelSprite {
+  int32_t cellX, cellY;
+  int32_t textureID;
+};
+
+struct LevelChunkIndex {
+  uint32_t firstThickWallRef, thickWallRefCount; // range of thickWallRefs
+  uint32_t firstSprite, spriteCount;
+};
+
+/**
+ * A Level is either mapped from a level file or built in memory with build().
+ * Either way the data has the same layout, so save() can write it as is.
+ */
+class Level {
+public:
+  Level();
+
+  // Maps a level file. Returns false if the file is missing or invalid.
+  bool load(const std::string& filename);
+
+  // Builds a level in memory. cells has gridCount levels of width*height
+  // cells one after another, and floor and ceiling have width*height
+  // elements. distanceFields can be empty, otherwise it has the same layout
+  // as cells. terrain is either 0 or has (width+1)*(height+1) heights.
+  bool build(int width, int height, int gridCount, int tileSize,
+             int playerCellX, int playerCellY, float playerRot,
+             const Cell* cells,
+             const int* floor, const int* ceiling,
+             const std::vector<unsigned char>& distanceFields,
+             const std::vector<CellMaterial>& materials,
+             const std::vector<LevelThickWall>& thickWalls,
+             const std::vector<LevelSprite>& sprites,
+             const float* terrain=0);
+
+  // Uses the data of another level without copying it. other has to stay
+  // loaded while this level is used.
+  bool share(const Level& other);
+
+  bool save(const std::string& filename) const;
+  void close();
+  // Exchanges the data of two levels, so a level can be checked before it
+  // replaces the one in use
+  void swap(Level& other);
+  bool isLoaded() const { return header != 0; }
+
+  int getWidth() const { return header->width; }
+  int getHeight() const { return header->height; }
+  int getGridCount() const { return header->gridCount; }
+  int getTileSize() const { return header->tileSize; }
+  int getPlayerCellX() const { return header->playerCellX; }
+  int getPlayerCellY() const { return header->playerCellY; }
+  float getPlayerRot() const { return header->playerRot; }
+
+  // All levels are stored one after another
+  const Cell* cells() const { return gridsData; }
+  const Cell* grid(int z) const {
+    return gridsData + (size_t)z * header->width * header->height;
+  }
+  // Levels saved without distance fields need them computed after loading
+  bool hasDistanceFields() const { return distanceFieldsData != 0; }
+  const uint8_t* distanceField(int z) const {
+    return distanceFieldsData + (size_t)z * header->width * header->height;
+  }
+  const int32_t* getFloorData() const { return floorData; }
+  const int32_t* getCeilingData() const { return ceilingData; }
+  int floorAt(int x, int y) const { return floorData[x + y*header->width]; }
+  int ceilingAt(int x, int y) const {return ceilingData[x + y*header->width];}
+
+  int getThickWallCount() const { return header->thickWallCount; }
+  const LevelThickWall& thickWall(int i) const { return thickWallsData[i]; }
+  // Index of a ThickWall, see LevelChunkIndex::firstThickWallRef
+  uint32_t thickWallRef(int i) const { return thickWallRefsData[i]; }
+  int getSpriteCount() const { return header->spriteCount; }
+  const LevelSprite& sprite(int i) const { return spritesData[i]; }
+  int getMaterialCount() const { return header->materialCount; }
+  const CellMaterial& material(int i) const { return materialsData[i]; }
+  bool hasTerrain() const { return terrainData != 0; }
+  const float* getTerrainData() const { return terrainData; }
+
+  int getChunksX() const { return chunksX; }
+  int getChunksY() const { return chunksY; }
+  const LevelChunkIndex& chunkIndex(int chunkX, int chunkY) const {
+    return chunkIndexData[chunkX + chunkY * chunksX];
+  }
+
+  // Box around the points of a ThickWall description. False if its shape
+  // is unknown.
+  static bool thickWallBounds(const LevelThickWall& desc, float& minX,
+                              float& minY, float& maxX, float& maxY);
+  // Chunk that a ThickWall description belongs to
+  static int thickWallChunk(const LevelThickWall& desc, int tileSize,
+                            int chunksX, int chunksY);
+
+private:
+  // Not copyable, the pointers refer to file or memory
+  Level(const Level&);
+  Level& operator=(const Level&);
+
+  // Checks the header and sets up the section pointers
+  bool attach(const char* data, size_t size);
+
+  MappedFile file;
+  std::vector<uint32_t> memory; // uint32_t keeps built levels aligned
+  const char* data;
+  size_t size;
+  const LevelHeader* header;
+  const Cell* gridsData;
+  const int32_t* floorData;
+  const int32_t* ceilingData;
+  const uint8_t* distanceFieldsData;
+  const LevelThickWall* thickWallsData;
+  const uint32_t* thickWallRefsData;
+  const LevelSprite* spritesData;
+  const LevelChunkIndex* chunkIndexData;
+  const CellMaterial* materialsData;
+  const float* terrainData;
+  int chunksX, chunksY;
+};
+
+} // raycasting
+} // al
+
+#endif
@@ -15,6 +15,8 @@ OR
 #include <SDL_mixer.h>
 #include "sdl2utils.h"
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
 #include <map>
 #include <cmath>
 #include <vector>
@@ -27,21 +29,26 @@ OR
 #include "raycasting.h"
 #include "defaults.h"
 #include "settingsmanager.h"
+#include "level.h"
+#include "chunkstore.h"
+#include "terrain.h"
+#include "inputrecording.h"
+#include "framering.h"
+#include "game.h"
+#include "vectorenv.h"
+#include "camerabatch.h"
 
 using namespace al::sdl2utils;
 using namespace al::raycasting;
 using namespace std;
 using namespace al;
 
-// Length of a wall or cell in game units.
-const int TILE_SIZE = 128;
-
 const int TEXTURE_SIZE = 128; // length of wall textures in pixels
+const int MIP_LEVELS = 8; // TEXTURE_SIZE halved down to 1 pixel
 const int MINIMAP_SCALE = 6;
 const int MINIMAP_Y = 0; // position of minimap from top of screen
-const int DESIRED_FPS = 120;
-const int UPDATE_INTERVAL = 1000/DESIRED_FPS;
-const float TWO_PI = M_PI*2;
+// Ticks run before drawing again after a stall, the rest are dropped
+const int MAX_TICKS_PER_FRAME = 5;
 const int SKYBOX_WIDTH = 512;
 const int SKYBOX_HEIGHT = 128;
 
@@ -54,14 +61,9 @@ const float HALF_JUMP_DISTANCE = MAX_JUMP_DISTANCE/2;
 // Player floats at the jump apex
 const float FLOAT_HEIGHT = HALF_JUMP_DISTANCE;
 
-void array2DToVector(int arr[MAP_HEIGHT][MAP_WIDTH], std::vector<int>& out) {
-  out.clear();
-  for (int y=0; y<MAP_HEIGHT; y++) {
-    for (int x=0; x<MAP_WIDTH; x++) {
-      out.push_back(arr[y][x]);
-    }
-  }
-}
+// Furthest the view looks up or down. The simulated pitch is in pixels of a
+// frame 2*MAX_PITCH high and drawn frames scale it to their own height.
+const float MAX_PITCH = 300;
 
 // Copies the addresses of ThinWalls from in vector b to a
 void appendThinWalls( std::vector<ThinWall*>& a,
@@ -92,122 +94,67 @@ typedef enum SpriteType {
 #define FOG_B 150.0f
 #define FOG_START_DISTANCE (TILE_SIZE*8)
 
-class Game {
-public:
-    Game();
-    ~Game();
-    void start();
-    void stop() ;
-    void draw();
-    void fillRect(SDL_Rect* rc, int r, int g, int b );
-    void drawLine(int startX, int startY, int endX, int endY, int r, int g,
-                  int b, int alpha=SDL_ALPHA_OPAQUE );
-    void fpsChanged( int fps );
-    void onQuit();
-    void onKeyDown( SDL_Event* event );
-    void onKeyUp( SDL_Event* event );
-    void reset();
-    void run();
-    void printHelp();
-    void update(float timeElapsed);
-    void drawWallTop(RayHit& rayHit, int wallScreenHeight, float playerScreenZ);
-    void drawWallBottom(RayHit&rayHit,int wallScreenHeight,float playerScreenZ);
-    void drawThinWallTop(RayHit& rayHit, int wallScreenHeight);
-    void drawThinWallBottom(RayHit& rayHit, int wallScreenHeight);
-    bool drawSlope(RayHit& rayHit, float playerScreenZ);
-    bool drawSlopeInverted(RayHit& rayHit, float playerScreenZ);
-    void drawFloor(vector<RayHit>& rayHits);
-    void drawSkyboxAndHighestCeiling(vector<RayHit>& rayHits);
-    void drawWeapon();
-    void drawMiniMap();
-    void drawMiniMapSprites();
-    void updatePlayer(float elapsedTime);
-    void updateProjectiles(float elaspedTime);
-    void drawPlayer();
-    void drawRay(float rayX, float rayY);
-    void drawRays(vector<RayHit>& rayHits);
-    float wallScreenY(RayHit& rayHit, float wallHeight);
-    SDL_Rect stripScreenRect(RayHit& rayHit, float wallHeight);
-    void drawSlopeStrip(RayHit& rayHit, SurfaceTexture& img,
-                        float textureX, float textureY);
-    void drawThinWallStrip(RayHit& rayHit, SurfaceTexture& img,
-                           float textureX, float textureY,
-                           bool aboveWall=false, bool beloWall=false);
-    void drawWallStrip(RayHit& rayHit, SurfaceTexture& img,
-                       float textureX, float textureY,
-                       int wallScreenHeight,
-                       bool aboveWall=false, bool beloWall=false);
-    bool ignoreWallStrip(RayHit& rayHit);
-    void drawWorld(vector<RayHit>& rayHits);
-    void raycastWorld(vector<RayHit>& rayHits);
-    bool isWallCell(int wallX, int wallY, int level=0);
-    bool playerInWall(float playerX, float playerY, float playerZ);
-    SDL_Rect findSpriteScreenPosition( Sprite& sprite );
-    void addSpriteAt( int spriteid, int cellX, int cellY );
-    void addProjectile(int textureid, int x, int y, int z, int size,
-                       float rotation);
-    float sine(float f);
-    float cosine(float f);
-    void toggleDoorPressed();
-    void toggleDoor(int cellX, int cellY);
-    Uint32 fogPixel( Uint32 pixel, float distance );
-    void fogWallStrip( SDL_Rect* dstrect, float distance  );
-    float slopeHeightAt(float worldX, float worldY);
-    void createThinWalls();
-private:
-    int displayWidth, displayHeight, stripWidth, rayCount;
-    int fovDegrees;
-    float fovRadians, viewDist;
-    bool fullscreen;
-    float pitch;
-    float* stripAngles;
-    Raycaster raycaster3D;
-    std::vector<int> ceilingGrid;
-    std::vector<int> groundWalls;
-    int frameSkip ;
-    int running ;
-    SDL_Window* window;
-    SDL_Renderer* renderer;
-    Sprite player;
-    SurfaceTexture wallsImage, wallsImageDark, gatesImage, gatesOpenImage;
-    SurfaceTexture gunImage;
-    vector<Sprite> sprites;
-    std::queue<Sprite> projectilesQueue;
-    bool drawMiniMapOn, drawTexturedFloorOn, drawCeilingOn, drawWallsOn;
-    bool skipDrawnFloorStrips, skipDrawnSkyboxStrips;
-    bool skipDrawnHighestCeilingStrips;
-    bool drawWeaponOn;
-    bool fogOn;
-    Bitmap ceilingBitmap;
-    SDL_Surface* skyboxSurface;
-    Uint32 ceilingColor;
-    Mix_Chunk* projectileFireSound;
-    Mix_Chunk* projectileExplodeSound;
-    Mix_Chunk* doorOpenSound;
-    Mix_Chunk* doorCloseSound;
-    std::map<int,SurfaceTexture> spriteTextures;
-    std::vector<Bitmap> floorCeilingBitmaps;
-
-    SDL_Texture* screenTexture;
-    SDL_Surface* screenSurface;
-    int highestCeilingLevel;
-    int rayHitsCount;
-    int doors[MAP_WIDTH * MAP_HEIGHT];
-    std::vector<ThinWall*> thinWalls;
-    ThickWall* rectWall;
-    ThickWall* triangleWall;
-    ThickWall* diamondWall;
-    std::vector<ThickWall*> helloWalls;
-    std::vector<ThickWall*> slopedWalls;
+// How far around the player chunks are kept loaded when streaming, in cells
+const int DEFAULT_STREAM_VIEW_DISTANCE = 128;
+
+// How far terrain is drawn, in cells
+const int DEFAULT_TERRAIN_VIEW_DISTANCE = 48;
+
+// Render sizes tried by dynamic resolution, in percent of the window size.
+// Past the last one the strip width is doubled.
+const int RESOLUTION_SCALES[] = { 100, 90, 80, 70, 60, 50 };
+const int RESOLUTION_SCALE_COUNT = sizeof(RESOLUTION_SCALES) / sizeof(int);
+// Frames drawn at a new resolution before it is judged
+const int RESOLUTION_SETTLE_FRAMES = 30;
+
+// Strips between the grid rays that adaptive raycasting always casts
+const int DEFAULT_ADAPTIVE_RAY_STEP = 8;
+// Neighbouring hits further apart in depth than this ratio are refined
+const float ADAPTIVE_DEPTH_RATIO = 1.5f;
+
+// Mouse look turns this many thousandths of a radian per pixel by default
+const int DEFAULT_MOUSE_SENSITIVITY = 3;
+
+// Frames a FrameRing holds when config.ini doesn't say
+const int DEFAULT_FRAME_RING_SLOTS = 4;
+
+/*
+Everything the simulation changes, packed into one buffer by
+Game::captureWorld():
+
+  WorldSnapshotHeader
+  Sprite[spriteCount]
+  rowCount times: int y, Cell[gridCount][mapWidth],
+                  unsigned char distances[gridCount][mapWidth]
+
+Only rows of cells that differ from the level are stored. The rest are copied
+back from the level data on restore, so a snapshot of a big map with a few
+open doors stays small.
+*/
+struct WorldSnapshotHeader {
+  int mapWidth, mapHeight, gridCount;
+  Sprite player;
+  float pitch;
+  Uint32 tick;
+  Uint32 randomState;
+  int spriteCount;
+  int rowCount;
 };
 
 
-Game::Game()
-:frameSkip(0), running(0), window(NULL), renderer(NULL) {
-  srand (time(NULL));
+Game::Game(GameAssets* sharedAssets, bool defaultLevel)
+:frameSkip(0), running(0), window(NULL), renderer(NULL),
+ assets(sharedAssets ? *sharedAssets : ownAssets),
+ screenTexture(NULL), screenSurface(NULL) {
+  seed = time(NULL);
+  sdlStarted = false;
+  quiet = false;
+  displayWidth = windowWidth = DEFAULT_DISPLAY_WIDTH;
+  displayHeight = windowHeight = DEFAULT_DISPLAY_HEIGHT;
+  baseCells = 0;
+  baseDistances = 0;
   drawMiniMapOn = true;
   skipDrawnFloorStrips = true;
-  skipDrawnSkyboxStrips = true;
   skipDrawnHighestCeilingStrips = true;
   drawTexturedFloorOn = true;
   drawCeilingOn = true;
@@ -215,55 +162,504 @@ Game::Game()
   drawWallsOn = true;
   rayHitsCount = 0;
   fogOn = false;
-  rectWall = triangleWall = diamondWall = 0;
+  mipmapsOn = true;
+  adaptiveRaysOn = false;
+  adaptiveRayStep = DEFAULT_ADAPTIVE_RAY_STEP;
+  gridRaysCast = 0;
+  renderThread = NULL;
+  renderStart = renderDone = NULL;
+  renderPending = renderThreadQuit = false;
+  renderMs = 0;
+  aux = NULL;
+  tick = 0;
+  mouseLook = false;
+  pendingUseDone = false;
+  mouseSensitivity = DEFAULT_MOUSE_SENSITIVITY / 1000.0f;
+  tickedInputTime = frameInputTime = 0;
+  latencySum = 0;
+  latencyCount = 0;
+  dynamicResolution = false;
+  frameBudgetMs = 1000.0f / DESIRED_FPS;
+  averageFrameMs = 0;
+  resolutionLevel = resolutionSettleFrames = 0;
   stripAngles = 0;
-  reset();
+  cameraStripAngles = 0;
+  cameraWidth = cameraStripWidth = 0;
+  mapWidth = mapHeight = 0;
+  streaming = false;
+  streamViewDistance = DEFAULT_STREAM_VIEW_DISTANCE;
+  terrainViewDistance = DEFAULT_TERRAIN_VIEW_DISTANCE;
+  if (defaultLevel) {
+    createDefaultLevel();
+    reset();
+  }
 }
 
 Game::~Game() {
   this->stop();
+  clearThickWalls();
 }
 
 void Game::reset()
 {
-  pitch = 0;
+  if (resetSnapshot.data.size() && restoreWorld(resetSnapshot)) {
+    random.setSeed(seed); // a replay may have changed it since
+    return;
+  }
+  random.setSeed(seed);
+  world.pitch = 0;
+  world.tick = 0;
+
+  const Level& level = activeLevel();
+  mapWidth = level.getWidth();
+  mapHeight = level.getHeight();
+  highestCeilingLevel = level.getGridCount();
+
+  if (streaming) {
+    chunkStore.revertCells(); // doors opened before the reset
+    raycaster3D.setChunkStore(&chunkStore, TILE_SIZE);
+  }
+  else {
+    // Cells and distance fields are copied straight from the level data
+    const int cellCount = mapWidth * mapHeight * highestCeilingLevel;
+    raycaster3D.setChunkStore(0, TILE_SIZE);
+    raycaster3D.createGrids(mapWidth, mapHeight, highestCeilingLevel,
+                            TILE_SIZE);
+    memcpy(&raycaster3D.cells[0], level.cells(), cellCount*sizeof(Cell));
+    if (level.hasDistanceFields()) {
+      memcpy(&raycaster3D.distanceFields[0], level.distanceField(0),
+             cellCount);
+      baseDistances = level.distanceField(0);
+    }
+    else {
+      raycaster3D.computeDistanceFields();
+      computedDistanceFields = raycaster3D.distanceFields;
+      baseDistances = &computedDistanceFields[0];
+    }
+    baseCells = level.cells();
+    raycaster3D.clearChangedRows();
+  }
+
+  raycaster3D.resetMaterials();
+  for (int i=0; i<level.getMaterialCount(); ++i) {
+    raycaster3D.materials[i] = level.material(i);
+  }
+
+  if (level.hasTerrain()) {
+    terrain.attach(level.getTerrainData(), mapWidth, mapHeight, TILE_SIZE);
+  }
+  else {
+    terrain.clear();
+  }
+
+  world.player.x = level.getPlayerCellX() * TILE_SIZE;
+  world.player.y = level.getPlayerCellY() * TILE_SIZE;
+  world.player.z = 0;
+  world.player.rot = level.getPlayerRot();
+  world.player.moveSpeed = TILE_SIZE / (DESIRED_FPS/60.0f*16);
+  world.player.rotSpeed = 1.5 * M_PI/180;
+
+  world.sprites.clear();
+  clearThickWalls();
+
+  vector<int> chunks;
+  if (streaming) {
+    // Wait for the chunk the player starts in, the rest stream in later
+    const int cellX = level.getPlayerCellX();
+    const int cellY = level.getPlayerCellY();
+    while (!chunkStore.isResident(cellX, cellY)) {
+      chunkStore.update(cellX, cellY, streamViewDistance);
+      SDL_Delay(1);
+    }
+    chunkStore.getResidentChunks(chunks);
+  }
+  else {
+    for (int i=0; i<level.getChunksX()*level.getChunksY(); ++i) {
+      chunks.push_back(i);
+    }
+  }
+  for (size_t i=0; i<chunks.size(); ++i) {
+    addChunkObjects(chunks[i]);
+  }
+  createThinWalls();
+  savePreviousState();
+  publishWorld(0);
+  if (!streaming) {
+    captureWorld(resetSnapshot);
+  }
+}
+
+// Packs the world into snapshot, reusing its memory. Streamed levels can't
+// be captured since their cells are spread over the ChunkStore.
+bool Game::captureWorld(WorldSnapshot& snapshot)
+{
+  if (streaming) {
+    printf("World snapshots don't support streamed levels\n");
+    return false;
+  }
+  finishRender();
+  const vector<unsigned char>& changedRows = raycaster3D.changedRows;
+  WorldSnapshotHeader h;
+  h.mapWidth = mapWidth;
+  h.mapHeight = mapHeight;
+  h.gridCount = highestCeilingLevel;
+  h.player = world.player;
+  h.pitch = world.pitch;
+  h.tick = world.tick;
+  h.randomState = random.getState();
+  h.spriteCount = world.sprites.size();
+  h.rowCount = std::count(changedRows.begin(), changedRows.end(), 1);
+
+  const size_t spritesSize = h.spriteCount * sizeof(Sprite);
+  const size_t rowSize = sizeof(int) +
+                         mapWidth * highestCeilingLevel * (sizeof(Cell) + 1);
+  snapshot.data.resize(sizeof(h) + spritesSize + h.rowCount * rowSize);
+  unsigned char* out = &snapshot.data[0];
+  memcpy(out, &h, sizeof(h));
+  out += sizeof(h);
+  if (spritesSize) {
+    memcpy(out, &world.sprites[0], spritesSize);
+    out += spritesSize;
+  }
+  const size_t cellsSize = mapWidth * sizeof(Cell);
+  for (int y=0; y<mapHeight; ++y) {
+    if (!changedRows[y]) {
+      continue;
+    }
+    memcpy(out, &y, sizeof(int));
+    out += sizeof(int);
+    for (int z=0; z<highestCeilingLevel; ++z) {
+      memcpy(out, &raycaster3D.cells[(y + z*mapHeight) * mapWidth],
+             cellsSize);
+      out += cellsSize;
+    }
+    for (int z=0; z<highestCeilingLevel; ++z) {
+      memcpy(out, &raycaster3D.distanceFields[(y + z*mapHeight) * mapWidth],
+             mapWidth);
+      out += mapWidth;
+    }
+  }
+
+  // So restoreWorld() never has to allocate
+  world.sprites.reserve(h.spriteCount);
+  previousSprites.reserve(h.spriteCount);
+  sprites.reserve(h.spriteCount);
+  return true;
+}
+
+// Puts the world back to how it was in snapshot. Only rows of cells that
+// changed since the level was reset are copied.
+bool Game::restoreWorld(const WorldSnapshot& snapshot)
+{
+  WorldSnapshotHeader h;
+  if (streaming || snapshot.data.size() < sizeof(h)) {
+    return false;
+  }
+  const unsigned char* in = &snapshot.data[0];
+  memcpy(&h, in, sizeof(h));
+  in += sizeof(h);
+  if (h.mapWidth != mapWidth || h.mapHeight != mapHeight ||
+      h.gridCount != highestCeilingLevel) {
+    printf("World snapshot is of a different level\n");
+    return false;
+  }
+  finishRender();
+
+  world.player = h.player;
+  world.pitch = h.pitch;
+  world.tick = h.tick;
+  random.setSeed(h.randomState);
+  world.sprites.resize(h.spriteCount);
+  if (h.spriteCount) {
+    memcpy(&world.sprites[0], in, h.spriteCount * sizeof(Sprite));
+    in += h.spriteCount * sizeof(Sprite);
+  }
+  // Only holds projectiles during a tick
+  while (!projectilesQueue.empty()) {
+    projectilesQueue.pop();
+  }
 
-  highestCeilingLevel = 3;
+  // Rows changed now go back to the level, then the snapshot's rows are
+  // copied over them
+  vector<unsigned char>& changedRows = raycaster3D.changedRows;
+  for (int y=0; y<mapHeight; ++y) {
+    if (changedRows[y]) {
+      copyGridRow(y, baseCells + y*mapWidth, baseDistances + y*mapWidth,
+                  mapWidth * mapHeight);
+    }
+  }
+  raycaster3D.clearChangedRows();
+  const size_t cellsSize = mapWidth * highestCeilingLevel * sizeof(Cell);
+  for (int i=0; i<h.rowCount; ++i) {
+    int y;
+    memcpy(&y, in, sizeof(int));
+    in += sizeof(int);
+    copyGridRow(y, in, in + cellsSize, mapWidth);
+    in += cellsSize + mapWidth * highestCeilingLevel;
+    changedRows[y] = 1;
+  }
 
-  raycaster3D.createGrids(MAP_WIDTH, MAP_HEIGHT,highestCeilingLevel, TILE_SIZE);
-  array2DToVector(g_map, raycaster3D.grids[0]);
-  array2DToVector(g_map2, raycaster3D.grids[1]);
-  array2DToVector(g_map3, raycaster3D.grids[2]);
+  savePreviousState();
+  publishWorld(0);
+  return true;
+}
 
-  array2DToVector(g_ceilingmap, ceilingGrid);
+// Copies one row of cells and distances on every level into the grids.
+// Each level's row is levelStride elements after the last one.
+void Game::copyGridRow(int y, const void* cells,
+                       const unsigned char* distances, int levelStride)
+{
+  const size_t cellsSize = mapWidth * sizeof(Cell);
+  for (int z=0; z<highestCeilingLevel; ++z) {
+    const int offset = (y + z*mapHeight) * mapWidth;
+    memcpy(&raycaster3D.cells[offset],
+           (const char*) cells + z * levelStride * sizeof(Cell), cellsSize);
+    memcpy(&raycaster3D.distanceFields[offset], distances + z * levelStride,
+           mapWidth);
+  }
+}
 
-  player.x = 26 * TILE_SIZE;
-  player.y = 6 * TILE_SIZE;
-  player.z = 0;
-  player.rot = 0;
-  player.moveSpeed = TILE_SIZE / (DESIRED_FPS/60.0f*16);
-  player.rotSpeed = 1.5 * M_PI/180;
+// The level being played. When streaming it is mapped by the ChunkStore.
+const Level& Game::activeLevel() const
+{
+  return streaming ? chunkStore.getLevel() : level;
+}
 
-  sprites.clear();
-  for (int y=0; y<MAP_HEIGHT; y++) {
-    for (int x=0; x<MAP_WIDTH; x++) {
-      int spriteid = g_spritemap[ y ][ x ];
-      if (spriteid) {
-        addSpriteAt( spriteid, x, y );
-      }
+// Adds the sprites and ThickWalls of a chunk. createThinWalls() must be
+// called afterwards.
+void Game::addChunkObjects(int chunk)
+{
+  const Level& level = activeLevel();
+  const LevelChunkIndex& index = level.chunkIndex(chunk % level.getChunksX(),
+                                                  chunk / level.getChunksX());
+  for (uint32_t i=0; i<index.spriteCount; ++i) {
+    const LevelSprite& sprite = level.sprite(index.firstSprite + i);
+    addSpriteAt( sprite.textureID, sprite.cellX, sprite.cellY );
+  }
+  for (uint32_t i=0; i<index.thickWallRefCount; ++i) {
+    const uint32_t ref = level.thickWallRef(index.firstThickWallRef + i);
+    ChunkThickWall& entry = thickWalls[ref];
+    if (!entry.chunks++) {
+      entry.thickWall = createThickWall(level.thickWall(ref));
     }
   }
+}
+
+// Used to remove sprites standing in a chunk
+struct SpriteInChunk {
+  int chunk, chunksX;
+  SpriteInChunk(int chunk, int chunksX) : chunk(chunk), chunksX(chunksX) {}
+  bool operator()(const Sprite& sprite) const {
+    const int cellX = (int)sprite.x / TILE_SIZE;
+    const int cellY = (int)sprite.y / TILE_SIZE;
+    return (cellX >> LEVEL_CHUNK_SHIFT) +
+           (cellY >> LEVEL_CHUNK_SHIFT) * chunksX == chunk;
+  }
+};
 
-  for (int y=0; y<MAP_HEIGHT; ++y) {
-    for (int x=0; x<MAP_WIDTH; ++x) {
-      doors[ x + y * MAP_WIDTH ] = 0;
+// Removes the sprites and ThickWalls of a chunk. createThinWalls() must be
+// called afterwards.
+void Game::removeChunkObjects(int chunk)
+{
+  world.sprites.erase( remove_if(world.sprites.begin(), world.sprites.end(),
+                           SpriteInChunk(chunk, activeLevel().getChunksX())),
+                 world.sprites.end() );
+  // ThickWalls go with the last chunk they overlap
+  const Level& level = activeLevel();
+  const LevelChunkIndex& index = level.chunkIndex(chunk % level.getChunksX(),
+                                                  chunk / level.getChunksX());
+  for (uint32_t i=0; i<index.thickWallRefCount; ++i) {
+    const uint32_t ref = level.thickWallRef(index.firstThickWallRef + i);
+    std::map<uint32_t, ChunkThickWall>::iterator it = thickWalls.find(ref);
+    if (it != thickWalls.end() && !--it->second.chunks) {
+      delete it->second.thickWall;
+      thickWalls.erase(it);
     }
   }
+}
 
-  createThinWalls();
+void Game::clearThickWalls()
+{
+  std::map<uint32_t, ChunkThickWall>::iterator it;
+  for (it=thickWalls.begin(); it!=thickWalls.end(); ++it) {
+    delete it->second.thickWall;
+  }
+  thickWalls.clear();
+}
+
+// Keeps the chunks around the player loaded when streaming
+void Game::streamChunks()
+{
+  if (!streaming) {
+    return;
+  }
+  chunkStore.update(world.player.x / TILE_SIZE, world.player.y / TILE_SIZE,
+                    streamViewDistance);
+
+  // A chunk can finish loading and be evicted in the same update
+  const vector<int>& loaded = chunkStore.loadedChunks();
+  const vector<int>& evicted = chunkStore.evictedChunks();
+  for (size_t i=0; i<loaded.size(); ++i) {
+    addChunkObjects(loaded[i]);
+  }
+  for (size_t i=0; i<evicted.size(); ++i) {
+    removeChunkObjects(evicted[i]);
+  }
+  if (loaded.size() || evicted.size()) {
+    createThinWalls();
+  }
+  if (evicted.size()) {
+    // Indices have changed, so sprites are drawn where they are until the
+    // next tick
+    previousSprites.clear();
+  }
+}
+
+int Game::floorTypeAt(int cellX, int cellY)
+{
+  return streaming ? chunkStore.floorAt(cellX, cellY)
+                   : level.floorAt(cellX, cellY);
+}
+
+int Game::ceilingTypeAt(int cellX, int cellY)
+{
+  return streaming ? chunkStore.ceilingAt(cellX, cellY)
+                   : level.ceilingAt(cellX, cellY);
 }
 
+// Collects the ThinWalls of all ThickWalls and indexes the ThickWalls by
+// cell. Call this whenever ThickWalls are added or removed.
 void Game::createThinWalls()
+{
+  std::vector<ThickWall*> allThickWalls;
+  thinWalls.clear();
+  std::map<uint32_t, ChunkThickWall>::iterator it;
+  for (it=thickWalls.begin(); it!=thickWalls.end(); ++it) {
+    ThickWall* thickWall = it->second.thickWall;
+    allThickWalls.push_back(thickWall);
+    appendThinWalls(thinWalls, thickWall->thinWalls);
+  }
+  thickWallIndex.build(allThickWalls, TILE_SIZE);
+}
+
+// Creates a ThickWall and its ThinWalls from a level description
+ThickWall* Game::createThickWall(const LevelThickWall& desc)
+{
+  const float* c = desc.coords;
+  ThickWall* thickWall = new ThickWall();
+  thickWall->ceilingTextureID = desc.ceilingTextureID;
+  thickWall->floorTextureID = desc.floorTextureID;
+  switch (desc.shape) {
+    case LEVEL_WALL_TRIANGLE:
+      thickWall->createTriangleThickWall(
+        Point(c[0], c[1]), Point(c[2], c[3]), Point(c[4], c[5]),
+        desc.z, desc.height
+      );
+      break;
+    case LEVEL_WALL_QUAD:
+      thickWall->createQuadThickWall(
+        Point(c[0], c[1]), Point(c[2], c[3]),
+        Point(c[4], c[5]), Point(c[6], c[7]),
+        desc.z, desc.height
+      );
+      break;
+    case LEVEL_WALL_SLOPE:
+      thickWall->createRectSlope(
+        desc.slopeType, c[0], c[1], c[2], c[3], desc.z,
+        desc.startHeight, desc.endHeight
+      );
+      break;
+    case LEVEL_WALL_INVERTED_SLOPE:
+      thickWall->createRectInvertedSlope(
+        desc.slopeType, c[0], c[1], c[2], c[3], desc.z,
+        desc.startHeight, desc.endHeight
+      );
+      break;
+    default:
+      thickWall->createRectThickWall(
+        c[0], c[1], c[2], c[3], desc.z, desc.height
+      );
+      break;
+  }
+  thickWall->setThinWallsType(desc.thinWallType);
+  return thickWall;
+}
+
+static LevelThickWall rectThickWallDesc(float x, float y, float w, float h,
+                                        float z, float height,
+                                        int thinWallType,
+                                        int ceilingTextureID,
+                                        int floorTextureID)
+{
+  LevelThickWall desc;
+  memset(&desc, 0, sizeof(desc));
+  desc.shape = LEVEL_WALL_RECT;
+  desc.thinWallType = thinWallType;
+  desc.ceilingTextureID = ceilingTextureID;
+  desc.floorTextureID = floorTextureID;
+  desc.z = z;
+  desc.height = height;
+  desc.coords[0] = x;
+  desc.coords[1] = y;
+  desc.coords[2] = w;
+  desc.coords[3] = h;
+  return desc;
+}
+
+static LevelThickWall slopeDesc(int shape, int slopeType,
+                                float x, float y, float w, float h, float z,
+                                float startHeight, float endHeight,
+                                int thinWallType,
+                                int ceilingTextureID, int floorTextureID)
+{
+  LevelThickWall desc = rectThickWallDesc(x, y, w, h, z, 0, thinWallType,
+                                          ceilingTextureID, floorTextureID);
+  desc.shape = shape;
+  desc.slopeType = slopeType;
+  desc.startHeight = startHeight;
+  desc.endHeight = endHeight;
+  return desc;
+}
+
+// Converts a value from the arrays in defaults.cpp to a Cell, adding a
+// material the first time a value is seen. Values above 1000 are doors,
+// horizontal ones above 1500.
+static Cell defaultLevelCell(int value, vector<CellMaterial>& materials,
+                             std::map<int, Cell>& cellForValue)
+{
+  if (!value) {
+    return 0;
+  }
+  std::map<int, Cell>::iterator it = cellForValue.find(value);
+  if (it != cellForValue.end()) {
+    return it->second;
+  }
+  CellMaterial material;
+  material.textureID = 0;
+  material.flags = MATERIAL_SOLID;
+  if (value > 1500) {
+    material.flags |= MATERIAL_DOOR | MATERIAL_DOOR_HORIZONTAL |
+                      MATERIAL_TRANSPARENT;
+  }
+  else if (value > 1000) {
+    material.flags |= MATERIAL_DOOR | MATERIAL_TRANSPARENT;
+  }
+  else {
+    material.textureID = value - 1;
+  }
+  // The last material is what cells in chunks that aren't loaded read as
+  if ((int)materials.size() >= MAX_MATERIALS-1) {
+    printf("Too many materials, %d is drawn as a wall\n", value);
+    return MAX_MATERIALS-1;
+  }
+  const Cell cell = materials.size();
+  materials.push_back(material);
+  cellForValue[value] = cell;
+  return cell;
+}
+
+// Builds the demo level from the arrays in defaults.cpp
+void Game::createDefaultLevel()
 {
   float commonZ = TILE_SIZE*0;
   int commonThinWallType = 4;
@@ -271,135 +667,260 @@ void Game::createThinWalls()
   int commonFloorTextureID = 8;
   int commonHeight = TILE_SIZE * 0.2;
 
-  if (slopedWalls.empty()) {
-    // Floor slope 1
-    ThickWall* slopedWall = new ThickWall();
-    slopedWall->createRectSlope(
-      SLOPE_TYPE_WEST_EAST,
-      5*TILE_SIZE, 19*TILE_SIZE, TILE_SIZE*3, TILE_SIZE*1, 0,
-      1, TILE_SIZE
-    );
-    slopedWalls.push_back(slopedWall);
-    slopedWall->ceilingTextureID = commonCeilingTextureID;
-    slopedWall->floorTextureID = 5;
-    slopedWall->setThinWallsType(commonThinWallType);
-    appendThinWalls(thinWalls, slopedWall->thinWalls);
-
-    // Floor slope 2
-    slopedWall = new ThickWall();
-    slopedWall->createRectSlope(
-      SLOPE_TYPE_NORTH_SOUTH,
-      11*TILE_SIZE, 18*TILE_SIZE, TILE_SIZE*1, TILE_SIZE*2, 0,
-      0, TILE_SIZE
-    );
-    slopedWalls.push_back(slopedWall);
-    slopedWall->ceilingTextureID = commonCeilingTextureID;
-    slopedWall->floorTextureID = 4;
-    slopedWall->setThinWallsType(commonThinWallType);
-    appendThinWalls(thinWalls, slopedWall->thinWalls);
-
-    // Floor slope 3
-    slopedWall = new ThickWall();
-    slopedWall->createRectSlope(
-      SLOPE_TYPE_WEST_EAST,
-      7*TILE_SIZE, 12*TILE_SIZE, TILE_SIZE*5, TILE_SIZE, 0,
-      TILE_SIZE, 0
-    );
-    slopedWalls.push_back(slopedWall);
-    slopedWall->ceilingTextureID = commonCeilingTextureID;
-    slopedWall->floorTextureID = 5;
-    slopedWall->setThinWallsType(commonThinWallType);
-    appendThinWalls(thinWalls, slopedWall->thinWalls);
-
-    // Ceiling slope
-    slopedWall = new ThickWall();
-    slopedWall->createRectInvertedSlope(
-      SLOPE_TYPE_NORTH_SOUTH,
-      7*TILE_SIZE, 7*TILE_SIZE, TILE_SIZE, TILE_SIZE*2, TILE_SIZE*1.5,
-      TILE_SIZE, 1
-    );
-    slopedWalls.push_back(slopedWall);
-    slopedWall->ceilingTextureID = commonCeilingTextureID;
-    slopedWall->floorTextureID = 5;
-    slopedWall->setThinWallsType(commonThinWallType);
-    appendThinWalls(thinWalls, slopedWall->thinWalls);
-  }
-
-  if (!rectWall) {
-    rectWall = new ThickWall();
-    rectWall->ceilingTextureID = commonCeilingTextureID;
-    rectWall->floorTextureID = commonFloorTextureID;
-    rectWall->createRectThickWall(
-      18*TILE_SIZE, 17*TILE_SIZE, TILE_SIZE, TILE_SIZE, commonZ, commonHeight
-    );
-    rectWall->setThinWallsType(commonThinWallType);
-    appendThinWalls(thinWalls, rectWall->thinWalls);
-  }
-
-  if (!triangleWall) {
-    triangleWall = new ThickWall();
-    triangleWall->ceilingTextureID = commonCeilingTextureID;
-    triangleWall->floorTextureID = commonFloorTextureID;
-    triangleWall->createTriangleThickWall(
-      Point(rectWall->x - 1.5*TILE_SIZE, rectWall->y),
-      Point(rectWall->x - 0.5*TILE_SIZE, rectWall->y + TILE_SIZE),
-      Point(rectWall->x - 2.5*TILE_SIZE, rectWall->y + TILE_SIZE),
-      commonZ, commonHeight
-    );
-    triangleWall->setThinWallsType(commonThinWallType);
-    appendThinWalls(thinWalls, triangleWall->thinWalls);
-  }
-
-  if (!diamondWall) {
-    diamondWall = new ThickWall();
-    diamondWall->ceilingTextureID = commonCeilingTextureID;
-    diamondWall->floorTextureID = commonFloorTextureID;
-    diamondWall->createQuadThickWall(
-      Point(rectWall->x - 3.5*TILE_SIZE, rectWall->y),
-      Point(rectWall->x - 3*TILE_SIZE, rectWall->y + 0.5*TILE_SIZE),
-      Point(rectWall->x - 3.5*TILE_SIZE, rectWall->y + TILE_SIZE),
-      Point(rectWall->x - 4*TILE_SIZE, rectWall->y + 0.5*TILE_SIZE),
-      commonZ, commonHeight
-    );
-    diamondWall->setThinWallsType(4);
-    appendThinWalls(thinWalls, diamondWall->thinWalls);
-  }
-
-  if (helloWalls.empty()) {
-    float helloCoords[15][6] = {
-      { 4*TILE_SIZE, 18*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
-      { 4*TILE_SIZE, 17.80*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 48, 32 },
-      { 4*TILE_SIZE, 17.61*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
-      { 4*TILE_SIZE, 17.22*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
-      { 4*TILE_SIZE, 16.83*TILE_SIZE, 0.2*TILE_SIZE, 0.39*TILE_SIZE, 0, 25 },
-      { 4*TILE_SIZE, 16.83*TILE_SIZE, 0.2*TILE_SIZE, 0.39*TILE_SIZE, 51, 25 },
-      { 4*TILE_SIZE, 16.83*TILE_SIZE, 0.2*TILE_SIZE, 0.39*TILE_SIZE, 103, 25 },
-      { 4*TILE_SIZE, 16.44*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
-      { 4*TILE_SIZE, 16.05*TILE_SIZE, 0.2*TILE_SIZE, 0.39*TILE_SIZE, 0, 25 },
-      { 4*TILE_SIZE, 15.66*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
-      { 4*TILE_SIZE, 15.27*TILE_SIZE, 0.2*TILE_SIZE, 0.39*TILE_SIZE, 0, 25 },
-      { 4*TILE_SIZE, 14.88*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
-      { 4*TILE_SIZE, 14.68*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 25 },
-      { 4*TILE_SIZE, 14.68*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 103, 25 },
-      { 4*TILE_SIZE, 14.48*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
-    };
-    for (int i=0; i<15; ++i) {
-      ThickWall* tmpWall = new ThickWall();
-      tmpWall->ceilingTextureID = commonCeilingTextureID;
-      tmpWall->floorTextureID = commonFloorTextureID;
-      tmpWall->createRectThickWall(
-        helloCoords[i][0],
-        helloCoords[i][1],
-        helloCoords[i][2],
-        helloCoords[i][3],
-        helloCoords[i][4],
-        helloCoords[i][5]
-      );
-      helloWalls.push_back( tmpWall );
-      tmpWall->setThinWallsType(4);
-      appendThinWalls(thinWalls, tmpWall->thinWalls);
+  vector<LevelThickWall> walls;
+
+  // Floor slope 1
+  walls.push_back(slopeDesc(
+    LEVEL_WALL_SLOPE, SLOPE_TYPE_WEST_EAST,
+    5*TILE_SIZE, 19*TILE_SIZE, TILE_SIZE*3, TILE_SIZE*1, 0,
+    1, TILE_SIZE,
+    commonThinWallType, commonCeilingTextureID, 5
+  ));
+
+  // Floor slope 2
+  walls.push_back(slopeDesc(
+    LEVEL_WALL_SLOPE, SLOPE_TYPE_NORTH_SOUTH,
+    11*TILE_SIZE, 18*TILE_SIZE, TILE_SIZE*1, TILE_SIZE*2, 0,
+    0, TILE_SIZE,
+    commonThinWallType, commonCeilingTextureID, 4
+  ));
+
+  // Floor slope 3
+  walls.push_back(slopeDesc(
+    LEVEL_WALL_SLOPE, SLOPE_TYPE_WEST_EAST,
+    7*TILE_SIZE, 12*TILE_SIZE, TILE_SIZE*5, TILE_SIZE, 0,
+    TILE_SIZE, 0,
+    commonThinWallType, commonCeilingTextureID, 5
+  ));
+
+  // Ceiling slope
+  walls.push_back(slopeDesc(
+    LEVEL_WALL_INVERTED_SLOPE, SLOPE_TYPE_NORTH_SOUTH,
+    7*TILE_SIZE, 7*TILE_SIZE, TILE_SIZE, TILE_SIZE*2, TILE_SIZE*1.5,
+    TILE_SIZE, 1,
+    commonThinWallType, commonCeilingTextureID, 5
+  ));
+
+  // Rectangle
+  const float rectX = 18*TILE_SIZE;
+  const float rectY = 17*TILE_SIZE;
+  walls.push_back(rectThickWallDesc(
+    rectX, rectY, TILE_SIZE, TILE_SIZE, commonZ, commonHeight,
+    commonThinWallType, commonCeilingTextureID, commonFloorTextureID
+  ));
+
+  // Triangle
+  LevelThickWall triangle = walls.back();
+  triangle.shape = LEVEL_WALL_TRIANGLE;
+  triangle.coords[0] = rectX - 1.5*TILE_SIZE;
+  triangle.coords[1] = rectY;
+  triangle.coords[2] = rectX - 0.5*TILE_SIZE;
+  triangle.coords[3] = rectY + TILE_SIZE;
+  triangle.coords[4] = rectX - 2.5*TILE_SIZE;
+  triangle.coords[5] = rectY + TILE_SIZE;
+  walls.push_back(triangle);
+
+  // Diamond
+  LevelThickWall diamond = triangle;
+  diamond.shape = LEVEL_WALL_QUAD;
+  diamond.coords[0] = rectX - 3.5*TILE_SIZE;
+  diamond.coords[1] = rectY;
+  diamond.coords[2] = rectX - 3*TILE_SIZE;
+  diamond.coords[3] = rectY + 0.5*TILE_SIZE;
+  diamond.coords[4] = rectX - 3.5*TILE_SIZE;
+  diamond.coords[5] = rectY + TILE_SIZE;
+  diamond.coords[6] = rectX - 4*TILE_SIZE;
+  diamond.coords[7] = rectY + 0.5*TILE_SIZE;
+  walls.push_back(diamond);
+
+  // HELLO
+  float helloCoords[15][6] = {
+    { 4*TILE_SIZE, 18*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
+    { 4*TILE_SIZE, 17.80*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 48, 32 },
+    { 4*TILE_SIZE, 17.61*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
+    { 4*TILE_SIZE, 17.22*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
+    { 4*TILE_SIZE, 16.83*TILE_SIZE, 0.2*TILE_SIZE, 0.39*TILE_SIZE, 0, 25 },
+    { 4*TILE_SIZE, 16.83*TILE_SIZE, 0.2*TILE_SIZE, 0.39*TILE_SIZE, 51, 25 },
+    { 4*TILE_SIZE, 16.83*TILE_SIZE, 0.2*TILE_SIZE, 0.39*TILE_SIZE, 103, 25 },
+    { 4*TILE_SIZE, 16.44*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
+    { 4*TILE_SIZE, 16.05*TILE_SIZE, 0.2*TILE_SIZE, 0.39*TILE_SIZE, 0, 25 },
+    { 4*TILE_SIZE, 15.66*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
+    { 4*TILE_SIZE, 15.27*TILE_SIZE, 0.2*TILE_SIZE, 0.39*TILE_SIZE, 0, 25 },
+    { 4*TILE_SIZE, 14.88*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
+    { 4*TILE_SIZE, 14.68*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 25 },
+    { 4*TILE_SIZE, 14.68*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 103, 25 },
+    { 4*TILE_SIZE, 14.48*TILE_SIZE, 0.2*TILE_SIZE, 0.2*TILE_SIZE, 0, 128 },
+  };
+  for (int i=0; i<15; ++i) {
+    walls.push_back(rectThickWallDesc(
+      helloCoords[i][0],
+      helloCoords[i][1],
+      helloCoords[i][2],
+      helloCoords[i][3],
+      helloCoords[i][4],
+      helloCoords[i][5],
+      4, commonCeilingTextureID, commonFloorTextureID
+    ));
+  }
+
+  vector<LevelSprite> levelSprites;
+  for (int y=0; y<MAP_HEIGHT; y++) {
+    for (int x=0; x<MAP_WIDTH; x++) {
+      if (g_spritemap[ y ][ x ]) {
+        LevelSprite sprite;
+        sprite.cellX = x;
+        sprite.cellY = y;
+        sprite.textureID = g_spritemap[ y ][ x ];
+        levelSprites.push_back(sprite);
+      }
+    }
+  }
+
+  const int* maps[] = { &g_map[0][0], &g_map2[0][0], &g_map3[0][0] };
+  const int mapCount = sizeof(maps) / sizeof(maps[0]);
+  const int mapCells = MAP_WIDTH * MAP_HEIGHT;
+  vector<CellMaterial> materials(1);
+  materials[0].textureID = 0;
+  materials[0].flags = MATERIAL_TRANSPARENT;
+  std::map<int, Cell> cellForValue;
+  vector<Cell> cells(mapCells * mapCount);
+  for (int z=0; z<mapCount; ++z) {
+    for (int i=0; i<mapCells; ++i) {
+      cells[i + z*mapCells] = defaultLevelCell(maps[z][i], materials,
+                                               cellForValue);
+    }
+  }
+
+  level.build(MAP_WIDTH, MAP_HEIGHT, mapCount, TILE_SIZE, 26, 6, 0,
+              &cells[0], &g_floormap[0][0], &g_ceilingmap[0][0],
+              vector<unsigned char>(), materials, walls, levelSprites);
+}
+
+// Maps a level file and restarts the game in it. The current level is kept
+// if the file can't be used. When streaming, only the chunks near the player
+// are loaded.
+bool Game::loadLevel(const std::string& filename)
+{
+  Level newLevel;
+  if (!newLevel.load(filename)) {
+    return false;
+  }
+  if (newLevel.getTileSize() != TILE_SIZE) {
+    printf("%s has tile size %d but %d is required\n", filename.c_str(),
+           newLevel.getTileSize(), TILE_SIZE);
+    return false;
+  }
+  if (streaming) {
+    // Enough chunks for the view distance plus one ring that has just been
+    // left behind
+    const int range = (streamViewDistance + LEVEL_CHUNK_SIZE - 1) >>
+                      LEVEL_CHUNK_SHIFT;
+    const int maxChunks = (2*range + 3) * (2*range + 3);
+    if (!chunkStore.open(filename, maxChunks)) {
+      return false;
+    }
+  }
+  else {
+    level.swap(newLevel); // the old level is closed with newLevel
+  }
+  resetSnapshot.data.clear(); // the next reset() builds the new level
+  reset();
+  return true;
+}
+
+// Saves the current level along with its distance fields
+bool Game::saveLevel(const std::string& filename)
+{
+  if (streaming) {
+    printf("Streamed levels can't be saved\n");
+    return false;
+  }
+  vector<CellMaterial> materials(raycaster3D.materials,
+                                 raycaster3D.materials + MAX_MATERIALS);
+  vector<LevelThickWall> walls;
+  for (int i=0; i<level.getThickWallCount(); ++i) {
+    walls.push_back(level.thickWall(i));
+  }
+  vector<LevelSprite> levelSprites;
+  for (int i=0; i<level.getSpriteCount(); ++i) {
+    levelSprites.push_back(level.sprite(i));
+  }
+  Level out;
+  out.build(mapWidth, mapHeight, highestCeilingLevel, TILE_SIZE,
+            level.getPlayerCellX(), level.getPlayerCellY(),
+            level.getPlayerRot(), &raycaster3D.cells[0],
+            level.getFloorData(), level.getCeilingData(),
+            raycaster3D.distanceFields, materials, walls, levelSprites,
+            terrain.empty() ? 0 : terrain.getHeights());
+  return out.save(filename);
+}
+
+// Replaces the terrain with heights from a grayscale BMP. Black is 0 and
+// white is maxHeight. The image is stretched over the whole map, and the
+// terrain is kept when the level is saved.
+bool Game::loadHeightmap(const std::string& filename, float maxHeight)
+{
+  SDL_Surface* surface = SDL_LoadBMP(filename.c_str());
+  if (!surface) {
+    printf("Could not load heightmap %s: %s\n", filename.c_str(),
+           SDL_GetError());
+    return false;
+  }
+  SDL_Surface* argb = SDL_ConvertSurfaceFormat(surface,
+                                               SDL_PIXELFORMAT_ARGB8888, 0);
+  SDL_FreeSurface(surface);
+  if (!argb) {
+    printf("Could not convert heightmap %s: %s\n", filename.c_str(),
+           SDL_GetError());
+    return false;
+  }
+
+  terrain.create(mapWidth, mapHeight, TILE_SIZE);
+  for (int vy=0; vy<=mapHeight; ++vy) {
+    const int py = vy * (argb->h-1) / mapHeight;
+    const Uint32* row = (const Uint32*)((const char*)argb->pixels +
+                                        py * argb->pitch);
+    for (int vx=0; vx<=mapWidth; ++vx) {
+      const int px = vx * (argb->w-1) / mapWidth;
+      const int red = (row[px] >> 16) & 0xFF;
+      terrain.setVertexHeight(vx, vy, red / 255.0f * maxHeight);
     }
   }
+  SDL_FreeSurface(argb);
+  return true;
+}
+
+// Mip level that has about one texel per pixel, for a texture that is
+// stretched or shrunk to texelsPerPixel
+static int mipLevel(float texelsPerPixel)
+{
+  int level = 0;
+  while (texelsPerPixel >= 2 && level < MIP_LEVELS-1) {
+    texelsPerPixel *= 0.5f;
+    level++;
+  }
+  return level;
+}
+
+// Mip level for a floor or ceiling point at a diagonal distance from the
+// player. A strip is stripWidth pixels wide and spans that many viewDists
+// of distance across the ray.
+int Game::floorMipLevel(float distance)
+{
+  if (!mipmapsOn) {
+    return 0;
+  }
+  return mipLevel(distance * stripWidth / viewDist * TEXTURE_SIZE / TILE_SIZE);
+}
+
+// Mip level for a wall strip where a whole texture is wallScreenHeight
+// pixels high
+int Game::wallMipLevel(float wallScreenHeight)
+{
+  if (!mipmapsOn || wallScreenHeight <= 0) {
+    return 0;
+  }
+  return mipLevel(TEXTURE_SIZE / wallScreenHeight);
 }
 
 float Game::sine(float f) {
@@ -432,8 +953,11 @@ void Game::addSpriteAt( int spriteid, int cellX, int cellY ) {
   }
   s.level = level;
   s.z = level * TILE_SIZE;
+  if (!level && !terrain.empty()) {
+    s.z = terrain.heightAt(s.x, s.y);
+  }
 
-  sprites.push_back(s);
+  world.sprites.push_back(s);
 }
 
 void Game::addProjectile(int textureid, int x, int y, int z, int size,
@@ -450,39 +974,93 @@ void Game::addProjectile(int textureid, int x, int y, int z, int size,
   projectilesQueue.push( s );
 }
 
-void Game::start() {
+// Runs the game, or only draws benchmarkFrames frames for benchmark()
+void Game::start(int benchmarkFrames) {
   SettingsManager settingsManager;
   settingsManager.loadConfig("config.ini");
 
   displayWidth = settingsManager.getInt("displayWidth",DEFAULT_DISPLAY_WIDTH);
   displayHeight =settingsManager.getInt("displayHeight",DEFAULT_DISPLAY_HEIGHT);
   stripWidth = settingsManager.getInt("stripWidth", DEFAULT_STRIP_WIDTH);
+  windowWidth = displayWidth;
+  windowHeight = displayHeight;
+  windowStripWidth = stripWidth;
   rayCount = displayWidth / stripWidth;
   fovDegrees = settingsManager.getInt("fov", DEFAULT_FOV_DEGREES);
   fovRadians = (float)fovDegrees * M_PI / 180;
   viewDist = Raycaster::screenDistance(displayWidth, fovRadians);
   fullscreen = settingsManager.getInt("fullscreen", 0);
-
-  // Calculate the angles for each column strip once and save them
-  this->stripAngles = new float[rayCount];
-  for (int strip=0; strip<rayCount; strip++) {
-    float screenX = (rayCount/2 - strip) * stripWidth;
-    stripAngles[strip] = Raycaster::stripAngle(screenX, viewDist);
+  const bool vsync = settingsManager.getInt("vsync", 0);
+  framePacer.setTargetFps(settingsManager.getInt("maxFps", DESIRED_FPS));
+  levelFile = settingsManager.getString("levelFile", "");
+  streaming = levelFile.size() && settingsManager.getInt("streamLevel", 0);
+  streamViewDistance = settingsManager.getInt("streamViewDistance",
+                                              DEFAULT_STREAM_VIEW_DISTANCE);
+  terrainViewDistance = settingsManager.getInt("terrainViewDistance",
+                                               DEFAULT_TERRAIN_VIEW_DISTANCE);
+  if (levelFile.size() && !loadLevel(levelFile)) {
+    printf("Using the default level instead of %s\n", levelFile.c_str());
+    streaming = false;
+  }
+  raycaster3D.fixedPoint = settingsManager.getInt("fixedPointRaycast", 1);
+  mipmapsOn = settingsManager.getInt("mipmaps", 1);
+  dynamicResolution = settingsManager.getInt("dynamicResolution", 0);
+  const int targetFps = settingsManager.getInt("dynamicResolutionFps",
+                                               DESIRED_FPS);
+  frameBudgetMs = 1000.0f / std::max(1, targetFps);
+  mouseSensitivity = settingsManager.getInt("mouseSensitivity",
+                                      DEFAULT_MOUSE_SENSITIVITY) / 1000.0f;
+  adaptiveRaysOn = settingsManager.getInt("adaptiveRays", 0);
+  adaptiveRayStep = std::max(2, settingsManager.getInt("adaptiveRayStep",
+                                                   DEFAULT_ADAPTIVE_RAY_STEP));
+  setAuxBuffersOn(settingsManager.getInt("auxBuffers", 0));
+  const string frameRingName = settingsManager.getString("frameRing", "");
+  if (frameRingName.size()) {
+    // Dynamic resolution only ever renders smaller than the window
+    const int slots = settingsManager.getInt("frameRingSlots",
+                                             DEFAULT_FRAME_RING_SLOTS);
+    if (frameRing.create(frameRingName, slots, displayWidth, displayHeight,
+                         aux != NULL)) {
+      printf("Frame ring   = %s, %d slots%s\n", frameRingName.c_str(),
+             slots, aux ? " with aux buffers" : "");
+    }
   }
+
+  createStripAngles();
   printf("stripAngles have been calculated and saved\n");
 
   printf("Resolution   = %d x %d\n", displayWidth, displayHeight);
-  printf("Map size     = %d x %d\n", MAP_WIDTH, MAP_HEIGHT);
+  printf("Map size     = %d x %d\n", mapWidth, mapHeight);
   printf("FOV          = %d degrees\n", fovDegrees);
   printf("stripWidth   = %d\n", stripWidth);
   printf("rayCount     = %d\n", rayCount);
   printf("Distance to Projection Plane = %f\n", viewDist);
   printf("Wall size    = %d game units\n", TILE_SIZE);
+  printf("Raycast mode = %s\n", raycaster3D.fixedPoint ? "fixed-point"
+                                                       : "floating point");
+  if (framePacer.getTargetFps()) {
+    printf("Max FPS      = %d%s\n", framePacer.getTargetFps(),
+           vsync ? ", vsync" : "");
+  }
+  else {
+    printf("Max FPS      = uncapped%s\n", vsync ? ", vsync" : "");
+  }
+  if (dynamicResolution) {
+    printf("Dynamic resolution = %.2f ms frame budget\n", frameBudgetMs);
+  }
+  if (adaptiveRaysOn) {
+    printf("Adaptive rays = every %d strips, refined at edges\n",
+           adaptiveRayStep);
+  }
+  if (streaming) {
+    printf("Streaming    = %d cells around the player\n", streamViewDistance);
+  }
   printf("Texture Size = %d pixels\n", TEXTURE_SIZE);
   int flags = SDL_WINDOW_SHOWN ;
   if (SDL_Init(SDL_INIT_EVERYTHING)) {
       return ;
   }
+  sdlStarted = true;
 
   SDL_version compiled;
   SDL_version linked;
@@ -501,18 +1079,11 @@ void Game::start() {
                              displayHeight,
                              flags);
 
-  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED );
+  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED |
+                                (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
   SDL_SetWindowResizable(window, SDL_TRUE );
 
-  screenTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
-                                    SDL_TEXTUREACCESS_TARGET, displayWidth,
-                                    displayHeight);
-
-  screenSurface = SDL_CreateRGBSurface(0, displayWidth, displayHeight, 32,
-                                       0x00FF0000,
-                                       0x0000FF00,
-                                       0x000000FF,
-                                       0xFF000000);
+  createScreenBuffers();
 
   SDL_RendererInfo rendererInfo;
   SDL_GetRendererInfo(renderer, &rendererInfo);
@@ -532,159 +1103,595 @@ void Game::start() {
   Uint32 pf = SDL_GetWindowPixelFormat(window);
   printf("windowPixelFormat = %s\n", SDL_GetPixelFormatName(pf));
 
+  if (!loadAssets(pf, settingsManager.getInt("swizzleTextures", 1))) {
+    return;
+  }
+
+  //Initialize SDL_mixer
+  if( Mix_OpenAudio( 44100, MIX_DEFAULT_FORMAT, 2, 2048 ) < 0 )
+  {
+    printf( "Mix_OpenAudio failed. SDL_mixer Error: %s\n", Mix_GetError() );
+    return;
+  }
+
+  assets.projectileFireSound = Mix_LoadWAV( "..\\res\\iceball.wav" );
+  assets.projectileExplodeSound = Mix_LoadWAV( "..\\res\\explode.wav" );
+  assets.doorOpenSound = Mix_LoadWAV( "..\\res\\door-09.wav" );
+  assets.doorCloseSound = Mix_LoadWAV( "..\\res\\door-08.wav" );
+  Mix_VolumeChunk(assets.projectileFireSound, MIX_MAX_VOLUME/2);
+  Mix_VolumeChunk(assets.projectileExplodeSound, MIX_MAX_VOLUME/3);
+  Mix_VolumeChunk(assets.doorOpenSound, MIX_MAX_VOLUME);
+  Mix_VolumeChunk(assets.doorCloseSound, MIX_MAX_VOLUME);
+
+  if (benchmarkFrames > 0) {
+    benchmark(benchmarkFrames);
+    return;
+  }
+  if (replayFile.size()) {
+    replay();
+    return;
+  }
+
+  if (settingsManager.getInt("renderThread", 1)) {
+    renderStart = SDL_CreateSemaphore(0);
+    renderDone = SDL_CreateSemaphore(0);
+    renderThread = SDL_CreateThread(renderThreadMain, "Render", this);
+    if (!renderThread) {
+      printf("SDL_CreateThread failed: %s\n", SDL_GetError());
+    }
+  }
+
+  setMouseLook(settingsManager.getInt("mouseLook", 0));
+  if (recordFile.size()) {
+    // Replays start from a reset world too
+    recording.clear(seed, UPDATE_INTERVAL, mouseSensitivity);
+    reset();
+  }
+  this->running = 1 ;
+  printHelp();
+  run();
+
+  if (recordFile.size() && recording.save(recordFile)) {
+    printf("Recorded %d ticks to %s (%u bytes)\n", recording.getTickCount(),
+           recordFile.c_str(), (unsigned) recording.getDataSize());
+  }
+}
+
+// Loads the textures in pixel format pf into assets. renderer must be set,
+// though it can be a software renderer.
+bool Game::loadAssets(Uint32 pf, bool swizzleTextures)
+{
   SDL_PixelFormat* tmppf = SDL_AllocFormat(pf);
-  ceilingColor = SDL_MapRGB(tmppf, 139, 185, 249);
+  assets.ceilingColor = SDL_MapRGB(tmppf, 139, 185, 249);
   SDL_FreeFormat(tmppf);
 
   //--------------
   // Load Textures
   //--------------
 
-  if (!wallsImage.loadBitmap("..\\res\\walls4.bmp")) {
+  if (!assets.wallsImage.loadBitmap("..\\res\\walls4.bmp")) {
     printf("Error loading walls4.bmp\n");
-    return;
+    return false;
   }
-  if (!wallsImageDark.loadBitmap("..\\res\\walls4dark.bmp")) {
+  if (!assets.wallsImageDark.loadBitmap("..\\res\\walls4dark.bmp")) {
     printf("Error loading walls4dark.bmp\n");
-    return;
+    return false;
   }
-  if (!gatesImage.loadBitmap("..\\res\\gates.bmp")) {
+  if (!assets.gatesImage.loadBitmap("..\\res\\gates.bmp")) {
     printf("Error loading gates.bmp\n");
+    return false;
+  }
+  if (!assets.gatesOpenImage.loadBitmap("..\\res\\gatesopen.bmp")) {
+    printf("Error loading gatesopen.bmp\n");
+    return false;
+  }
+
+  assets.wallsImage.createTexture(renderer);
+  assets.wallsImageDark.createTexture(renderer);
+  assets.gatesImage.createTexture(renderer);
+  assets.gatesOpenImage.createTexture(renderer);
+
+  if (!assets.gunImage.loadBitmap("..\\res\\gun1a.bmp")) {
+    printf("Error loading gun image\n");
+    return false;
+  }
+  Uint32 colorKey = SDL_MapRGB(assets.gunImage.getSurface()->format,152,0,136);
+  SDL_SetColorKey( assets.gunImage.getSurface(), true, colorKey );
+  assets.gunImage.createTexture(renderer);
+
+  SDL_SetColorKey( assets.gatesImage.getSurface(), true, colorKey );
+  SDL_SetColorKey( assets.gatesOpenImage.getSurface(), true, colorKey );
+
+  assets.wallsImage.generateMipmaps(MIP_LEVELS);
+  assets.wallsImageDark.generateMipmaps(MIP_LEVELS);
+  assets.gatesImage.generateMipmaps(MIP_LEVELS);
+  assets.gatesOpenImage.generateMipmaps(MIP_LEVELS);
+
+  // Load Sprite Images
+  std::map<int,std::string> spriteFilenames;
+  spriteFilenames[ SpriteTypeTree1 ] = "tree.bmp";
+  spriteFilenames[ SpriteTypeTree2 ] = "tree2.bmp";
+  spriteFilenames[ SpriteTypeZombie ] = "zombie.bmp";
+  spriteFilenames[ SpriteTypeSkeleton ] = "skeleton.bmp";
+  spriteFilenames[ SpriteTypeRobot ] = "robot1.bmp";
+  spriteFilenames[ SpriteTypeFrogman ] = "frogman.bmp";
+  spriteFilenames[ SpriteTypeHeroine ] = "heroine.bmp";
+  spriteFilenames[ SpriteTypeDruid ] = "druid.bmp";
+  spriteFilenames[ SpriteTypeProjectile ] = "plasmball.bmp";
+  spriteFilenames[ SpriteTypeProjectileSplash ] = "fireball0.bmp";
+  spriteFilenames[ SpriteTypeGates ] = "gates.bmp";
+  for (std::map<int,std::string>::iterator i=spriteFilenames.begin();
+       i!=spriteFilenames.end(); ++i)
+  {
+    int textureid = i->first;
+    std::string filename = "..\\res\\" + i->second;
+    printf("Loading texture image %s\n", filename.c_str());
+    SurfaceTexture& surfaceTexture = assets.spriteTextures[textureid];
+    if (!surfaceTexture.loadBitmap(filename.c_str())) {
+      printf("Error loading %s\n", filename.c_str());
+      return false;
+    }
+    SDL_SetColorKey( surfaceTexture.getSurface(), true, colorKey );
+    surfaceTexture.createTexture(renderer);
+    surfaceTexture.generateMipmaps(MIP_LEVELS);
+  }
+
+  // Load Floors and Ceiling Images. They are sampled along rays at any
+  // angle, which Z-order storage handles better than rows.
+  std::map<int,std::string> floorCeilingFilenames;
+  floorCeilingFilenames[ 0 ] = "grass.bmp";
+  floorCeilingFilenames[ 1 ] = "texture1.bmp";
+  floorCeilingFilenames[ 2 ] = "texture2.bmp";
+  floorCeilingFilenames[ 3 ] = "texture3.bmp";
+  floorCeilingFilenames[ 4 ] = "texture4.bmp";
+  floorCeilingFilenames[ 5 ] = "default_brick.bmp";
+  floorCeilingFilenames[ 6 ] = "default_aspen_wood.bmp";
+  floorCeilingFilenames[ 7 ] = "water.bmp";
+  floorCeilingFilenames[ 8 ] = "mossycobble.bmp";
+  assets.floorCeilingBitmaps.resize(floorCeilingFilenames.size());
+  for (std::map<int,std::string>::iterator i=floorCeilingFilenames.begin();
+       i!=floorCeilingFilenames.end(); ++i)
+  {
+    int textureid = i->first;
+    std::string filename = "..\\res\\" + i->second;
+    printf("Loading bitmap image %s\n", filename.c_str());
+    Bitmap& bitmap = assets.floorCeilingBitmaps[textureid];
+    if (!bitmap.load(filename.c_str(), renderer, pf)) {
+      printf("Error loading %s\n", filename.c_str());
+      return false;
+    }
+    bitmap.generateMipmaps(MIP_LEVELS);
+    if (swizzleTextures) {
+      bitmap.swizzle();
+    }
+  }
+
+  assets.ceilingBitmap.load("..\\res\\texture1.bmp", renderer, pf);
+  assets.skyboxSurface = SDL_LoadBMP("..\\res\\skybox2.bmp");
+
+  if (!assets.skyboxSurface) {
+    printf("Error loading skybox2.bmp\n");
+    return false;
+  }
+  assets.skyboxSurface = SDL_ConvertSurface(assets.skyboxSurface,
+                                            screenSurface->format, 0);
+  return true;
+}
+
+// Sets up a Game without a window or sound that draws into screenSurface,
+// for VectorEnv. Assets are only loaded if they aren't shared, through a
+// software renderer on screenSurface.
+bool Game::startHeadless(int width, int height, int newStripWidth, int fov)
+{
+  drawMiniMapOn = false;
+  quiet = true;
+  fovDegrees = fov;
+  fovRadians = (float)fovDegrees * M_PI / 180;
+  stripWidth = windowStripWidth = newStripWidth;
+  displayWidth = windowWidth = width - width % newStripWidth;
+  displayHeight = windowHeight = height;
+  rayCount = displayWidth / stripWidth;
+  viewDist = Raycaster::screenDistance(displayWidth, fovRadians);
+  createStripAngles();
+  createScreenBuffers();
+  if (!screenSurface) {
+    printf("SDL_CreateRGBSurface failed: %s\n", SDL_GetError());
+    return false;
+  }
+  if (&assets != &ownAssets) {
+    return true;
+  }
+  renderer = SDL_CreateSoftwareRenderer(screenSurface);
+  if (!renderer) {
+    printf("SDL_CreateSoftwareRenderer failed: %s\n", SDL_GetError());
+    return false;
+  }
+  return loadAssets(screenSurface->format->format, true);
+}
+
+// Plays in the level of another Game without a copy of its data
+void Game::shareLevel(const Game& other)
+{
+  level.share(other.activeLevel());
+  resetSnapshot.data.clear();
+  reset();
+}
+
+// Calculate the angles for each column strip once and save them
+void Game::createStripAngles()
+{
+  delete[] stripAngles;
+  stripAngles = new float[rayCount];
+  for (int strip=0; strip<rayCount; strip++) {
+    float screenX = (rayCount/2 - strip) * stripWidth;
+    stripAngles[strip] = Raycaster::stripAngle(screenX, viewDist);
+  }
+}
+
+// Frames are drawn into screenSurface and stretched over the whole window
+// through screenTexture
+void Game::createScreenBuffers()
+{
+  if (screenSurface) {
+    SDL_FreeSurface(screenSurface);
+  }
+  if (screenTexture) {
+    SDL_DestroyTexture(screenTexture);
+  }
+  screenTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                                    SDL_TEXTUREACCESS_TARGET, displayWidth,
+                                    displayHeight);
+
+  screenSurface = SDL_CreateRGBSurface(0, displayWidth, displayHeight, 32,
+                                       0x00FF0000,
+                                       0x0000FF00,
+                                       0x000000FF,
+                                       0xFF000000);
+}
+
+// Changes the size frames are rendered at without touching the window
+void Game::setRenderResolution(int width, int height, int newStripWidth)
+{
+  width -= width % newStripWidth; // whole strips only
+  if (width==displayWidth && height==displayHeight &&
+      newStripWidth==stripWidth) {
     return;
   }
-  if (!gatesOpenImage.loadBitmap("..\\res\\gatesopen.bmp")) {
-    printf("Error loading gatesopen.bmp\n");
-    return;
+  pitch = floor(pitch * height / displayHeight + 0.5f);
+  displayWidth = width;
+  displayHeight = height;
+  stripWidth = newStripWidth;
+  rayCount = displayWidth / stripWidth;
+  viewDist = Raycaster::screenDistance(displayWidth, fovRadians);
+  createStripAngles();
+  createScreenBuffers();
+}
+
+// Level 0 is the window size. Each level after that is cheaper to draw.
+void Game::setResolutionLevel(int level)
+{
+  resolutionLevel = level;
+  const int scaleIndex = std::min(level, RESOLUTION_SCALE_COUNT-1);
+  const int scale = RESOLUTION_SCALES[scaleIndex];
+  int newStripWidth = windowStripWidth;
+  for (int i=RESOLUTION_SCALE_COUNT-1; i<level; ++i) {
+    newStripWidth *= 2;
+  }
+  setRenderResolution(windowWidth * scale / 100, windowHeight * scale / 100,
+                      newStripWidth);
+  resolutionSettleFrames = RESOLUTION_SETTLE_FRAMES;
+  printf("Render resolution = %d x %d, stripWidth = %d\n",
+         displayWidth, displayHeight, stripWidth);
+}
+
+/*
+Moves one resolution level down when the average frame takes longer than the
+budget, and one level up when it would still fit after the extra pixels.
+Each level has about 20% fewer pixels than the one before, so the frame has to
+be well under budget before going up, otherwise it would flip back and forth.
+*/
+void Game::updateDynamicResolution(float frameMs)
+{
+  if (!dynamicResolution) {
+    return;
+  }
+  averageFrameMs = averageFrameMs ? averageFrameMs*0.9f + frameMs*0.1f
+                                  : frameMs;
+  if (resolutionSettleFrames > 0) {
+    resolutionSettleFrames--;
+    return;
+  }
+  int maxLevel = RESOLUTION_SCALE_COUNT - 1;
+  for (int width=windowStripWidth*2; width<=MAX_STRIP_WIDTH; width*=2) {
+    maxLevel++;
+  }
+  if (averageFrameMs > frameBudgetMs && resolutionLevel < maxLevel) {
+    setResolutionLevel(resolutionLevel + 1);
+  }
+  else if (averageFrameMs < frameBudgetMs*0.6f && resolutionLevel > 0) {
+    setResolutionLevel(resolutionLevel - 1);
   }
+}
 
-  wallsImage.createTexture(renderer);
-  wallsImageDark.createTexture(renderer);
-  gatesImage.createTexture(renderer);
-  gatesOpenImage.createTexture(renderer);
+// Turns the player around once on the spot with mipmaps off and then on,
+// and prints how long the frames took to draw
+void Game::benchmark(int frames)
+{
+  const Sprite startPlayer = world.player;
+  const bool mipmapsWereOn = mipmapsOn;
+  for (int pass=0; pass<2; ++pass) {
+    mipmapsOn = pass == 1;
+    world.player = startPlayer;
+    FramePacer uncapped;
+    uncapped.start();
+    const Uint64 start = SDL_GetPerformanceCounter();
+    for (int i=0; i<frames; ++i) {
+      world.player.rot = startPlayer.rot + TWO_PI * i / frames;
+      streamChunks();
+      savePreviousState();
+      publishWorld(0);
+      draw();
+      SDL_PumpEvents();
+      uncapped.wait();
+    }
+    const double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 /
+                      SDL_GetPerformanceFrequency();
+    printf("mipmaps %-3s: %d frames in %.0f ms, %.2f ms/frame (%.1f fps), "
+           "jitter %.2f ms, longest %.2f ms\n",
+           mipmapsOn ? "on" : "off", frames, ms, ms/frames, frames*1000/ms,
+           uncapped.jitterMs(), uncapped.maxMs());
+  }
+  world.player = startPlayer;
+  mipmapsOn = mipmapsWereOn;
+}
 
-  if (!gunImage.loadBitmap("..\\res\\gun1a.bmp")) {
-    printf("Error loading gun image\n");
+// Runs the ticks of replayFile as fast as they can be drawn, one frame per
+// tick, and prints how long the frames took. The same recording gives the
+// same frames, so the hash of the last one shows whether anything changed.
+void Game::replay()
+{
+  if (!recording.load(replayFile)) {
     return;
   }
-  Uint32 colorKey = SDL_MapRGB(gunImage.getSurface()->format,152,0,136);
-  SDL_SetColorKey( gunImage.getSurface(), true, colorKey );
-  gunImage.createTexture(renderer);
-
-  SDL_SetColorKey( gatesImage.getSurface(), true, colorKey );
-  SDL_SetColorKey( gatesOpenImage.getSurface(), true, colorKey );
-
-  // Load Sprite Images
-  std::map<int,std::string> spriteFilenames;
-  spriteFilenames[ SpriteTypeTree1 ] = "tree.bmp";
-  spriteFilenames[ SpriteTypeTree2 ] = "tree2.bmp";
-  spriteFilenames[ SpriteTypeZombie ] = "zombie.bmp";
-  spriteFilenames[ SpriteTypeSkeleton ] = "skeleton.bmp";
-  spriteFilenames[ SpriteTypeRobot ] = "robot1.bmp";
-  spriteFilenames[ SpriteTypeFrogman ] = "frogman.bmp";
-  spriteFilenames[ SpriteTypeHeroine ] = "heroine.bmp";
-  spriteFilenames[ SpriteTypeDruid ] = "druid.bmp";
-  spriteFilenames[ SpriteTypeProjectile ] = "plasmball.bmp";
-  spriteFilenames[ SpriteTypeProjectileSplash ] = "fireball0.bmp";
-  spriteFilenames[ SpriteTypeGates ] = "gates.bmp";
-  for (std::map<int,std::string>::iterator i=spriteFilenames.begin();
-       i!=spriteFilenames.end(); ++i)
-  {
-    int textureid = i->first;
-    std::string filename = "..\\res\\" + i->second;
-    printf("Loading texture image %s\n", filename.c_str());
-    SurfaceTexture& surfaceTexture = spriteTextures[textureid];
-    if (!surfaceTexture.loadBitmap(filename.c_str())) {
-      printf("Error loading %s\n", filename.c_str());
-      return;
-    }
-    SDL_SetColorKey( surfaceTexture.getSurface(), true, colorKey );
-    surfaceTexture.createTexture(renderer);
+  if (recording.getTickMs() != UPDATE_INTERVAL) {
+    printf("%s was recorded with %d ms ticks, not %d ms\n",
+           replayFile.c_str(), recording.getTickMs(), UPDATE_INTERVAL);
+    return;
   }
+  seed = recording.getSeed();
+  mouseSensitivity = recording.getMouseSensitivity();
+  dynamicResolution = false; // frames stay at the window size
+  reset();
 
-  // Load Floors and Ceiling Images
-  std::map<int,std::string> floorCeilingFilenames;
-  floorCeilingFilenames[ 0 ] = "grass.bmp";
-  floorCeilingFilenames[ 1 ] = "texture1.bmp";
-  floorCeilingFilenames[ 2 ] = "texture2.bmp";
-  floorCeilingFilenames[ 3 ] = "texture3.bmp";
-  floorCeilingFilenames[ 4 ] = "texture4.bmp";
-  floorCeilingFilenames[ 5 ] = "default_brick.bmp";
-  floorCeilingFilenames[ 6 ] = "default_aspen_wood.bmp";
-  floorCeilingFilenames[ 7 ] = "water.bmp";
-  floorCeilingFilenames[ 8 ] = "mossycobble.bmp";
-  floorCeilingBitmaps.resize(floorCeilingFilenames.size());
-  for (std::map<int,std::string>::iterator i=floorCeilingFilenames.begin();
-       i!=floorCeilingFilenames.end(); ++i)
-  {
-    int textureid = i->first;
-    std::string filename = "..\\res\\" + i->second;
-    printf("Loading bitmap image %s\n", filename.c_str());
-    Bitmap& bitmap = floorCeilingBitmaps[textureid];
-    if (!bitmap.load(filename.c_str(), renderer, pf)) {
-      printf("Error loading %s\n", filename.c_str());
-      return;
+  FramePacer uncapped;
+  uncapped.start();
+  const Uint64 start = SDL_GetPerformanceCounter();
+  InputSnapshot input;
+  int ticks = 0;
+  while (recording.next(input)) {
+    update(UPDATE_INTERVAL, input);
+    streamChunks();
+    publishWorld(1);
+    draw();
+    SDL_PumpEvents();
+    uncapped.wait();
+    ticks++;
+  }
+  const double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 /
+                    SDL_GetPerformanceFrequency();
+
+  // FNV-1a of the last frame
+  Uint32 hash = 2166136261u;
+  for (int y=0; y<screenSurface->h; ++y) {
+    const Uint8* row = (const Uint8*) screenSurface->pixels +
+                       y * screenSurface->pitch;
+    for (int x=0; x<screenSurface->w * 4; ++x) {
+      hash = (hash ^ row[x]) * 16777619u;
     }
   }
+  printf("replay: %d ticks in %.0f ms, %.2f ms/frame (%.1f fps), "
+         "jitter %.2f ms, longest %.2f ms\n",
+         ticks, ms, ms/std::max(1, ticks), ticks*1000/std::max(1.0, ms),
+         uncapped.jitterMs(), uncapped.maxMs());
+  printf("replay: player at (%.2f,%.2f,%.2f) rot %.4f, last frame %08x\n",
+         world.player.x, world.player.y, world.player.z, world.player.rot,
+         (unsigned) hash);
+}
 
-  ceilingBitmap.load("..\\res\\texture1.bmp", renderer, pf);
-  skyboxSurface = SDL_LoadBMP("..\\res\\skybox2.bmp");
-
-  if (!skyboxSurface) {
-    printf("Error loading skybox2.bmp\n");
-    return;
-  }
-  skyboxSurface = SDL_ConvertSurface(skyboxSurface, screenSurface->format, 0);
+void Game::draw() {
+  renderFrame();
+  presentFrame();
+}
 
-  //Initialize SDL_mixer
-  if( Mix_OpenAudio( 44100, MIX_DEFAULT_FORMAT, 2, 2048 ) < 0 )
-  {
-    printf( "Mix_OpenAudio failed. SDL_mixer Error: %s\n", Mix_GetError() );
-    return;
+// Draws the published world into screenSurface. Only uses SDL surfaces so
+// it can run on the render thread.
+void Game::renderFrame() {
+  const Uint64 start = SDL_GetPerformanceCounter();
+  frameRayHits.clear();
+  raycastWorld(frameRayHits);
+  drawWorld(frameRayHits);
+  drawWeapon();
+  if (frameRing.isOpen()) {
+    writeFrameRing();
   }
+  renderMs = (SDL_GetPerformanceCounter() - start) * 1000.0f /
+             SDL_GetPerformanceFrequency();
+}
 
-  projectileFireSound = Mix_LoadWAV( "..\\res\\iceball.wav" );
-  projectileExplodeSound = Mix_LoadWAV( "..\\res\\explode.wav" );
-  doorOpenSound = Mix_LoadWAV( "..\\res\\door-09.wav" );
-  doorCloseSound = Mix_LoadWAV( "..\\res\\door-08.wav" );
-  Mix_VolumeChunk(projectileFireSound, MIX_MAX_VOLUME/2);
-  Mix_VolumeChunk(projectileExplodeSound, MIX_MAX_VOLUME/3);
-  Mix_VolumeChunk(doorOpenSound, MIX_MAX_VOLUME);
-  Mix_VolumeChunk(doorCloseSound, MIX_MAX_VOLUME);
+// Copies the frame just drawn into frameRing for other processes
+void Game::writeFrameRing()
+{
+  FrameSlotHeader info;
+  memset(&info, 0, sizeof(info));
+  info.tick = tick;
+  info.playerX = player.x;
+  info.playerY = player.y;
+  info.playerZ = player.z;
+  info.playerRot = player.rot;
+  info.pitch = pitch;
+  info.width = screenSurface->w;
+  info.height = screenSurface->h;
+  const bool withAux = aux && aux->width == screenSurface->w &&
+                       aux->height == screenSurface->h && !aux->depth.empty();
+  frameRing.write(info, screenSurface->pixels, screenSurface->pitch,
+                  withAux ? &aux->depth[0] : NULL,
+                  withAux ? &aux->surface[0] : NULL,
+                  withAux ? &aux->material[0] : NULL);
+}
 
-  this->running = 1 ;
-  printHelp();
-  run();
+/*
+Draws the published world as camera sees it into output, which must be a
+32-bit surface in the same format as screenSurface with no padding between
+rows. Its width should be a whole number of strips. sharedSpriteIndex, if
+not NULL, has to be built from the same sprites as this Game's. The aux
+buffers are filled into auxOutput if it isn't NULL.
+
+The Game's own render size, strip angles, player and pitch are put back
+afterwards. The camera's strip angles are kept for the next output of the
+same width.
+*/
+bool Game::renderCamera(const Camera& camera, SDL_Surface* output,
+                        const SpriteIndex* sharedSpriteIndex,
+                        AuxBuffers* auxOutput)
+{
+  if (output->format->format != screenSurface->format->format ||
+      output->pitch != output->w * 4) {
+    printf("Camera surfaces must be like the screen surface\n");
+    return false;
+  }
+  const int ownWidth = displayWidth;
+  const int ownHeight = displayHeight;
+  const int ownRayCount = rayCount;
+  const float ownViewDist = viewDist;
+  float* ownStripAngles = stripAngles;
+  const Sprite ownPlayer = player;
+  const float ownPitch = pitch;
+  SDL_Surface* ownSurface = screenSurface;
+  AuxBuffers* ownAuxBuffers = aux;
+
+  displayWidth = output->w;
+  displayHeight = output->h;
+  rayCount = displayWidth / stripWidth;
+  viewDist = Raycaster::screenDistance(displayWidth, fovRadians);
+  stripAngles = cameraStripAngles;
+  if (cameraWidth != displayWidth || cameraStripWidth != stripWidth) {
+    createStripAngles(); // replaces cameraStripAngles
+    cameraStripAngles = stripAngles;
+    cameraWidth = displayWidth;
+    cameraStripWidth = stripWidth;
+  }
+  player = world.player;
+  player.x = camera.x;
+  player.y = camera.y;
+  player.z = camera.z;
+  player.rot = camera.rot;
+  pitch = camera.pitch;
+  screenSurface = output;
+  aux = auxOutput;
+  frameRayHits.clear();
+  raycastWorld(frameRayHits, sharedSpriteIndex);
+  drawWorld(frameRayHits);
+
+  displayWidth = ownWidth;
+  displayHeight = ownHeight;
+  rayCount = ownRayCount;
+  viewDist = ownViewDist;
+  stripAngles = ownStripAngles;
+  player = ownPlayer;
+  pitch = ownPitch;
+  screenSurface = ownSurface;
+  aux = ownAuxBuffers;
+  return true;
 }
 
-void Game::draw() {
+// Shows the last rendered frame with the minimap over it
+void Game::presentFrame() {
     // Clear screen
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE );
     SDL_RenderClear(renderer);
 
-    //memset(screenSurface->pixels,0,sizeof(Uint32)*displayWidth*displayHeight);
-
-    static vector<RayHit> allRayHits;
-    allRayHits.clear();
-    raycastWorld(allRayHits);
-    drawWorld(allRayHits);
-    drawWeapon();
     SDL_UpdateTexture(screenTexture, NULL, screenSurface->pixels,
                       screenSurface->pitch);
     SDL_RenderCopy(renderer, screenTexture, NULL, NULL);
     if (drawMiniMapOn) {
       drawMiniMap();
-      drawRays(allRayHits);
+      drawRays(frameRayHits);
       drawPlayer();
       drawMiniMapSprites();
     }
     SDL_RenderPresent(renderer);
+
+    if (frameInputTime) {
+      latencySum += SDL_GetTicks() - frameInputTime;
+      latencyCount++;
+      frameInputTime = 0;
+    }
+}
+
+// Starts drawing the published world, on the render thread if there is one
+void Game::beginRender() {
+  if (renderThread) {
+    renderPending = true;
+    SDL_SemPost(renderStart);
+  }
+  else {
+    renderFrame();
+  }
+}
+
+// Waits for the frame started by beginRender()
+void Game::finishRender() {
+  if (renderPending) {
+    SDL_SemWait(renderDone);
+    renderPending = false;
+  }
+}
+
+int Game::renderThreadMain(void* data) {
+  Game* game = (Game*) data;
+  for (;;) {
+    SDL_SemWait(game->renderStart);
+    if (game->renderThreadQuit) {
+      break;
+    }
+    game->renderFrame();
+    SDL_SemPost(game->renderDone);
+  }
+  return 0;
 }
 
 void Game::stop() {
+    if (renderThread) {
+      finishRender();
+      renderThreadQuit = true;
+      SDL_SemPost(renderStart);
+      SDL_WaitThread(renderThread, NULL);
+      renderThread = NULL;
+      SDL_DestroySemaphore(renderStart);
+      SDL_DestroySemaphore(renderDone);
+      renderStart = renderDone = NULL;
+    }
+    if (frameRing.isOpen()) {
+      printf("Frame ring: %d frames written, %d dropped\n",
+             frameRing.getFramesWritten(), frameRing.getFramesDropped());
+      frameRing.close();
+    }
     if (stripAngles) {
       delete[] stripAngles;
       stripAngles = 0;
     }
+    if (cameraStripAngles) {
+      delete[] cameraStripAngles;
+      cameraStripAngles = 0;
+    }
+    if (NULL != screenSurface) {
+        SDL_FreeSurface(screenSurface);
+        screenSurface = NULL;
+    }
+    if (NULL != screenTexture) {
+        SDL_DestroyTexture(screenTexture);
+        screenTexture = NULL;
+    }
     if (NULL != renderer) {
         SDL_DestroyRenderer(renderer);
         renderer = NULL;
@@ -693,7 +1700,10 @@ void Game::stop() {
         SDL_DestroyWindow(window);
         window = NULL;
     }
-    SDL_Quit() ;
+    if (sdlStarted) {
+        SDL_Quit() ;
+        sdlStarted = false;
+    }
 }
 
 void Game::fillRect(SDL_Rect* rc, int r, int g, int b ) {
@@ -714,7 +1724,7 @@ void Game::drawWeapon() {
   }
   float gunScale = displayHeight / 320.0;
   SDL_Rect dstRect;
-  SDL_Surface* gunSurface = gunImage.getSurface();
+  SDL_Surface* gunSurface = assets.gunImage.getSurface();
   dstRect.w = gunSurface->w * gunScale;
   dstRect.h = gunSurface->h * gunScale;
   dstRect.x = (displayWidth - dstRect.w) / 2;
@@ -723,58 +1733,123 @@ void Game::drawWeapon() {
 }
 
 void Game::fpsChanged( int fps ) {
-    char szFps[ 128 ] ;
-    sprintf( szFps, "FPS=%d   rayHits=%d   Cell=(%d,%d,%d) Rot=(%d deg)",
-     fps, rayHitsCount,
+    char szFps[ 256 ] ;
+    sprintf( szFps, "FPS=%d   frame=%.2f+-%.2f ms   latency=%.0f ms   "
+     "%dx%d   rays=%d/%d   rayHits=%d   Cell=(%d,%d,%d) Rot=(%d deg)",
+     fps, framePacer.averageMs(), framePacer.jitterMs(),
+     latencyCount ? latencySum / latencyCount : 0.0,
+     displayWidth, displayHeight, gridRaysCast, rayCount, rayHitsCount,
      (int)(player.x/TILE_SIZE), (int)(player.y/TILE_SIZE),
      (int)(player.z/TILE_SIZE),
      (int)(player.rot*(180/M_PI))
     );
     SDL_SetWindowTitle(window, szFps);
+    framePacer.resetStats();
+    latencySum = 0;
+    latencyCount = 0;
 }
 
 void Game::onQuit() {
     running = 0 ;
 }
 
+/*
+The simulation always advances in ticks of UPDATE_INTERVAL ms, however long
+frames take to draw. Ticks run while the last published frame is drawn on the
+render thread. Once it is done it is shown, events are handled and the world
+is published again, placed between the last two ticks by how much time is
+left over.
+*/
 void Game::run() {
-    int past = SDL_GetTicks();
-    int now = past, pastFps = past ;
-    int fps = 0, framesSkipped = 0 ;
+    const double countsPerMs = SDL_GetPerformanceFrequency() / 1000.0;
+    Uint64 past = SDL_GetPerformanceCounter();
+    double lag = 0; // ms not simulated yet
+    int pastFps = SDL_GetTicks();
+    int fps = 0 ;
     SDL_Event event ;
+    beginRender();
+    framePacer.start();
     while ( running ) {
-        int timeElapsed = 0 ;
-        if (SDL_PollEvent(&event)) {
-            switch (event.type) {
-                case SDL_QUIT:    onQuit();            break;
-                case SDL_KEYDOWN: onKeyDown( &event ); break ;
-                case SDL_KEYUP:   onKeyUp( &event );   break ;
-                case SDL_MOUSEBUTTONDOWN:
-                case SDL_MOUSEBUTTONUP:
-                case SDL_MOUSEMOTION:
-                    break ;
-            }
-        }
-        // update/draw
-        timeElapsed = (now=SDL_GetTicks()) - past ;
-        if ( timeElapsed >= UPDATE_INTERVAL  ) {
-            past = now ;
-            update(timeElapsed);
-            if ( framesSkipped++ >= frameSkip ) {
-                draw();
-                ++fps ;
-                framesSkipped = 0 ;
+        // update
+        const Uint64 now = SDL_GetPerformanceCounter();
+        lag += (now - past) / countsPerMs;
+        past = now;
+        lag = std::min(lag, (double) MAX_TICKS_PER_FRAME * UPDATE_INTERVAL);
+        while (lag >= UPDATE_INTERVAL) {
+            const InputSnapshot input = takeInput();
+            if (recordFile.size()) {
+              recording.add(input);
             }
+            update(UPDATE_INTERVAL, input);
+            lag -= UPDATE_INTERVAL;
         }
-        // fps
-        if ( now - pastFps >= 1000 ) {
-            pastFps = now ;
+
+        // draw
+        finishRender();
+        presentFrame();
+        updateDynamicResolution(renderMs);
+        ++fps ;
+        const int ticks = SDL_GetTicks();
+        if ( ticks - pastFps >= 1000 ) {
+            pastFps = ticks ;
             fpsChanged( fps );
             fps = 0 ;
         }
-        // sleep?
-//        SDL_Delay( 1 );
+
+        // Nothing is being drawn until beginRender(), so events and
+        // streaming can change the level
+        while (SDL_PollEvent(&event)) {
+            handleEvent(event);
+        }
+        usePendingDoor();
+        streamChunks();
+        publishWorld(lag / UPDATE_INTERVAL);
+        beginRender();
+
+        // Sleep until the next frame is due while the render thread works
+        framePacer.wait();
     }
+    finishRender();
+}
+
+// Only positions are interpolated. Sprites added since are drawn where they
+// are.
+void Game::savePreviousState() {
+  const Sprite& player = world.player;
+  const TickPosition position = { player.x, player.y, player.z, player.rot };
+  previousPlayer = position;
+  const vector<Sprite>& sprites = world.sprites;
+  previousSprites.resize(sprites.size());
+  for (size_t i=0; i<sprites.size(); ++i) {
+    const Sprite& sprite = sprites[i];
+    const TickPosition position = { sprite.x, sprite.y, sprite.z, sprite.rot };
+    previousSprites[i] = position;
+  }
+}
+
+// Copies the world to what is drawn, alpha of the way from the previous tick
+// to the current one
+void Game::publishWorld(float alpha) {
+  frameInputTime = tickedInputTime;
+  tickedInputTime = 0;
+
+  player = world.player;
+  player.x = previousPlayer.x + (player.x - previousPlayer.x) * alpha;
+  player.y = previousPlayer.y + (player.y - previousPlayer.y) * alpha;
+  player.z = previousPlayer.z + (player.z - previousPlayer.z) * alpha;
+  player.rot = previousPlayer.rot + (player.rot - previousPlayer.rot) * alpha;
+  pitch = floor(world.pitch * displayHeight / (2*MAX_PITCH) + 0.5f);
+  tick = world.tick;
+
+  sprites = world.sprites;
+  const size_t count = std::min(sprites.size(), previousSprites.size());
+  for (size_t i=0; i<count; ++i) {
+    Sprite& sprite = sprites[i];
+    const TickPosition& previous = previousSprites[i];
+    sprite.x = previous.x + (sprite.x - previous.x) * alpha;
+    sprite.y = previous.y + (sprite.y - previous.y) * alpha;
+    sprite.z = previous.z + (sprite.z - previous.z) * alpha;
+  }
 }
 
 void Game::printHelp() {
@@ -795,54 +1870,66 @@ void Game::printHelp() {
          "C      - Toggle skybox and ceilings\n"
          "G      - Toggle weapon visibility\n"
          "F      - Toggle fog\n"
+         "Tab    - Toggle mouse look\n"
          "H      - Print this message again\n"
          "See config.ini for more settings.\n"
          "=====================================\n");
 }
 
-void Game::update(float timeElapsed) {
-  const Uint8* keyboard = SDL_GetKeyboardState(NULL);
+bool needsCleanUp (const Sprite& sprite) {
+  return sprite.cleanup;
+}
 
-  if (keyboard[SDL_SCANCODE_UP] || keyboard[SDL_SCANCODE_W]) {
-    // up, move player forward
-    player.speed = 1;
-  }
-  else if (keyboard[SDL_SCANCODE_DOWN] || keyboard[SDL_SCANCODE_S]) {
-    // down, move player backward
-    player.speed = -1;
-  }
-  else {
-    player.speed = 0; // stop moving
+void Game::update(float timeElapsed, const InputSnapshot& input) {
+  if (input.reset) {
+    finishRender(); // reset() changes cells
+    reset();
+    if (!quiet) {
+      printf("Game reset!\n");
+    }
   }
+  Sprite& player = world.player; // only the simulation state is updated
+  float& pitch = world.pitch;
+  world.tick++;
 
-  if (keyboard[SDL_SCANCODE_LEFT] || keyboard[SDL_SCANCODE_A]) {
-    // left, rotate player left
-    player.dir = -1;
-  }
-  else if (keyboard[SDL_SCANCODE_RIGHT] || keyboard[SDL_SCANCODE_D]) {
-    // right, rotate player right
-    player.dir = 1;
+  if (input.face == INPUT_FACE_EAST) {
+    if (!quiet) {
+      printf("Rotation set to 0\n");
+    }
+    player.rot = 0;
   }
-  else {
-    player.dir = 0; // stop rotating
+  else if (input.face == INPUT_FACE_WEST) {
+    if (!quiet) {
+      printf("Rotation set to pi degrees\n");
+    }
+    player.rot = M_PI;
   }
 
+  player.speed = input.move;
+  player.dir = input.turn;
+  player.rot -= input.mouseX * mouseSensitivity;
+
   float timeBasedFactor = timeElapsed / UPDATE_INTERVAL;
-  static const float MAX_PITCH = displayHeight/2;
   const int PITCH_SPEED = 10 * timeBasedFactor;
 
-  if (keyboard[SDL_SCANCODE_PAGEDOWN]) {
+  if (input.mouseY) {
+    pitch = std::max(-MAX_PITCH, std::min(pitch - input.mouseY, MAX_PITCH));
+  }
+  else if (input.look < 0) {
     pitch -= PITCH_SPEED;
     if (pitch < -MAX_PITCH) {
       pitch = -MAX_PITCH;
     }
   }
-  else if (keyboard[SDL_SCANCODE_PAGEUP]) {
+  else if (input.look > 0) {
     pitch += PITCH_SPEED;
     if (pitch > MAX_PITCH) {
       pitch = MAX_PITCH;
     }
   }
+  else if (input.mouseLook) {
+    // Mouse look keeps the pitch where it was left
+  }
   else if (pitch<0) {
     pitch += PITCH_SPEED;
     if (pitch > 0) {
@@ -855,7 +1942,36 @@ void Game::update(float timeElapsed) {
       pitch = 0;
     }
   }
-  updatePlayer(timeElapsed);
+
+  // Sprites are only removed before the snapshot, so sprites in both keep
+  // the same index. Sprites added during the tick go on the end.
+  vector<Sprite>& sprites = world.sprites;
+  sprites.erase( remove_if(sprites.begin(), sprites.end(), needsCleanUp),
+                 sprites.end() );
+  savePreviousState();
+
+  if (input.jump && !player.jumping) {
+    player.jumping = true;
+  }
+  if (input.fire) {
+    playSound(assets.projectileFireSound);
+    addProjectile(SpriteTypeProjectile, player.x, player.y, player.z,
+                  TILE_SIZE, player.rot);
+  }
+  if (input.use) {
+    // usePendingDoor() toggles the door first, unless a reset undid it
+    if (!pendingUseDone || input.reset) {
+      // Doors are cells, which the render thread reads
+      finishRender();
+      toggleDoorPressed();
+    }
+    pendingUseDone = false;
+  }
+  if (input.timestamp && !tickedInputTime) {
+    tickedInputTime = input.timestamp;
+  }
+
+  updatePlayer(timeElapsed, input);
   updateProjectiles(timeElapsed);
 }
 
@@ -863,13 +1979,16 @@ void Game::drawMiniMap() {
   SDL_Rect miniMapRect;
   miniMapRect.x = 0;
   miniMapRect.y = MINIMAP_Y ;
-  miniMapRect.w = MAP_WIDTH * MINIMAP_SCALE;
-  miniMapRect.h = MAP_HEIGHT * MINIMAP_SCALE;
+  miniMapRect.w = mapWidth * MINIMAP_SCALE;
+  miniMapRect.h = mapHeight * MINIMAP_SCALE;
   fillRect(&miniMapRect, 0, 0, 0);
 
-  for (int y=0; y<MAP_HEIGHT; ++y) {
-    for (int x=0; x<MAP_WIDTH; ++x) {
-      if (g_map[y][x]>0) {
+  // Large maps are cut off at the edge of the screen
+  const int cellsDown = std::min(mapHeight, windowHeight / MINIMAP_SCALE);
+  const int cellsAcross = std::min(mapWidth, windowWidth / MINIMAP_SCALE);
+  for (int y=0; y<cellsDown; ++y) {
+    for (int x=0; x<cellsAcross; ++x) {
+      if (raycaster3D.cellAt(x, y)>0) {
         SDL_Rect rc;
         rc.x = x * MINIMAP_SCALE;
         rc.y = y * MINIMAP_SCALE;
@@ -882,8 +2001,8 @@ void Game::drawMiniMap() {
   }
 }
 
-void Game::updatePlayer(float elapsedTime) {
-  const Uint8 *state = SDL_GetKeyboardState(NULL);
+void Game::updatePlayer(float elapsedTime, const InputSnapshot& input) {
+  Sprite& player = world.player; // only the simulation state is updated
 
   float timeBasedFactor = elapsedTime / UPDATE_INTERVAL;
   float moveStep = player.speed * player.moveSpeed * timeBasedFactor;
@@ -894,8 +2013,8 @@ void Game::updatePlayer(float elapsedTime) {
 
   float strafeMagnitude = 0;
   float strafeRotation = 0;
-  bool strafeLeft = state[SDL_SCANCODE_Q];
-  bool strafeRight = state[SDL_SCANCODE_E];
+  bool strafeLeft = input.strafe < 0;
+  bool strafeRight = input.strafe > 0;
 
   // Strafing left/right is just adding/subtracting 90 degrees to the
   // player's rotation
@@ -923,8 +2042,10 @@ void Game::updatePlayer(float elapsedTime) {
     else if (player.heightJumped<MAX_JUMP_DISTANCE) {
       player.heightJumped += jumpSpeed;
       newZ -= jumpSpeed;
-      if (newZ<0) {
-        newZ = 0;
+      const float groundHeight = terrain.empty() ? 0.0f :
+                                 terrain.heightAt(newX, newY);
+      if (newZ<groundHeight) {
+        newZ = groundHeight;
         player.jumping = false;
         player.heightJumped = 0;
       }
@@ -993,20 +2114,13 @@ void Game::updatePlayer(float elapsedTime) {
   }
 }
 
-bool needsCleanUp (const Sprite& sprite) {
-  return sprite.cleanup;
-}
-
 bool isKillableSprite(int textureid) {
   return textureid >= 3 && textureid <= 8;
 }
 
 void Game::updateProjectiles(float timeElapsed) {
-
-  sprites.erase( remove_if(sprites.begin(), sprites.end(), needsCleanUp),
-                 sprites.end() );
-
-
+  vector<Sprite>& sprites = world.sprites; // see update()
+  const Sprite& player = world.player;
   float timeBasedFactor = timeElapsed / UPDATE_INTERVAL;
   float projectileSpeed = player.moveSpeed * 3 * timeBasedFactor;
   float moveStep = 1 * projectileSpeed;
@@ -1070,7 +2184,7 @@ void Game::updateProjectiles(float timeElapsed) {
           addProjectile(SpriteTypeProjectileSplash, projectile.x, projectile.y,
                         projectile.z,
                         TILE_SIZE, projectile.rot);
-          Mix_PlayChannel( -1, projectileExplodeSound, 0 );
+          playSound(assets.projectileExplodeSound);
         }
         projectile.cleanup = true;
         wallHit = true;
@@ -1079,8 +2193,8 @@ void Game::updateProjectiles(float timeElapsed) {
 
     if (wallHit) {
     }
-    else if (newX<0 || newX>MAP_WIDTH*TILE_SIZE ||
-             newY<0 || newY>MAP_HEIGHT*TILE_SIZE) {
+    else if (newX<0 || newX>mapWidth*TILE_SIZE ||
+             newY<0 || newY>mapHeight*TILE_SIZE) {
       outOfBounds = true;
       projectile.cleanup = true;
     }
@@ -1103,7 +2217,7 @@ void Game::updateProjectiles(float timeElapsed) {
               addProjectile(SpriteTypeProjectileSplash, projectile.x,
                             projectile.y, projectile.z, TILE_SIZE,
                             projectile.rot);
-              Mix_PlayChannel( -1, projectileExplodeSound, 0 );
+              playSound(assets.projectileExplodeSound);
             }
           }
         }
@@ -1121,40 +2235,51 @@ void Game::updateProjectiles(float timeElapsed) {
 float Game::slopeHeightAt(float worldX, float worldY)
 {
   if (worldX<0 || worldY<0 ||
-      worldX>=TILE_SIZE*MAP_WIDTH || worldY>=TILE_SIZE*MAP_HEIGHT )
+      worldX>=TILE_SIZE*mapWidth || worldY>=TILE_SIZE*mapHeight )
   {
     return 0.0f;
   }
-  for (size_t i=0; i<slopedWalls.size(); ++i) {
-    ThickWall* slopedWall = slopedWalls[i];
-    if (slopedWall->containsPoint(worldX, worldY) && !slopedWall->invertedSlope)
+  // Slopes and walls stand on the terrain's base level, so whichever is
+  // higher is the ground
+  const float terrainHeight = terrain.empty() ? 0.0f :
+                              terrain.heightAt(worldX, worldY);
+  int count;
+  const ThickWallIndex::Entry* entries = thickWallIndex.entriesAt(worldX,
+                                                                  worldY,
+                                                                  count);
+  for (int i=0; i<count; ++i) {
+    ThickWall* slopedWall = entries[i].thickWall;
+    if (slopedWall->slopeType && !slopedWall->invertedSlope &&
+        entries[i].contains(worldX, worldY))
     {
       float floorX = worldX - slopedWall->x;
       float floorY = worldY - slopedWall->y;
       if (slopedWall->slopeType == SLOPE_TYPE_WEST_EAST) {
-        return slopedWall->startHeight + slopedWall->slope * floorX;
+        return std::max(terrainHeight,
+                        slopedWall->startHeight + slopedWall->slope * floorX);
       }
       if (slopedWall->slopeType == SLOPE_TYPE_NORTH_SOUTH) {
-        return slopedWall->startHeight + slopedWall->slope * floorY;
+        return std::max(terrainHeight,
+                        slopedWall->startHeight + slopedWall->slope * floorY);
       }
     }
   }
   int cellX = worldX / TILE_SIZE;
   int cellY = worldY / TILE_SIZE;
   if (raycaster3D.safeCellAt(cellX, cellY, 0, 0)) {
-    return TILE_SIZE;
+    return std::max(terrainHeight, (float)TILE_SIZE);
   }
-  return 0.0f;
+  return terrainHeight;
 }
 
 void Game::drawPlayer() {
   SDL_Rect playerRect;
 
-  float playerX =  (float)player.x / (MAP_WIDTH*TILE_SIZE) * 100;
-  playerX = playerX/100 * MINIMAP_SCALE * MAP_WIDTH;
+  float playerX =  (float)player.x / (mapWidth*TILE_SIZE) * 100;
+  playerX = playerX/100 * MINIMAP_SCALE * mapWidth;
 
-  float playerY =  (float)player.y / (MAP_HEIGHT*TILE_SIZE) * 100;
-  playerY = playerY/100 * MINIMAP_SCALE * MAP_HEIGHT;
+  float playerY =  (float)player.y / (mapHeight*TILE_SIZE) * 100;
+  playerY = playerY/100 * MINIMAP_SCALE * mapHeight;
 
   playerRect.x = playerX - 2 ;
   playerRect.y = playerY - 2 + MINIMAP_Y;
@@ -1172,11 +2297,11 @@ void Game::drawMiniMapSprites() {
   for (vector<Sprite>::iterator it=sprites.begin(); it!=sprites.end(); ++it)
   {
     Sprite* sprite = &*it;
-    float spriteX =  (float)sprite->x / (MAP_WIDTH*TILE_SIZE) * 100;
-    spriteX = spriteX/100 * MINIMAP_SCALE * MAP_WIDTH;
+    float spriteX =  (float)sprite->x / (mapWidth*TILE_SIZE) * 100;
+    spriteX = spriteX/100 * MINIMAP_SCALE * mapWidth;
 
-    float spriteY =  (float)sprite->y / (MAP_HEIGHT*TILE_SIZE) * 100;
-    spriteY = spriteY/100 * MINIMAP_SCALE * MAP_HEIGHT;
+    float spriteY =  (float)sprite->y / (mapHeight*TILE_SIZE) * 100;
+    spriteY = spriteY/100 * MINIMAP_SCALE * mapHeight;
 
     SDL_Rect rc;
     rc.x = spriteX - 2 ;
@@ -1189,16 +2314,16 @@ void Game::drawMiniMapSprites() {
 }
 
 void Game::drawRay(float rayX, float rayY) {
-  float playerX =  (float)player.x / (MAP_WIDTH*TILE_SIZE) * 100;
-  playerX = playerX/100 * MINIMAP_SCALE * MAP_WIDTH;
+  float playerX =  (float)player.x / (mapWidth*TILE_SIZE) * 100;
+  playerX = playerX/100 * MINIMAP_SCALE * mapWidth;
 
-  float playerY =  (float)player.y / (MAP_HEIGHT*TILE_SIZE) * 100;
-  playerY = playerY/100 * MINIMAP_SCALE * MAP_HEIGHT;
+  float playerY =  (float)player.y / (mapHeight*TILE_SIZE) * 100;
+  playerY = playerY/100 * MINIMAP_SCALE * mapHeight;
 
-  rayX = rayX / (MAP_WIDTH*TILE_SIZE) * 100.0;
-  rayX = rayX/100.0 * MINIMAP_SCALE * MAP_WIDTH;
-  rayY = rayY / (MAP_HEIGHT*TILE_SIZE) * 100.0;
-  rayY = rayY/100.0 * MINIMAP_SCALE * MAP_HEIGHT;
+  rayX = rayX / (mapWidth*TILE_SIZE) * 100.0;
+  rayX = rayX/100.0 * MINIMAP_SCALE * mapWidth;
+  rayY = rayY / (mapHeight*TILE_SIZE) * 100.0;
+  rayY = rayY/100.0 * MINIMAP_SCALE * mapHeight;
 
   drawLine(playerX, playerY+MINIMAP_Y, rayX, rayY+MINIMAP_Y,0,100,0,0.3*255);
 }
@@ -1248,6 +2373,237 @@ void Game::fogWallStrip( SDL_Rect* dstrect, float distance ) {
   }
 }
 
+// Marks one row of a strip in the aux buffers
+void Game::writeAux(int dstPixel, float depth, int surface, int material)
+{
+  for (int i=0; i<stripWidth; ++i) {
+    aux->depth[dstPixel+i] = depth;
+    aux->surface[dstPixel+i] = surface;
+    aux->material[dstPixel+i] = material;
+  }
+}
+
+void Game::writeAuxRect(const SDL_Rect& rect, float depth, int surface,
+                        int material)
+{
+  const int left = std::max(0, (int)rect.x);
+  const int right = std::min(displayWidth, rect.x + rect.w);
+  const int top = std::max(0, (int)rect.y);
+  const int bottom = std::min(displayHeight, rect.y + rect.h);
+  for (int y=top; y<bottom; ++y) {
+    const int row = y * displayWidth;
+    std::fill(&aux->depth[row+left], &aux->depth[row+right], depth);
+    std::fill(&aux->surface[row+left], &aux->surface[row+right], surface);
+    std::fill(&aux->material[row+left], &aux->material[row+right], material);
+  }
+}
+
+// Marks what SDL_BlitScaled() of srcRect, or all of src if NULL, onto
+// dstRect drew over, which leaves out the pixels of src's color key
+void Game::writeAuxBlit(SDL_Surface* src, const SDL_Rect* srcRect,
+                        const SDL_Rect& dstRect, float depth, int surface,
+                        int material)
+{
+  Uint32 colorKey;
+  if (SDL_GetColorKey(src, &colorKey) || src->format->BytesPerPixel != 4) {
+    writeAuxRect(dstRect, depth, surface, material);
+    return;
+  }
+  if (dstRect.w <= 0 || dstRect.h <= 0) {
+    return;
+  }
+  SDL_Rect from = { 0, 0, src->w, src->h };
+  if (srcRect) {
+    from = *srcRect;
+  }
+  const Uint32 colorMask = ~src->format->Amask;
+  colorKey &= colorMask;
+  const int left = std::max(0, (int)dstRect.x);
+  const int right = std::min(displayWidth, dstRect.x + dstRect.w);
+  const int top = std::max(0, (int)dstRect.y);
+  const int bottom = std::min(displayHeight, dstRect.y + dstRect.h);
+  for (int y=top; y<bottom; ++y) {
+    const int srcY = from.y + (y - dstRect.y) * from.h / dstRect.h;
+    if (srcY < 0 || srcY >= src->h) {
+      continue;
+    }
+    const Uint32* srcRow = (const Uint32*)((const Uint8*) src->pixels +
+                                           srcY * src->pitch);
+    for (int x=left; x<right; ++x) {
+      const int srcX = from.x + (x - dstRect.x) * from.w / dstRect.w;
+      if (srcX < 0 || srcX >= src->w ||
+          (srcRow[srcX] & colorMask) == colorKey) {
+        continue;
+      }
+      const int dstPixel = x + y * displayWidth;
+      aux->depth[dstPixel] = depth;
+      aux->surface[dstPixel] = surface;
+      aux->material[dstPixel] = material;
+    }
+  }
+}
+
+// Covers the strip of a ray that reached a chunk which isn't loaded yet,
+// from the ground up to the highest ceiling
+void Game::drawFogStrip(RayHit& rayHit)
+{
+  const int wallScreenHeight = Raycaster::stripScreenHeight(viewDist,
+                                                        rayHit.correctDistance,
+                                                        TILE_SIZE);
+  const int playerScreenZ = Raycaster::stripScreenHeight(viewDist,
+                                                       rayHit.correctDistance,
+                                                       player.z);
+  const int bottom = (displayHeight+wallScreenHeight)/2 + playerScreenZ +pitch;
+  const int top = bottom - wallScreenHeight * highestCeilingLevel;
+  SDL_Rect rc;
+  rc.x = rayHit.strip * stripWidth;
+  rc.y = std::max(top, 0);
+  rc.w = stripWidth;
+  rc.h = std::min(bottom, displayHeight) - rc.y;
+  if (rc.h <= 0) {
+    return;
+  }
+  SDL_FillRect(screenSurface, &rc,
+               SDL_MapRGB(screenSurface->format, FOG_R, FOG_G, FOG_B));
+  if (aux) {
+    writeAuxRect(rc, rayHit.correctDistance, AUX_FOG, 0);
+  }
+}
+
+/*
+Voxel space style terrain. Samples are taken front to back along the ray and
+each one only fills the rows above everything filled before it, the y-buffer,
+so every terrain pixel is written once and hidden terrain costs nothing. Rows
+between two samples are textured from positions in between them.
+
+Pixels are written to terrainPixels first. The rows are handed to drawWorld()
+as RayHits that each cover half a tile of the ray, so walls and sprites are
+sorted against terrain the same way they are sorted against each other.
+*/
+void Game::raycastTerrain(vector<RayHit>& rayHits, int strip, float stripAngle)
+{
+  terrainPixels.resize(rayCount * displayHeight);
+  if (aux) {
+    terrainDepths.resize(rayCount * displayHeight);
+    terrainMaterials.resize(rayCount * displayHeight);
+  }
+
+  const float rayAngle = player.rot + stripAngle;
+  const float dirX = cosine(rayAngle);
+  const float dirY = -sine(rayAngle);
+  const float cosFactor = cos(stripAngle);
+  const float eyeY = TILE_SIZE/2 + player.z;
+  const float horizon = displayHeight/2 + pitch;
+  const float maxDistance = terrainViewDistance * TILE_SIZE;
+  const float maxX = mapWidth * TILE_SIZE;
+  const float maxY = mapHeight * TILE_SIZE;
+  const float bandLength = TILE_SIZE/2;
+  const float nearestStep = TILE_SIZE/16.0f;
+
+  int yBuffer = displayHeight; // rows from here down are filled
+  int bandBottom = yBuffer;
+  float bandStart = 0;
+  float prevDistance = 0;
+  float distance = nearestStep;
+  while (distance < maxDistance && yBuffer > 0) {
+    const float worldX = player.x + distance * dirX;
+    const float worldY = player.y + distance * dirY;
+    const bool outside = worldX < 0 || worldY < 0 ||
+                         worldX >= maxX || worldY >= maxY;
+    const float height = outside ? 0 : terrain.heightAt(worldX, worldY);
+    const float rowF = horizon + (eyeY-height) * viewDist /
+                                 (distance*cosFactor);
+    const int top = std::max(0, (int)ceil(rowF));
+    if (!outside && top < yBuffer) {
+      // Spread the rows from the previous sample to this one
+      const float rowDistance = (distance - prevDistance) /
+                                std::max(1, yBuffer - top);
+      float d = distance;
+      for (int y=top; y<yBuffer; ++y, d-=rowDistance) {
+        const float x = player.x + d * dirX;
+        const float z = player.y + d * dirY;
+        const int cellX = (int)x / TILE_SIZE;
+        const int cellY = (int)z / TILE_SIZE;
+        Uint32 pixel = 0;
+        const int textureID = floorTypeAt(cellX, cellY);
+        if (textureID >= 0 &&
+            textureID < (int)assets.floorCeilingBitmaps.size()) {
+          Bitmap& bitmap = assets.floorCeilingBitmaps[ textureID ];
+          if (bitmap.getPixels()) {
+            const int level = std::min(floorMipLevel(d),
+                                       bitmap.getMipLevels()-1);
+            const int textureX = ((int)x % TILE_SIZE * TEXTURE_SIZE /
+                                  TILE_SIZE) >> level;
+            const int textureY = ((int)z % TILE_SIZE * TEXTURE_SIZE /
+                                  TILE_SIZE) >> level;
+            pixel = bitmap.getMipPixels(level)[
+                      bitmap.pixelIndex(level, textureX, textureY)];
+          }
+        }
+        if (fogOn) {
+          pixel = fogPixel(pixel, d);
+        }
+        terrainPixels[strip + y * rayCount] = pixel;
+        if (aux) {
+          terrainDepths[strip + y * rayCount] = d * cosFactor;
+          terrainMaterials[strip + y * rayCount] = textureID;
+        }
+      }
+      yBuffer = top;
+    }
+    prevDistance = distance;
+
+    // Further samples cover fewer rows so they can be further apart
+    distance += std::max(nearestStep, distance / 100);
+
+    if (distance - bandStart >= bandLength || distance >= maxDistance ||
+        yBuffer <= 0 || outside) {
+      if (yBuffer < bandBottom) {
+        RayHit rayHit(worldX, worldY, rayAngle);
+        rayHit.strip = strip;
+        rayHit.terrain = true;
+        rayHit.terrainTop = yBuffer;
+        rayHit.terrainBottom = bandBottom;
+        rayHit.distance = prevDistance;
+        rayHit.sortdistance = prevDistance;
+        rayHit.correctDistance = prevDistance * cosFactor;
+        rayHits.push_back(rayHit);
+      }
+      bandBottom = yBuffer;
+      bandStart = prevDistance;
+    }
+    if (outside) {
+      break;
+    }
+  }
+}
+
+void Game::drawTerrainStrip(RayHit& rayHit)
+{
+  Uint32* screenPixels = (Uint32*) screenSurface->pixels;
+  const Uint32* src = &terrainPixels[rayHit.strip];
+  const int screenX = rayHit.strip * stripWidth;
+  for (int y=rayHit.terrainTop; y<rayHit.terrainBottom; ++y) {
+    const Uint32 pixel = src[y * rayCount];
+    const int dstPixel = screenX + y * displayWidth;
+    switch (stripWidth) {
+      case 4:
+        screenPixels[dstPixel+3] = pixel;
+      case 3:
+        screenPixels[dstPixel+2] = pixel;
+      case 2:
+        screenPixels[dstPixel+1] = pixel;
+      default:
+        screenPixels[dstPixel] = pixel;
+        break;
+    }
+    if (aux) {
+      writeAux(dstPixel, terrainDepths[rayHit.strip + y * rayCount],
+               AUX_FLOOR, terrainMaterials[rayHit.strip + y * rayCount]);
+    }
+  }
+}
+
 void Game::drawFloor(vector<RayHit>& rayHits)
 {
   // If floor texture mapping off, just draw a solid color
@@ -1268,8 +2624,8 @@ void Game::drawFloor(vector<RayHit>& rayHits)
   for (int i=0; i<(int)rayHits.size(); ++i) {
     RayHit& rayHit = rayHits[i];
 
-    // Must be a wall, not a sprite
-    if (!rayHit.wallType) {
+    // Must be a wall or fog, not a sprite
+    if (!rayHit.wallType && !rayHit.fog) {
       continue;
     }
 
@@ -1279,7 +2635,7 @@ void Game::drawFloor(vector<RayHit>& rayHits)
     }
 
     // Ignore doors
-    if (Raycaster::isDoor(rayHit.wallType)) {
+    if (isDoorHit(rayHit)) {
       continue;
     }
 
@@ -1325,43 +2681,110 @@ void Game::drawFloor(vector<RayHit>& rayHits)
       int y = (int)(yEnd*textureRepeat) % TILE_SIZE;
       int tileX = xEnd / TILE_SIZE;
       int tileY = yEnd / TILE_SIZE;
-      if ( x<0 || y<0 || tileX >= MAP_WIDTH || tileY >= MAP_HEIGHT ) {
+      if ( x<0 || y<0 || tileX >= mapWidth || tileY >= mapHeight ) {
         continue;
       }
-      int floorTileType = g_floormap[ tileY ][ tileX ];
-      bool wallTextureExists = floorTileType>=0 &&
-                               floorTileType<(int)floorCeilingBitmaps.size();
+      int floorTileType = floorTypeAt(tileX, tileY);
+      const int bitmapCount = assets.floorCeilingBitmaps.size();
+      bool wallTextureExists = floorTileType>=0 && floorTileType<bitmapCount;
       if (!wallTextureExists) {
         continue;
       }
-      Bitmap& bitmap = floorCeilingBitmaps[ floorTileType ];
-      Uint32* pix = (Uint32*)bitmap.getPixels();
-      if (!pix) {
+      Bitmap& bitmap = assets.floorCeilingBitmaps[ floorTileType ];
+      if (!bitmap.getPixels()) {
         continue;
       }
-      int textureX = (float) x / TILE_SIZE * TEXTURE_SIZE;
-      int textureY = (float) y / TILE_SIZE * TEXTURE_SIZE;
+      const int level = std::min(floorMipLevel(diagonalDistance*textureRepeat),
+                                 bitmap.getMipLevels()-1);
+      Uint32* pix = bitmap.getMipPixels(level);
+      int textureX = (int)((float) x / TILE_SIZE * TEXTURE_SIZE) >> level;
+      int textureY = (int)((float) y / TILE_SIZE * TEXTURE_SIZE) >> level;
       int dstPixel = screenX + (screenY+pitch) * displayWidth;
-      int srcPixel = textureY * bitmap.getWidth() + textureX;
+      int srcPixel = bitmap.pixelIndex(level, textureX, textureY);
       bool pixelOK = srcPixel>=0 && dstPixel>=0 &&
-                     srcPixel<bitmap.getWidth()*bitmap.getHeight() &&
+                     srcPixel<bitmap.getMipWidth(level) *
+                              bitmap.getMipHeight(level) &&
                      dstPixel<displayWidth*displayHeight;
 
-      if (pixelOK) {
-        Uint32 srcPixelValue = pix[srcPixel];
-        if (fogOn) {
-          srcPixelValue = fogPixel(srcPixelValue, diagonalDistance);
+      if (pixelOK) {
+        Uint32 srcPixelValue = pix[srcPixel];
+        if (fogOn) {
+          srcPixelValue = fogPixel(srcPixelValue, diagonalDistance);
+        }
+        switch (stripWidth) {
+          case 4:
+            screenPixels[dstPixel+3] = srcPixelValue;
+          case 3:
+            screenPixels[dstPixel+2] = srcPixelValue;
+          case 2:
+            screenPixels[dstPixel+1] = srcPixelValue;
+          default:
+            screenPixels[dstPixel] = srcPixelValue;
+            break;
+        }
+        if (aux) {
+          writeAux(dstPixel, straightDistance, AUX_FLOOR, floorTileType);
+        }
+      }
+    }
+  }
+}
+
+// Fills each column of the screen with the skybox from the top down to
+// skyboxColumnTops. Rows are written left to right from a row of the
+// skybox, through per column offsets that only change with rotation.
+void Game::drawSkybox()
+{
+  const int PIXEL_LENGTH = SKYBOX_WIDTH * SKYBOX_HEIGHT;
+  if ((int)skyboxRowOffsets.size() != displayHeight) {
+    skyboxRowOffsets.resize(displayHeight);
+    for (int screenY=0; screenY<displayHeight; ++screenY) {
+      int skyboxY = (screenY / (displayHeight/2.0f) * SKYBOX_HEIGHT);
+      // Rows below the skybox repeat its last pixel
+      skyboxRowOffsets[screenY] = skyboxY < SKYBOX_HEIGHT ?
+                                  skyboxY * SKYBOX_WIDTH : -1;
+    }
+  }
+
+  // Every pixel of a strip shows the skybox column of its first pixel
+  int skyboxOffsetX = -((player.rot/TWO_PI)*SKYBOX_WIDTH)*4;
+  skyboxColumnOffsets.resize(displayWidth);
+  int lowestTop = displayHeight, highestTop = -1;
+  for (int screenX=0; screenX<displayWidth; ++screenX) {
+    const int stripX = screenX - screenX % stripWidth;
+    int skyboxX = (float)stripX / displayWidth * SKYBOX_WIDTH;
+    skyboxX = (skyboxX + skyboxOffsetX) % SKYBOX_WIDTH;
+    skyboxColumnOffsets[screenX] = skyboxX<0 ? skyboxX+SKYBOX_WIDTH : skyboxX;
+    lowestTop = std::min(lowestTop, skyboxColumnTops[screenX]);
+    highestTop = std::max(highestTop, skyboxColumnTops[screenX]);
+  }
+
+  Uint32* screenPixels = (Uint32*) screenSurface->pixels;
+  const Uint32* skyboxPixels = (Uint32*) assets.skyboxSurface->pixels;
+  const int* columnOffsets = &skyboxColumnOffsets[0];
+  const int* columnTops = &skyboxColumnTops[0];
+  for (int screenY=0; screenY<=highestTop; ++screenY) {
+    Uint32* dst = screenPixels + screenY * displayWidth;
+    if (skyboxRowOffsets[screenY] < 0) {
+      const Uint32 pixel = skyboxPixels[PIXEL_LENGTH-1];
+      for (int x=0; x<displayWidth; ++x) {
+        if (screenY <= columnTops[x]) {
+          dst[x] = pixel;
         }
-        switch (stripWidth) {
-          case 4:
-            screenPixels[dstPixel+3] = srcPixelValue;
-          case 3:
-            screenPixels[dstPixel+2] = srcPixelValue;
-          case 2:
-            screenPixels[dstPixel+1] = srcPixelValue;
-          default:
-            screenPixels[dstPixel] = srcPixelValue;
-            break;
+      }
+      continue;
+    }
+    const Uint32* src = skyboxPixels + skyboxRowOffsets[screenY];
+    if (screenY <= lowestTop) {
+      // Nothing in this row is above the skybox
+      for (int x=0; x<displayWidth; ++x) {
+        dst[x] = src[columnOffsets[x]];
+      }
+    }
+    else {
+      for (int x=0; x<displayWidth; ++x) {
+        if (screenY <= columnTops[x]) {
+          dst[x] = src[columnOffsets[x]];
         }
       }
     }
@@ -1381,24 +2804,25 @@ void Game::drawSkyboxAndHighestCeiling(vector<RayHit>& rayHits)
     return;
   }
 
-  vector<int> drawnStrips;
-  drawnStrips.resize( rayCount + 1 );
+  // The skybox is drawn above the highest point of each column once all
+  // the hits are known
+  skyboxColumnTops.assign(displayWidth, -1);
 
   Uint32* screenPixels = (Uint32*) screenSurface->pixels;
   for (int i=0; i<(int)rayHits.size(); i++) {
     RayHit& rayHit = rayHits[i];
-      // Only draw above furthest wall
-    if (!rayHit.wallType) {
+      // Only draw above furthest wall or fog
+    if (!rayHit.wallType && !rayHit.fog) {
       continue;
     }
 
     // Ignore doors
-    if (Raycaster::isDoor(rayHit.wallType)) {
+    if (isDoorHit(rayHit)) {
       continue;
     }
 
     // Only draw above highest wall
-    if (rayHit.level!=highestCeilingLevel-1) {
+    if (!rayHit.fog && rayHit.level!=highestCeilingLevel-1) {
       if (raycaster3D.safeCellAt(rayHit.wallX, rayHit.wallY, rayHit.level+1)) {
         continue;
       }
@@ -1424,57 +2848,11 @@ void Game::drawSkyboxAndHighestCeiling(vector<RayHit>& rayHits)
       return;
     }
 
-    if (skipDrawnSkyboxStrips) {
-      // Only draw this strip if we have not drawn it or we drew at a
-      // higher point previously
-      if (drawnStrips[rayHit.strip] < screenY) {
-        drawnStrips[rayHit.strip] = screenY;
-      }
-      else {
-        continue;
-      }
-    }
-
-    // Draw skybox first
-    for (;screenY>=0;screenY--)
-    {
-      int dstPixel = screenX + (screenY) * displayWidth;
-      if (dstPixel >= displayWidth*displayHeight) {
-        continue;
-      }
-
-      const int PIXEL_LENGTH = SKYBOX_WIDTH * SKYBOX_HEIGHT;
-      int skyboxY = (screenY / (displayHeight/2.0f) * SKYBOX_HEIGHT);
-      Uint32* pix2 = (Uint32*) skyboxSurface->pixels;
-      int skyboxX = (float)screenX / displayWidth * SKYBOX_WIDTH;
-      float rotation = player.rot;
-      int skyboxOffsetX = -((rotation/TWO_PI)*SKYBOX_WIDTH)*4;
-      skyboxX += skyboxOffsetX;
-      int offset = (skyboxX%SKYBOX_WIDTH +skyboxY*SKYBOX_WIDTH);
-      if (offset < 0) {
-        offset = 0;
-      }
-      if (offset >= PIXEL_LENGTH) {
-        offset = PIXEL_LENGTH - 1;
-      }
-      bool pixelOK = dstPixel >=0 && dstPixel < displayWidth * displayHeight;
-      if (!pixelOK) {
-        continue;
-      }
-      Uint32 pixel = pix2[ offset ];
-      switch (stripWidth) {
-        case 4:
-          screenPixels[dstPixel+3] = pixel;
-        case 3:
-          screenPixels[dstPixel+2] = pixel;
-        case 2:
-          screenPixels[dstPixel+1] = pixel;
-        default:
-          screenPixels[dstPixel] = pixel;
-          break;
-      }
+    for (int x=screenX; x<screenX+stripWidth && x<displayWidth; ++x) {
+      skyboxColumnTops[x] = std::max(skyboxColumnTops[x], screenY);
     }
   }
+  drawSkybox();
 
   vector<int> drawnCeilingStrips;
   drawnCeilingStrips.resize( rayCount + 1 );
@@ -1487,7 +2865,7 @@ void Game::drawSkyboxAndHighestCeiling(vector<RayHit>& rayHits)
     }
 
     // Ignore doors
-    if (Raycaster::isDoor(rayHit.wallType)) {
+    if (isDoorHit(rayHit)) {
       continue;
     }
 
@@ -1545,28 +2923,32 @@ void Game::drawSkyboxAndHighestCeiling(vector<RayHit>& rayHits)
       xEnd += player.x;
       yEnd += player.y;
 
-      bool outOfBounds = xEnd<0 || xEnd>=MAP_WIDTH*TILE_SIZE ||
-                         yEnd<0 || yEnd>=MAP_HEIGHT*TILE_SIZE;
+      bool outOfBounds = xEnd<0 || xEnd>=mapWidth*TILE_SIZE ||
+                         yEnd<0 || yEnd>=mapHeight*TILE_SIZE;
       int x = (int)(xEnd) % TILE_SIZE;
       int y = (int)(yEnd) % TILE_SIZE;
       int tileX = xEnd / TILE_SIZE;
       int tileY = yEnd / TILE_SIZE;
       int textureX = (float) x / TILE_SIZE * TEXTURE_SIZE;
       int textureY = (float) y / TILE_SIZE * TEXTURE_SIZE;
-      int tileType = outOfBounds ? 0 : g_ceilingmap[ tileY ][ tileX ];
+      int tileType = outOfBounds ? 0 : ceilingTypeAt(tileX, tileY);
       int dstPixel = screenX + (screenY+pitch) * displayWidth;
       if (dstPixel >= displayWidth*displayHeight) {
         continue;
       }
 
       // Draw highest ceiling if it is not out of bounds and above the center
-      if (!outOfBounds && tileType) {
-        Bitmap& bitmap = floorCeilingBitmaps[tileType];
-        Uint32* pix = (Uint32*)bitmap.getPixels();
-        if (!pix) {
+      if (!outOfBounds && tileType > 0 &&
+          tileType < (int)assets.floorCeilingBitmaps.size()) {
+        Bitmap& bitmap = assets.floorCeilingBitmaps[tileType];
+        if (!bitmap.getPixels()) {
           continue;
         }
-        int srcPixel = textureY * TEXTURE_SIZE + textureX;
+        const int level = std::min(floorMipLevel(diagonalDistance),
+                                   bitmap.getMipLevels()-1);
+        Uint32* pix = bitmap.getMipPixels(level);
+        int srcPixel = bitmap.pixelIndex(level, textureX >> level,
+                                         textureY >> level);
         switch (stripWidth) {
           case 4:
             screenPixels[dstPixel+3] = pix[srcPixel];
@@ -1578,6 +2960,9 @@ void Game::drawSkyboxAndHighestCeiling(vector<RayHit>& rayHits)
             screenPixels[dstPixel] = pix[srcPixel];
             break;
         }
+        if (aux) {
+          writeAux(dstPixel, straightDistance, AUX_CEILING, tileType);
+        }
       }
     }
   }
@@ -1618,9 +3003,10 @@ void Game::drawWallBottom(RayHit& rayHit, int wallScreenHeight,
     int wallX = xEnd / TILE_SIZE;
     int wallY = yEnd / TILE_SIZE;
 
-    bool wallTextureExists = rayHit.wallType < (int)floorCeilingBitmaps.size();
-    bool outOfBounds = x < 0 || y < 0 || x>MAP_WIDTH*TILE_SIZE ||
-                       y>MAP_HEIGHT*TILE_SIZE;
+    const int bitmapCount = assets.floorCeilingBitmaps.size();
+    bool wallTextureExists = rayHit.wallType < bitmapCount;
+    bool outOfBounds = x < 0 || y < 0 || x>mapWidth*TILE_SIZE ||
+                       y>mapHeight*TILE_SIZE;
     bool sameWall = wallX==rayHit.wallX && wallY==rayHit.wallY;
     if (outOfBounds || !wallTextureExists || !sameWall ||
         !raycaster3D.cellAt(wallX,wallY,rayHit.level)) {
@@ -1629,18 +3015,21 @@ void Game::drawWallBottom(RayHit& rayHit, int wallScreenHeight,
       }
       continue;
     }
-    Bitmap& bitmap = floorCeilingBitmaps[ rayHit.wallType ];
-    Uint32* pix = (Uint32*)bitmap.getPixels();
-    if (!pix) {
+    Bitmap& bitmap = assets.floorCeilingBitmaps[ rayHit.wallType ];
+    if (!bitmap.getPixels()) {
       continue;
     }
-    int textureX = (float) x / TILE_SIZE * TEXTURE_SIZE;
-    int textureY = (float) y / TILE_SIZE * TEXTURE_SIZE;
+    const int level = std::min(floorMipLevel(diagonalDistance),
+                               bitmap.getMipLevels()-1);
+    Uint32* pix = bitmap.getMipPixels(level);
+    int textureX = (int)((float) x / TILE_SIZE * TEXTURE_SIZE) >> level;
+    int textureY = (int)((float) y / TILE_SIZE * TEXTURE_SIZE) >> level;
     Uint32* screenPixels = (Uint32*) screenSurface->pixels;
     int dstPixel = screenX + (screenY+pitch) * displayWidth;
-    int srcPixel = textureY * bitmap.getWidth() + textureX;
+    int srcPixel = bitmap.pixelIndex(level, textureX, textureY);
     bool pixelOK = srcPixel>=0 && dstPixel>=0 &&
-                   srcPixel<bitmap.getWidth()*bitmap.getHeight() &&
+                   srcPixel<bitmap.getMipWidth(level) *
+                            bitmap.getMipHeight(level) &&
                    dstPixel<displayWidth*displayHeight;
     if (pixelOK) {
       wasInWall = true;
@@ -1655,6 +3044,9 @@ void Game::drawWallBottom(RayHit& rayHit, int wallScreenHeight,
           screenPixels[dstPixel] = pix[srcPixel];
           break;
       }
+      if (aux) {
+        writeAux(dstPixel, straightDistance, AUX_CEILING, rayHit.wallType);
+      }
     }
   }
 }
@@ -1695,9 +3087,10 @@ void Game::drawWallTop(RayHit& rayHit, int wallScreenHeight,float playerScreenZ)
     int wallX = xEnd / TILE_SIZE;
     int wallY = yEnd / TILE_SIZE;
 
-    bool wallTextureExists = rayHit.wallType < (int)floorCeilingBitmaps.size();
-    bool outOfBounds = x < 0 || y < 0 || x>MAP_WIDTH*TILE_SIZE ||
-                       y>MAP_HEIGHT*TILE_SIZE;
+    const int bitmapCount = assets.floorCeilingBitmaps.size();
+    bool wallTextureExists = rayHit.wallType < bitmapCount;
+    bool outOfBounds = x < 0 || y < 0 || x>mapWidth*TILE_SIZE ||
+                       y>mapHeight*TILE_SIZE;
     bool sameWall = wallX==rayHit.wallX && wallY==rayHit.wallY;
     if (outOfBounds || !wallTextureExists || !sameWall ||
         !raycaster3D.cellAt(wallX,wallY,rayHit.level)) {
@@ -1706,17 +3099,20 @@ void Game::drawWallTop(RayHit& rayHit, int wallScreenHeight,float playerScreenZ)
       }
       continue;
     }
-    Bitmap& bitmap = floorCeilingBitmaps[ rayHit.wallType ];
-    Uint32* pix = (Uint32*)bitmap.getPixels();
-    if (!pix) {
+    Bitmap& bitmap = assets.floorCeilingBitmaps[ rayHit.wallType ];
+    if (!bitmap.getPixels()) {
       continue;
     }
-    int textureX = (float) x / TILE_SIZE * TEXTURE_SIZE;
-    int textureY = (float) y / TILE_SIZE * TEXTURE_SIZE;
+    const int level = std::min(floorMipLevel(diagonalDistance),
+                               bitmap.getMipLevels()-1);
+    Uint32* pix = bitmap.getMipPixels(level);
+    int textureX = (int)((float) x / TILE_SIZE * TEXTURE_SIZE) >> level;
+    int textureY = (int)((float) y / TILE_SIZE * TEXTURE_SIZE) >> level;
     int dstPixel = screenX + (screenY+pitch) * displayWidth;
-    int srcPixel = textureY * bitmap.getWidth() + textureX;
+    int srcPixel = bitmap.pixelIndex(level, textureX, textureY);
     bool pixelOK = srcPixel>=0 && dstPixel>=0 &&
-                   srcPixel<bitmap.getWidth()*bitmap.getHeight() &&
+                   srcPixel<bitmap.getMipWidth(level) *
+                            bitmap.getMipHeight(level) &&
                    dstPixel<displayWidth*displayHeight;
     if (pixelOK) {
       wasInWall = true;
@@ -1731,6 +3127,9 @@ void Game::drawWallTop(RayHit& rayHit, int wallScreenHeight,float playerScreenZ)
           screenPixels[dstPixel] = pix[srcPixel];
           break;
       }
+      if (aux) {
+        writeAux(dstPixel, straightDistance, AUX_FLOOR, rayHit.wallType);
+      }
     }
   }
 }
@@ -1740,70 +3139,8 @@ void Game::drawThinWallTop(RayHit& rayHit, int wallScreenHeight)
   if (!rayHit.thinWall || !rayHit.thinWall->thickWall) {
     return;
   }
-
-  Uint32* screenPixels = (Uint32*) screenSurface->pixels;
-  float eyeHeight = TILE_SIZE/2 + player.z;
-  float wallTop = rayHit.thinWall->z + rayHit.thinWall->height;
-  float centerPlane = displayHeight/2;
-  bool wasInWall = false;
-  int screenX = rayHit.strip * stripWidth;
-  const float cosFactor = 1/cos(player.rot-rayHit.rayAngle);
-  for (int screenY=centerPlane; screenY<displayHeight-pitch; screenY++)
-  {
-    float ratio= (eyeHeight - wallTop) / (screenY-centerPlane);
-    float straightDistance = viewDist * ratio;
-    float diagonalDistance = straightDistance * cosFactor;
-
-    float xEnd = (diagonalDistance *  cosine(rayHit.rayAngle));
-    float yEnd = (diagonalDistance * -sine(rayHit.rayAngle));
-    xEnd += player.x;
-    yEnd += player.y;
-    int x = (int)(xEnd) % TILE_SIZE;
-    int y = (int)(yEnd) % TILE_SIZE;
-
-    int textureID = rayHit.thinWall->thickWall->ceilingTextureID;
-    bool wallTextureExists = textureID < (int)floorCeilingBitmaps.size();
-    bool outOfBounds = x < 0 || y < 0 || x>MAP_WIDTH*TILE_SIZE ||
-                       y>MAP_HEIGHT*TILE_SIZE;
-    if (outOfBounds || !wallTextureExists) {
-      continue;
-    }
-    if (isinf(xEnd) || isinf(yEnd)) {
-      continue;
-    }
-    if (!rayHit.thinWall->thickWall->containsPoint(xEnd,yEnd)) {
-      if (wasInWall) {
-        return;
-      }
-      continue;
-    }
-    Bitmap& bitmap = floorCeilingBitmaps[ textureID ];
-    Uint32* pix = (Uint32*)bitmap.getPixels();
-    if (!pix) {
-      continue;
-    }
-    int textureX = (float) x / TILE_SIZE * TEXTURE_SIZE;
-    int textureY = (float) y / TILE_SIZE * TEXTURE_SIZE;
-    int dstPixel = screenX + (screenY+pitch) * displayWidth;
-    int srcPixel = textureY * bitmap.getWidth() + textureX;
-    bool pixelOK = srcPixel>=0 && dstPixel>=0 &&
-                   srcPixel<bitmap.getWidth()*bitmap.getHeight() &&
-                   dstPixel<displayWidth*displayHeight;
-    if (pixelOK) {
-      wasInWall = true;
-      switch (stripWidth) {
-        case 4:
-          screenPixels[dstPixel+3] = pix[srcPixel];
-        case 3:
-          screenPixels[dstPixel+2] = pix[srcPixel];
-        case 2:
-          screenPixels[dstPixel+1] = pix[srcPixel];
-        default:
-          screenPixels[dstPixel] = pix[srcPixel];
-          break;
-      }
-    }
-  }
+  drawThickWallFace(rayHit, rayHit.thinWall->z + rayHit.thinWall->height,
+                    rayHit.thinWall->thickWall->ceilingTextureID, true);
 }
 
 void Game::drawThinWallBottom(RayHit& rayHit, int wallScreenHeight)
@@ -1811,354 +3148,72 @@ void Game::drawThinWallBottom(RayHit& rayHit, int wallScreenHeight)
   if (!rayHit.thinWall || !rayHit.thinWall->thickWall) {
     return;
   }
-
-  Uint32* screenPixels = (Uint32*) screenSurface->pixels;
-  float eyeHeight = TILE_SIZE/2 + player.z;
-  float wallBottom = rayHit.thinWall->z;
-  float centerPlane = displayHeight/2;
-  bool wasInWall = false;
-  int screenX = rayHit.strip * stripWidth;
-  const float cosFactor = 1/cos(player.rot-rayHit.rayAngle);
-  for (int screenY=centerPlane; screenY>=0-pitch; screenY--)
-  {
-    float ratio = (wallBottom - eyeHeight) / (centerPlane - screenY);
-    float straightDistance = viewDist * ratio;
-    float diagonalDistance = straightDistance * cosFactor;
-
-    float xEnd = (diagonalDistance *  cosine(rayHit.rayAngle));
-    float yEnd = (diagonalDistance * -sine(rayHit.rayAngle));
-    xEnd += player.x;
-    yEnd += player.y;
-    int x = (int)(xEnd) % TILE_SIZE;
-    int y = (int)(yEnd) % TILE_SIZE;
-
-    int textureID = rayHit.thinWall->thickWall->floorTextureID;
-    bool wallTextureExists = textureID < (int)floorCeilingBitmaps.size();
-    bool outOfBounds = x < 0 || y < 0 || x>MAP_WIDTH*TILE_SIZE ||
-                       y>MAP_HEIGHT*TILE_SIZE;
-    if (outOfBounds || !wallTextureExists) {
-      continue;
-    }
-    if (isinf(xEnd) || isinf(yEnd)) {
-      continue;
-    }
-    if (!rayHit.thinWall->thickWall->containsPoint(xEnd,yEnd)) {
-      if (wasInWall) {
-        return;
-      }
-      continue;
-    }
-    Bitmap& bitmap = floorCeilingBitmaps[ textureID ];
-    Uint32* pix = (Uint32*)bitmap.getPixels();
-    if (!pix) {
-      continue;
-    }
-    int textureX = (float) x / TILE_SIZE * TEXTURE_SIZE;
-    int textureY = (float) y / TILE_SIZE * TEXTURE_SIZE;
-    int dstPixel = screenX + (screenY+pitch) * displayWidth;
-    int srcPixel = textureY * bitmap.getWidth() + textureX;
-    bool pixelOK = srcPixel>=0 && dstPixel>=0 &&
-                   srcPixel<bitmap.getWidth()*bitmap.getHeight() &&
-                   dstPixel<displayWidth*displayHeight;
-    if (pixelOK) {
-      wasInWall = true;
-      switch (stripWidth) {
-        case 4:
-          screenPixels[dstPixel+3] = pix[srcPixel];
-        case 3:
-          screenPixels[dstPixel+2] = pix[srcPixel];
-        case 2:
-          screenPixels[dstPixel+1] = pix[srcPixel];
-        default:
-          screenPixels[dstPixel] = pix[srcPixel];
-          break;
-      }
-    }
-  }
+  drawThickWallFace(rayHit, rayHit.thinWall->z,
+                    rayHit.thinWall->thickWall->floorTextureID, false);
 }
 
-bool Game::drawSlope(RayHit& rayHit, float playerScreenZ)
+// Draws the flat top or bottom face of a ThickWall at height planeZ in one
+// strip. The rows are found from where the ray enters and leaves the
+// ThickWall, so no pixel has to be tested against its shape.
+void Game::drawThickWallFace(RayHit& rayHit, float planeZ, int textureID,
+                             bool top)
 {
-  Uint32* screenPixels = (Uint32*) screenSurface->pixels;
-  RayHit sibling;
-
-  // We should already have found the sibling with Raycaster::raycastThinWalls()
-  // No sibling found yet means the player is directly above/below the slope.
-  // The sibling is behind the player, so we do a backwards raycast to find it
-  // and store its properties in the RayHit.sibling* fields
-  if (rayHit.siblingDistance == 0) {
-    if (!rayHit.findSiblingAtAngle(rayHit.rayAngle-M_PI, player.rot,
-                                   player.x, player.y,
-                                   raycaster3D.gridWidth, TILE_SIZE)) {
-      return false; // no sibling found
-    }
+  if (textureID < 0 || textureID >= (int)assets.floorCeilingBitmaps.size()) {
+    return;
   }
-
-  // Only draw slope if current wall is further than sibling wall
-  if (!rayHit.siblingDistance ||
-       rayHit.correctDistance < rayHit.siblingCorrectDistance) {
-    return false;
+  Bitmap& bitmap = assets.floorCeilingBitmaps[ textureID ];
+  if (!bitmap.getPixels()) {
+    return;
   }
-
-  // Cross section values of current strip
-  float farWallX = rayHit.correctDistance;
-  float farWallY = rayHit.thinWall->z + rayHit.wallHeight;
-  float nearWallX = rayHit.siblingCorrectDistance;
-  float nearWallY = rayHit.siblingThinWallZ + rayHit.siblingWallHeight;
-  float eyeX = 0; // relative to player eye, so always 0
-  float eyeY = TILE_SIZE/2 + player.z;
-
-  float centerPlane = displayHeight / 2;
-  float cosFactor = 1/cos(player.rot-rayHit.rayAngle);
-  float screenX = rayHit.strip * stripWidth;
-  float wasInWall = false; // used to stop drawing early
-
-  SDL_Rect rc = stripScreenRect(rayHit, rayHit.wallHeight);
-  float screenY = rc.y + playerScreenZ;
-
-  // Raycast vertically from top to bottom to find slope intersection
-  for (; screenY<displayHeight-pitch; screenY++) {
-    float wallTop = 0;
-    bool hitSlope = false;
-
-    // Angle is below eye
-    float divisor = screenY-centerPlane;
-    if (screenY >= centerPlane ) {
-      float dy = screenY - centerPlane;
-      if (dy==0) {
-        dy = screenY+1 - centerPlane;
-        divisor = screenY+1 - centerPlane;
-      }
-      float angle = atan( dy / viewDist );
-      float floorX = eyeY / tan( angle );
-      float floorY = 0; // should always be 0
-      Point hit;
-      hitSlope = Shape::linesIntersect(
-        eyeX, eyeY, floorX, floorY,
-        farWallX, farWallY, nearWallX, nearWallY,
-        &hit.x, &hit.y
-      );
-      if (hitSlope) {
-        wallTop = hit.y;
-      }
-    }
-    // Angle is above eye
-    else {
-      float dy = centerPlane - screenY;
-      float angle = atan( dy / viewDist );
-      float ceilingY = TILE_SIZE*99; // imaginary high ceiling
-      float ceilingX = ceilingY / tan( angle  );
-      Point hit;
-      hitSlope = Shape::linesIntersect(
-        eyeX, eyeY, ceilingX, ceilingY,
-        farWallX, farWallY, nearWallX, nearWallY,
-        &hit.x, &hit.y
-      );
-      if (hitSlope) {
-        wallTop = hit.y;
-      }
-    }
-
-    if (!hitSlope) {
-      if (wasInWall) {
-        return true;
-      }
-      continue;
-    }
-
-    float ratio = (eyeY - wallTop) / divisor;
-    float straightDistance = viewDist * ratio;
-    float diagonalDistance = straightDistance * cosFactor;
-
-    float xEnd = (diagonalDistance *  cosine(rayHit.rayAngle));
-    float yEnd = (diagonalDistance * -sine(rayHit.rayAngle));
-    if (isinf(xEnd) || isinf(yEnd)) {
-      if (wasInWall) {
-        return true;
-      }
-      continue;
-    }
-    xEnd += player.x;
-    yEnd += player.y;
-    int x = (int)(xEnd) % TILE_SIZE;
-    int y = (int)(yEnd) % TILE_SIZE;
-
-    int textureID = rayHit.thinWall->thickWall->floorTextureID;
-    bool wallTextureExists = textureID < (int)floorCeilingBitmaps.size();
-    bool outOfBounds = x < 0 || y < 0 || x>MAP_WIDTH*TILE_SIZE ||
-                       y>MAP_HEIGHT*TILE_SIZE;
-    if (outOfBounds || !wallTextureExists) {
-      if (wasInWall) {
-        return true;
-      }
-      continue;
-    }
-
-    Bitmap& bitmap = floorCeilingBitmaps[ textureID ];
-    Uint32* pix = (Uint32*)bitmap.getPixels();
-    if (!pix) {
-      continue;
-    }
-    int textureX = (float) x / TILE_SIZE * TEXTURE_SIZE;
-    int textureY = (float) y / TILE_SIZE * TEXTURE_SIZE;
-    int dstPixel = screenX + (screenY+pitch) * displayWidth;
-    int srcPixel = textureY * bitmap.getWidth() + textureX;
-    bool pixelOK = srcPixel>=0 && dstPixel>=0 &&
-                   srcPixel<bitmap.getWidth()*bitmap.getHeight() &&
-                   dstPixel<displayWidth*displayHeight;
-    if (pixelOK) {
-      wasInWall = true;
-      switch (stripWidth) {
-        case 4:
-          screenPixels[dstPixel+3] = pix[srcPixel];
-        case 3:
-          screenPixels[dstPixel+2] = pix[srcPixel];
-        case 2:
-          screenPixels[dstPixel+1] = pix[srcPixel];
-        default:
-          screenPixels[dstPixel] = pix[srcPixel];
-          break;
-      }
-    }
+  const float rayCos = cosine(rayHit.rayAngle);
+  const float raySin = sine(rayHit.rayAngle);
+  float enterDistance, exitDistance;
+  if (!rayHit.thinWall->thickWall->rayInterval(player.x, player.y,
+                                               rayCos, -raySin,
+                                               enterDistance, exitDistance)) {
+    return;
   }
 
-  return true;
-}
-
-bool Game::drawSlopeInverted(RayHit& rayHit, float playerScreenZ)
-{
   Uint32* screenPixels = (Uint32*) screenSurface->pixels;
+  float eyeHeight = TILE_SIZE/2 + player.z;
+  float centerPlane = displayHeight/2;
+  int screenX = rayHit.strip * stripWidth;
+  const float cosFactor = 1/cos(player.rot-rayHit.rayAngle);
 
-  RayHit sibling;
-
-  // We should already have found the sibling with Raycaster::raycastThinWalls()
-  // No sibling found yet means the player is directly above/below the slope.
-  // The sibling is behind the player, so we do a backwards raycast to find it
-  // and store its properties in the RayHit.sibling* fields
-  if (rayHit.siblingDistance == 0) {
-    if (!rayHit.findSiblingAtAngle(rayHit.rayAngle-M_PI, player.rot,
-                                   player.x, player.y,
-                                   raycaster3D.gridWidth, TILE_SIZE))
-    {
-      return false;
-    }
-  }
-
-  // Only draw slope if current wall is further than sibling wall
-  if (!rayHit.siblingDistance ||
-       rayHit.correctDistance < rayHit.siblingCorrectDistance) {
-    return false;
-  }
-
-  // Cross section values of current strip
-  float farWallX = rayHit.correctDistance;
-  float farWallY = rayHit.thinWall->z + rayHit.invertedZ;
-  float nearWallX = rayHit.siblingCorrectDistance;
-  float nearWallY = rayHit.siblingThinWallZ + rayHit.siblingInvertedZ;
-  float eyeX = 0;
-  float eyeY = TILE_SIZE/2 + player.z;
-
-  float centerPlane = displayHeight / 2;
-  float cosFactor = 1/cos(player.rot-rayHit.rayAngle);
-  float wasInWall = false;
-  float screenX = rayHit.strip * stripWidth;
-  SDL_Rect rc = stripScreenRect(rayHit, rayHit.wallHeight);
-  float screenY = rc.y + rc.h + playerScreenZ;
-
-  // Raycast vertically from bottom to top to find slope intersection
-  for (; screenY>=0-pitch; screenY--) {
-    float wallTop = 0;
-    bool hitSlope = false;
-
-    // Angle is below eye
-    float divisor = screenY-centerPlane;
-    if (screenY >= centerPlane ) {
-      float dy = screenY - centerPlane;
-      if (dy==0) {
-        dy = screenY+1 - centerPlane;
-        divisor = screenY+1 - centerPlane;
-      }
-      float angle = atan( dy / viewDist );
-      float floorX = eyeY / tan( angle );
-      float floorY = 0; // should always be 0
-      Point hit;
-      hitSlope = Shape::linesIntersect(
-        eyeX, eyeY, floorX, floorY,
-        farWallX, farWallY, nearWallX, nearWallY,
-        &hit.x, &hit.y
-      );
-      if (hitSlope) {
-        wallTop = hit.y;
-      }
-    }
-    // Angle is above eye
-    else {
-      float dy = centerPlane - screenY;
-      float angle = atan( dy / viewDist );
-      float ceilingY = TILE_SIZE*99; // imaginary high ceiling
-      float ceilingX = ceilingY / tan( angle  );
-      Point hit;
-      hitSlope = Shape::linesIntersect(
-        eyeX, eyeY, ceilingX, ceilingY,
-        farWallX, farWallY, nearWallX, nearWallY,
-        &hit.x, &hit.y
-      );
-      if (hitSlope) {
-        wallTop = hit.y;
-      }
-    }
-
-    if (!hitSlope) {
-      if (wasInWall) {
-        return true;
-      }
-      continue;
-    }
-
-    float ratio = (eyeY - wallTop) / divisor;
-    float straightDistance = viewDist * ratio;
-    float diagonalDistance = straightDistance * cosFactor;
-
-    float xEnd = (diagonalDistance *  cosine(rayHit.rayAngle));
-    float yEnd = (diagonalDistance * -sine(rayHit.rayAngle));
-
-    if (isinf(xEnd) || isinf(yEnd)) {
-      if (wasInWall) {
-        return true;
-      }
-      continue;
+  // The row offset pixels away from the center sees the face at diagonal
+  // distance k / offset, so the face covers offsets k/exit to k/enter
+  const float k = viewDist * fabs(eyeHeight - planeZ) * cosFactor;
+  const float farOffset = k / exitDistance;
+  const float nearOffset = enterDistance > 0 ? k / enterDistance
+                                             : (float) displayHeight;
+  const int firstOffset = std::max(1, (int)ceil(farOffset));
+  const int lastOffset = (int)std::min(floor(nearOffset),
+                                       (float) displayHeight);
+
+  for (int offset=firstOffset; offset<=lastOffset; ++offset)
+  {
+    const int screenY = top ? centerPlane + offset : centerPlane - offset;
+    if (top ? screenY>=displayHeight-pitch : screenY<0-pitch) {
+      break;
     }
-
-    xEnd += player.x;
-    yEnd += player.y;
+    float diagonalDistance = k / offset;
+    float xEnd = player.x + diagonalDistance * rayCos;
+    float yEnd = player.y - diagonalDistance * raySin;
     int x = (int)(xEnd) % TILE_SIZE;
     int y = (int)(yEnd) % TILE_SIZE;
 
-    int textureID = rayHit.thinWall->thickWall->ceilingTextureID;
-    bool wallTextureExists = textureID < (int)floorCeilingBitmaps.size();
-    bool outOfBounds = x < 0 || y < 0 || x>MAP_WIDTH*TILE_SIZE ||
-                       y>MAP_HEIGHT*TILE_SIZE;
-    if (outOfBounds || !wallTextureExists) {
-      if (wasInWall) {
-        return true;
-      }
-      continue;
-    }
-
-    Bitmap& bitmap = floorCeilingBitmaps[ textureID ];
-    Uint32* pix = (Uint32*)bitmap.getPixels();
-    if (!pix) {
-      continue;
-    }
-    int textureX = (float) x / TILE_SIZE * TEXTURE_SIZE;
-    int textureY = (float) y / TILE_SIZE * TEXTURE_SIZE;
+    const int level = std::min(floorMipLevel(diagonalDistance),
+                               bitmap.getMipLevels()-1);
+    Uint32* pix = bitmap.getMipPixels(level);
+    int textureX = (int)((float) x / TILE_SIZE * TEXTURE_SIZE) >> level;
+    int textureY = (int)((float) y / TILE_SIZE * TEXTURE_SIZE) >> level;
     int dstPixel = screenX + (screenY+pitch) * displayWidth;
-    int srcPixel = textureY * bitmap.getWidth() + textureX;
+    int srcPixel = bitmap.pixelIndex(level, textureX, textureY);
     bool pixelOK = srcPixel>=0 && dstPixel>=0 &&
-                   srcPixel<bitmap.getWidth()*bitmap.getHeight() &&
+                   srcPixel<bitmap.getMipWidth(level) *
+                            bitmap.getMipHeight(level) &&
                    dstPixel<displayWidth*displayHeight;
     if (pixelOK) {
-      wasInWall = true;
       switch (stripWidth) {
         case 4:
           screenPixels[dstPixel+3] = pix[srcPixel];
@@ -2170,6 +3225,145 @@ bool Game::drawSlopeInverted(RayHit& rayHit, float playerScreenZ)
           screenPixels[dstPixel] = pix[srcPixel];
           break;
       }
+      if (aux) {
+        writeAux(dstPixel, diagonalDistance / cosFactor,
+                 top ? AUX_FLOOR : AUX_CEILING, textureID);
+      }
+    }
+  }
+}
+
+bool Game::drawSlope(RayHit& rayHit)
+{
+  return drawSlopeSurface(rayHit,
+                          rayHit.siblingThinWallZ + rayHit.siblingWallHeight,
+                          rayHit.thinWall->z + rayHit.wallHeight,
+                          rayHit.thinWall->thickWall->floorTextureID, true);
+}
+
+bool Game::drawSlopeInverted(RayHit& rayHit)
+{
+  return drawSlopeSurface(rayHit,
+                          rayHit.siblingThinWallZ + rayHit.siblingInvertedZ,
+                          rayHit.thinWall->z + rayHit.invertedZ,
+                          rayHit.thinWall->thickWall->ceilingTextureID, false);
+}
+
+/*
+Draws the top surface of a slope or the bottom surface of an inverted slope.
+
+In the cross section of a strip, X is the straight distance from the eye and
+Y is the height. The surface is the segment from the sibling wall
+(nearX, nearY) to the current wall (farX, farY), and screen row r pixels
+below the center looks along
+
+  Y = eyeY - X * r / viewDist
+
+which meets the segment at
+
+  t = ((eyeY-nearY)*viewDist - r*nearX) / ((farY-nearY)*viewDist + r*(farX-nearX))
+
+Both the top and bottom of that fraction change by a constant every row, and
+the floor position is linear in t, so after the setup each pixel only costs
+one divide, same as flat floors. The rows covered are simply the projections
+of the two edges.
+*/
+bool Game::drawSlopeSurface(RayHit& rayHit, float nearY, float farY,
+                            int textureID, bool topSurface)
+{
+  // Only draw slope if current wall is further than sibling wall
+  const float nearX = rayHit.siblingCorrectDistance;
+  const float farX = rayHit.correctDistance;
+  if (!rayHit.siblingDistance || farX <= nearX || textureID < 0 ||
+      textureID >= (int)assets.floorCeilingBitmaps.size()) {
+    return false;
+  }
+  Bitmap& bitmap = assets.floorCeilingBitmaps[ textureID ];
+  if (!bitmap.getPixels()) {
+    return false;
+  }
+
+  const float dX = farX - nearX;
+  const float dY = farY - nearY;
+  const float eyeY = TILE_SIZE/2 + player.z;
+
+  // Skip surfaces facing away from the eye, the walls of the slope hide them
+  const float facing = dX*(eyeY-nearY) + dY*nearX;
+  if (topSurface ? facing <= 0 : facing >= 0) {
+    return false;
+  }
+
+  // When the player stands above or below the slope the sibling is behind
+  // them and the surface reaches the bottom or top of the screen
+  const float centerPlane = displayHeight / 2;
+  const float offScreen = displayHeight * 2;
+  const float nearRow = nearX > 0 ? (eyeY - nearY) * viewDist / nearX :
+                        (topSurface ? offScreen : -offScreen);
+  const float farRow = (eyeY - farY) * viewDist / farX;
+  const float rowOffset = centerPlane + pitch;
+  const int firstRow = std::max(0,
+                         (int)ceil(std::min(nearRow, farRow) + rowOffset));
+  const int lastRow = std::min(displayHeight-1,
+                        (int)floor(std::max(nearRow, farRow) + rowOffset));
+  if (firstRow > lastRow) {
+    return false;
+  }
+
+  // Floor position of the near edge and how far it is to the far edge
+  const float cosFactor = 1/cos(player.rot-rayHit.rayAngle);
+  const float dirX = cosFactor * cosine(rayHit.rayAngle);
+  const float dirY = cosFactor * -sine(rayHit.rayAngle);
+  const float startX = player.x + nearX * dirX;
+  const float startY = player.y + nearX * dirY;
+  const float spanX = dX * dirX;
+  const float spanY = dX * dirY;
+  const float maxX = mapWidth * TILE_SIZE;
+  const float maxY = mapHeight * TILE_SIZE;
+
+  const float r = firstRow - rowOffset;
+  float numerator = (eyeY - nearY) * viewDist - r * nearX;
+  float denominator = dY * viewDist + r * dX;
+
+  Uint32* screenPixels = (Uint32*) screenSurface->pixels;
+  const int screenX = rayHit.strip * stripWidth;
+  for (int screenY=firstRow; screenY<=lastRow; ++screenY,
+       numerator -= nearX, denominator += dX) {
+    if (!denominator) {
+      continue;
+    }
+    float t = numerator / denominator;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+    const float xEnd = startX + t * spanX;
+    const float yEnd = startY + t * spanY;
+    if (xEnd < 0 || yEnd < 0 || xEnd > maxX || yEnd > maxY) {
+      continue;
+    }
+    const int level = std::min(floorMipLevel((nearX + t*dX) * cosFactor),
+                               bitmap.getMipLevels()-1);
+    Uint32* pix = bitmap.getMipPixels(level);
+    const int textureX = ((int)xEnd % TILE_SIZE * TEXTURE_SIZE / TILE_SIZE)
+                         >> level;
+    const int textureY = ((int)yEnd % TILE_SIZE * TEXTURE_SIZE / TILE_SIZE)
+                         >> level;
+    const int srcPixel = bitmap.pixelIndex(level, textureX, textureY);
+    if (srcPixel >= bitmap.getMipWidth(level) * bitmap.getMipHeight(level)) {
+      continue;
+    }
+    const int dstPixel = screenX + screenY * displayWidth;
+    switch (stripWidth) {
+      case 4:
+        screenPixels[dstPixel+3] = pix[srcPixel];
+      case 3:
+        screenPixels[dstPixel+2] = pix[srcPixel];
+      case 2:
+        screenPixels[dstPixel+1] = pix[srcPixel];
+      default:
+        screenPixels[dstPixel] = pix[srcPixel];
+        break;
+    }
+    if (aux) {
+      writeAux(dstPixel, nearX + t*dX,
+               topSurface ? AUX_SLOPE : AUX_SLOPE_CEILING, textureID);
     }
   }
 
@@ -2180,6 +3374,9 @@ void Game::drawWorld(vector<RayHit>& rayHits)
 {
   RayHitSorter rayHitSorter(&raycaster3D, TILE_SIZE/2+player.z);
   std::sort(rayHits.begin(), rayHits.end(), rayHitSorter);
+  if (aux) {
+    aux->clear(displayWidth, displayHeight);
+  }
 
   drawSkyboxAndHighestCeiling(rayHits);
   drawFloor(rayHits);
@@ -2207,20 +3404,23 @@ void Game::drawWorld(vector<RayHit>& rayHits)
       if (sx >= TEXTURE_SIZE) {
         sx = TEXTURE_SIZE-1;
       }
-      float sy = TEXTURE_SIZE * (rayHit.wallType-1);
+      // Grid walls pick their texture through their material
+      float sy = rayHit.thinWall ? TEXTURE_SIZE * (rayHit.wallType-1) :
+                 TEXTURE_SIZE * raycaster3D.material(rayHit.wallType).textureID;
       bool wallAboveWall = false;
       bool wallBelowWall = false;
       if (!rayHit.thinWall) {
         if (rayHit.level) {
           int wallBelow = raycaster3D.cellAt(rayHit.wallX, rayHit.wallY,
                                              rayHit.level-1);
-          wallAboveWall = wallBelow && !Raycaster::isDoor(wallBelow);
+          wallAboveWall = wallBelow && !raycaster3D.isDoor(wallBelow);
         }
         wallBelowWall= raycaster3D.safeCellAt(rayHit.wallX,rayHit.wallY,
                                               rayHit.level+1);
       }
 
-      SurfaceTexture* img = rayHit.horizontal ? &wallsImageDark : &wallsImage;
+      SurfaceTexture* img = rayHit.horizontal ? &assets.wallsImageDark
+                                              : &assets.wallsImage;
 
       //------------------------------------------------------------------------
       // Corner Checking Start
@@ -2241,8 +3441,12 @@ void Game::drawWorld(vector<RayHit>& rayHits)
       // (e.g. 12800 instead of 128), this check is not necessary.
       // But a large TILE_SIZE seems to cause frame drops because many
       // modulus (%) operations use TILE_SIZE.
+      //
+      // The fixed-point raycast steps along exact cell boundaries and does
+      // not produce these tears, so the check is only needed for the
+      // floating point raycast.
       //------------------------------------------------------------------------
-      bool cornerCheck = !rayHit.thinWall && true;
+      bool cornerCheck = !rayHit.thinWall && !raycaster3D.fixedPoint;
       int sxi = (int) sx;
       bool isLeftEdge = sxi==0;
       bool isRightEdge = sxi == TEXTURE_SIZE-1;
@@ -2257,18 +3461,18 @@ void Game::drawWorld(vector<RayHit>& rayHits)
         int topWall = raycaster3D.safeCellAt(wallX, wallY-1, level);
         if (isRightEdge) {
           if (rayHit.horizontal && rayHit.up && !rayHit.right && bottomWall) {
-            img = &wallsImage;
+            img = &assets.wallsImage;
           }
           else if (rayHit.up && rayHit.right && leftWall) {
-            img = &wallsImageDark;
+            img = &assets.wallsImageDark;
           }
         }
         else if (isLeftEdge) {
           if (rayHit.horizontal && !rayHit.up && !rayHit.right && topWall) {
-            img = &wallsImage;
+            img = &assets.wallsImage;
           }
           else if (rayHit.up && !rayHit.right && rightWall) {
-            img = &wallsImageDark;
+            img = &assets.wallsImageDark;
           }
         }
       }
@@ -2277,11 +3481,11 @@ void Game::drawWorld(vector<RayHit>& rayHits)
       //---------------------
 
       // Wall is a door
-      bool wallIsDoor = Raycaster::isDoor(rayHit.wallType);
+      bool wallIsDoor = isDoorHit(rayHit);
       if (wallIsDoor) {
         sy = 0;
-        img = doors[rayHit.wallX+rayHit.wallY*MAP_WIDTH] ? &gatesOpenImage :
-                                                           &gatesImage;
+        img = isDoorOpen(rayHit.wallX, rayHit.wallY) ? &assets.gatesOpenImage :
+                                                       &assets.gatesImage;
       }
 
       bool isSlope = rayHit.thinWall && rayHit.thinWall->thickWall &&
@@ -2291,10 +3495,10 @@ void Game::drawWorld(vector<RayHit>& rayHits)
       if (isSlope) {
         drawSlopeStrip(rayHit,*img,sx,sy);
         if (rayHit.thinWall->thickWall->invertedSlope) {
-          drawSlopeInverted(rayHit, playerScreenZ);
+          drawSlopeInverted(rayHit);
         }
         else {
-          drawSlope(rayHit, playerScreenZ);
+          drawSlope(rayHit);
         }
       }
       else if (rayHit.thinWall) {
@@ -2343,19 +3547,35 @@ void Game::drawWorld(vector<RayHit>& rayHits)
 
     } // if rayHit.wallType
 
+    else if (rayHit.fog) {
+      drawFogStrip(rayHit);
+    }
+
+    else if (rayHit.terrain) {
+      drawTerrainStrip(rayHit);
+    }
+
     // Sprite
     else if (rayHit.sprite && !rayHit.sprite->hidden) {
       SDL_Rect dstRect;
       SurfaceTexture* spriteSurfaceTexture = NULL;
       std::map<int,SurfaceTexture>::iterator i =
-        spriteTextures.find(rayHit.sprite->textureID);
-      if (i == spriteTextures.end()) {
+        assets.spriteTextures.find(rayHit.sprite->textureID);
+      if (i == assets.spriteTextures.end()) {
         continue;
       }
-      spriteSurfaceTexture = &spriteTextures[rayHit.sprite->textureID];
+      spriteSurfaceTexture = &assets.spriteTextures[rayHit.sprite->textureID];
       dstRect = findSpriteScreenPosition( *rayHit.sprite  );
-      SDL_BlitScaled(spriteSurfaceTexture->getSurface(), NULL, screenSurface,
-                     &dstRect);
+      SDL_Surface* spriteSurface = spriteSurfaceTexture->getSurface();
+      if (mipmapsOn && dstRect.w > 0) {
+        const int level = mipLevel((float)spriteSurface->w / dstRect.w);
+        spriteSurface = spriteSurfaceTexture->getMipSurface(level);
+      }
+      SDL_BlitScaled(spriteSurface, NULL, screenSurface, &dstRect);
+      if (aux) {
+        writeAuxBlit(spriteSurface, NULL, dstRect, rayHit.correctDistance,
+                     AUX_SPRITE, rayHit.sprite->textureID);
+      }
     }
   }
 }
@@ -2440,6 +3660,10 @@ void Game::drawThinWallStrip(RayHit& rayHit, SurfaceTexture& img,
                                                  player.z);
   }
 
+  const int level = wallMipLevel(Raycaster::stripScreenHeight(viewDist,
+                                 rayHit.correctDistance, TILE_SIZE));
+  SDL_Surface* surface = img.getMipSurface(level);
+
   float heightToDraw = TILE_SIZE;
   float dstY = 0;
   float heightDrawn=0;
@@ -2450,10 +3674,11 @@ void Game::drawThinWallStrip(RayHit& rayHit, SurfaceTexture& img,
     }
 
     SDL_Rect srcrect;
-    srcrect.x = textureX;
-    srcrect.y = textureY;
+    srcrect.x = (int)textureX >> level;
+    srcrect.y = (int)textureY >> level;
     srcrect.w = 1;
-    srcrect.h = (heightToDraw/TILE_SIZE) * TEXTURE_SIZE;
+    srcrect.h = std::max(1, (int)((heightToDraw/TILE_SIZE) * TEXTURE_SIZE)
+                            >> level);
 
     SDL_Rect dstrect = stripScreenRect(rayHit, heightToDraw);
     if (heightDrawn == 0) {
@@ -2475,7 +3700,11 @@ void Game::drawThinWallStrip(RayHit& rayHit, SurfaceTexture& img,
       continue;
     }
 
-    SDL_BlitScaled(img.getSurface(), &srcrect, screenSurface, &dstrect);
+    SDL_BlitScaled(surface, &srcrect, screenSurface, &dstrect);
+    if (aux) {
+      writeAuxBlit(surface, &srcrect, dstrect, rayHit.correctDistance,
+                   AUX_WALL, rayHit.wallType);
+    }
   }
 }
 
@@ -2501,11 +3730,14 @@ void Game::drawWallStrip(RayHit& rayHit, SurfaceTexture& img,
     }
   }
 
+  // Distant walls read from a smaller copy of the texture
+  const int level = wallMipLevel(wallScreenHeight);
+  SDL_Surface* surface = img.getMipSurface(level);
   SDL_Rect srcrect;
-  srcrect.x = textureX;
-  srcrect.y = textureY;
+  srcrect.x = (int)textureX >> level;
+  srcrect.y = (int)textureY >> level;
   srcrect.w = 1;
-  srcrect.h = TEXTURE_SIZE;
+  srcrect.h = TEXTURE_SIZE >> level;
 
   SDL_Rect dstrect;
   dstrect.x = rayHit.strip * stripWidth;
@@ -2522,14 +3754,18 @@ void Game::drawWallStrip(RayHit& rayHit, SurfaceTexture& img,
   }
 
   dstrect.y -= rayHit.level * wallScreenHeight;
-  SDL_BlitScaled(img.getSurface(), &srcrect, screenSurface, &dstrect);
+  SDL_BlitScaled(surface, &srcrect, screenSurface, &dstrect);
+  if (aux) {
+    writeAuxBlit(surface, &srcrect, dstrect, rayHit.correctDistance,
+                 AUX_WALL, rayHit.wallType & CELL_MATERIAL_MASK);
+  }
   if (fogOn) {
     fogWallStrip(&dstrect, rayHit.correctDistance);
   }
   int floors = 1;
   while (floors-- > 1) {
     dstrect.y -= wallScreenHeight;
-    SDL_BlitScaled(img.getSurface(), &srcrect, screenSurface, &dstrect);
+    SDL_BlitScaled(surface, &srcrect, screenSurface, &dstrect);
   }
 }
 
@@ -2588,54 +3824,295 @@ SDL_Rect Game::findSpriteScreenPosition( Sprite& sprite )
   return rc;
 }
 
-void Game::raycastWorld(vector<RayHit>& rayHits)
+/*
+With adaptiveRaysOn, grid rays are only cast every adaptiveRayStep strips at
+first. Where two of those rays hit the same runs of wall faces, the strips
+between them hit those faces too and their hits are worked out from the face
+lines. Everywhere else the span is halved and cast again until neighbouring
+strips are reached. Thin walls, sprites and terrain are still cast per strip.
+*/
+void Game::raycastWorld(vector<RayHit>& rayHits,
+                        const SpriteIndex* sharedSpriteIndex)
 {
-  vector<Sprite*> spritesFound;
   rayHitsCount = 0;
+  gridRaysCast = 0;
   for (int i=0; i<(int)sprites.size(); ++i) {
     sprites[i].rayhit = false;
   }
+  if (!sharedSpriteIndex) {
+    spriteIndex.build(sprites, TILE_SIZE);
+  }
+  const SpriteIndex* index = sharedSpriteIndex ? sharedSpriteIndex
+                                               : &spriteIndex;
+
+  if (adaptiveRaysOn) {
+    gridStripHits.resize(rayCount);
+    for (int strip=0; strip<rayCount; strip+=adaptiveRayStep) {
+      castGridRay(strip);
+    }
+    const int lastStrip = rayCount - 1;
+    if (lastStrip % adaptiveRayStep) {
+      castGridRay(lastStrip);
+    }
+    for (int strip=0; strip<lastStrip; strip+=adaptiveRayStep) {
+      refineGridRays(strip, std::min(strip+adaptiveRayStep, lastStrip));
+    }
+    for (int strip=0; strip<rayCount; strip++) {
+      rayHits.insert(rayHits.end(), gridStripHits[strip].begin(),
+                     gridStripHits[strip].end());
+    }
+  }
 
   // Loop through and raycast each angle
   for (int strip=0; strip<rayCount; strip++) {
     const float stripAngle = stripAngles[strip];
-    raycaster3D.raycast(rayHits, player.x, player.y, player.z, player.rot,
-                        stripAngle, strip, 0);
+    if (!adaptiveRaysOn) {
+      raycaster3D.raycast(rayHits, player.x, player.y, player.z, player.rot,
+                          stripAngle, strip, 0);
+      gridRaysCast++;
+    }
 
     raycaster3D.raycastThinWalls(rayHits, this->thinWalls,
                                  player.x, player.y, player.z, player.rot,
                                  stripAngle, strip);
 
-    raycaster3D.raycastSprites(rayHits,
-                               raycaster3D.grids, raycaster3D.gridWidth,
+    raycaster3D.raycastSprites(rayHits, raycaster3D.gridWidth,
                                raycaster3D.gridHeight, TILE_SIZE,
                                player.x, player.y, player.z, player.rot,
-                               stripAngle, strip, &sprites);
+                               stripAngle, strip, &sprites, index);
+
+    if (!terrain.empty()) {
+      raycastTerrain(rayHits, strip, stripAngle);
+    }
   }
   rayHitsCount = rayHits.size();
 }
 
-bool Game::isWallCell(int x, int y, int level) {
-  // first make sure that we cannot move outside the boundaries of the level
-  if (y < 0 || y >= MAP_HEIGHT || x < 0 || x >= MAP_WIDTH)
-    return true;
+void Game::castGridRay(int strip)
+{
+  vector<RayHit>& hits = gridStripHits[strip];
+  hits.clear();
+  raycaster3D.raycast(hits, player.x, player.y, player.z, player.rot,
+                      stripAngles[strip], strip, 0);
+  gridRaysCast++;
+}
+
+// Fills the strips between two strips that have been cast
+void Game::refineGridRays(int stripA, int stripB)
+{
+  if (stripB - stripA < 2) {
+    return;
+  }
+  if (canInterpolateGridRays(stripA, stripB)) {
+    interpolateGridRays(stripA, stripB);
+    return;
+  }
+  const int middle = (stripA + stripB) / 2;
+  castGridRay(middle);
+  refineGridRays(stripA, middle);
+  refineGridRays(middle, stripB);
+}
+
+/*
+Both strips have to hit the same faces in the same order. A cell between
+the two rays, like a pillar or a closed door in front of a long wall, is
+only sure to be hit by one of them if they are less than a cell apart
+everywhere they can see, so further away the strips are refined instead.
+*/
+bool Game::canInterpolateGridRays(int stripA, int stripB)
+{
+  const vector<RayHit>& hitsA = gridStripHits[stripA];
+  const vector<RayHit>& hitsB = gridStripHits[stripB];
+  if (hitsA.size() != hitsB.size()) {
+    return false;
+  }
+  const float spread = fabs(stripAngles[stripA] - stripAngles[stripB]);
+  const float reach = std::max(gridRayReach(stripA), gridRayReach(stripB));
+  if (reach * spread >= TILE_SIZE) {
+    return false;
+  }
+  for (size_t i=0; i<hitsA.size(); ++i) {
+    if (!sameWallRun(hitsA[i], hitsB[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+How far a cast strip can see. On each level that's the nearest wall that
+stops the ray. If a level has none, the ray went on over, under or through
+every wall there and it sees as far as the map edge.
+*/
+float Game::gridRayReach(int strip)
+{
+  const vector<RayHit>& hits = gridStripHits[strip];
+  float furthest = 0;
+  for (int level=0; level<highestCeilingLevel; ++level) {
+    const RayHit* stop = 0;
+    for (size_t i=0; i<hits.size(); ++i) {
+      const RayHit& hit = hits[i];
+      if (hit.level==level && (!stop || hit.distance < stop->distance) &&
+          !raycaster3D.needsNextWall(player.z, hit.wallX, hit.wallY, level)) {
+        stop = &hit;
+      }
+    }
+    if (!stop) {
+      // Window coordinates have the Y-axis pointing down
+      const float angle = player.rot + stripAngles[strip];
+      const float dx = cos(angle);
+      const float dy = -sin(angle);
+      const float mapW = (float)mapWidth * TILE_SIZE;
+      const float mapH = (float)mapHeight * TILE_SIZE;
+      float edge = mapW + mapH;
+      if (dx > 0) edge = std::min(edge, (mapW - player.x) / dx);
+      if (dx < 0) edge = std::min(edge, -player.x / dx);
+      if (dy > 0) edge = std::min(edge, (mapH - player.y) / dy);
+      if (dy < 0) edge = std::min(edge, -player.y / dy);
+      return edge;
+    }
+    furthest = std::max(furthest, stop->distance);
+  }
+  return furthest;
+}
+
+/*
+True if two hits are on one straight run of identical wall columns with
+identical columns in front of it, so a ray between them hits the same kind
+of wall on this grid line. Cells nearer than the run aren't checked here,
+see canInterpolateGridRays(). Doors are pushed halfway into their cells and
+always need their own rays.
+*/
+bool Game::sameWallRun(const RayHit& a, const RayHit& b)
+{
+  if (a.fog || b.fog || a.level != b.level || a.wallType != b.wallType ||
+      a.horizontal != b.horizontal) {
+    return false;
+  }
+  const int playerCellX = (int)player.x / TILE_SIZE;
+  const int playerCellY = (int)player.y / TILE_SIZE;
+  const bool aInPlayerCell = a.wallX==playerCellX && a.wallY==playerCellY;
+  const bool bInPlayerCell = b.wallX==playerCellX && b.wallY==playerCellY;
+  if (aInPlayerCell || bInPlayerCell) {
+    // Walls stacked over the player don't depend on the ray angle
+    return aInPlayerCell && bInPlayerCell && a.tileX == b.tileX;
+  }
+  if (a.right != b.right || a.up != b.up ||
+      std::max(a.distance, b.distance) >
+      std::min(a.distance, b.distance) * ADAPTIVE_DEPTH_RATIO) {
+    return false;
+  }
+  // A ray goes on over, under or through a wall it can see past, so a ray
+  // between two cells of the run would also hit the sides between them
+  if ((a.wallX != b.wallX || a.wallY != b.wallY) &&
+      raycaster3D.needsNextWall(player.z, a.wallX, a.wallY, a.level)) {
+    return false;
+  }
 
-  if (level==0) {
-    if (Raycaster::isDoor(g_map[y][x])) {
-      if (doors[x + y * MAP_WIDTH]) {
+  // Cells along the run are (along, across) with across fixed
+  int alongA, alongB, across, acrossFront;
+  if (a.horizontal) {
+    if (a.y != b.y) {
+      return false;
+    }
+    alongA = a.wallX;
+    alongB = b.wallX;
+    across = a.wallY;
+    acrossFront = a.up ? across + 1 : across - 1;
+  }
+  else {
+    if (a.x != b.x) {
+      return false;
+    }
+    alongA = a.wallY;
+    alongB = b.wallY;
+    across = a.wallX;
+    acrossFront = a.right ? across - 1 : across + 1;
+  }
+  const int first = std::min(alongA, alongB);
+  const int last = std::max(alongA, alongB);
+  const int gridCount = raycaster3D.gridCount;
+  for (int level=0; level<gridCount; ++level) {
+    const int wall = a.horizontal ?
+                     raycaster3D.safeCellAt(alongA, across, level) :
+                     raycaster3D.safeCellAt(across, alongA, level);
+    const int front = a.horizontal ?
+                      raycaster3D.safeCellAt(alongA, acrossFront, level) :
+                      raycaster3D.safeCellAt(acrossFront, alongA, level);
+    if (raycaster3D.isDoor(wall)) {
+      return false;
+    }
+    for (int along=first; along<=last; ++along) {
+      const int wallCell = a.horizontal ?
+                           raycaster3D.safeCellAt(along, across, level) :
+                           raycaster3D.safeCellAt(across, along, level);
+      const int frontCell = a.horizontal ?
+                            raycaster3D.safeCellAt(along, acrossFront, level) :
+                            raycaster3D.safeCellAt(acrossFront, along, level);
+      if (wallCell != wall || frontCell != front) {
         return false;
       }
-      return true;
     }
   }
+  return true;
+}
+
+// Moves the hits of stripA along their face lines for each strip up to stripB
+void Game::interpolateGridRays(int stripA, int stripB)
+{
+  const vector<RayHit>& hitsA = gridStripHits[stripA];
+  const int playerX = player.x;
+  const int playerY = player.y;
+  for (int strip=stripA+1; strip<stripB; ++strip) {
+    const float stripAngle = stripAngles[strip];
+    float rayAngle = stripAngle + player.rot;
+    while (rayAngle < 0) rayAngle += TWO_PI;
+    while (rayAngle >= TWO_PI) rayAngle -= TWO_PI;
+    const float tanAngle = tan(rayAngle);
+    const float cosStrip = cos(stripAngle);
+
+    vector<RayHit>& hits = gridStripHits[strip];
+    hits.assign(hitsA.begin(), hitsA.end());
+    for (size_t i=0; i<hits.size(); ++i) {
+      RayHit& rayHit = hits[i];
+      rayHit.strip = strip;
+      rayHit.rayAngle = rayAngle;
+      const bool inPlayerCell = rayHit.x==playerX && rayHit.y==playerY;
+      if (!inPlayerCell) {
+        if (rayHit.horizontal) {
+          rayHit.x = playerX + (playerY - rayHit.y) / tanAngle;
+          rayHit.wallX = (int)floor(rayHit.x / TILE_SIZE);
+          const float texX = fmod(rayHit.x, (float)TILE_SIZE);
+          rayHit.tileX = rayHit.up ? texX : TILE_SIZE - texX;
+        }
+        else {
+          rayHit.y = playerY + (playerX - rayHit.x) * tanAngle;
+          rayHit.wallY = (int)floor(rayHit.y / TILE_SIZE);
+          const float texX = fmod(rayHit.y, (float)TILE_SIZE);
+          rayHit.tileX = rayHit.right ? texX : TILE_SIZE - texX;
+        }
+        const float distX = playerX - rayHit.x;
+        const float distY = playerY - rayHit.y;
+        rayHit.distance = sqrt(distX*distX + distY*distY);
+        rayHit.sortdistance = rayHit.distance;
+      }
+      rayHit.correctDistance = rayHit.distance * cosStrip;
+    }
+  }
+}
+
+bool Game::isWallCell(int x, int y, int level) {
+  // first make sure that we cannot move outside the boundaries of the level
+  if (y < 0 || y >= mapHeight || x < 0 || x >= mapWidth)
+    return true;
 
-  // return true if the map block is not 0, ie. if there is a blocking wall.
-  return raycaster3D.safeCellAt(x,y,level);
+  // Solid blocks and closed doors are walls
+  return raycaster3D.blocksMovement(raycaster3D.safeCellAt(x,y,level));
 }
 
 bool Game::playerInWall(float playerX, float playerY, float playerZ) {
-  if (playerX<0 || playerY<0 || playerX>MAP_WIDTH*TILE_SIZE ||
-      playerY>MAP_HEIGHT*TILE_SIZE) {
+  if (playerX<0 || playerY<0 || playerX>mapWidth*TILE_SIZE ||
+      playerY>mapHeight*TILE_SIZE) {
     return true;
   }
   float playerWidth = TILE_SIZE/5;
@@ -2656,36 +4133,36 @@ bool Game::playerInWall(float playerX, float playerY, float playerZ) {
 
   // Top-Left
   if (raycaster3D.cellAt(playerTileLeft, playerTileTop, playerTileFeet)) {
-    if (!Raycaster::isDoor(g_map[playerTileTop][playerTileLeft])) {
+    if (!raycaster3D.isDoor(raycaster3D.cellAt(playerTileLeft, playerTileTop))) {
       return true;
     }
   }
 
   // Top-Right
   if (raycaster3D.cellAt(playerTileRight, playerTileTop, playerTileFeet)) {
-    if (!Raycaster::isDoor(g_map[playerTileTop][playerTileRight])) {
+    if (!raycaster3D.isDoor(raycaster3D.cellAt(playerTileRight, playerTileTop))) {
       return true;
     }
   }
 
   // Bottom-Left
   if (raycaster3D.cellAt(playerTileLeft, playerTileBottom, playerTileFeet)) {
-    if (!Raycaster::isDoor(g_map[playerTileBottom][playerTileLeft])) {
+    if (!raycaster3D.isDoor(raycaster3D.cellAt(playerTileLeft, playerTileBottom))) {
       return true;
     }
   }
 
   // Bottom-Right
   if (raycaster3D.cellAt(playerTileRight, playerTileBottom, playerTileFeet)) {
-    if (!Raycaster::isDoor(g_map[playerTileBottom][playerTileRight])) {
+    if (!raycaster3D.isDoor(raycaster3D.cellAt(playerTileRight, playerTileBottom))) {
       return true;
     }
   }
 
   // Feet
   if (raycaster3D.cellAt(playerTileX, playerTileY, playerTileFeet)) {
-    if (Raycaster::isDoor(g_map[playerTileY][playerTileX])) {
-      if (!doors[playerTileX + playerTileY * MAP_WIDTH]) {
+    if (raycaster3D.isDoor(raycaster3D.cellAt(playerTileX, playerTileY))) {
+      if (!isDoorOpen(playerTileX, playerTileY)) {
         return true;
       }
     }
@@ -2697,8 +4174,8 @@ bool Game::playerInWall(float playerX, float playerY, float playerZ) {
   // Head
   if (raycaster3D.cellAt(playerTileX, playerTileY, playerTileHead)) {
     if ( playerTileHead == 0 ) {
-      if (Raycaster::isDoor(g_map[playerTileY][playerTileX])) {
-        if (!doors[playerTileX + playerTileY * MAP_WIDTH]) {
+      if (raycaster3D.isDoor(raycaster3D.cellAt(playerTileX, playerTileY))) {
+        if (!isDoorOpen(playerTileX, playerTileY)) {
           return true;
         }
       }
@@ -2723,14 +4200,11 @@ void Game::onKeyUp( SDL_Event* evt ) {
         break;
       }
       case SDLK_LCTRL: {
-        if (!player.jumping) {
-          player.jumping = true;
-        }
+        pendingInput.jump = true;
         break;
       }
       case SDLK_r: {
-        reset();
-        printf("Game reset!\n");
+        pendingInput.reset = true;
         break;
       }
       case SDLK_t: {
@@ -2760,9 +4234,8 @@ void Game::onKeyUp( SDL_Event* evt ) {
         break;
       }
       case SDLK_3: {
-        skipDrawnSkyboxStrips = !skipDrawnSkyboxStrips;
-        printf("skipDrawnSkyboxStrips = %s\n",
-               skipDrawnSkyboxStrips?"true":"false");
+        mipmapsOn = !mipmapsOn;
+        printf("mipmapsOn = %s\n", mipmapsOn?"true":"false");
         break;
       }
       case SDLK_4: {
@@ -2771,23 +4244,32 @@ void Game::onKeyUp( SDL_Event* evt ) {
                skipDrawnHighestCeilingStrips?"true":"false");
         break;
       }
+      case SDLK_5: {
+        raycaster3D.fixedPoint = !raycaster3D.fixedPoint;
+        printf("fixedPointRaycast = %s\n",
+               raycaster3D.fixedPoint?"true":"false");
+        break;
+      }
+      case SDLK_6: {
+        adaptiveRaysOn = !adaptiveRaysOn;
+        printf("adaptiveRaysOn = %s\n", adaptiveRaysOn?"true":"false");
+        break;
+      }
       case SDLK_h: {
         printHelp();
         break;
       }
       case SDLK_RETURN2:
       case SDLK_RETURN: {
-        toggleDoorPressed();
+        pendingInput.use = true;
         break;
       }
       case SDLK_o: {
-        printf("Rotation set to 0\n");
-        player.rot = 0;
+        pendingInput.face = INPUT_FACE_EAST;
         break;
       }
       case SDLK_p: {
-        printf("Rotation set to pi degrees\n");
-        player.rot = M_PI;
+        pendingInput.face = INPUT_FACE_WEST;
         break;
       }
       case SDLK_g: {
@@ -2796,58 +4278,366 @@ void Game::onKeyUp( SDL_Event* evt ) {
         break;
       }
       case SDLK_SPACE: {
-        Mix_PlayChannel( -1, projectileFireSound, 0 );
-        addProjectile(SpriteTypeProjectile, player.x, player.y, player.z,
-                      TILE_SIZE, player.rot);
+        pendingInput.fire = true;
+        break;
+      }
+      case SDLK_TAB: {
+        setMouseLook(!mouseLook);
+        printf("mouseLook = %s\n", mouseLook?"true":"false");
         break;
       }
     }
 }
 
+// Key presses, mouse motion and clicks are collected in pendingInput until
+// the next tick takes them
+void Game::handleEvent( SDL_Event& event ) {
+  switch (event.type) {
+    case SDL_QUIT:
+      onQuit();
+      return;
+    case SDL_KEYDOWN:
+      onKeyDown( &event );
+      break;
+    case SDL_KEYUP:
+      onKeyUp( &event );
+      break;
+    case SDL_MOUSEMOTION:
+      if (!mouseLook) {
+        return;
+      }
+      pendingInput.mouseX += event.motion.xrel;
+      pendingInput.mouseY += event.motion.yrel;
+      break;
+    case SDL_MOUSEBUTTONDOWN:
+      if (event.button.button == SDL_BUTTON_LEFT) {
+        pendingInput.fire = true;
+      }
+      break;
+    default:
+      return;
+  }
+  if (!pendingInput.timestamp) {
+    pendingInput.timestamp = event.common.timestamp;
+  }
+}
+
+// Input for the next tick. Held keys are read now, everything else happened
+// since the last tick.
+InputSnapshot Game::takeInput() {
+  const Uint8* keyboard = SDL_GetKeyboardState(NULL);
+  InputSnapshot input = pendingInput;
+  pendingInput.clear();
+  input.mouseLook = mouseLook;
+
+  if (keyboard[SDL_SCANCODE_UP] || keyboard[SDL_SCANCODE_W]) {
+    input.move = 1;
+  }
+  else if (keyboard[SDL_SCANCODE_DOWN] || keyboard[SDL_SCANCODE_S]) {
+    input.move = -1;
+  }
+  if (keyboard[SDL_SCANCODE_LEFT] || keyboard[SDL_SCANCODE_A]) {
+    input.turn = -1;
+  }
+  else if (keyboard[SDL_SCANCODE_RIGHT] || keyboard[SDL_SCANCODE_D]) {
+    input.turn = 1;
+  }
+  if (keyboard[SDL_SCANCODE_Q]) {
+    input.strafe = -1;
+  }
+  else if (keyboard[SDL_SCANCODE_E]) {
+    input.strafe = 1;
+  }
+  if (keyboard[SDL_SCANCODE_PAGEDOWN]) {
+    input.look = -1;
+  }
+  else if (keyboard[SDL_SCANCODE_PAGEUP]) {
+    input.look = 1;
+  }
+  return input;
+}
+
+// Mouse look hides the cursor and keeps it in the window
+void Game::setMouseLook(bool on) {
+  mouseLook = on;
+  SDL_SetRelativeMouseMode(on ? SDL_TRUE : SDL_FALSE);
+  pendingInput.mouseX = pendingInput.mouseY = 0;
+}
+
+// Doors keep their open state in the CELL_DOOR_OPEN bit of their cell
+bool Game::isDoorOpen(int x, int y) {
+  const int cell = raycaster3D.safeCellAt(x, y, 0);
+  return cell > 0 && (cell & CELL_DOOR_OPEN);
+}
+
+// Thin walls use wall types that aren't materials so they are never doors
+bool Game::isDoorHit(const RayHit& rayHit) {
+  return !rayHit.thinWall && raycaster3D.isDoor(rayHit.wallType);
+}
+
+// Headless Games have no sounds loaded
+void Game::playSound(Mix_Chunk* sound) {
+  if (sound) {
+    Mix_PlayChannel( -1, sound, 0 );
+  }
+}
+
 void Game::toggleDoor( int x, int y ) {
-  int offset = x + y * MAP_WIDTH;
-  doors[offset] = !doors[offset];
-  if (doors[offset]) {
-    Mix_PlayChannel( -1, doorOpenSound, 0 );
+  raycaster3D.setCell(x, y, 0, raycaster3D.cellAt(x, y) ^ CELL_DOOR_OPEN);
+  if (isDoorOpen(x, y)) {
+    playSound(assets.doorOpenSound);
   }
   else {
-    Mix_PlayChannel( -1, doorCloseSound, 0 );
+    playSound(assets.doorCloseSound);
+  }
+}
+
+/*
+Doors are cells, which the render thread reads, so run() toggles the door
+of a use key press between frames rather than in the tick that takes the
+press. The player doesn't move between the two, so it's the same door and
+a recording of the tick still replays the same.
+*/
+void Game::usePendingDoor()
+{
+  // A reset in the same tick goes first and would undo the door
+  if (pendingInput.use && !pendingInput.reset && !pendingUseDone) {
+    toggleDoorPressed();
+    pendingUseDone = true;
   }
 }
 
 void Game::toggleDoorPressed()
 {
-  const int wallX = player.x / TILE_SIZE;
-  const int wallY = player.y / TILE_SIZE;
+  const int wallX = world.player.x / TILE_SIZE;
+  const int wallY = world.player.y / TILE_SIZE;
   const int level = 0;
   int rightWall = raycaster3D.safeCellAt(wallX+1, wallY, level);
-  if (Raycaster::isDoor(rightWall)) {
-    printf("Triggering east door\n");
+  if (raycaster3D.isDoor(rightWall)) {
+    if (!quiet) {
+      printf("Triggering east door\n");
+    }
     toggleDoor(wallX+1, wallY);
     return;
   }
   int leftWall = raycaster3D.safeCellAt(wallX-1, wallY, level);
-  if (Raycaster::isDoor(leftWall)) {
-    printf("Triggering west door\n");
+  if (raycaster3D.isDoor(leftWall)) {
+    if (!quiet) {
+      printf("Triggering west door\n");
+    }
     toggleDoor(wallX-1, wallY);
     return;
   }
   int bottomWall = raycaster3D.safeCellAt(wallX, wallY+1, level);
-  if (Raycaster::isDoor(bottomWall)) {
-    printf("Triggering south door\n");
+  if (raycaster3D.isDoor(bottomWall)) {
+    if (!quiet) {
+      printf("Triggering south door\n");
+    }
     toggleDoor(wallX, wallY+1);
     return;
   }
   int topWall = raycaster3D.safeCellAt(wallX, wallY-1, level);
-  if (Raycaster::isDoor(topWall)) {
-    printf("Triggering north door\n");
+  if (raycaster3D.isDoor(topWall)) {
+    if (!quiet) {
+      printf("Triggering north door\n");
+    }
     toggleDoor(wallX, wallY-1);
     return;
   }
 }
 
+// Height of the first slope found under a point, or -1. Only used by
+// benchSlopes() to compare the old linear search against ThickWallIndex.
+static float linearSlopeHeight(const vector<ThickWall*>& slopes,
+                               float x, float y)
+{
+  for (size_t i=0; i<slopes.size(); ++i) {
+    if (slopes[i]->containsPoint(x, y)) {
+      return slopes[i]->startHeight + slopes[i]->slope * (x - slopes[i]->x);
+    }
+  }
+  return -1;
+}
+
+static float indexedSlopeHeight(const ThickWallIndex& index, float x, float y)
+{
+  int count;
+  const ThickWallIndex::Entry* entries = index.entriesAt(x, y, count);
+  for (int i=0; i<count; ++i) {
+    if (entries[i].contains(x, y)) {
+      ThickWall* slope = entries[i].thickWall;
+      return slope->startHeight + slope->slope * (x - slope->x);
+    }
+  }
+  return -1;
+}
+
+// -benchslopes: times slope height queries with a linear search and with
+// ThickWallIndex as the number of slopes grows. The map grows with the
+// slope count so slopes per cell stay about the same.
+static void benchSlopes()
+{
+  const int counts[] = { 4, 40, 400, 4000, 10000 };
+  const int queryCount = 200000;
+  srand(1);
+  for (size_t c=0; c<sizeof(counts)/sizeof(counts[0]); ++c) {
+    const int count = counts[c];
+    const int cells = std::max(8, (int) ceil(sqrt(count * 4.0f)));
+    vector<ThickWall*> slopes;
+    for (int i=0; i<count; ++i) {
+      ThickWall* slope = new ThickWall();
+      slope->createRectSlope(SLOPE_TYPE_WEST_EAST,
+                             (rand() % cells) * TILE_SIZE,
+                             (rand() % cells) * TILE_SIZE,
+                             (1 + rand() % 3) * TILE_SIZE,
+                             (1 + rand() % 3) * TILE_SIZE,
+                             0, 0, TILE_SIZE);
+      slopes.push_back(slope);
+    }
+    vector<Point> queries;
+    for (int i=0; i<queryCount; ++i) {
+      queries.push_back(Point(rand() % (cells * TILE_SIZE),
+                              rand() % (cells * TILE_SIZE)));
+    }
+
+    const Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 start = SDL_GetPerformanceCounter();
+    ThickWallIndex index;
+    index.build(slopes, TILE_SIZE);
+    const double buildMs = (SDL_GetPerformanceCounter() - start) * 1000.0
+                           / frequency;
+
+    float linearSum = 0, indexedSum = 0;
+    start = SDL_GetPerformanceCounter();
+    for (int i=0; i<queryCount; ++i) {
+      linearSum += linearSlopeHeight(slopes, queries[i].x, queries[i].y);
+    }
+    const double linearNs = (SDL_GetPerformanceCounter() - start) * 1e9
+                            / frequency / queryCount;
+    start = SDL_GetPerformanceCounter();
+    for (int i=0; i<queryCount; ++i) {
+      indexedSum += indexedSlopeHeight(index, queries[i].x, queries[i].y);
+    }
+    const double indexedNs = (SDL_GetPerformanceCounter() - start) * 1e9
+                             / frequency / queryCount;
+
+    printf("%5d slopes: linear %8.1f ns/query, indexed %6.1f ns/query, "
+           "build %.2f ms%s\n", count, linearNs, indexedNs, buildMs,
+           linearSum == indexedSum ? "" : " (RESULTS DIFFER)");
+    for (size_t i=0; i<slopes.size(); ++i) {
+      delete slopes[i];
+    }
+  }
+}
+
+// -framereader <name> [seconds]: reads frames from the frameRing of a game
+// running on this machine, in place, and prints once a second how many came
+// through and how many it and the game dropped
+static void readFrameRing(const char* name, int seconds)
+{
+  FrameRingReader reader;
+  if (!reader.open(name)) {
+    return;
+  }
+  const FrameRingHeader* header = reader.getHeader();
+  printf("%s: %u slots of up to %ux%u%s\n", name, header->slotCount,
+         header->maxWidth, header->maxHeight,
+         header->flags & FRAME_HAS_AUX ? " with aux buffers" : "");
+  const Uint32 start = SDL_GetTicks();
+  Uint32 nextReport = start + 1000;
+  Uint32 reportRead = 0;
+  for (;;) {
+    const FrameSlotHeader* frame = reader.acquire();
+    if (!frame) {
+      SDL_Delay(1);
+    }
+    const Uint32 now = SDL_GetTicks();
+    if (frame && (int) (now - nextReport) >= 0) {
+      // Looked at straight in the shared memory
+      const int center = frame->height/2 * frame->width + frame->width/2;
+      printf("%3u fps  tick %u  %ux%u  pos=(%.0f,%.0f,%.0f)  "
+             "center=%06x",
+             reader.getFramesRead() - reportRead, frame->tick,
+             frame->width, frame->height, frame->playerX, frame->playerY,
+             frame->playerZ, framePixels(frame)[center] & 0xffffff);
+      if (frame->flags & FRAME_HAS_AUX) {
+        printf(" depth=%.0f", frameDepth(frame)[center]);
+      }
+      printf("  missed %u  dropped %d\n", reader.getFramesMissed(),
+             reader.getFramesDropped());
+      reportRead = reader.getFramesRead();
+      nextReport = now + 1000;
+    }
+    reader.release(frame);
+    if (seconds > 0 && now - start >= (Uint32) seconds * 1000) {
+      break;
+    }
+  }
+  printf("Read %u frames, missed %u\n", reader.getFramesRead(),
+         reader.getFramesMissed());
+}
+
 int main(int argc, char** argv){
     Game game;
+
+    if (argc == 2 && !strcmp(argv[1], "-benchslopes")) {
+      benchSlopes();
+      return 0;
+    }
+
+    // -benchmark [frames] draws a full turn on the spot and exits
+    if (argc >= 2 && argc <= 3 && !strcmp(argv[1], "-benchmark")) {
+      game.start(argc == 3 ? atoi(argv[2]) : 360);
+      return 0;
+    }
+
+    if (argc >= 2 && argc <= 6 && !strcmp(argv[1], "-vectorenv")) {
+      benchVectorEnv(argc >= 3 ? atoi(argv[2]) : 64,
+                     argc >= 4 ? atoi(argv[3]) : SDL_GetCPUCount(),
+                     argc >= 5 ? atoi(argv[4]) : 600,
+                     argc >= 6 ? atoi(argv[5]) : 1);
+      return 0;
+    }
+
+    if (argc >= 2 && argc <= 5 && !strcmp(argv[1], "-cameras")) {
+      benchCameras(argc >= 3 ? atoi(argv[2]) : 16,
+                   argc >= 4 ? atoi(argv[3]) : SDL_GetCPUCount(),
+                   argc >= 5 ? atoi(argv[4]) : 60);
+      return 0;
+    }
+
+    if (argc >= 3 && argc <= 4 && !strcmp(argv[1], "-framereader")) {
+      readFrameRing(argv[2], argc == 4 ? atoi(argv[3]) : 0);
+      return 0;
+    }
+
+    // -record <file> plays as usual and saves every tick's input to a file.
+    // -replay <file> plays it back as fast as possible and prints timings.
+    if (argc == 3 && !strcmp(argv[1], "-record")) {
+      game.recordTo(argv[2]);
+      game.start();
+      return 0;
+    }
+    if (argc == 3 && !strcmp(argv[1], "-replay")) {
+      game.replayFrom(argv[2]);
+      game.start();
+      return 0;
+    }
+
+    // -savelevel <file> [heightmap.bmp [maxHeight]] writes the built-in
+    // level to a level file and exits. A grayscale heightmap adds terrain.
+    if (argc >= 3 && argc <= 5 && !strcmp(argv[1], "-savelevel")) {
+      const float maxHeight = argc==5 ? atof(argv[4]) : TILE_SIZE*2;
+      if (argc >= 4 && !game.loadHeightmap(argv[3], maxHeight)) {
+        return 1;
+      }
+      if (!game.saveLevel(argv[2])) {
+        return 1;
+      }
+      printf("Saved level to %s\n", argv[2]);
+      return 0;
+    }
+
     game.start();
     return 0;
 }
@@ -0,0 +1,130 @@
+#include "mappedfile.h"
+#include <cstdio>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace al;
+
+MappedFile::MappedFile()
+: data(0), size(0), fileHandle(0), mappingHandle(0), fd(-1)
+{
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+void MappedFile::swap(MappedFile& other)
+{
+  std::swap(data, other.data);
+  std::swap(size, other.size);
+  std::swap(fileHandle, other.fileHandle);
+  std::swap(mappingHandle, other.mappingHandle);
+  std::swap(fd, other.fd);
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& filename)
+{
+  close();
+  HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    printf("Could not open %s\n", filename.c_str());
+    return false;
+  }
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+    printf("Could not get size of %s\n", filename.c_str());
+    CloseHandle(file);
+    return false;
+  }
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!mapping) {
+    printf("CreateFileMapping failed for %s\n", filename.c_str());
+    CloseHandle(file);
+    return false;
+  }
+  void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!view) {
+    printf("MapViewOfFile failed for %s\n", filename.c_str());
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+  fileHandle = file;
+  mappingHandle = mapping;
+  data = view;
+  size = (size_t) fileSize.QuadPart;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (data) {
+    UnmapViewOfFile(data);
+    data = 0;
+  }
+  if (mappingHandle) {
+    CloseHandle((HANDLE) mappingHandle);
+    mappingHandle = 0;
+  }
+  if (fileHandle) {
+    CloseHandle((HANDLE) fileHandle);
+    fileHandle = 0;
+  }
+  size = 0;
+}
+
+#else
+
+bool MappedFile::open(const std::string& filename)
+{
+  close();
+  int file = ::open(filename.c_str(), O_RDONLY);
+  if (file < 0) {
+    printf("Could not open %s\n", filename.c_str());
+    return false;
+  }
+  struct stat st;
+  if (fstat(file, &st) != 0 || st.st_size == 0) {
+    printf("Could not get size of %s\n", filename.c_str());
+    ::close(file);
+    return false;
+  }
+  void* view = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  if (view == MAP_FAILED) {
+    printf("mmap failed for %s\n", filename.c_str());
+    ::close(file);
+    return false;
+  }
+  fd = file;
+  data = view;
+  size = (size_t) st.st_size;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (data) {
+    munmap(data, size);
+    data = 0;
+  }
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  size = 0;
+}
+
+#endif
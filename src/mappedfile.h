@@ -0,0 +1,44 @@
+/*
+Read-only memory mapped files.
+
+Author: Andrew Lim
+https://github.com/andrew-lim
+*/
+#ifndef AL_MAPPEDFILE_H
+#define AL_MAPPEDFILE_H
+#include <string>
+#include <cstddef>
+
+namespace al {
+
+/**
+ * Maps a whole file into memory for reading. Uses MapViewOfFile() on Windows
+ * and mmap() everywhere else. The data stays valid until close() is called
+ * or the MappedFile is destroyed.
+ */
+class MappedFile {
+public:
+  MappedFile();
+  ~MappedFile();
+  bool open(const std::string& filename);
+  void close();
+  // Exchanges the mappings of two MappedFiles
+  void swap(MappedFile& other);
+  bool isOpen() const { return data != 0; }
+  const char* getData() const { return (const char*) data; }
+  size_t getSize() const { return size; }
+private:
+  // Not copyable
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  void* data;
+  size_t size;
+  void* fileHandle;     // Windows only
+  void* mappingHandle;  // Windows only
+  int fd;               // POSIX only
+};
+
+} // al
+
+#endif
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <cstdio>
 #include <cassert>
+#include <limits>
 #include "shape.h"
 using namespace std;
 using namespace al::raycasting;
@@ -45,71 +46,6 @@ float ThinWall::distanceToOrigin(float ix, float iy)
   return sqrt(dx*dx + dy*dy);
 }
 
-bool RayHit::findSiblingAtAngle(float originAngle, float playerRot,
-                                float playerX, float playerY,
-                                float gridWidth, float tileSize)
-{
-  if (!thinWall->thickWall) {
-    return false;
-  }
-
-  ThickWall* thickWall = thinWall->thickWall;
-
-  const float TWO_PI = M_PI*2;
-  float rayAngle = originAngle; // Note: we don't add player angle
-  while (rayAngle < 0) rayAngle += TWO_PI;
-  while (rayAngle >= TWO_PI) rayAngle -= TWO_PI;
-
-  bool right = (rayAngle<TWO_PI*0.25 && rayAngle>=0) || // Quadrant 1
-              (rayAngle>TWO_PI*0.75); // Quadrant 4
-
-  float vx = 0;
-  if (right) {
-    vx = gridWidth * tileSize;
-  }
-  else {
-    vx = 0;
-  }
-
-  float vy = playerY + (playerX-vx)*tan(rayAngle);
-
-  for (size_t i=0; i<thickWall->thinWalls.size(); ++i) {
-    ThinWall* siblingThinWall = &thickWall->thinWalls[i];
-    if (siblingThinWall == this->thinWall) {
-      continue;
-    }
-    float x=0, y=0;
-    if (Shape::linesIntersect(siblingThinWall->x1, siblingThinWall->y1,
-                              siblingThinWall->x2, siblingThinWall->y2,
-                              playerX, playerY,
-                              vx, vy, &x, &y))
-    {
-      float distX = playerX - x;
-      float distY = playerY - y;
-      float squaredDistance = distX*distX + distY*distY;
-      float distance = sqrt(squaredDistance);
-      this->siblingDistance = distance;
-      this->siblingThinWallZ = siblingThinWall->z;
-      this->siblingWallHeight = siblingThinWall->height;
-      if (distance) {
-        this->siblingCorrectDistance = distance * cos(playerRot-rayAngle);
-      }
-      // Slope
-      if (siblingThinWall->slope) {
-        this->siblingWallHeight = thickWall->startHeight +
-                                  siblingThinWall->slope *
-                                  siblingThinWall->distanceToOrigin(x,y);
-        if (thickWall->invertedSlope) {
-          this->siblingInvertedZ = siblingWallHeight;
-          this->siblingWallHeight = thickWall->tallerHeight - siblingWallHeight;
-        }
-      }
-      return true;
-    }
-  }
-  return false;
-}
-
 ThickWall::ThickWall()
 {
   type = 0;
@@ -384,6 +320,226 @@ bool ThickWall::containsPoint(float px, float py)
   return false;
 }
 
+// Clips a ray against a convex polygon of either winding, edges included
+// like Shape::pointInTriangle()
+static bool clipRayToConvex(const al::Point* points, int count,
+                            float originX, float originY,
+                            float dirX, float dirY,
+                            float& enterDistance, float& exitDistance)
+{
+  float area = 0;
+  for (int i=0; i<count; ++i) {
+    const al::Point& a = points[i];
+    const al::Point& b = points[(i+1)%count];
+    area += a.x * b.y - b.x * a.y;
+  }
+  if (area == 0) {
+    return false;
+  }
+  const float winding = area > 0 ? 1 : -1;
+  enterDistance = 0;
+  exitDistance = numeric_limits<float>::infinity();
+  for (int i=0; i<count; ++i) {
+    const al::Point& a = points[i];
+    const al::Point& b = points[(i+1)%count];
+    const float edgeX = b.x - a.x;
+    const float edgeY = b.y - a.y;
+    // Inside while num + t*den >= 0
+    const float num = winding*(edgeX*(originY-a.y) - edgeY*(originX-a.x));
+    const float den = winding*(edgeX*dirY - edgeY*dirX);
+    if (den == 0) {
+      if (num < 0) {
+        return false;
+      }
+      continue;
+    }
+    const float t = -num / den;
+    if (den > 0) {
+      enterDistance = std::max(enterDistance, t);
+    }
+    else {
+      exitDistance = std::min(exitDistance, t);
+    }
+  }
+  return enterDistance <= exitDistance;
+}
+
+bool ThickWall::rayInterval(float originX, float originY,
+                            float dirX, float dirY,
+                            float& enterDistance, float& exitDistance)
+{
+  if (type == THICK_WALL_TYPE_RECT) {
+    const Point corners[4] = {
+      Point(x, y), Point(x+w, y), Point(x+w, y+h), Point(x, y+h)
+    };
+    return clipRayToConvex(corners, 4, originX, originY, dirX, dirY,
+                           enterDistance, exitDistance);
+  }
+  if (type == THICK_WALL_TYPE_TRIANGLE) {
+    return clipRayToConvex(&points[0], 3, originX, originY, dirX, dirY,
+                           enterDistance, exitDistance);
+  }
+  if (type == THICK_WALL_TYPE_QUAD) {
+    // Same two triangles as containsPoint(). If the ray crosses both, they
+    // only count as one run when they touch.
+    const Point first[3] = { points[0], points[1], points[2] };
+    const Point second[3] = { points[2], points[3], points[0] };
+    float otherEnter, otherExit;
+    const bool hit1 = clipRayToConvex(first, 3, originX, originY, dirX, dirY,
+                                      enterDistance, exitDistance);
+    const bool hit2 = clipRayToConvex(second, 3, originX, originY, dirX, dirY,
+                                      otherEnter, otherExit);
+    if (!hit1 && !hit2) {
+      return false;
+    }
+    if (!hit1 || (hit2 && otherEnter < enterDistance)) {
+      std::swap(enterDistance, otherEnter);
+      std::swap(exitDistance, otherExit);
+    }
+    if (hit1 && hit2 && otherEnter <= exitDistance) {
+      exitDistance = std::max(exitDistance, otherExit);
+    }
+    return true;
+  }
+  return false;
+}
+
+ThickWallIndex::ThickWallIndex()
+: originX(0), originY(0), cellsX(0), cellsY(0), invTileSize(0)
+{
+}
+
+void ThickWallIndex::clear()
+{
+  originX = originY = cellsX = cellsY = 0;
+  cellStart.clear();
+  entries.clear();
+}
+
+void ThickWallIndex::bounds(const ThickWall& thickWall,
+                            float& minX, float& minY, float& maxX, float& maxY)
+{
+  if (thickWall.type == THICK_WALL_TYPE_RECT) {
+    minX = thickWall.x;
+    minY = thickWall.y;
+    maxX = thickWall.x + thickWall.w;
+    maxY = thickWall.y + thickWall.h;
+    return;
+  }
+  minX = maxX = thickWall.points.empty() ? 0 : thickWall.points[0].x;
+  minY = maxY = thickWall.points.empty() ? 0 : thickWall.points[0].y;
+  for (size_t i=1; i<thickWall.points.size(); ++i) {
+    minX = std::min(minX, thickWall.points[i].x);
+    minY = std::min(minY, thickWall.points[i].y);
+    maxX = std::max(maxX, thickWall.points[i].x);
+    maxY = std::max(maxY, thickWall.points[i].y);
+  }
+}
+
+// Counting sort of (cell, ThickWall) pairs into cellStart and entries.
+// containsPoint() includes the edges, so a ThickWall that ends exactly on a
+// cell boundary is listed in the cell past it too.
+void ThickWallIndex::build(const vector<ThickWall*>& thickWalls, int tileSize)
+{
+  clear();
+  invTileSize = 1.0f / tileSize;
+  if (thickWalls.empty()) {
+    return;
+  }
+
+  vector<int> cellBounds(thickWalls.size() * 4);
+  int maxCellX = 0, maxCellY = 0;
+  for (size_t i=0; i<thickWalls.size(); ++i) {
+    float minX, minY, maxX, maxY;
+    bounds(*thickWalls[i], minX, minY, maxX, maxY);
+    int* b = &cellBounds[i*4];
+    b[0] = (int) floor(minX * invTileSize);
+    b[1] = (int) floor(minY * invTileSize);
+    b[2] = (int) floor(maxX * invTileSize);
+    b[3] = (int) floor(maxY * invTileSize);
+    if (!i || b[0] < originX) originX = b[0];
+    if (!i || b[1] < originY) originY = b[1];
+    if (!i || b[2] > maxCellX) maxCellX = b[2];
+    if (!i || b[3] > maxCellY) maxCellY = b[3];
+  }
+  cellsX = maxCellX - originX + 1;
+  cellsY = maxCellY - originY + 1;
+
+  cellStart.assign(cellsX * cellsY + 1, 0);
+  for (size_t i=0; i<thickWalls.size(); ++i) {
+    const int* b = &cellBounds[i*4];
+    for (int y=b[1]; y<=b[3]; ++y) {
+      for (int x=b[0]; x<=b[2]; ++x) {
+        cellStart[(x-originX) + (y-originY)*cellsX + 1]++;
+      }
+    }
+  }
+  for (size_t i=1; i<cellStart.size(); ++i) {
+    cellStart[i] += cellStart[i-1];
+  }
+
+  entries.resize(cellStart.back());
+  vector<int> next(cellStart.begin(), cellStart.end()-1);
+  for (size_t i=0; i<thickWalls.size(); ++i) {
+    ThickWall* thickWall = thickWalls[i];
+    const int* b = &cellBounds[i*4];
+    for (int y=b[1]; y<=b[3]; ++y) {
+      for (int x=b[0]; x<=b[2]; ++x) {
+        Entry& entry = entries[next[(x-originX) + (y-originY)*cellsX]++];
+        entry.thickWall = thickWall;
+        // Only rectangles are cheap to check, and they are most slopes
+        entry.coversCell = thickWall->type == THICK_WALL_TYPE_RECT &&
+                           thickWall->x <= x*tileSize &&
+                           thickWall->y <= y*tileSize &&
+                           (x+1)*tileSize <= thickWall->x + thickWall->w &&
+                           (y+1)*tileSize <= thickWall->y + thickWall->h;
+      }
+    }
+  }
+}
+
+static bool entryBefore(const SpriteIndex::Entry& a,
+                        const SpriteIndex::Entry& b)
+{
+  if (a.cellY != b.cellY) return a.cellY < b.cellY;
+  if (a.cellX != b.cellX) return a.cellX < b.cellX;
+  return a.sprite < b.sprite;
+}
+
+// Sprites are in the cell findSpritesInCell() puts them in
+void SpriteIndex::build(const vector<Sprite>& sprites, int tileSize)
+{
+  entries.resize(sprites.size());
+  for (size_t i=0; i<sprites.size(); ++i) {
+    Entry& entry = entries[i];
+    entry.cellX = (int)sprites[i].x / tileSize;
+    entry.cellY = (int)sprites[i].y / tileSize;
+    entry.sprite = i;
+  }
+  std::sort(entries.begin(), entries.end(), entryBefore);
+}
+
+const SpriteIndex::Entry* SpriteIndex::entriesAt(int cellX, int cellY,
+                                                 int& count) const
+{
+  count = 0;
+  if (entries.empty()) {
+    return 0;
+  }
+  Entry key;
+  key.cellX = cellX;
+  key.cellY = cellY;
+  key.sprite = -1;
+  const Entry* end = &entries[0] + entries.size();
+  const Entry* first = std::lower_bound(&entries[0], end, key, entryBefore);
+  const Entry* last = first;
+  while (last != end && last->cellX == cellX && last->cellY == cellY) {
+    ++last;
+  }
+  count = last - first;
+  return count ? first : 0;
+}
+
 bool RayHit::sameRayHit(const RayHit& rayHit2)
 {
   const RayHit& rayHit = *this;
@@ -455,11 +611,143 @@ void Raycaster::createGrids( int gridWidth, int gridHeight, int gridCount,
   this->gridHeight = gridHeight;
   this->gridCount = gridCount;
   this->tileSize = tileSize;
-  grids.clear();
+  cells.assign(gridWidth * gridHeight * gridCount, 0);
+
+  // Distance 0 everywhere means no empty space skipping until
+  // computeDistanceFields() is called
+  distanceFields.assign(gridWidth * gridHeight * gridCount, 0);
+  changedRows.assign(gridHeight, 0);
+}
+
+const CellMaterial Raycaster::notResidentMaterial = { 0, MATERIAL_SOLID };
+
+void Raycaster::resetMaterials()
+{
+  materials[0].textureID = 0;
+  materials[0].flags = MATERIAL_TRANSPARENT;
+  for (int i=1; i<MAX_MATERIALS; ++i) {
+    materials[i].textureID = 0;
+    materials[i].flags = MATERIAL_SOLID;
+  }
+}
+
+void Raycaster::setChunkStore(ChunkStore* chunkStore, int tileSize)
+{
+  this->chunkStore = chunkStore;
+  if (chunkStore) {
+    gridWidth = chunkStore->getWidth();
+    gridHeight = chunkStore->getHeight();
+    gridCount = chunkStore->getGridCount();
+    this->tileSize = tileSize;
+    std::vector<Cell>().swap(cells);
+    std::vector<unsigned char>().swap(distanceFields);
+    std::vector<unsigned char>().swap(changedRows);
+  }
+}
+
+void Raycaster::clearChangedRows()
+{
+  std::fill(changedRows.begin(), changedRows.end(), 0);
+}
+
+void Raycaster::computeDistanceFields()
+{
+  distanceFields.resize(cells.size());
   for (int z=0; z<gridCount; ++z) {
-    std::vector<int> grid;
-    grid.resize( gridWidth * gridHeight );
-    grids.push_back(grid);
+    updateDistanceField(z, 0, 0, gridWidth-1, gridHeight-1);
+  }
+}
+
+/*
+Two pass chamfer transform using the Chebyshev metric, where all 8 neighbours
+are 1 cell away. The first pass goes top-left to bottom-right looking at
+neighbours above and to the left. The second pass goes the other way.
+Neighbours outside the rectangle are read as they are, so they act as seeds
+for cells inside it.
+*/
+void Raycaster::updateDistanceField(int z, int x0, int y0, int x1, int y1)
+{
+  x0 = std::max(x0, 0);
+  y0 = std::max(y0, 0);
+  x1 = std::min(x1, gridWidth-1);
+  y1 = std::min(y1, gridHeight-1);
+  if (x0>x1 || y0>y1) {
+    return;
+  }
+  std::fill(changedRows.begin() + y0, changedRows.begin() + y1 + 1, 1);
+  const Cell* grid = &cells[z * gridWidth * gridHeight];
+  unsigned char* field = &distanceFields[z * gridWidth * gridHeight];
+
+  for (int y=y0; y<=y1; ++y) {
+    for (int x=x0; x<=x1; ++x) {
+      const int offset = x + y * gridWidth;
+      field[offset] = grid[offset] ? 0 : MAX_EMPTY_DISTANCE;
+    }
+  }
+
+  for (int y=y0; y<=y1; ++y) {
+    for (int x=x0; x<=x1; ++x) {
+      const int offset = x + y * gridWidth;
+      int d = field[offset];
+      if (!d) {
+        continue;
+      }
+      if (x>0) {
+        d = std::min(d, field[offset-1] + 1);
+      }
+      if (y>0) {
+        const int above = offset - gridWidth;
+        d = std::min(d, field[above] + 1);
+        if (x>0) {
+          d = std::min(d, field[above-1] + 1);
+        }
+        if (x<gridWidth-1) {
+          d = std::min(d, field[above+1] + 1);
+        }
+      }
+      field[offset] = d;
+    }
+  }
+
+  for (int y=y1; y>=y0; --y) {
+    for (int x=x1; x>=x0; --x) {
+      const int offset = x + y * gridWidth;
+      int d = field[offset];
+      if (!d) {
+        continue;
+      }
+      if (x<gridWidth-1) {
+        d = std::min(d, field[offset+1] + 1);
+      }
+      if (y<gridHeight-1) {
+        const int below = offset + gridWidth;
+        d = std::min(d, field[below] + 1);
+        if (x>0) {
+          d = std::min(d, field[below-1] + 1);
+        }
+        if (x<gridWidth-1) {
+          d = std::min(d, field[below+1] + 1);
+        }
+      }
+      field[offset] = d;
+    }
+  }
+}
+
+void Raycaster::setCell(int x, int y, int z, Cell value)
+{
+  if (chunkStore) {
+    chunkStore->setCell(x, y, z, value);
+    return;
+  }
+  Cell& cell = cells[x + (y + z*gridHeight) * gridWidth];
+  const bool wasEmpty = !cell;
+  cell = value;
+  changedRows[y] = 1;
+  if (wasEmpty != !value && !distanceFields.empty()) {
+    // Only cells closer than MAX_EMPTY_DISTANCE can be affected
+    const int r = MAX_EMPTY_DISTANCE;
+    updateDistanceField(z, x-r, y-r, x+r, y+r);
   }
 }
 
@@ -547,74 +835,48 @@ vector<Sprite*> Raycaster::findSpritesInCell(vector<Sprite>& sprites,
   return spritesFound;
 }
 
-// Checks if there are any empty blocks below specified block
-bool Raycaster::anySpaceBelow( std::vector< std::vector<int> >& grids,
-                               int gridWidth, int x, int y, int z )
+// Checks if there are any transparent blocks below specified block
+bool Raycaster::anySpaceBelow(int x, int y, int z)
 {
-  if (z==0) {
-    std::vector<int>& grid = grids[ 0 ];
-    if (x>=0 && y>=0) {
-      if (isDoor(grid[x+y*gridWidth])) {
-        return true;
-      }
-    }
+  if (z==0 && isTransparent(cellAt(x, y))) {
+    return true;
   }
   for (int level=z-1; level>=0; level--) {
-    std::vector<int>& grid = grids[ level ];
-    int gridOffset = x + y*gridWidth;
-    if (0 == grid[gridOffset] || isDoor(grid[gridOffset])) {
+    if (isTransparent(cellAt(x, y, level))) {
       return true;
     }
   }
   return false;
 }
 
-// Checks if there are any empty blocks above specified block
-bool Raycaster::anySpaceAbove( std::vector< std::vector<int> >& grids,
-                               int gridWidth, int x, int y, int z )
+// Checks if there are any transparent blocks above specified block
+bool Raycaster::anySpaceAbove(int x, int y, int z)
 {
-  if (z==0) {
-    std::vector<int>& grid = grids[ 0 ];
-    if (x>=0 && y>=0) {
-      if (isDoor(grid[x+y*gridWidth])) {
-        return true;
-      }
-    }
+  if (z==0 && isTransparent(cellAt(x, y))) {
+    return true;
   }
-  for (int level=z+1; level<(int)grids.size(); level++) {
-    std::vector<int>& grid = grids[ level ];
-    int gridOffset = x + y*gridWidth;
-    if (0 == grid[gridOffset] || isDoor(grid[gridOffset])) {
+  for (int level=z+1; level<gridCount; level++) {
+    if (isTransparent(cellAt(x, y, level))) {
       return true;
     }
   }
   return false;
 }
 
-bool Raycaster::needsNextWall(std::vector< std::vector<int> >& grids,
-                              float playerZ, int tileSize,
-                              int gridWidth, int x, int y, int z )
+bool Raycaster::needsNextWall(float playerZ, int x, int y, int z)
 {
-  if (z==0) {
-    std::vector<int>& grid = grids[ 0 ];
-    if (x>=0 && y>=0) {
-      if (isDoor(grid[x+y*gridWidth])) {
-        return true;
-      }
-    }
+  if (z==0 && isTransparent(cellAt(x, y))) {
+    return true;
   }
 
   float eyeHeight  = tileSize/2 + playerZ;
   float wallBottom = z * tileSize;
   float wallTop    = wallBottom + tileSize;
-  bool eyeAboveWall = eyeHeight > wallTop;
-  bool eyeBelowWall = eyeHeight < wallBottom;
-
-  if (eyeAboveWall) {
-    return anySpaceAbove(grids, gridWidth, x, y, z);
+  if (eyeHeight > wallTop) {
+    return anySpaceAbove(x, y, z);
   }
-  if (eyeBelowWall) {
-    return anySpaceBelow(grids, gridWidth, x, y, z);
+  if (eyeHeight < wallBottom) {
+    return anySpaceBelow(x, y, z);
   }
   return false;
 }
@@ -624,22 +886,22 @@ void Raycaster::raycast(std::vector<RayHit>& rayHits,
                         float playerRot, float stripAngle, int stripIdx,
                         std::vector<Sprite>* spritesToLookFor)
 {
-  Raycaster::raycast(rayHits, this->grids,
-                     this->gridWidth, this->gridHeight, this->tileSize,
-                     playerX, playerY, playerZ, playerRot,
-                     stripAngle, stripIdx,
-                     spritesToLookFor);
+  if (fixedPoint || chunkStore) {
+    raycastFixed(rayHits, playerX, playerY, playerZ, playerRot,
+                 stripAngle, stripIdx, spritesToLookFor);
+    return;
+  }
+  raycastFloat(rayHits, playerX, playerY, playerZ, playerRot,
+               stripAngle, stripIdx, spritesToLookFor);
 }
 
-void Raycaster::raycast(vector<RayHit>& hits,
-                        vector< vector<int> >& grids,
-                        int gridWidth, int gridHeight, int tileSize,
-                        int playerX, int playerY, float playerZ,
-                        float playerRot,
-                        float stripAngle, int stripIdx,
-                        vector<Sprite>* spritesToLookFor)
+void Raycaster::raycastFloat(vector<RayHit>& hits,
+                             int playerX, int playerY, float playerZ,
+                             float playerRot,
+                             float stripAngle, int stripIdx,
+                             vector<Sprite>* spritesToLookFor)
 {
-  if (grids.empty()) {
+  if (cells.empty()) {
     return;
   }
 
@@ -656,13 +918,11 @@ void Raycaster::raycast(vector<RayHit>& hits,
               (rayAngle>TWO_PI*0.75); // Quadrant 4
   bool up    = rayAngle<TWO_PI*0.5  && rayAngle>=0; // Quadrant 1 and 2
 
-  std::vector<int>& groundGrid = grids[0];
-
   int currentTileX = playerX / tileSize;
   int currentTileY = playerY / tileSize;
 
-  for (int level=0; level<(int)grids.size(); ++level) {
-    vector<int>& grid = grids[level];
+  for (int level=0; level<gridCount; ++level) {
+    const Cell* grid = &cells[level * gridWidth * gridHeight];
 
     //--------------------------------------------------------------------------
     // Check if the player is standing below or above a wall, and add that wall
@@ -671,9 +931,12 @@ void Raycaster::raycast(vector<RayHit>& hits,
     // Figured this out by trial and error!
     // Not really sure why it works. :|
     //--------------------------------------------------------------------------
-    int playerOffset = currentTileX + currentTileY*gridWidth;
     float trialAndErrorDistance = 10.0f;
-    if (level+1<(int)grids.size() && grids[level+1][playerOffset] > 0) {
+    const int cellAbove = level+1<gridCount ?
+                          cellAt(currentTileX, currentTileY, level+1) : 0;
+    const int cellBelow = level-1>=0 ?
+                          cellAt(currentTileX, currentTileY, level-1) : 0;
+    if (cellAbove > 0) {
       const float distX = trialAndErrorDistance;
       const float distY = trialAndErrorDistance;
       const float blockDist = distX*distX + distY*distY;
@@ -682,7 +945,7 @@ void Raycaster::raycast(vector<RayHit>& hits,
         texX = right ? texX : tileSize - texX; // Facing left, flip image
         RayHit rayHit(playerX, playerY, rayAngle);
         rayHit.strip = stripIdx;
-        rayHit.wallType = grids[level+1][playerOffset];
+        rayHit.wallType = cellAbove & CELL_MATERIAL_MASK;
         rayHit.wallX = currentTileX;
         rayHit.wallY = currentTileY;
         rayHit.level = level+1;
@@ -693,8 +956,7 @@ void Raycaster::raycast(vector<RayHit>& hits,
         hits.push_back( rayHit );
       }
     }
-    if (level-1>=0 && grids[level-1][playerOffset] > 0 &&
-        !isDoor(grids[level-1][playerOffset]) ) {
+    if (cellBelow > 0 && !isDoor(cellBelow)) {
       const float distX = trialAndErrorDistance;
       const float distY = trialAndErrorDistance;
       const float blockDist = distX*distX + distY*distY;
@@ -703,7 +965,7 @@ void Raycaster::raycast(vector<RayHit>& hits,
         texX = right ? texX : tileSize - texX; // Facing left, flip image
         RayHit rayHit(playerX, playerY, rayAngle);
         rayHit.strip = stripIdx;
-        rayHit.wallType = grids[level-1][playerOffset];
+        rayHit.wallType = cellBelow & CELL_MATERIAL_MASK;
         rayHit.wallX = currentTileX;
         rayHit.wallY = currentTileY;
         rayHit.level = level-1;
@@ -817,7 +1079,7 @@ void Raycaster::raycast(vector<RayHit>& hits,
           texX = right ? texX : tileSize - texX; // Facing left, flip image
           RayHit rayHit(vx, vy, rayAngle);
           rayHit.strip = stripIdx;
-          rayHit.wallType = grid[wallOffset];
+          rayHit.wallType = grid[wallOffset] & CELL_MATERIAL_MASK;
           rayHit.wallX = wallX;
           rayHit.wallY = wallY;
           rayHit.level = level;
@@ -847,8 +1109,7 @@ void Raycaster::raycast(vector<RayHit>& hits,
           rayHit.correctDistance = rayHit.distance * cos(stripAngle);
           rayHit.horizontal = false;
           rayHit.tileX = texX;
-          bool gaps=needsNextWall(grids,playerZ,tileSize,gridWidth,wallX,wallY,
-                                  level);
+          bool gaps=needsNextWall(playerZ, wallX, wallY, level);
           // There is an empty space below this wall, or the wall before
           if (gaps) {
             prevGaps = gaps; // for next wall check
@@ -949,7 +1210,7 @@ void Raycaster::raycast(vector<RayHit>& hits,
           texX = up ? texX : tileSize - texX; // Facing down, flip image
           RayHit rayHit(hx, hy, rayAngle);
           rayHit.strip = stripIdx;
-          rayHit.wallType = grid[wallOffset];
+          rayHit.wallType = grid[wallOffset] & CELL_MATERIAL_MASK;
           rayHit.wallX = wallX;
           rayHit.wallY = wallY;
           rayHit.level = level;
@@ -984,8 +1245,7 @@ void Raycaster::raycast(vector<RayHit>& hits,
             hits.push_back( rayHit );
           }
 
-          bool gaps=needsNextWall(grids,playerZ,tileSize,gridWidth,wallX,wallY,
-                                  level);
+          bool gaps=needsNextWall(playerZ, wallX, wallY, level);
           // There is an empty space below this wall, or the wall before
           if (gaps) {
             // Add the previous vertical line if any
@@ -1011,6 +1271,397 @@ void Raycaster::raycast(vector<RayHit>& hits,
   }
 }
 
+//------------------------------------------------------------------------------
+// Fixed-point DDA traversal
+//
+// Positions are kept in 16.16 fixed-point numbers where 1.0 is the length of
+// one grid cell. Grid lines are crossed at exact integer cell boundaries so
+// there is no need for the "-1" offsets used by the floating point version,
+// which is what caused the corner tears. Each step is an integer add and a
+// shift instead of float divisions and floor() calls.
+//
+// 15 integer bits means grids can be up to 16383 cells wide or high.
+//------------------------------------------------------------------------------
+static const int FIXED_SHIFT = 16;
+static const int FIXED_ONE = 1 << FIXED_SHIFT;
+
+// Converts a value in cell units to fixed-point, clamped to +/- limit cells
+static int toFixed(double cells, int limit)
+{
+  if (cells > limit) {
+    cells = limit;
+  }
+  else if (cells < -limit) {
+    cells = -limit;
+  }
+  return (int)floor(cells * FIXED_ONE + 0.5);
+}
+
+// Adds the wall directly above or below the player's cell.
+// See the "trial and error" comment in the floating point raycast().
+static void addStackedWallHit(vector<RayHit>& hits, int wallType,
+                              int cellX, int cellY, int level,
+                              int playerX, int playerY, int tileSize,
+                              float rayAngle, float stripAngle, int stripIdx,
+                              bool right)
+{
+  const float trialAndErrorDistance = 10.0f;
+  const float blockDist = trialAndErrorDistance*trialAndErrorDistance*2;
+  float texX = fmod2(playerY, tileSize);
+  texX = right ? texX : tileSize - texX; // Facing left, flip image
+  RayHit rayHit(playerX, playerY, rayAngle);
+  rayHit.strip = stripIdx;
+  rayHit.wallType = wallType & CELL_MATERIAL_MASK;
+  rayHit.wallX = cellX;
+  rayHit.wallY = cellY;
+  rayHit.level = level;
+  rayHit.distance = sqrt(blockDist);
+  rayHit.correctDistance = rayHit.distance * cos(stripAngle);
+  rayHit.horizontal = false;
+  rayHit.tileX = texX;
+  hits.push_back( rayHit );
+}
+
+// Adds sprites inside a cell that have not been hit by any ray yet
+static void addSpriteHits(vector<RayHit>& hits, vector<Sprite>& sprites,
+                          int cellX, int cellY, int tileSize,
+                          int playerX, int playerY,
+                          float stripAngle, int stripIdx)
+{
+  vector<Sprite*> spritesFound = Raycaster::findSpritesInCell(sprites,
+                                                              cellX, cellY,
+                                                              tileSize);
+  for (size_t i=0; i<spritesFound.size(); ++i) {
+    Sprite* sprite = spritesFound[ i ];
+    if (!sprite->rayhit) {
+      const float distX = playerX - sprite->x;
+      const float distY = playerY - sprite->y;
+      hits.push_back( RayHit::spriteRayHit(sprite, distX, distY, stripIdx,
+                                           stripAngle) );
+    }
+  }
+}
+
+// Number of grid lines that can be skipped from a cell with distance field
+// value d. After j more lines the cell checked has moved j cells along one
+// axis and at most floor(j*step)+1 cells along the other, so those cells are
+// guaranteed to be empty while both stay below d.
+static int emptyLinesToSkip(int d, int fixedStep)
+{
+  if (d<2) {
+    return 0;
+  }
+  const int absStep = fixedStep < 0 ? -fixedStep : fixedStep;
+  int lines = d - 1;
+  if (absStep > 0) {
+    lines = std::min(lines, ((d-2) << FIXED_SHIFT) / absStep);
+  }
+  return lines;
+}
+
+void Raycaster::raycastFixed(vector<RayHit>& hits,
+                             int playerX, int playerY, float playerZ,
+                             float playerRot, float stripAngle, int stripIdx,
+                             vector<Sprite>* spritesToLookFor)
+{
+  if (cells.empty() && !chunkStore) {
+    return;
+  }
+
+  // See raycast()
+  bool findAllWalls = false;
+
+  float rayAngle = stripAngle + playerRot;
+  const float TWO_PI = M_PI*2;
+  while (rayAngle < 0) rayAngle += TWO_PI;
+  while (rayAngle >= TWO_PI) rayAngle -= TWO_PI;
+
+  bool right = (rayAngle<TWO_PI*0.25 && rayAngle>=0) || // Quadrant 1
+              (rayAngle>TWO_PI*0.75); // Quadrant 4
+  bool up    = rayAngle<TWO_PI*0.5  && rayAngle>=0; // Quadrant 1 and 2
+
+  const int currentTileX = playerX / tileSize;
+  const int currentTileY = playerY / tileSize;
+
+  // Player position in cell units
+  const double cellPosX = (double)playerX / tileSize;
+  const double cellPosY = (double)playerY / tileSize;
+  const double tanAngle = tan(rayAngle);
+  const double invTanAngle = tanAngle ? 1/tanAngle : gridWidth+1;
+
+  // Vertical lines are crossed 1 cell apart in x. Window coordinates have
+  // the Y-axis pointing down so y decreases when moving right in Quadrant 1.
+  const int vFirstLine = right ? currentTileX + 1 : currentTileX;
+  const int vStepLine  = right ? 1 : -1;
+  const int vFirstY = toFixed(cellPosY + (cellPosX-vFirstLine)*tanAngle,
+                              gridHeight+1);
+  const int vStepY  = toFixed(right ? -tanAngle : tanAngle, gridHeight+1);
+
+  // Horizontal lines are crossed 1 cell apart in y
+  const int hFirstLine = up ? currentTileY : currentTileY + 1;
+  const int hStepLine  = up ? -1 : 1;
+  const int hFirstX = toFixed(cellPosX + (cellPosY-hFirstLine)*invTanAngle,
+                              gridWidth+1);
+  const int hStepX  = toFixed(up ? invTanAngle : -invTanAngle, gridWidth+1);
+
+  // Empty cells can't be skipped when looking for sprites
+  const bool skipEmpty = !spritesToLookFor &&
+                         (chunkStore || distanceFields.size()==cells.size());
+
+  // Squared distance to the nearest chunk that isn't loaded
+  float fogDistance = 0;
+
+  for (int level=0; level<gridCount; ++level) {
+    // Without a ChunkStore the grid and distance field are read directly
+    const int levelOffset = level * gridWidth * gridHeight;
+    const Cell* grid = chunkStore ? 0 : &cells[levelOffset];
+    const unsigned char* field = skipEmpty && !chunkStore ?
+                                 &distanceFields[levelOffset] : 0;
+
+    const int cellAbove = level+1<gridCount ?
+                          cellAt(currentTileX, currentTileY, level+1) : 0;
+    if (cellAbove > 0) {
+      addStackedWallHit(hits, cellAbove,
+                        currentTileX, currentTileY, level+1,
+                        playerX, playerY, tileSize,
+                        rayAngle, stripAngle, stripIdx, right);
+    }
+    const int cellBelow = level-1>=0 ?
+                          cellAt(currentTileX, currentTileY, level-1) : 0;
+    if (cellBelow > 0 && !isDoor(cellBelow)) {
+      addStackedWallHit(hits, cellBelow,
+                        currentTileX, currentTileY, level-1,
+                        playerX, playerY, tileSize,
+                        rayAngle, stripAngle, stripIdx, right);
+    }
+
+    if (spritesToLookFor) {
+      addSpriteHits(hits, *spritesToLookFor, currentTileX, currentTileY,
+                    tileSize, playerX, playerY, stripAngle, stripIdx);
+    }
+
+    //--------------------------
+    // Vertical Lines Checking
+    //--------------------------
+    float verticalLineDistance = 0;
+    RayHit verticalWallHit;
+    bool prevGaps = false;
+    int line = vFirstLine;
+    int fixedY = vFirstY;
+    for (;; line += vStepLine, fixedY += vStepY) {
+      const int wallX = right ? line : line - 1;
+      if (wallX<0 || wallX>=gridWidth || fixedY<0) {
+        break;
+      }
+      const int wallY = fixedY >> FIXED_SHIFT;
+      if (wallY>=gridHeight) {
+        break;
+      }
+      const int wallOffset = wallX + wallY * gridWidth;
+
+      const int emptyDistance = !skipEmpty ? 0 : field ? field[wallOffset] :
+                                chunkStore->distanceAt(wallX, wallY, level);
+      if (emptyDistance>1) {
+        const int skip = emptyLinesToSkip(emptyDistance, vStepY);
+        line += skip * vStepLine;
+        fixedY += skip * vStepY;
+        continue;
+      }
+
+      if (spritesToLookFor) {
+        addSpriteHits(hits, *spritesToLookFor, wallX, wallY,
+                      tileSize, playerX, playerY, stripAngle, stripIdx);
+      }
+
+      const int wallType = grid ? grid[wallOffset]
+                                : chunkStore->cellAt(wallX, wallY, level);
+      const float vx = (float)line * tileSize;
+      const float vy = (float)fixedY / FIXED_ONE * tileSize;
+      float distX = playerX - vx;
+      float distY = playerY - vy;
+      float blockDist = distX*distX + distY*distY;
+      if (wallType==CELL_NOT_RESIDENT) {
+        if (!fogDistance || blockDist<fogDistance) {
+          fogDistance = blockDist;
+        }
+        break;
+      }
+      if (wallType<=0 || isHorizontalDoor(wallType)) {
+        continue;
+      }
+      if (!blockDist) {
+        continue;
+      }
+      float texX = fmod2(vy, tileSize);
+      texX = right ? texX : tileSize - texX; // Facing left, flip image
+      RayHit rayHit(vx, vy, rayAngle);
+      rayHit.strip = stripIdx;
+      rayHit.wallType = wallType & CELL_MATERIAL_MASK;
+      rayHit.wallX = wallX;
+      rayHit.wallY = wallY;
+      rayHit.level = level;
+      rayHit.up = up;
+      rayHit.right = right;
+      rayHit.distance = sqrt(blockDist);
+      rayHit.sortdistance = rayHit.distance;
+      bool canAdd = true;
+      // If a door was hit, move ray halfway inside
+      if (isVerticalDoor(wallType)) {
+        const int halfY = fixedY + vStepY/2;
+        if (halfY>=0 && (halfY >> FIXED_SHIFT)==wallY) {
+          const float halfStepX = tileSize / 2.0f;
+          const float halfStepY = (float)vStepY / FIXED_ONE * tileSize / 2;
+          rayHit.distance += sqrt(halfStepX*halfStepX + halfStepY*halfStepY);
+          texX = fmod2(vy+halfStepY, tileSize);
+          rayHit.sortdistance -= 1;
+        }
+        else {
+          canAdd = false;
+        }
+      }
+      rayHit.correctDistance = rayHit.distance * cos(stripAngle);
+      rayHit.horizontal = false;
+      rayHit.tileX = texX;
+      bool gaps = needsNextWall(playerZ, wallX, wallY, level);
+      if (gaps) {
+        prevGaps = gaps;
+      }
+      else if (!findAllWalls) {
+        verticalWallHit = rayHit;
+        verticalLineDistance = blockDist;
+        break;
+      }
+      if (canAdd) {
+        hits.push_back( rayHit );
+      }
+    }
+
+    //--------------------------
+    // Horizontal Lines Checking
+    //--------------------------
+    float horizontalLineDistance = 0;
+    prevGaps = false;
+    line = hFirstLine;
+    int fixedX = hFirstX;
+    for (;; line += hStepLine, fixedX += hStepX) {
+      const int wallY = up ? line - 1 : line;
+      if (wallY<0 || wallY>=gridHeight || fixedX<0) {
+        break;
+      }
+      const int wallX = fixedX >> FIXED_SHIFT;
+      if (wallX>=gridWidth) {
+        break;
+      }
+      const int wallOffset = wallX + wallY * gridWidth;
+
+      const int emptyDistance = !skipEmpty ? 0 : field ? field[wallOffset] :
+                                chunkStore->distanceAt(wallX, wallY, level);
+      if (emptyDistance>1) {
+        const int skip = emptyLinesToSkip(emptyDistance, hStepX);
+        line += skip * hStepLine;
+        fixedX += skip * hStepX;
+        continue;
+      }
+
+      if (spritesToLookFor) {
+        addSpriteHits(hits, *spritesToLookFor, wallX, wallY,
+                      tileSize, playerX, playerY, stripAngle, stripIdx);
+      }
+
+      const int wallType = grid ? grid[wallOffset]
+                                : chunkStore->cellAt(wallX, wallY, level);
+      const float hx = (float)fixedX / FIXED_ONE * tileSize;
+      const float hy = (float)line * tileSize;
+      const float distX = playerX - hx;
+      const float distY = playerY - hy;
+      float blockDist = distX*distX + distY*distY;
+      if (wallType==CELL_NOT_RESIDENT) {
+        if (!fogDistance || blockDist<fogDistance) {
+          fogDistance = blockDist;
+        }
+        break;
+      }
+      if (wallType<=0 || isVerticalDoor(wallType)) {
+        continue;
+      }
+
+      // If vertical distance is less than horizontal line distance, stop
+      // unless there was some space below previous wall
+      if (verticalLineDistance>0 && verticalLineDistance<blockDist &&
+          !prevGaps) {
+        break;
+      }
+      if (!blockDist) {
+        continue;
+      }
+
+      float texX = fmod2(hx, tileSize);
+      texX = up ? texX : tileSize - texX; // Facing down, flip image
+      RayHit rayHit(hx, hy, rayAngle);
+      rayHit.strip = stripIdx;
+      rayHit.wallType = wallType & CELL_MATERIAL_MASK;
+      rayHit.wallX = wallX;
+      rayHit.wallY = wallY;
+      rayHit.level = level;
+      rayHit.up = up;
+      rayHit.right = right;
+      rayHit.distance = sqrt(blockDist);
+      rayHit.sortdistance = rayHit.distance;
+      bool canAdd = true;
+      // If a door was hit, move ray halfway inside
+      if (isHorizontalDoor(wallType)) {
+        const int halfX = fixedX + hStepX/2;
+        if (halfX>=0 && (halfX >> FIXED_SHIFT)==wallX) {
+          const float halfStepX = (float)hStepX / FIXED_ONE * tileSize / 2;
+          const float halfStepY = tileSize / 2.0f;
+          rayHit.distance += sqrt(halfStepX*halfStepX + halfStepY*halfStepY);
+          texX = fmod2(hx+halfStepX, tileSize);
+          rayHit.sortdistance -= 1;
+        }
+        else {
+          canAdd = false;
+        }
+      }
+      rayHit.correctDistance = rayHit.distance * cos(stripAngle);
+      rayHit.horizontal = true;
+      rayHit.tileX = texX;
+      horizontalLineDistance = blockDist;
+      if (canAdd) {
+        hits.push_back( rayHit );
+      }
+
+      bool gaps = needsNextWall(playerZ, wallX, wallY, level);
+      if (gaps) {
+        // Add the previous vertical line if any
+        if (verticalLineDistance) {
+          hits.push_back(verticalWallHit);
+          verticalLineDistance = 0; // Make sure not to add it again
+        }
+        prevGaps = gaps;
+      }
+      else if (!findAllWalls) {
+        break;
+      }
+    }
+
+    // If no horizontal line was found, but a vertical line was.
+    if (!horizontalLineDistance && verticalLineDistance) {
+      hits.push_back(verticalWallHit);
+    }
+  }
+
+  // One fog hit covers every level. Anything nearer is drawn over it.
+  if (fogDistance) {
+    RayHit rayHit(playerX, playerY, rayAngle);
+    rayHit.strip = stripIdx;
+    rayHit.fog = true;
+    rayHit.distance = sqrt(fogDistance);
+    rayHit.sortdistance = rayHit.distance;
+    rayHit.correctDistance = rayHit.distance * cos(stripAngle);
+    hits.push_back( rayHit );
+  }
+}
+
 void Raycaster::findIntersectingThinWalls(std::vector<RayHit>& rayHits,
                                           std::vector<ThinWall*>& thinWalls,
                                           float playerX,
@@ -1043,6 +1694,79 @@ void Raycaster::findIntersectingThinWalls(std::vector<RayHit>& rayHits,
   }
 }
 
+// Finds where a ray from (px,py) going in direction (dirX,dirY) crosses a
+// ThinWall. t is the distance along the ray and is negative behind the start.
+// The ends of the ThinWall are stretched by slack, a fraction of its length.
+static bool rayCrossesThinWall(const ThinWall& thinWall,
+                               float px, float py, float dirX, float dirY,
+                               float slack, float* t)
+{
+  const float edgeX = thinWall.x2 - thinWall.x1;
+  const float edgeY = thinWall.y2 - thinWall.y1;
+  const float denominator = dirX*edgeY - dirY*edgeX;
+  if (!denominator) {
+    return false; // parallel
+  }
+  const float toStartX = thinWall.x1 - px;
+  const float toStartY = thinWall.y1 - py;
+  const float u = (toStartX*dirY - toStartY*dirX) / denominator;
+  if (u<-slack || u>1+slack) {
+    return false;
+  }
+  *t = (toStartX*edgeY - toStartY*edgeX) / denominator;
+  return true;
+}
+
+// How far apart, in game units, a ThinWall crossing and the ThickWall edge
+// it belongs to can be found along a ray
+static const float THIN_WALL_CROSSING_EPSILON = 0.5f;
+// How far past its corners, as a fraction of its length, a ThickWall edge
+// still counts as crossed
+static const float THIN_WALL_CORNER_SLACK = 0.001f;
+
+// Creates the RayHit for a ray crossing a ThinWall t units from the player
+static RayHit thinWallRayHit(ThinWall* thinWall, float t,
+                             float playerX, float playerY,
+                             float dirX, float dirY, float cosFactor,
+                             float rayAngle, int stripIdx, int tileSize)
+{
+  RayHit rayHit(0, 0, rayAngle);
+  rayHit.x = playerX + t*dirX;
+  rayHit.y = playerY + t*dirY;
+  rayHit.distance = fabs(t);
+  rayHit.squaredDistance = t*t;
+  rayHit.correctDistance = t * cosFactor;
+  rayHit.thinWall = thinWall;
+  rayHit.wallHeight = thinWall->height;
+  rayHit.strip      = stripIdx;
+  float dto         = round(thinWall->distanceToOrigin(rayHit.x,rayHit.y));
+  rayHit.tileX      = (int)(dto) % tileSize;
+  rayHit.horizontal = thinWall->horizontal;
+  rayHit.wallType   = thinWall->wallType;
+
+  // Slope
+  ThickWall* thickWall = thinWall->thickWall;
+  if (thinWall->slope) {
+    rayHit.wallHeight = thickWall->startHeight + thinWall->slope *
+                        thinWall->distanceToOrigin(rayHit.x,rayHit.y);
+    if (thickWall->invertedSlope) {
+      rayHit.invertedZ = rayHit.wallHeight;
+      rayHit.wallHeight = thickWall->tallerHeight - rayHit.wallHeight;
+    }
+  }
+  return rayHit;
+}
+
+/*
+ThinWalls are tested one ThickWall at a time. ThickWall::rayInterval() gives
+where the ray enters and leaves it, and the ThinWalls crossed there are the
+two hits. For slopes those two crossings are each other's siblings, which
+gives the cross section of the slope surface along the ray.
+
+If the player is inside a slope's ThickWall only the exit is in front. The
+crossing behind the player becomes the sibling instead, with a negative
+correctDistance.
+*/
 void Raycaster::raycastThinWalls(std::vector<RayHit>& rayHits,
                                  std::vector<ThinWall*>& thinWalls,
                                  float playerX, float playerY, float playerZ,
@@ -1054,78 +1778,156 @@ void Raycaster::raycastThinWalls(std::vector<RayHit>& rayHits,
   while (rayAngle < 0) rayAngle += TWO_PI;
   while (rayAngle >= TWO_PI) rayAngle -= TWO_PI;
 
-  bool right = (rayAngle<TWO_PI*0.25 && rayAngle>=0) || // Quadrant 1
-              (rayAngle>TWO_PI*0.75); // Quadrant 4
-
-  float vx = 0;
-  if (right) {
-    vx = gridWidth * tileSize;
-  }
-  else {
-    vx = 0;
-  }
-
-  float vy = playerY + (playerX-vx)*tan(rayAngle);
+  const float dirX = cos(rayAngle);
+  const float dirY = -sin(rayAngle);
+  const float cosFactor = cos( playerRot - rayAngle );
+
+  size_t first = 0;
+  while (first < thinWalls.size()) {
+    ThickWall* thickWall = thinWalls[first]->thickWall;
+    size_t end = first + 1;
+    while (thickWall && end<thinWalls.size() &&
+           thinWalls[end]->thickWall==thickWall) {
+      ++end;
+    }
 
-  std::vector<RayHit> newRayHits;
-  std::vector<RayHit*> addedRayHits;
-  findIntersectingThinWalls(newRayHits, thinWalls, playerX, playerY, vx, vy);
-  for (int i=0; i<(int)newRayHits.size(); ++i) {
-    RayHit& rayHit = newRayHits[i];
-    ThinWall* thinWall = rayHit.thinWall;
-    ThickWall* thickWall = thinWall->thickWall;
-
-    rayHit.wallHeight = thinWall->height;
-    rayHit.strip      = stripIdx;
-    float dto         = round(thinWall->distanceToOrigin(rayHit.x,rayHit.y));
-    rayHit.tileX      = (int)(dto) % this->tileSize;
-    rayHit.horizontal = thinWall->horizontal;
-    rayHit.wallType   = thinWall->wallType;
-    rayHit.rayAngle   = rayAngle;
-    if (rayHit.distance) {
-      rayHit.correctDistance = rayHit.distance * cos( playerRot - rayAngle );
-      if (rayHit.correctDistance < 1) {
+    // Crossings in front of the player, nearest first, and the nearest one
+    // behind
+    RayHit crossings[2];
+    int crossingCount = 0;
+    float behindT = 0;
+    int behindIndex = -1;
+    float enterT = 0, exitT = 0;
+    if (thickWall &&
+        (!thickWall->rayInterval(playerX, playerY, dirX, dirY,
+                                 enterT, exitT) ||
+         exitT - enterT < THIN_WALL_CROSSING_EPSILON)) {
+      first = end; // missed or only grazed
+      continue;
+    }
+    // A ray through a corner crosses both edges there at the same t, or
+    // just misses both through rounding. Edges are stretched a little and
+    // matched to where the ThickWall says the ray enters and leaves, rather
+    // than taken in the order they are found.
+    const float slack = thickWall ? THIN_WALL_CORNER_SLACK : 0;
+    int enterIndex = -1, exitIndex = -1;
+    float enterError = THIN_WALL_CROSSING_EPSILON;
+    float exitError = THIN_WALL_CROSSING_EPSILON;
+    for (size_t i=first; i<end; ++i) {
+      float t = 0;
+      if (!rayCrossesThinWall(*thinWalls[i], playerX, playerY, dirX, dirY,
+                              slack, &t)) {
         continue;
       }
-      addedRayHits.push_back(&rayHit);
-      // Slope
-      if (thinWall->slope) {
-        rayHit.wallHeight = thickWall->startHeight + thinWall->slope *
-                            thinWall->distanceToOrigin(rayHit.x,rayHit.y);
-        if (thickWall->invertedSlope) {
-          rayHit.invertedZ = rayHit.wallHeight;
-          rayHit.wallHeight = thickWall->tallerHeight - rayHit.wallHeight;
+      if (t < 0) {
+        if (behindIndex<0 || t>behindT) {
+          behindT = t;
+          behindIndex = i;
         }
+        continue;
       }
+      if (!t) {
+        continue;
+      }
+      if (!thickWall) {
+        enterIndex = i;
+        enterT = t;
+        continue;
+      }
+      if (enterT > 0 && fabs(t - enterT) < enterError) {
+        enterIndex = i;
+        enterError = fabs(t - enterT);
+      }
+      if (fabs(t - exitT) < exitError) {
+        exitIndex = i;
+        exitError = fabs(t - exitT);
+      }
+    }
+    if (enterIndex >= 0) {
+      crossings[crossingCount++] = thinWallRayHit(thinWalls[enterIndex],
+                                                  enterT, playerX, playerY,
+                                                  dirX, dirY, cosFactor,
+                                                  rayAngle, stripIdx,
+                                                  tileSize);
+    }
+    if (exitIndex >= 0) {
+      crossings[crossingCount++] = thinWallRayHit(thinWalls[exitIndex],
+                                                  exitT, playerX, playerY,
+                                                  dirX, dirY, cosFactor,
+                                                  rayAngle, stripIdx,
+                                                  tileSize);
+    }
 
-      if (thickWall && thickWall->slope) {
-        for (int j=0; j<(int)addedRayHits.size(); ++j) {
-          RayHit* addedRayHit = addedRayHits[ j ];
-          if (!addedRayHit->sameRayHit(rayHit)) {
-            if (addedRayHit->thinWall->thickWall == thickWall) {
-              addedRayHit->copySibling(rayHit);
-              rayHit.copySibling(*addedRayHit);
-            }
-          }
-        }
+    if (thickWall && thickWall->slope) {
+      if (crossingCount==2) {
+        crossings[0].copySibling(crossings[1]);
+        crossings[1].copySibling(crossings[0]);
+      }
+      else if (crossingCount==1 && behindIndex>=0) {
+        crossings[0].copySibling(thinWallRayHit(thinWalls[behindIndex],
+                                                behindT, playerX, playerY,
+                                                dirX, dirY, cosFactor,
+                                                rayAngle, stripIdx,
+                                                tileSize));
       }
     }
+
+    for (int i=0; i<crossingCount; ++i) {
+      if (crossings[i].correctDistance >= 1) {
+        rayHits.push_back(crossings[i]);
+      }
+    }
+    first = end;
+  }
+}
+
+// Adds a hit for a sprite unless a ray has already hit it
+static void addSpriteHit(vector<RayHit>& hits, Sprite* sprite,
+                         int playerX, int playerY,
+                         float stripAngle, int stripIdx)
+{
+  if (!sprite->rayhit) {
+    const float distX = playerX - sprite->x;
+    const float distY = playerY - sprite->y;
+    hits.push_back(RayHit::spriteRayHit(sprite, distX, distY, stripIdx,
+                                        stripAngle));
   }
+}
 
-  for (size_t i=0; i<addedRayHits.size(); ++i) {
-    rayHits.push_back(*addedRayHits[i]);
+static void addSpriteHits(vector<RayHit>& hits, vector<Sprite>& sprites,
+                          const SpriteIndex* spriteIndex,
+                          int cellX, int cellY, int tileSize,
+                          int playerX, int playerY,
+                          float stripAngle, int stripIdx)
+{
+  if (spriteIndex) {
+    int count;
+    const SpriteIndex::Entry* entries = spriteIndex->entriesAt(cellX, cellY,
+                                                               count);
+    for (int i=0; i<count; ++i) {
+      addSpriteHit(hits, &sprites[entries[i].sprite], playerX, playerY,
+                   stripAngle, stripIdx);
+    }
+    return;
+  }
+  vector<Sprite*> spritesFound = Raycaster::findSpritesInCell(sprites,
+                                                              cellX, cellY,
+                                                              tileSize);
+  for (size_t i=0; i<spritesFound.size(); ++i) {
+    addSpriteHit(hits, spritesFound[i], playerX, playerY, stripAngle,
+                 stripIdx);
   }
 }
 
 void Raycaster::raycastSprites(vector<RayHit>& hits,
-                               vector< vector<int> >& grids,
                                int gridWidth, int gridHeight, int tileSize,
                                int playerX, int playerY, float playerZ,
                                float playerRot,
                                float stripAngle, int stripIdx,
-                               vector<Sprite>* spritesToLookFor)
+                               vector<Sprite>* spritesToLookFor,
+                               const SpriteIndex* spriteIndex)
 {
-  if (grids.empty()) {
+  if (!spritesToLookFor || spritesToLookFor->empty()) {
     return;
   }
 
@@ -1138,30 +1940,15 @@ void Raycaster::raycastSprites(vector<RayHit>& hits,
               (rayAngle>TWO_PI*0.75); // Quadrant 4
   bool up    = rayAngle<TWO_PI*0.5  && rayAngle>=0; // Quadrant 1 and 2
 
-  std::vector<int>& groundGrid = grids[0];
-
   int currentTileX = playerX / tileSize;
   int currentTileY = playerY / tileSize;
 
   //----------------------------------------
   // Check player's current tile for sprites
   //----------------------------------------
-  vector<Sprite*> spritesHit;
-
-  vector<Sprite*> spritesFound = findSpritesInCell( *spritesToLookFor,
-                                                    currentTileX,
-                                                    currentTileY,
-                                                    tileSize );
-  for (size_t i=0; i<spritesFound.size(); ++i) {
-    Sprite* sprite = spritesFound[ i ];
-    if (!sprite->rayhit) {
-      const float distX = playerX - sprite->x;
-      const float distY = playerY - sprite->y;
-      RayHit spriteRayHit = RayHit::spriteRayHit(sprite, distX, distY, stripIdx,
-                                                 stripAngle);
-      hits.push_back( spriteRayHit );
-    }
-  }
+  addSpriteHits(hits, *spritesToLookFor, spriteIndex,
+                currentTileX, currentTileY, tileSize,
+                playerX, playerY, stripAngle, stripIdx);
 
   //--------------------------
   // Vertical Lines Checking
@@ -1196,20 +1983,8 @@ void Raycaster::raycastSprites(vector<RayHit>& hits,
     int wallX = floor(vx / tileSize);
 
     // Look for sprites in current cell
-    vector<Sprite*> spritesFound = findSpritesInCell( *spritesToLookFor,
-                                                      wallX, wallY,
-                                                      tileSize );
-    for (size_t i=0; i<spritesFound.size(); ++i) {
-      Sprite* sprite = spritesFound[ i ];
-      if (!sprite->rayhit) {
-        const float distX = playerX - sprite->x;
-        const float distY = playerY - sprite->y;
-        RayHit spriteRayHit = RayHit::spriteRayHit(sprite, distX, distY,
-                                                   stripIdx,
-                                                   stripAngle);
-        hits.push_back( spriteRayHit );
-      }
-    }
+    addSpriteHits(hits, *spritesToLookFor, spriteIndex, wallX, wallY,
+                  tileSize, playerX, playerY, stripAngle, stripIdx);
 
     vx += stepx;
     vy += stepy;
@@ -1246,20 +2021,8 @@ void Raycaster::raycastSprites(vector<RayHit>& hits,
     int wallX = floor(hx / tileSize);
 
     // Look for sprites in current cell
-    vector<Sprite*> spritesFound = findSpritesInCell( *spritesToLookFor,
-                                                      wallX, wallY,
-                                                      tileSize );
-    for (size_t i=0; i<spritesFound.size(); ++i) {
-      Sprite* sprite = spritesFound[ i ];
-      if (!sprite->rayhit) {
-        const float distX = playerX - sprite->x;
-        const float distY = playerY - sprite->y;
-        RayHit spriteRayHit = RayHit::spriteRayHit(sprite, distX, distY,
-                                                   stripIdx,
-                                                   stripAngle);
-        hits.push_back( spriteRayHit );
-      }
-    }
+    addSpriteHits(hits, *spritesToLookFor, spriteIndex, wallX, wallY,
+                  tileSize, playerX, playerY, stripAngle, stripIdx);
 
     hx += stepx;
     hy += stepy;
@@ -5,7 +5,10 @@ https://github.com/andrew-lim/sdl2-raycast
 #ifndef ANDREW_LIM_RAYCASTING_H
 #define ANDREW_LIM_RAYCASTING_H
 #include <vector>
+#include <cmath>
 #include "shape.h"
+#include "cell.h"
+#include "chunkstore.h"
 
 #define THICK_WALL_TYPE_NONE 0
 #define THICK_WALL_TYPE_RECT 1
@@ -73,12 +76,61 @@ public:
   float getHeight() { return height; }
   void setThinWallsType(int wallType);
   bool containsPoint(float x, float y);
+  // Distances along a ray where it enters and leaves the ThickWall, with
+  // (dirX,dirY) of unit length. Only the part of the ray from the origin up
+  // to the first exit is considered. Returns false if the ray misses.
+  bool rayInterval(float originX, float originY, float dirX, float dirY,
+                   float& enterDistance, float& exitDistance);
   void setTallerHeight(float height);
 private:
   float height;
   float z;
 };
 
+/**
+ * Lists the ThickWalls whose bounds overlap each grid cell, so finding the
+ * ThickWall under a point only tests the few near it.
+ *
+ * Only the cells inside the bounds of all the ThickWalls are stored.
+ */
+class ThickWallIndex {
+public:
+  struct Entry {
+    ThickWall* thickWall;
+    bool coversCell; // every point of the cell is inside the ThickWall
+    bool contains(float x, float y) const {
+      return coversCell || thickWall->containsPoint(x, y);
+    }
+  };
+
+  ThickWallIndex();
+  void build(const std::vector<ThickWall*>& thickWalls, int tileSize);
+  void clear();
+
+  // Entries of the cell at a world position, in the same order as the
+  // ThickWalls given to build()
+  const Entry* entriesAt(float worldX, float worldY, int& count) const {
+    const int cellX = (int) floor(worldX * invTileSize) - originX;
+    const int cellY = (int) floor(worldY * invTileSize) - originY;
+    if (cellX < 0 || cellY < 0 || cellX >= cellsX || cellY >= cellsY) {
+      count = 0;
+      return 0;
+    }
+    const int cell = cellX + cellY * cellsX;
+    count = cellStart[cell+1] - cellStart[cell];
+    return count ? &entries[cellStart[cell]] : 0;
+  }
+
+private:
+  static void bounds(const ThickWall& thickWall,
+                     float& minX, float& minY, float& maxX, float& maxY);
+
+  int originX, originY, cellsX, cellsY;
+  float invTileSize;
+  std::vector<int> cellStart; // entries of cell i are cellStart[i..i+1]
+  std::vector<Entry> entries;
+};
+
 class Sprite {
 public:
     float x, y, z;
@@ -133,21 +185,28 @@ struct RayHit {
   float wallHeight;
   float invertedZ;
 
-  // Slope sibling
+  // Slope sibling, the other place the ray crosses the same slope.
+  // siblingCorrectDistance is negative if it is behind the player.
   float siblingWallHeight;
   float siblingDistance;
   float siblingCorrectDistance;
   float siblingThinWallZ;
   float siblingInvertedZ;
-  bool findSiblingAtAngle(float originAngle, float playerRot,
-                          float playerX, float playerY,
-                          float gridWidth, float tileSize);
 
   // sortdistance is used to sort which objects are drawn first.
   // Further objects are drawn first. Value is usually same as distance, but
   // can be different for edge cases like doors.
   float sortdistance;
 
+  // The ray reached a chunk that is not loaded yet. Nothing past this
+  // distance is known.
+  bool fog;
+
+  // Terrain seen between these screen rows. Only set by the game's terrain
+  // renderer, which covers a short stretch of the ray with each hit.
+  bool terrain;
+  int terrainTop, terrainBottom;
+
   RayHit(int worldX=0, int worldY=0, float angle=0)
   : x(worldX), y(worldY), rayAngle(angle) {
     wallType = strip = wallX = wallY = tileX = squaredDistance = distance = 0;
@@ -161,9 +220,12 @@ struct RayHit {
     invertedZ = 0;
     siblingWallHeight = siblingDistance = siblingCorrectDistance = 0;
     siblingThinWallZ = siblingInvertedZ = 0;
+    fog = false;
+    terrain = false;
+    terrainTop = terrainBottom = 0;
   }
 
-  void copySibling(RayHit& rayHit2) {
+  void copySibling(const RayHit& rayHit2) {
     siblingWallHeight = rayHit2.wallHeight;
     siblingDistance = rayHit2.distance;
     siblingCorrectDistance = rayHit2.correctDistance;
@@ -179,34 +241,110 @@ struct RayHit {
                              int strip, float rayAngle);
 };
 
+/**
+ * The sprites in each grid cell, so a ray crossing a cell doesn't have to
+ * look at every sprite. Sprites are kept as indices into the vector given to
+ * build(), so the index also works for any copy of that vector.
+ */
+class SpriteIndex {
+public:
+  struct Entry {
+    int cellX, cellY;
+    int sprite;
+  };
+
+  void build(const std::vector<Sprite>& sprites, int tileSize);
+  void clear() { entries.clear(); }
+  bool empty() const { return entries.empty(); }
+
+  // Entries of a cell, in the same order as the sprites given to build()
+  const Entry* entriesAt(int cellX, int cellY, int& count) const;
+
+private:
+  std::vector<Entry> entries; // by cellY, then cellX, then sprite
+};
+
 /**
 Contains static utility functions for raycasting.
 
 A Raycaster instance holds information for one or more 2D grids with the same
-dimensions. Each grid is stored as a single vector in row-major order.
-The element offset for each grid is calculated using x + y * width.
+dimensions. All grids are stored one after another in a single vector of
+Cells, each in row-major order. The element offset for a cell is calculated
+using x + y * width + z * width * height.
 
 If there are two or more grids, it is effectively a 3D grid.
 **/
 class Raycaster {
 public:
-  std::vector< std::vector<int> > grids;
+  std::vector<Cell> cells;
   int gridWidth;
   int gridHeight;
   int gridCount;
   int tileSize;
+
+  // Per-level distance fields with the same layout as cells. Each element is
+  // the Chebyshev distance in cells to the nearest non-empty cell on the same
+  // level, capped at MAX_EMPTY_DISTANCE. Non-empty cells are 0.
+  // The fixed-point raycast uses this to step over empty space.
+  std::vector<unsigned char> distanceFields;
+
+  // One flag per row of cells, set when setCell() or updateDistanceField()
+  // write to that row on any level. World snapshots only copy these rows.
+  std::vector<unsigned char> changedRows;
+
+  // Indexed by the material bits of a cell. Material 0 is empty space.
+  CellMaterial materials[MAX_MATERIALS];
+
+  // Use the fixed-point DDA traversal in raycast() instead of the older
+  // floating point version
+  bool fixedPoint;
+
+  // When set, cells and distance fields come from the chunks resident in
+  // this store instead of grids, and the fixed-point raycast is always used.
+  // Cells in chunks that are not loaded read as CELL_NOT_RESIDENT.
+  ChunkStore* chunkStore;
+
+  enum { MAX_EMPTY_DISTANCE = 255 };
+  static const CellMaterial notResidentMaterial;
 public:
   Raycaster()
-  : gridWidth(0), gridHeight(0), gridCount(0), tileSize(0) {
+  : gridWidth(0), gridHeight(0), gridCount(0), tileSize(0), fixedPoint(true),
+    chunkStore(0) {
+    resetMaterials();
   }
 
   Raycaster(int gridWidth, int gridHeight, int tileSize)
-  : gridWidth(gridWidth), gridHeight(gridHeight), tileSize(tileSize) {
+  : gridWidth(gridWidth), gridHeight(gridHeight), gridCount(1),
+    tileSize(tileSize), fixedPoint(true), chunkStore(0) {
+    resetMaterials();
     createGrids(gridWidth, gridHeight, gridCount, tileSize);
   }
 
   void createGrids( int gridWidth, int gridHeight, int gridCount, int tileSize);
 
+  // Material 0 becomes empty space and every other material a solid wall
+  // using texture 0
+  void resetMaterials();
+
+  // Reads cells from a ChunkStore instead of cells, which are freed.
+  // Pass 0 to go back to using cells after calling createGrids().
+  void setChunkStore(ChunkStore* chunkStore, int tileSize);
+
+  // Rebuilds all the distance fields. Call this after writing to cells
+  // directly.
+  void computeDistanceFields();
+
+  // Recalculates the distance field of a level inside a rectangle of cells
+  // (inclusive). Cells outside the rectangle must already be correct.
+  void updateDistanceField(int z, int x0, int y0, int x1, int y1);
+
+  // Forgets which rows have changed, after the grids have been filled
+  void clearChangedRows();
+
+  // Changes a cell and updates the distance field around it if the cell
+  // became empty or non-empty
+  void setCell(int x, int y, int z, Cell value);
+
   // Distance between player to screen / projection plane
   static float screenDistance(float screenWidth, float fovRadians);
 
@@ -223,20 +361,15 @@ public:
                                                 int cellX, int cellY,
                                                 int tileSize);
 
-  // Checks if there are any empty blocks below specified block.
+  // Checks if there are any transparent blocks below specified block.
   // This checks multiple levels of blocks, not just the one directly below.
-  static bool anySpaceBelow( std::vector< std::vector<int> >& grids,
-                             int gridWidth, int x, int y, int z );
+  bool anySpaceBelow(int x, int y, int z);
 
-   // Checks if there are any empty blocks above specified block.
+  // Checks if there are any transparent blocks above specified block.
   // This checks multiple levels of blocks, not just the one directly above.
-  static bool anySpaceAbove( std::vector< std::vector<int> >& grids,
-                             int gridWidth, int x, int y, int z );
+  bool anySpaceAbove(int x, int y, int z);
 
-  static
-  bool needsNextWall(std::vector< std::vector<int> >& grids,
-                     float playerZ, int tileSize,
-                     int gridWidth, int x, int y, int z );
+  bool needsNextWall(float playerZ, int x, int y, int z);
 
   /*
   The raycast methods look for collisions with walls and sprites.
@@ -248,31 +381,63 @@ public:
                float playerRot, float stripAngle, int stripIdx,
                std::vector<Sprite>* spritesToLookFor=0);
 
-  static void raycast(std::vector<RayHit>& hits,
-                      std::vector< std::vector<int> >& grids,
-                      int gridWidth, int gridHeight, int tileSize,
-                      int playerX, int playerY, float playerZ,
-                      float playerRot,
-                      float stripAngle, int stripIdx,
-                      std::vector<Sprite>* spritesToLookFor=0 );
-
-  int cellAt( int x, int y ) { return grids[0][x+y*gridWidth]; }
-  int cellAt( int x, int y, int z ) { return grids[z][x+y*gridWidth]; }
+  // The older floating point version of raycast()
+  void raycastFloat(std::vector<RayHit>& hits,
+                    int playerX, int playerY, float playerZ,
+                    float playerRot,
+                    float stripAngle, int stripIdx,
+                    std::vector<Sprite>* spritesToLookFor=0 );
+
+  // Same as raycast() but steps through the grid using 16.16 fixed-point
+  // cell coordinates. Cell boundaries are exact so walls meeting at corners
+  // are never skipped.
+  void raycastFixed(std::vector<RayHit>& rayHits,
+                    int playerX, int playerY, float playerZ,
+                    float playerRot, float stripAngle, int stripIdx,
+                    std::vector<Sprite>* spritesToLookFor=0);
+
+  int cellAt( int x, int y ) { return cellAt(x, y, 0); }
+  int cellAt( int x, int y, int z ) {
+    return chunkStore ? chunkStore->cellAt(x, y, z)
+                      : cells[x + (y + z*gridHeight)*gridWidth];
+  }
   int safeCellAt( int x, int y, int z, int fallback=0 ) {
-    const int offset = x+y*gridWidth;
-    if (z<0 || z>=gridCount || offset<0 || offset>=gridWidth*gridHeight) {
+    if (z<0 || z>=gridCount || x<0 || x>=gridWidth || y<0 || y>=gridHeight) {
       return fallback;
     }
-    return grids[z][offset];
+    return cellAt(x, y, z);
   }
 
-  // Reserve wall types above 1000 for door detection
-  static bool isHorizontalDoor(int wallType) { return wallType > 1500; }
-  static bool isVerticalDoor(int wallType) {
-    return wallType > 1000 && wallType <= 1500;
+  // Material of a cell or wall type. CELL_NOT_RESIDENT is always a solid
+  // wall, whatever the level's materials say.
+  const CellMaterial& material(int cell) const {
+    return cell == CELL_NOT_RESIDENT ? notResidentMaterial
+                                     : materials[cell & CELL_MATERIAL_MASK];
+  }
+  bool isDoor(int cell) const {
+    return material(cell).flags & MATERIAL_DOOR;
   }
-  static bool isDoor(int wallType) {
-    return isVerticalDoor(wallType) || isHorizontalDoor(wallType);
+  bool isHorizontalDoor(int cell) const {
+    const uint32_t mask = MATERIAL_DOOR | MATERIAL_DOOR_HORIZONTAL;
+    return (material(cell).flags & mask) == mask;
+  }
+  bool isVerticalDoor(int cell) const {
+    const uint32_t mask = MATERIAL_DOOR | MATERIAL_DOOR_HORIZONTAL;
+    return (material(cell).flags & mask) == MATERIAL_DOOR;
+  }
+  bool isTransparent(int cell) const {
+    return material(cell).flags & MATERIAL_TRANSPARENT;
+  }
+  // Solid cells block movement unless they are open doors
+  bool blocksMovement(int cell) const {
+    if (cell == CELL_NOT_RESIDENT) {
+      return true;
+    }
+    const uint32_t flags = material(cell).flags;
+    if (flags & MATERIAL_DOOR && cell & CELL_DOOR_OPEN) {
+      return false;
+    }
+    return flags & MATERIAL_SOLID;
   }
 
   static void findIntersectingThinWalls(std::vector<RayHit>& rayHits,
@@ -282,19 +447,23 @@ public:
                                         float rayEndX,
                                         float rayEndY);
 
+  // ThinWalls of the same ThickWall must be next to each other in thinWalls.
+  // Hits on slopes come with their sibling already set.
   void raycastThinWalls(std::vector<RayHit>& rayHits,
                         std::vector<ThinWall*>& thinWalls,
                         float playerX, float playerY, float playerZ,
                         float playerRot,
                         float stripAngle, int stripIdx);
 
+  // spriteIndex, if given, must have been built from spritesToLookFor or
+  // a copy of it
   static void raycastSprites(std::vector<RayHit>& hits,
-                             std::vector< std::vector<int> >& grids,
                              int gridWidth, int gridHeight, int tileSize,
                              int playerX, int playerY, float playerZ,
                              float playerRot,
                              float stripAngle, int stripIdx,
-                             std::vector<Sprite>* spritesToLookFor);
+                             std::vector<Sprite>* spritesToLookFor,
+                             const SpriteIndex* spriteIndex=0);
 };
 
 /**
@@ -1,4 +1,5 @@
 #include "sdl2utils.h"
+#include <cmath>
 
 SDL_Color al::sdl2utils::getRGBAPixelColor(Uint8* pixels, int x, int y, int w) {
   SDL_Color color;
@@ -144,3 +145,208 @@ bool al::sdl2utils::Bitmap::load( const char* s, SDL_Renderer* renderer,
   }
   return false;
 }
+
+void al::sdl2utils::halvePixels(const Uint32* src, int srcPitch,
+                                Uint32* dst, int dstPitch,
+                                int dstWidth, int dstHeight,
+                                bool colorKeyed, Uint32 colorKey)
+{
+  for (int y=0; y<dstHeight; ++y) {
+    const Uint32* row0 = src + y*2 * srcPitch;
+    const Uint32* row1 = row0 + srcPitch;
+    for (int x=0; x<dstWidth; ++x) {
+      const Uint32 block[4] = {
+        row0[x*2], row0[x*2+1], row1[x*2], row1[x*2+1]
+      };
+      Uint32 sums[4] = { 0, 0, 0, 0 };
+      int count = 0;
+      for (int i=0; i<4; ++i) {
+        if (colorKeyed && block[i] == colorKey) {
+          continue;
+        }
+        for (int c=0; c<4; ++c) {
+          sums[c] += (block[i] >> (c*8)) & 0xFF;
+        }
+        count++;
+      }
+      if (count < 2 && colorKeyed) {
+        dst[x + y*dstPitch] = colorKey;
+        continue;
+      }
+      Uint32 pixel = 0;
+      for (int c=0; c<4; ++c) {
+        pixel |= ((sums[c] + count/2) / count) << (c*8);
+      }
+      // An average can land on the color key by chance
+      if (colorKeyed && pixel == colorKey) {
+        pixel ^= 1;
+      }
+      dst[x + y*dstPitch] = pixel;
+    }
+  }
+}
+
+void al::sdl2utils::SurfaceTexture::generateMipmaps(int maxLevels)
+{
+  destroyMipmaps();
+  if (!surface) {
+    return;
+  }
+  Uint32 colorKey = 0;
+  const bool colorKeyed = SDL_GetColorKey(surface, &colorKey) == 0;
+  SDL_Surface* level = SDL_ConvertSurfaceFormat(surface,
+                                                SDL_PIXELFORMAT_RGB888, 0);
+  if (!level) {
+    return;
+  }
+  if (colorKeyed) {
+    Uint8 r, g, b;
+    SDL_GetRGB(colorKey, surface->format, &r, &g, &b);
+    colorKey = SDL_MapRGB(level->format, r, g, b);
+  }
+  SDL_Surface* previous = level;
+  while ((int)mipSurfaces.size() < maxLevels-1 &&
+         previous->w > 1 && previous->h > 1) {
+    SDL_Surface* next = SDL_CreateRGBSurface(0, previous->w/2, previous->h/2,
+                                             32, 0x00FF0000, 0x0000FF00,
+                                             0x000000FF, 0);
+    if (!next) {
+      break;
+    }
+    halvePixels((Uint32*)previous->pixels, previous->pitch/4,
+                (Uint32*)next->pixels, next->pitch/4, next->w, next->h,
+                colorKeyed, colorKey);
+    if (colorKeyed) {
+      SDL_SetColorKey(next, true, colorKey);
+    }
+    mipSurfaces.push_back(next);
+    previous = next;
+  }
+  SDL_FreeSurface(level);
+}
+
+void al::sdl2utils::Bitmap::generateMipmaps(int maxLevels)
+{
+  mipChain.clear();
+  mipOffsets.clear();
+  if (!pixels || pitch != width*4 || swizzled) {
+    return;
+  }
+  int total = 0;
+  for (int level=1; level<maxLevels && (width>>level) && (height>>level);
+       ++level) {
+    mipOffsets.push_back(total);
+    total += (width>>level) * (height>>level);
+  }
+  mipChain.resize(total);
+  for (size_t i=0; i<mipOffsets.size(); ++i) {
+    const int level = i+1;
+    halvePixels(getMipPixels(level-1), getMipWidth(level-1),
+                getMipPixels(level), getMipWidth(level),
+                getMipWidth(level), getMipHeight(level), false, 0);
+  }
+}
+
+bool al::sdl2utils::Bitmap::swizzle()
+{
+  const bool powerOfTwo = width > 0 && !(width & (width-1));
+  if (!pixels || swizzled || width != height || !powerOfTwo ||
+      pitch != width*4) {
+    return false;
+  }
+  std::vector<Uint32> rowMajor;
+  for (int level=0; level<getMipLevels(); ++level) {
+    Uint32* levelPixels = getMipPixels(level);
+    const int size = getMipWidth(level);
+    rowMajor.assign(levelPixels, levelPixels + size*size);
+    for (int y=0; y<size; ++y) {
+      for (int x=0; x<size; ++x) {
+        levelPixels[mortonSpread(x) | (mortonSpread(y) << 1)] =
+          rowMajor[x + y*size];
+      }
+    }
+  }
+  swizzled = true;
+  return true;
+}
+
+al::sdl2utils::FramePacer::FramePacer()
+: targetFps(0), period(0), nextFrame(0), lastFrame(0)
+{
+  countsPerMs = SDL_GetPerformanceFrequency() / 1000.0;
+  spinTail = (Uint64) countsPerMs;
+  resetStats();
+}
+
+void al::sdl2utils::FramePacer::setTargetFps(int fps)
+{
+  targetFps = fps > 0 ? fps : 0;
+  period = targetFps ? SDL_GetPerformanceFrequency() / targetFps : 0;
+  nextFrame = SDL_GetPerformanceCounter() + period;
+}
+
+void al::sdl2utils::FramePacer::start()
+{
+  lastFrame = SDL_GetPerformanceCounter();
+  nextFrame = lastFrame + period;
+}
+
+void al::sdl2utils::FramePacer::wait()
+{
+  Uint64 now = SDL_GetPerformanceCounter();
+  if (period) {
+    // Sleep in 1 ms steps while there's more than the spin tail left. The
+    // tail jumps up to any oversleep longer than it and slowly shrinks back.
+    const Uint64 oneMs = (Uint64) countsPerMs;
+    while (now < nextFrame && nextFrame - now > spinTail) {
+      const Uint64 before = now;
+      SDL_Delay(1);
+      now = SDL_GetPerformanceCounter();
+      const Uint64 oversleep = now - before > oneMs ? now - before - oneMs : 0;
+      if (oversleep > spinTail) {
+        spinTail = std::min(oversleep, oneMs * 4);
+      }
+      else {
+        spinTail -= (spinTail - oversleep) / 64;
+      }
+    }
+    while (now < nextFrame) {
+      now = SDL_GetPerformanceCounter();
+    }
+    nextFrame += period;
+    // Don't rush frames to catch up after falling behind
+    if (nextFrame < now) {
+      nextFrame = now + period;
+    }
+  }
+
+  const Uint64 frameCounts = now - lastFrame;
+  lastFrame = now;
+  const double ms = frameCounts / countsPerMs;
+  frames++;
+  sum += ms;
+  sumSquares += ms*ms;
+  longest = std::max(longest, frameCounts);
+}
+
+void al::sdl2utils::FramePacer::resetStats()
+{
+  frames = 0;
+  sum = sumSquares = 0;
+  longest = 0;
+}
+
+double al::sdl2utils::FramePacer::averageMs() const
+{
+  return frames ? sum / frames : 0;
+}
+
+double al::sdl2utils::FramePacer::jitterMs() const
+{
+  if (frames < 2) {
+    return 0;
+  }
+  const double average = sum / frames;
+  const double variance = sumSquares / frames - average*average;
+  return variance > 0 ? sqrt(variance) : 0;
+}
@@ -7,6 +7,8 @@ https://github.com/andrew-lim
 #ifndef SDL2_UTILS_H
 #define SDL2_UTILS_H
 #include <SDL2\SDL.h>
+#include <vector>
+#include <algorithm>
 
 namespace al {
 namespace sdl2utils {
@@ -29,6 +31,29 @@ Uint8* copySurfacePixels( SDL_Surface* surface,  // surface to copy from
  */
 SDL_Color getRGBAPixelColor(Uint8* pixels, int x, int y, int w);
 
+/**
+ * Averages each 2x2 block of 32 bit src pixels into one dst pixel. dstWidth
+ * and dstHeight are the size of dst, pitches are in pixels.
+ * If colorKeyed, pixels equal to colorKey are skipped and a block with less
+ * than 2 other pixels becomes colorKey.
+ */
+void halvePixels(const Uint32* src, int srcPitch,
+                 Uint32* dst, int dstPitch, int dstWidth, int dstHeight,
+                 bool colorKeyed, Uint32 colorKey);
+
+/**
+ * Spreads the low 16 bits of v out to the even bits. Interleaving x and y
+ * this way gives the Z-order (Morton order) index of a pixel.
+ */
+inline Uint32 mortonSpread(Uint32 v) {
+  v &= 0xFFFF;
+  v = (v | (v << 8)) & 0x00FF00FF;
+  v = (v | (v << 4)) & 0x0F0F0F0F;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
 /**
  * Wraps a SDL_Texture with SDL_TEXTUREACCESS_STREAMING for pixel manipulation.
  */
@@ -58,6 +83,13 @@ public:
 class SurfaceTexture {
   SDL_Surface* surface;
   SDL_Texture* texture;
+  std::vector<SDL_Surface*> mipSurfaces; // level 1 onwards
+  void destroyMipmaps() {
+    for (size_t i=0; i<mipSurfaces.size(); ++i) {
+      SDL_FreeSurface(mipSurfaces[i]);
+    }
+    mipSurfaces.clear();
+  }
 public:
   SurfaceTexture() : surface(0), texture(0) {}
   ~SurfaceTexture() {
@@ -65,7 +97,19 @@ public:
   }
   SDL_Surface* getSurface() {return surface;}
   SDL_Texture* getTexture() {return texture;}
+  // Creates up to maxLevels-1 half size copies of the surface, keeping its
+  // color key. Copies are 32 bit RGB.
+  void generateMipmaps(int maxLevels);
+  int getMipLevels() const { return surface ? 1 + mipSurfaces.size() : 0; }
+  // Level 0 is the surface itself. Levels past the last return the last.
+  SDL_Surface* getMipSurface(int level) {
+    if (level <= 0 || mipSurfaces.empty()) {
+      return surface;
+    }
+    return mipSurfaces[std::min(level, (int)mipSurfaces.size()) - 1];
+  }
   void destroy() {
+    destroyMipmaps();
     if (surface) {
       SDL_FreeSurface(surface);
       surface = NULL;
@@ -98,8 +142,12 @@ public:
 class Bitmap {
   int width, height, pitch;
   void* pixels;
+  // Levels 1 onwards of the mip chain, one after the other
+  std::vector<Uint32> mipChain;
+  std::vector<int> mipOffsets;
+  bool swizzled;
 public:
-  Bitmap() : width(0), height(0), pitch(0), pixels(NULL) {}
+  Bitmap() : width(0), height(0), pitch(0), pixels(NULL), swizzled(false) {}
   ~Bitmap() {
     destroy();
   }
@@ -108,12 +156,72 @@ public:
       free(pixels);
       pixels = NULL;
     }
+    mipChain.clear();
+    mipOffsets.clear();
+    swizzled = false;
   }
   void* getPixels() {return pixels;}
   int getWidth() const {return width;}
   int getHeight() const {return height;}
   int getPitch() const {return pitch;}
   bool load( const char* s, SDL_Renderer* renderer, Uint32 pixelFormat );
+
+  // Creates up to maxLevels-1 half size copies of a 32 bit bitmap.
+  // Level n is getWidth()>>n by getHeight()>>n pixels with no padding.
+  void generateMipmaps(int maxLevels);
+  int getMipLevels() const { return pixels ? 1 + mipOffsets.size() : 0; }
+  Uint32* getMipPixels(int level) {
+    return level ? &mipChain[mipOffsets[level-1]] : (Uint32*)pixels;
+  }
+  int getMipWidth(int level) const { return width >> level; }
+  int getMipHeight(int level) const { return height >> level; }
+
+  // Reorders every mip level into Z-order so pixels that are near each
+  // other in any direction are near each other in memory. Only square
+  // power of two bitmaps are reordered. Call after generateMipmaps().
+  bool swizzle();
+  bool isSwizzled() const { return swizzled; }
+  // Index of pixel (x,y) in getMipPixels(level), row major or Z-order
+  int pixelIndex(int level, int x, int y) const {
+    return swizzled ? mortonSpread(x) | (mortonSpread(y) << 1)
+                    : x + y * (width >> level);
+  }
+};
+
+/**
+ * Waits out the rest of each frame at a fixed frame rate. Most of the wait is
+ * spent in SDL_Delay() and the last part, about as long as SDL_Delay() has
+ * been seen to oversleep, is spent spinning on the performance counter.
+ * Also keeps frame time statistics, with or without a frame rate.
+ */
+class FramePacer {
+public:
+  FramePacer();
+  // 0 fps doesn't wait at all
+  void setTargetFps(int fps);
+  int getTargetFps() const { return targetFps; }
+  // Call once before the first frame
+  void start();
+  // Call once per frame. Returns when the next frame is due.
+  void wait();
+
+  // Statistics of the frames since resetStats(), in milliseconds
+  void resetStats();
+  int getFrames() const { return frames; }
+  double averageMs() const;
+  double jitterMs() const; // standard deviation of the frame time
+  double maxMs() const { return frames ? longest / countsPerMs : 0; }
+
+private:
+  int targetFps;
+  double countsPerMs;
+  Uint64 period;     // counts per frame
+  Uint64 nextFrame;  // when the next frame is due
+  Uint64 lastFrame;  // when the last wait() returned
+  Uint64 spinTail;   // counts to spin instead of sleeping
+  int frames;
+  double sum, sumSquares;
+  Uint64 longest;
 };
 
 } // namespace sdl2utils
@@ -0,0 +1,181 @@
+#include "sharedmemory.h"
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+using namespace al;
+
+SharedMemory::SharedMemory()
+: data(0), size(0), mappingHandle(0), fd(-1)
+{
+}
+
+SharedMemory::~SharedMemory()
+{
+  close();
+}
+
+#ifdef _WIN32
+
+bool SharedMemory::create(const std::string& name, size_t size)
+{
+  close();
+  const unsigned long long size64 = size;
+  HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL,
+                                      PAGE_READWRITE, (DWORD) (size64 >> 32),
+                                      (DWORD) size64, name.c_str());
+  if (!mapping) {
+    printf("CreateFileMapping failed for %s\n", name.c_str());
+    return false;
+  }
+  // A mapping still open elsewhere keeps its old size, so it can't be reused
+  if (GetLastError() == ERROR_ALREADY_EXISTS) {
+    printf("Shared memory %s is still in use\n", name.c_str());
+    CloseHandle(mapping);
+    return false;
+  }
+  void* view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+  if (!view) {
+    printf("MapViewOfFile failed for %s\n", name.c_str());
+    CloseHandle(mapping);
+    return false;
+  }
+  mappingHandle = mapping;
+  data = view;
+  this->size = size;
+  return true;
+}
+
+bool SharedMemory::open(const std::string& name)
+{
+  close();
+  HANDLE mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+  if (!mapping) {
+    printf("Could not open shared memory %s\n", name.c_str());
+    return false;
+  }
+  void* view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+  MEMORY_BASIC_INFORMATION info;
+  if (!view || !VirtualQuery(view, &info, sizeof(info))) {
+    printf("MapViewOfFile failed for %s\n", name.c_str());
+    if (view) {
+      UnmapViewOfFile(view);
+    }
+    CloseHandle(mapping);
+    return false;
+  }
+  mappingHandle = mapping;
+  data = view;
+  size = info.RegionSize;
+  return true;
+}
+
+void SharedMemory::close()
+{
+  if (data) {
+    UnmapViewOfFile(data);
+    data = 0;
+  }
+  if (mappingHandle) {
+    CloseHandle((HANDLE) mappingHandle);
+    mappingHandle = 0;
+  }
+  size = 0;
+}
+
+#else
+
+// shm_open() names have to start with a slash
+static std::string shmName(const std::string& name)
+{
+  return name.size() && name[0] == '/' ? name : "/" + name;
+}
+
+bool SharedMemory::create(const std::string& name, size_t size)
+{
+  close();
+  const std::string path = shmName(name);
+  // Like on Windows, a name that is still there is left alone, since
+  // readers may have it open
+  int file = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (file < 0 && errno == EEXIST) {
+    printf("Shared memory %s is still in use\n", name.c_str());
+    return false;
+  }
+  if (file < 0) {
+    printf("Could not create shared memory %s\n", name.c_str());
+    return false;
+  }
+  if (ftruncate(file, size) != 0) {
+    printf("Could not resize shared memory %s\n", name.c_str());
+    ::close(file);
+    shm_unlink(path.c_str());
+    return false;
+  }
+  void* view = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+  if (view == MAP_FAILED) {
+    printf("mmap failed for %s\n", name.c_str());
+    ::close(file);
+    shm_unlink(path.c_str());
+    return false;
+  }
+  fd = file;
+  data = view;
+  this->size = size;
+  createdName = path;
+  return true;
+}
+
+bool SharedMemory::open(const std::string& name)
+{
+  close();
+  int file = shm_open(shmName(name).c_str(), O_RDWR, 0);
+  if (file < 0) {
+    printf("Could not open shared memory %s\n", name.c_str());
+    return false;
+  }
+  struct stat st;
+  if (fstat(file, &st) != 0 || st.st_size == 0) {
+    printf("Could not get size of %s\n", name.c_str());
+    ::close(file);
+    return false;
+  }
+  void* view = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    file, 0);
+  if (view == MAP_FAILED) {
+    printf("mmap failed for %s\n", name.c_str());
+    ::close(file);
+    return false;
+  }
+  fd = file;
+  data = view;
+  size = (size_t) st.st_size;
+  return true;
+}
+
+void SharedMemory::close()
+{
+  if (data) {
+    munmap(data, size);
+    data = 0;
+  }
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  if (createdName.size()) {
+    shm_unlink(createdName.c_str());
+    createdName.clear();
+  }
+  size = 0;
+}
+
+#endif
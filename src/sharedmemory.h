@@ -0,0 +1,46 @@
+/*
+Named shared memory.
+
+Author: Andrew Lim
+https://github.com/andrew-lim
+*/
+#ifndef AL_SHAREDMEMORY_H
+#define AL_SHAREDMEMORY_H
+#include <string>
+#include <cstddef>
+
+namespace al {
+
+/**
+ * A block of memory other processes can map by name. Uses
+ * CreateFileMapping() on Windows and shm_open() everywhere else. The process
+ * that create()d it removes the name on close(), but processes that already
+ * opened it keep their mapping until they close it too.
+ */
+class SharedMemory {
+public:
+  SharedMemory();
+  ~SharedMemory();
+  // Fails if a block with the same name is still in use. The memory starts
+  // zeroed.
+  bool create(const std::string& name, size_t size);
+  bool open(const std::string& name);
+  void close();
+  bool isOpen() const { return data != 0; }
+  void* getData() const { return data; }
+  size_t getSize() const { return size; }
+private:
+  // Not copyable
+  SharedMemory(const SharedMemory&);
+  SharedMemory& operator=(const SharedMemory&);
+
+  void* data;
+  size_t size;
+  std::string createdName; // name to remove on close(), POSIX only
+  void* mappingHandle;     // Windows only
+  int fd;                  // POSIX only
+};
+
+} // al
+
+#endif
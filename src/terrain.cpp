@@ -0,0 +1,45 @@
+#include "terrain.h"
+#include <algorithm>
+
+using namespace std;
+using namespace al::raycasting;
+
+Terrain::Terrain()
+: heights(0), verticesX(0), verticesY(0), invTileSize(0), maxHeight(0)
+{
+}
+
+void Terrain::create(int cellsX, int cellsY, int tileSize)
+{
+  storage.assign((cellsX+1) * (cellsY+1), 0.0f);
+  heights = &storage[0];
+  verticesX = cellsX + 1;
+  verticesY = cellsY + 1;
+  invTileSize = 1.0f / tileSize;
+  maxHeight = 0;
+}
+
+void Terrain::attach(const float* heights, int cellsX, int cellsY,
+                     int tileSize)
+{
+  vector<float>().swap(storage);
+  this->heights = heights;
+  verticesX = cellsX + 1;
+  verticesY = cellsY + 1;
+  invTileSize = 1.0f / tileSize;
+  maxHeight = *std::max_element(heights, heights + verticesX * verticesY);
+}
+
+void Terrain::clear()
+{
+  vector<float>().swap(storage);
+  heights = 0;
+  verticesX = verticesY = 0;
+  maxHeight = 0;
+}
+
+void Terrain::setVertexHeight(int vx, int vy, float height)
+{
+  storage[vx + vy * verticesX] = height;
+  maxHeight = std::max(maxHeight, height);
+}
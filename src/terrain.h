@@ -0,0 +1,74 @@
+/*
+Heightmap terrain under the grid.
+
+Author: Andrew Lim
+https://github.com/andrew-lim/sdl2-raycast
+*/
+#ifndef AL_RAYCASTING_TERRAIN_H
+#define AL_RAYCASTING_TERRAIN_H
+#include <vector>
+
+namespace al {
+namespace raycasting {
+
+/**
+ * Heights at the corners of every grid cell, so a map with w*h cells has
+ * (w+1)*(h+1) vertices. Heights between vertices are bilinear.
+ *
+ * The heights are either owned, after create(), or point into a level that
+ * stays loaded, after attach().
+ */
+class Terrain {
+public:
+  Terrain();
+
+  // Flat terrain that can be changed with setVertexHeight()
+  void create(int cellsX, int cellsY, int tileSize);
+  // Uses heights stored elsewhere, (cellsX+1)*(cellsY+1) of them
+  void attach(const float* heights, int cellsX, int cellsY, int tileSize);
+  void clear();
+  bool empty() const { return heights == 0; }
+
+  int getVerticesX() const { return verticesX; }
+  int getVerticesY() const { return verticesY; }
+  const float* getHeights() const { return heights; }
+  float getMaxHeight() const { return maxHeight; }
+  float vertexHeight(int vx, int vy) const {
+    return heights[vx + vy * verticesX];
+  }
+  void setVertexHeight(int vx, int vy, float height);
+
+  // Height at a world position, clamped to the edges of the map
+  float heightAt(float worldX, float worldY) const {
+    float fx = worldX * invTileSize;
+    float fy = worldY * invTileSize;
+    fx = fx < 0 ? 0 : (fx > verticesX-1 ? verticesX-1 : fx);
+    fy = fy < 0 ? 0 : (fy > verticesY-1 ? verticesY-1 : fy);
+    int vx = (int)fx;
+    int vy = (int)fy;
+    if (vx == verticesX-1) vx--;
+    if (vy == verticesY-1) vy--;
+    const float tx = fx - vx;
+    const float ty = fy - vy;
+    const float* row = heights + vx + vy * verticesX;
+    const float top = row[0] + (row[1] - row[0]) * tx;
+    const float bottom = row[verticesX] + (row[verticesX+1]-row[verticesX])*tx;
+    return top + (bottom - top) * ty;
+  }
+
+private:
+  // Not copyable, heights may point into storage
+  Terrain(const Terrain&);
+  Terrain& operator=(const Terrain&);
+
+  std::vector<float> storage;
+  const float* heights;
+  int verticesX, verticesY;
+  float invTileSize;
+  float maxHeight;
+};
+
+} // raycasting
+} // al
+
+#endif
@@ -0,0 +1,206 @@
+#include "vectorenv.h"
+#include <cstdio>
+#include <algorithm>
+#include "defaults.h"
+#include "settingsmanager.h"
+
+using namespace std;
+using namespace al::raycasting;
+
+VectorEnv::VectorEnv()
+: done(NULL), actions(NULL), render(false), quit(false)
+{
+}
+
+VectorEnv::~VectorEnv()
+{
+  destroy();
+}
+
+// Creates count Games and threadCount threads to step them. Frames are only
+// drawn if render is set. Sizes and the level come from config.ini.
+bool VectorEnv::create(int count, int threadCount, bool render)
+{
+  destroy();
+  if (count < 1) {
+    return false;
+  }
+  SettingsManager settingsManager;
+  settingsManager.loadConfig("config.ini");
+  const int width = settingsManager.getInt("displayWidth",
+                                           DEFAULT_DISPLAY_WIDTH);
+  const int height = settingsManager.getInt("displayHeight",
+                                            DEFAULT_DISPLAY_HEIGHT);
+  const int stripWidth = settingsManager.getInt("stripWidth",
+                                                DEFAULT_STRIP_WIDTH);
+  const int fov = settingsManager.getInt("fov", DEFAULT_FOV_DEGREES);
+  const string levelFile = settingsManager.getString("levelFile", "");
+
+  this->render = render;
+  quit = false;
+  threadCount = std::max(1, std::min(threadCount, count));
+  workers.resize(threadCount);
+  for (int t=0; t<threadCount; ++t) {
+    Worker& worker = workers[t];
+    worker.env = this;
+    worker.first = count * t / threadCount;
+    worker.last = count * (t+1) / threadCount;
+    worker.thread = NULL;
+    worker.start = NULL;
+
+    GameAssets* assets = NULL; // loaded by the worker's first Game
+    for (int i=worker.first; i<worker.last; ++i) {
+      Game* game = new Game(assets, i == 0);
+      game->setQuiet(true);
+      games.push_back(game);
+      if (render && !game->startHeadless(width, height, stripWidth, fov)) {
+        destroy();
+        return false;
+      }
+      if (i == 0 && levelFile.size() && !game->loadLevel(levelFile)) {
+        printf("Using the default level instead of %s\n", levelFile.c_str());
+      }
+      if (i > 0) {
+        game->shareLevel(*games[0]);
+      }
+      if (!assets) {
+        assets = game->getAssets();
+      }
+    }
+  }
+  playerX.resize(count);
+  playerY.resize(count);
+  playerZ.resize(count);
+  playerRot.resize(count);
+  for (int i=0; i<count; ++i) {
+    observe(i);
+  }
+
+  done = SDL_CreateSemaphore(0);
+  for (int t=0; t<threadCount; ++t) {
+    workers[t].start = SDL_CreateSemaphore(0);
+    workers[t].thread = SDL_CreateThread(workerMain, "VectorEnv",
+                                         &workers[t]);
+    if (!workers[t].thread) {
+      printf("SDL_CreateThread failed: %s\n", SDL_GetError());
+      destroy();
+      return false;
+    }
+  }
+  return true;
+}
+
+void VectorEnv::destroy()
+{
+  quit = true;
+  for (size_t t=0; t<workers.size(); ++t) {
+    if (workers[t].thread) {
+      SDL_SemPost(workers[t].start);
+      SDL_WaitThread(workers[t].thread, NULL);
+    }
+    if (workers[t].start) {
+      SDL_DestroySemaphore(workers[t].start);
+    }
+  }
+  workers.clear();
+  if (done) {
+    SDL_DestroySemaphore(done);
+    done = NULL;
+  }
+  // Games that share the level or assets of an earlier Game go first
+  while (!games.empty()) {
+    delete games.back();
+    games.pop_back();
+  }
+}
+
+void VectorEnv::reset()
+{
+  for (size_t i=0; i<games.size(); ++i) {
+    games[i]->reset();
+    observe(i);
+  }
+}
+
+void VectorEnv::step(const InputSnapshot* actions)
+{
+  this->actions = actions;
+  for (size_t t=0; t<workers.size(); ++t) {
+    SDL_SemPost(workers[t].start);
+  }
+  for (size_t t=0; t<workers.size(); ++t) {
+    SDL_SemWait(done);
+  }
+}
+
+int VectorEnv::workerMain(void* data)
+{
+  Worker* worker = (Worker*) data;
+  VectorEnv* env = worker->env;
+  for (;;) {
+    SDL_SemWait(worker->start);
+    if (env->quit) {
+      break;
+    }
+    env->stepGames(worker->first, worker->last);
+    SDL_SemPost(env->done);
+  }
+  return 0;
+}
+
+void VectorEnv::stepGames(int first, int last)
+{
+  for (int i=first; i<last; ++i) {
+    Game* game = games[i];
+    game->update(UPDATE_INTERVAL, actions[i]);
+    if (render) {
+      game->publishWorld(1);
+      game->renderFrame();
+    }
+    observe(i);
+  }
+}
+
+void VectorEnv::observe(int i)
+{
+  const Sprite& player = games[i]->getPlayer();
+  playerX[i] = player.x;
+  playerY[i] = player.y;
+  playerZ[i] = player.z;
+  playerRot[i] = player.rot;
+}
+
+void al::raycasting::benchVectorEnv(int count, int threadCount, int ticks,
+                                    bool render)
+{
+  threadCount = std::max(1, std::min(threadCount, count));
+  VectorEnv env;
+  if (!env.create(count, threadCount, render)) {
+    return;
+  }
+  vector<InputSnapshot> actions(count);
+  vector<Random> randoms(count);
+  for (int i=0; i<count; ++i) {
+    randoms[i].setSeed(i + 1);
+  }
+
+  const Uint64 start = SDL_GetPerformanceCounter();
+  for (int tick=0; tick<ticks; ++tick) {
+    for (int i=0; i<count; ++i) {
+      InputSnapshot& action = actions[i];
+      Random& random = randoms[i];
+      action.clear();
+      action.move = random.nextInt(3) - 1;
+      action.turn = random.nextInt(3) - 1;
+      action.fire = random.nextInt(100) == 0;
+      action.use = random.nextInt(100) == 0;
+    }
+    env.step(&actions[0]);
+  }
+  const double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 /
+                    SDL_GetPerformanceFrequency();
+  const double steps = (double) count * ticks;
+  printf("vectorenv: %d envs x %d ticks on %d threads in %.0f ms, "
+         "%.0f ticks/s%s\n", count, ticks, threadCount, ms, steps*1000/ms,
+         render ? " with a frame each" : "");
+}
@@ -0,0 +1,70 @@
+/*
+Many headless Games stepped in lockstep, for training agents on.
+
+Author: Andrew Lim
+https://github.com/andrew-lim/sdl2-raycast
+*/
+#ifndef AL_RAYCASTING_VECTORENV_H
+#define AL_RAYCASTING_VECTORENV_H
+#include <SDL.h>
+#include <vector>
+#include "game.h"
+
+namespace al {
+namespace raycasting {
+
+/**
+ * Steps many headless Games in lockstep on a pool of threads. Every Game
+ * plays in the level data of the first one, and the Games a thread steps
+ * draw with that thread's textures. Textures aren't shared between threads
+ * since SDL blits write to the source surface.
+ *
+ * What each step gives back is kept as structure of arrays, one element per
+ * Game.
+ */
+class VectorEnv {
+public:
+  VectorEnv();
+  ~VectorEnv();
+  bool create(int count, int threadCount, bool render);
+  void destroy();
+  void reset();
+  // Runs one tick of every Game, Game i with actions[i], and draws their
+  // frames if rendering
+  void step(const InputSnapshot* actions);
+  int size() const { return games.size(); }
+  SDL_Surface* frame(int i) { return games[i]->getFrame(); }
+
+  std::vector<float> playerX, playerY, playerZ, playerRot;
+
+private:
+  VectorEnv(const VectorEnv&);
+  VectorEnv& operator=(const VectorEnv&);
+
+  struct Worker {
+    VectorEnv* env;
+    int first, last; // Games [first,last)
+    SDL_Thread* thread;
+    SDL_sem* start;
+  };
+  static int workerMain(void* data);
+  void stepGames(int first, int last);
+  void observe(int i);
+
+  std::vector<Game*> games;
+  std::vector<Worker> workers;
+  SDL_sem* done;
+  const InputSnapshot* actions; // of the step in progress
+  bool render;
+  bool quit;
+};
+
+// -vectorenv [envs [threads [ticks [render]]]]: steps envs Games in lockstep
+// with random movement and prints how many ticks they managed per second
+// between them. With render set every tick also draws a frame.
+void benchVectorEnv(int count, int threadCount, int ticks, bool render);
+
+} // raycasting
+} // al
+
+#endif